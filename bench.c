@@ -0,0 +1,838 @@
+/**
+ * @file bench.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief End-to-end throughput benchmark of get and put.
+ * Transfers generated files of each size and a set of small files, for each
+ * compression method and pipeline depth, against the in-tree server (or a
+ * real one) and reports throughput, CPU and syscall cost and request
+ * latency as JSON. Run it with LIBSFTP_NETEM set to measure under a given
+ * RTT and bandwidth, and build with -DLOG_LEVEL=WARNING: the DEBUG default
+ * logs every packet.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "libsftp/libsftp.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define BENCH_CHUNK SSH_FXP_MAXLEN
+#define BENCH_MAX_DEPTH 1024
+
+/* Small transfers are repeated until they ran this long */
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_MAX_REPS 10000
+
+#define DEFAULT_SIZES "1K,32K,1M,32M"
+/* writes and reads back 5G per depth and compression, minutes even on
+ * loopback, so it is asked for with -L */
+#define LARGE_SIZES "1K,32K,1M,32M,1G,4G"
+#define DEFAULT_DEPTHS "1,4,16,64"
+#define DEFAULT_COMPRESSION "none,zlib"
+
+struct bench_opts {
+    uint64_t sizes[32];
+    int nsizes;
+    int depths[16];
+    int ndepths;
+    int compression[2];
+    int ncompression;
+    int files;        /* small files per set */
+    uint64_t small;   /* size of a small file */
+    const char *host; /* NULL for the in-tree server */
+    int port;
+    const char *user;
+    const char *password;
+    unsigned int crypto_threads; /* both ends, 0 for none */
+};
+
+struct bench_result {
+    const char *workload;
+    const char *op;
+    uint64_t size;
+    int files;
+    int reps;
+    int depth;
+    uint64_t bytes;
+    double seconds;
+    double cpu;
+    uint64_t syscalls;
+    struct ssh_stats stats; /* counters of the session during the run */
+    struct ssh_buffer_stats buffers; /* of the client process */
+    uint32_t *latency; /* microseconds, per request or per small file */
+    size_t nlatency;
+    size_t latency_cap;
+};
+
+static FILE *msg;  /* progress, stderr is left to the library logs */
+static FILE *out;  /* JSON */
+static uint8_t chunk[BENCH_CHUNK];
+static int first_result = 1;
+
+/*
+ * Syscall accounting. The library is a shared object: defining the I/O
+ * calls it makes here interposes them, every one goes through the counter.
+ * Only counted on Linux, where they can be issued with syscall(2).
+ */
+#ifdef __linux__
+static uint64_t bench_syscalls;
+
+#define BENCH_COUNT() __atomic_add_fetch(&bench_syscalls, 1, __ATOMIC_RELAXED)
+
+ssize_t read(int fd, void *buf, size_t count) {
+    BENCH_COUNT();
+    return syscall(SYS_read, fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    BENCH_COUNT();
+    return syscall(SYS_write, fd, buf, count);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+    BENCH_COUNT();
+    return syscall(SYS_readv, fd, iov, iovcnt);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    BENCH_COUNT();
+    return syscall(SYS_writev, fd, iov, iovcnt);
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+    BENCH_COUNT();
+    return syscall(SYS_sendto, fd, buf, len, flags, NULL, 0);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    BENCH_COUNT();
+    return syscall(SYS_sendmsg, fd, msg, flags);
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+    BENCH_COUNT();
+    return syscall(SYS_recvfrom, fd, buf, len, flags, NULL, NULL);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    struct timespec ts;
+
+    BENCH_COUNT();
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+    return syscall(SYS_ppoll, fds, nfds, timeout < 0 ? NULL : &ts, NULL, 0);
+}
+
+static uint64_t bench_syscall_count(void) {
+    return __atomic_load_n(&bench_syscalls, __ATOMIC_RELAXED);
+}
+#else
+static uint64_t bench_syscall_count(void) { return 0; }
+#endif
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-s sizes] [-d depths] [-z compression] [-n files]\n"
+            "          [-S small] [-H host] [-p port] [-u user] [-P password]\n"
+            "          [-j threads] [-o file] [-L] [-v]\n"
+            "  -s  file sizes (default " DEFAULT_SIZES ")\n"
+            "  -L  the full sweep of file sizes, " LARGE_SIZES "\n"
+            "  -d  pipeline depths (default " DEFAULT_DEPTHS ")\n"
+            "  -z  compression methods (default " DEFAULT_COMPRESSION ")\n"
+            "  -n  small files per set (default 256), 0 to skip\n"
+            "  -S  size of a small file (default 4K)\n"
+            "  -H  benchmark a real server instead of the in-tree one, files\n"
+            "      are left in its working directory\n"
+            "  -j  crypto threads of the client and the in-tree server\n"
+            "      (default 0)\n"
+            "  -o  write the JSON report to file (default stdout)\n"
+            "  -v  keep the library logs on stderr\n",
+            prog);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_time(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * @brief Parse "1K", "32M", "4G" (powers of 1024).
+ */
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t n;
+
+    n = strtoull(s, &end, 10);
+    switch (*end) {
+        case 'G':
+        case 'g':
+            n <<= 10;
+            /* fall through */
+        case 'M':
+        case 'm':
+            n <<= 10;
+            /* fall through */
+        case 'K':
+        case 'k':
+            n <<= 10;
+            break;
+        default:
+            break;
+    }
+
+    return n;
+}
+
+/**
+ * @brief Split a comma separated list, calling `fn` on every item.
+ *
+ * @return number of items, -1 if there are more than `max`.
+ */
+static int parse_list(const char *list, int max,
+                      int (*fn)(const char *item, int i, void *arg),
+                      void *arg) {
+    char *copy, *item, *saveptr;
+    int n = 0;
+
+    copy = strdup(list);
+    if (copy == NULL) return -1;
+
+    for (item = strtok_r(copy, ",", &saveptr); item != NULL;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        if (n == max || fn(item, n, arg) != 0) {
+            free(copy);
+            return -1;
+        }
+        n++;
+    }
+
+    free(copy);
+    return n;
+}
+
+static int add_size(const char *item, int i, void *arg) {
+    struct bench_opts *opts = arg;
+
+    opts->sizes[i] = parse_size(item);
+    return opts->sizes[i] > 0 ? 0 : -1;
+}
+
+static int add_depth(const char *item, int i, void *arg) {
+    struct bench_opts *opts = arg;
+
+    opts->depths[i] = atoi(item);
+    return opts->depths[i] > 0 && opts->depths[i] <= BENCH_MAX_DEPTH ? 0 : -1;
+}
+
+static int add_compression(const char *item, int i, void *arg) {
+    struct bench_opts *opts = arg;
+
+    if (strcmp(item, "none") == 0) {
+        opts->compression[i] = 0;
+    } else if (strcmp(item, "zlib") == 0) {
+        opts->compression[i] = 1;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void result_add_latency(struct bench_result *r, double seconds) {
+    uint32_t *p;
+
+    if (r == NULL) return;
+    if (r->nlatency == r->latency_cap) {
+        r->latency_cap = r->latency_cap ? 2 * r->latency_cap : 1024;
+        p = realloc(r->latency, r->latency_cap * sizeof(uint32_t));
+        if (p == NULL) return;
+        r->latency = p;
+    }
+    r->latency[r->nlatency++] = seconds * 1e6;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const struct bench_result *r, double p) {
+    if (r->nlatency == 0) return 0;
+    return r->latency[(size_t)(p * (r->nlatency - 1))];
+}
+
+/**
+ * @brief Append one result object to the JSON report.
+ */
+static void report(ssh_session session, struct bench_result *r) {
+    const char *comp = ssh_get_compression_out(session);
+    double mb = r->bytes / 1e6;
+    double crypto = (r->stats.encrypt_ns + r->stats.decrypt_ns +
+                     r->stats.mac_in_ns + r->stats.mac_out_ns) / 1e9;
+
+    qsort(r->latency, r->nlatency, sizeof(uint32_t), cmp_u32);
+
+    fprintf(out, "%s\n    {", first_result ? "" : ",");
+    first_result = 0;
+    fprintf(out,
+            "\"workload\": \"%s\", \"op\": \"%s\", \"size\": %llu, "
+            "\"files\": %d, \"reps\": %d, ",
+            r->workload, r->op, (unsigned long long)r->size, r->files,
+            r->reps);
+    fprintf(out,
+            "\"cipher\": \"%s\", \"mac\": \"%s\", \"compression\": \"%s\", "
+            "\"depth\": %d, ",
+            ssh_get_cipher_out(session), ssh_get_hmac_out(session),
+            comp != NULL ? comp : "none", r->depth);
+    fprintf(out,
+            "\"bytes\": %llu, \"seconds\": %.6f, \"mb_per_s\": %.3f, "
+            "\"cpu_s_per_gb\": %.4f, \"crypto_s_per_gb\": %.4f, "
+            "\"window_stalls\": %llu, \"window_adjusts\": %llu, "
+            "\"buffer_reallocs\": %llu, ",
+            (unsigned long long)r->bytes, r->seconds, mb / r->seconds,
+            r->cpu / (mb / 1000), crypto / (mb / 1000),
+            (unsigned long long)r->stats.channels.window_stalls,
+            (unsigned long long)r->stats.channels.window_adjusts_sent,
+            (unsigned long long)(r->buffers.grows + r->buffers.shrinks));
+#ifdef __linux__
+    fprintf(out, "\"syscalls_per_mb\": %.2f, ", r->syscalls / mb);
+#else
+    fprintf(out, "\"syscalls_per_mb\": null, ");
+#endif
+    fprintf(out,
+            "\"latency_us\": {\"of\": \"%s\", \"p50\": %u, \"p99\": %u}}",
+            strcmp(r->workload, "file") == 0 ? "request" : "file",
+            percentile(r, 0.50), percentile(r, 0.99));
+    fflush(out);
+
+    fprintf(msg, "%-5s %-4s %10llu x%-5d depth %-3d %9.2f MB/s\n",
+            r->workload, r->op, (unsigned long long)r->size, r->files,
+            r->depth, mb / r->seconds);
+
+    free(r->latency);
+    r->latency = NULL;
+    r->nlatency = r->latency_cap = 0;
+}
+
+/**
+ * @brief Upload `size` bytes with up to `depth` writes in flight. The
+ * latency of every request is added to `r`, if not NULL.
+ */
+static int put_file(sftp_session sftp, const char *name, uint64_t size,
+                    int depth, struct bench_result *r) {
+    int ids[BENCH_MAX_DEPTH];
+    double start[BENCH_MAX_DEPTH];
+    uint64_t sent = 0;
+    uint32_t len;
+    int head = 0, count = 0;
+    sftp_file file;
+    int rc = SSH_OK;
+    int id;
+
+    file = sftp_open(sftp, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file == NULL) return SSH_ERROR;
+
+    while (sent < size || count > 0) {
+        while (count < depth && sent < size) {
+            len = size - sent < BENCH_CHUNK ? size - sent : BENCH_CHUNK;
+            /* no two chunks alike, compression gets no free ride */
+            memcpy(chunk, &sent, sizeof(sent));
+            id = sftp_async_write_begin(file, chunk, len);
+            if (id < 0) {
+                rc = SSH_ERROR;
+                goto out;
+            }
+            ids[(head + count) % depth] = id;
+            start[(head + count) % depth] = now();
+            count++;
+            sent += len;
+        }
+
+        if (sftp_async_write(file, ids[head]) != SSH_OK) {
+            rc = SSH_ERROR;
+            goto out;
+        }
+        result_add_latency(r, now() - start[head]);
+        head = (head + 1) % depth;
+        count--;
+    }
+
+out:
+    /* requests still in flight are answered before the close */
+    if (sftp_close(file) != SSH_OK) rc = SSH_ERROR;
+    return rc;
+}
+
+/**
+ * @brief Download a file of `size` bytes with up to `depth` reads in
+ * flight. The latency of every request is added to `r`, if not NULL.
+ */
+static int get_file(sftp_session sftp, const char *name, uint64_t size,
+                    int depth, struct bench_result *r) {
+    uint8_t buf[BENCH_CHUNK];
+    int ids[BENCH_MAX_DEPTH];
+    double start[BENCH_MAX_DEPTH];
+    uint64_t requested = 0, received = 0;
+    uint32_t len;
+    int head = 0, count = 0;
+    sftp_file file;
+    int rc = SSH_OK;
+    int id, n;
+
+    file = sftp_open(sftp, name, O_RDONLY, 0);
+    if (file == NULL) return SSH_ERROR;
+
+    while (received < size) {
+        while (count < depth && requested < size) {
+            len = size - requested < BENCH_CHUNK ? size - requested
+                                                 : BENCH_CHUNK;
+            id = sftp_async_read_begin(file, len);
+            if (id < 0) {
+                rc = SSH_ERROR;
+                goto out;
+            }
+            ids[(head + count) % depth] = id;
+            start[(head + count) % depth] = now();
+            count++;
+            requested += len;
+        }
+
+        n = sftp_async_read(file, buf, sizeof(buf), ids[head]);
+        if (n <= 0) {
+            if (n == 0) fprintf(msg, "%s: unexpected end of file\n", name);
+            rc = SSH_ERROR;
+            goto out;
+        }
+        result_add_latency(r, now() - start[head]);
+        received += n;
+        head = (head + 1) % depth;
+        count--;
+    }
+
+out:
+    if (sftp_close(file) != SSH_OK) rc = SSH_ERROR;
+    return rc;
+}
+
+static void measure_begin(ssh_session session, struct bench_result *r) {
+    r->seconds = now();
+    r->cpu = cpu_time();
+    r->syscalls = bench_syscall_count();
+    ssh_get_stats(session, &r->stats);
+    ssh_buffer_get_stats(&r->buffers);
+}
+
+static void measure_end(ssh_session session, struct bench_result *r) {
+    struct ssh_stats end;
+    struct ssh_buffer_stats buffers;
+
+    r->seconds = now() - r->seconds;
+    r->cpu = cpu_time() - r->cpu;
+    r->syscalls = bench_syscall_count() - r->syscalls;
+
+    ssh_get_stats(session, &end);
+    r->stats.encrypt_ns = end.encrypt_ns - r->stats.encrypt_ns;
+    r->stats.decrypt_ns = end.decrypt_ns - r->stats.decrypt_ns;
+    r->stats.mac_in_ns = end.mac_in_ns - r->stats.mac_in_ns;
+    r->stats.mac_out_ns = end.mac_out_ns - r->stats.mac_out_ns;
+    r->stats.channels.window_stalls =
+        end.channels.window_stalls - r->stats.channels.window_stalls;
+    r->stats.channels.window_adjusts_sent =
+        end.channels.window_adjusts_sent -
+        r->stats.channels.window_adjusts_sent;
+    ssh_buffer_get_stats(&buffers);
+    r->buffers.grows = buffers.grows - r->buffers.grows;
+    r->buffers.shrinks = buffers.shrinks - r->buffers.shrinks;
+}
+
+/**
+ * @brief put then get one file, repeated while it is too short to time.
+ */
+static int bench_file(ssh_session session, sftp_session sftp, uint64_t size,
+                      int depth) {
+    struct bench_result r;
+    char name[64];
+    int pass;
+    int rc;
+
+    snprintf(name, sizeof(name), "bench-%llu.bin", (unsigned long long)size);
+
+    for (pass = 0; pass < 2; pass++) {
+        memset(&r, 0, sizeof(r));
+        r.workload = "file";
+        r.op = pass == 0 ? "put" : "get";
+        r.size = size;
+        r.files = 1;
+        r.depth = depth;
+
+        measure_begin(session, &r);
+        do {
+            rc = pass == 0 ? put_file(sftp, name, size, depth, &r)
+                           : get_file(sftp, name, size, depth, &r);
+            if (rc != SSH_OK) {
+                fprintf(msg, "%s %s failed: %s\n", r.op, name,
+                        ssh_get_error());
+                free(r.latency);
+                return SSH_ERROR;
+            }
+            r.reps++;
+            r.bytes += size;
+        } while (now() - r.seconds < BENCH_MIN_SECONDS &&
+                 r.reps < BENCH_MAX_REPS);
+        measure_end(session, &r);
+
+        report(session, &r);
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief put then get a set of small files, one after the other.
+ */
+static int bench_small(ssh_session session, sftp_session sftp,
+                       const struct bench_opts *opts) {
+    struct bench_result r;
+    char name[64];
+    double t;
+    int pass, i;
+    int rc;
+
+    for (pass = 0; pass < 2; pass++) {
+        memset(&r, 0, sizeof(r));
+        r.workload = "small";
+        r.op = pass == 0 ? "put" : "get";
+        r.size = opts->small;
+        r.files = opts->files;
+        r.depth = 1;
+
+        measure_begin(session, &r);
+        do {
+            for (i = 0; i < opts->files; i++) {
+                snprintf(name, sizeof(name), "bench-small-%d.bin", i);
+                t = now();
+                /* one latency sample per file, not per request */
+                rc = pass == 0 ? put_file(sftp, name, opts->small, 1, NULL)
+                               : get_file(sftp, name, opts->small, 1, NULL);
+                if (rc != SSH_OK) {
+                    fprintf(msg, "%s %s failed: %s\n", r.op, name,
+                            ssh_get_error());
+                    free(r.latency);
+                    return SSH_ERROR;
+                }
+                r.bytes += opts->small;
+                result_add_latency(&r, now() - t);
+            }
+            r.reps++;
+        } while (now() - r.seconds < BENCH_MIN_SECONDS &&
+                 r.reps < BENCH_MAX_REPS);
+        measure_end(session, &r);
+
+        report(session, &r);
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Run the whole sweep on one connection.
+ */
+static int bench_connection(const struct bench_opts *opts, int compression) {
+    ssh_session session;
+    sftp_session sftp = NULL;
+    int rc = SSH_ERROR;
+    int i, j;
+
+    session = ssh_new();
+    if (session == NULL) return SSH_ERROR;
+
+    ssh_options_set(session, SSH_OPTIONS_HOST,
+                    opts->host != NULL ? opts->host : "127.0.0.1");
+    ssh_options_set(session, SSH_OPTIONS_PORT, &opts->port);
+    ssh_options_set(session, SSH_OPTIONS_USER, opts->user);
+    ssh_options_set(session, SSH_OPTIONS_COMPRESSION, &compression);
+    ssh_options_set(session, SSH_OPTIONS_CRYPTO_THREADS,
+                    &opts->crypto_threads);
+
+    if (ssh_connect(session) != SSH_OK ||
+        ssh_userauth_password(session, opts->password) != SSH_OK) {
+        fprintf(msg, "can not connect: %s\n", ssh_get_error());
+        goto out;
+    }
+
+    sftp = sftp_new(session);
+    if (sftp == NULL || sftp_init(sftp) != SSH_OK) {
+        fprintf(msg, "can not start sftp: %s\n", ssh_get_error());
+        goto out;
+    }
+
+    for (i = 0; i < opts->nsizes; i++) {
+        for (j = 0; j < opts->ndepths; j++) {
+            if (bench_file(session, sftp, opts->sizes[i], opts->depths[j]) !=
+                SSH_OK) {
+                goto out;
+            }
+        }
+    }
+
+    if (opts->files > 0 && bench_small(session, sftp, opts) != SSH_OK) {
+        goto out;
+    }
+    rc = SSH_OK;
+
+out:
+    sftp_free(sftp);
+    ssh_disconnect(session);
+    ssh_free(session);
+    return rc;
+}
+
+/**
+ * @brief Fork the in-tree server on a free loopback port.
+ *
+ * @param root directory served
+ * @param port [out]
+ * @param crypto_threads
+ * @return pid of the server, -1 on error.
+ */
+static pid_t server_start(const char *root, int *port,
+                          unsigned int crypto_threads) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    ssh_session session;
+    int compression = 1;
+    pid_t pid;
+    int listen_fd;
+    int fd;
+
+    if (ssh_server_init() != SSH_OK) return -1;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 4) < 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        close(listen_fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+
+    pid = fork();
+    if (pid != 0) {
+        close(listen_fd);
+        return pid;
+    }
+
+    /* one process per connection, as server.c */
+    signal(SIGCHLD, SIG_IGN);
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0 || errno == EINTR) {
+        if (fd < 0) continue;
+        if (fork() != 0) {
+            close(fd);
+            continue;
+        }
+        close(listen_fd);
+        session = ssh_new();
+        if (session == NULL) _exit(1);
+        /* the client picks, offering compression does not force it */
+        ssh_options_set(session, SSH_OPTIONS_COMPRESSION, &compression);
+        ssh_options_set(session, SSH_OPTIONS_CRYPTO_THREADS, &crypto_threads);
+        if (ssh_accept(session, fd) == SSH_OK &&
+            ssh_server_auth_password(session, NULL) == SSH_OK) {
+            sftp_server_run(session, root);
+        }
+        ssh_disconnect(session);
+        ssh_free(session);
+        _exit(0);
+    }
+    _exit(1);
+}
+
+/**
+ * @brief Remove what the benchmark left in the served directory.
+ */
+static void cleanup(const char *root, const struct bench_opts *opts) {
+    char path[4096];
+    int i;
+
+    for (i = 0; i < opts->nsizes; i++) {
+        snprintf(path, sizeof(path), "%s/bench-%llu.bin", root,
+                 (unsigned long long)opts->sizes[i]);
+        unlink(path);
+    }
+    for (i = 0; i < opts->files; i++) {
+        snprintf(path, sizeof(path), "%s/bench-small-%d.bin", root, i);
+        unlink(path);
+    }
+    rmdir(root);
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_opts opts;
+    char root[] = "/tmp/sftp-bench.XXXXXX";
+    const char *output = NULL;
+    const char *netem;
+    pid_t server = -1;
+    int verbose = 0;
+    int rc = 0;
+    int opt;
+    int i;
+    int devnull;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.files = 256;
+    opts.small = 4096;
+    opts.port = 22;
+    opts.user = getenv("USER") != NULL ? getenv("USER") : "bench";
+    opts.password = "";
+    opts.nsizes = parse_list(DEFAULT_SIZES, 32, add_size, &opts);
+    opts.ndepths = parse_list(DEFAULT_DEPTHS, 16, add_depth, &opts);
+    opts.ncompression =
+        parse_list(DEFAULT_COMPRESSION, 2, add_compression, &opts);
+
+    while ((opt = getopt(argc, argv, "s:d:z:n:S:H:p:u:P:j:o:Lvh")) != -1) {
+        switch (opt) {
+            case 's':
+                opts.nsizes = parse_list(optarg, 32, add_size, &opts);
+                break;
+            case 'd':
+                opts.ndepths = parse_list(optarg, 16, add_depth, &opts);
+                break;
+            case 'z':
+                opts.ncompression =
+                    parse_list(optarg, 2, add_compression, &opts);
+                break;
+            case 'n':
+                opts.files = atoi(optarg);
+                break;
+            case 'S':
+                opts.small = parse_size(optarg);
+                break;
+            case 'H':
+                opts.host = optarg;
+                break;
+            case 'p':
+                opts.port = atoi(optarg);
+                break;
+            case 'u':
+                opts.user = optarg;
+                break;
+            case 'P':
+                opts.password = optarg;
+                break;
+            case 'j':
+                opts.crypto_threads = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'L':
+                opts.nsizes = parse_list(LARGE_SIZES, 32, add_size, &opts);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (opts.nsizes <= 0 || opts.ndepths <= 0 || opts.ncompression <= 0 ||
+        opts.files < 0 || opts.small == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* keep our own messages on the original stderr */
+    msg = fdopen(dup(STDERR_FILENO), "w");
+    setvbuf(msg, NULL, _IOLBF, 0);
+    if (!verbose) {
+        devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
+    }
+
+    out = output != NULL ? fopen(output, "w") : stdout;
+    if (out == NULL) {
+        fprintf(msg, "can not open %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; i < BENCH_CHUNK; i++) chunk[i] = rand();
+
+    if (opts.host == NULL) {
+        if (mkdtemp(root) == NULL) {
+            fprintf(msg, "can not create %s: %s\n", root, strerror(errno));
+            return 1;
+        }
+        server = server_start(root, &opts.port, opts.crypto_threads);
+        if (server < 0) {
+            fprintf(msg, "can not start the server: %s\n", ssh_get_error());
+            rmdir(root);
+            return 1;
+        }
+    }
+
+    netem = getenv("LIBSFTP_NETEM");
+    fprintf(out, "{\n  \"server\": \"%s\",\n  \"netem\": ",
+            opts.host != NULL ? opts.host : "in-tree");
+    if (netem != NULL) {
+        fprintf(out, "\"%s\"", netem);
+    } else {
+        fprintf(out, "null");
+    }
+    fprintf(out, ",\n  \"results\": [");
+
+    for (i = 0; i < opts.ncompression; i++) {
+        if (bench_connection(&opts, opts.compression[i]) != SSH_OK) {
+            rc = 1;
+            break;
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        cleanup(root, &opts);
+    }
+
+    return rc;
+}
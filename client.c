@@ -149,17 +149,87 @@ int put_file(sftp_session sftp) {
     return 0;
 }
 
+void shell(sftp_session sftp) {
+    char cmd[11] = {'\0'};
+
+    /* File manipulation: interactive shell */
+    while (1) {
+        prompt();
+        if (fscanf(stdin, "%10s", cmd) != 1) break;
+        if (strcmp(cmd, "get") == 0) {
+            if (get_file(sftp) != 0) {
+                fprintf(stderr, "%s\n", ssh_get_error());
+                break;
+            }
+        } else if (strcmp(cmd, "put") == 0) {
+            if (put_file(sftp) != 0) {
+                fprintf(stderr, "%s\n", ssh_get_error());
+                break;
+            }
+        } else if (strcmp(cmd, "bye") == 0) {
+            fprintf(stdout, "%s", "Disconnect\n");
+            break;
+        } else {
+            fprintf(stderr,
+                    "Unsupported command: %s. Only supports 'get' and 'put'\n",
+                    cmd);
+        }
+    }
+}
+
+void usage() {
+    fprintf(stderr, "Usage: ./client [-M] [-S ctl_path] username@hostname\n"
+                    "       ./client -S ctl_path\n"
+                    "  -M            share the connection through ctl_path\n"
+                    "  -S ctl_path   attach to the master listening on "
+                    "ctl_path\n");
+    exit(1);
+}
+
 int main(int argc, char** argv) {
     int rc;
+    int opt;
+    int master = 0;
     char password[100];
-    char cmd[11] = {'\0'};
     char* host = NULL;
+    char* ctl_path = NULL;
+    sftp_session sftp = NULL;
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: ./client username@hostname\n");
-        exit(1);
-    } else {
-        host = argv[1];
+    while ((opt = getopt(argc, argv, "MS:")) != -1) {
+        switch (opt) {
+            case 'M':
+                master = 1;
+                break;
+            case 'S':
+                ctl_path = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind < argc) host = argv[optind++];
+    if (optind != argc || (master && ctl_path == NULL) ||
+        (host == NULL && (ctl_path == NULL || master))) {
+        usage();
+    }
+
+    if (ctl_path != NULL && !master) {
+        /* the master already did the transport and authentication layers */
+        sftp = sftp_mux_attach(ctl_path);
+        if (sftp == NULL) {
+            fprintf(stderr, "%s\n", ssh_get_error());
+            exit(1);
+        }
+
+        rc = sftp_init(sftp);
+        if (rc != SSH_OK) {
+            fprintf(stderr, "%s", ssh_get_error());
+            exit(1);
+        }
+
+        shell(sftp);
+        sftp_free(sftp);
+        return 0;
     }
 
     /* Transport Layer */
@@ -195,8 +265,19 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (master) {
+        /* serve the processes attaching to ctl_path until the connection
+         * is lost */
+        fprintf(stdout, "Sharing the connection on %s\n", ctl_path);
+        fflush(stdout);
+        ssh_mux_master(session, ctl_path);
+        fprintf(stderr, "%s\n", ssh_get_error());
+        ssh_free(session);
+        exit(1);
+    }
+
     /* Connection Layer & SFTP Layer */
-    sftp_session sftp = sftp_new(session);
+    sftp = sftp_new(session);
     if (sftp == NULL) {
         fprintf(stderr, "%s", ssh_get_error());
         exit(1);
@@ -208,32 +289,10 @@ int main(int argc, char** argv) {
         exit(1);
     }
 
-    /* File manipulation: interactive shell */
-    while (1) {
-        prompt();
-        fscanf(stdin, "%10s", cmd);
-        if (strcmp(cmd, "get") == 0) {
-            if (get_file(sftp) != 0) {
-                fprintf(stderr, "%s\n", ssh_get_error());
-                break;
-            }
-        } else if (strcmp(cmd, "put") == 0) {
-            if (put_file(sftp) != 0) {
-                fprintf(stderr, "%s\n", ssh_get_error());
-                break;
-            }
-        } else if (strcmp(cmd, "bye") == 0) {
-            fprintf(stdout, "%s", "Disconnect\n");
-            break;
-        } else {
-            fprintf(stderr,
-                    "Unsupported command: %s. Only supports 'get' and 'put'\n",
-                    cmd);
-        }
-    }
+    shell(sftp);
 
     sftp_free(sftp);
     ssh_free(session);
 
     return 0;
-}
\ No newline at end of file
+}
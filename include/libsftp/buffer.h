@@ -18,7 +18,16 @@
 
 #define SSH_BUFFER_PACK_END ((uint32_t) 0x4f65feb3)
 
+/* An SSH string left in the buffer it was read from ('V' of
+ * ssh_buffer_unpack()), not NUL terminated. It is valid until the buffer is
+ * written to, reinitialized or freed. */
+struct ssh_string_view {
+    const uint8_t *data;
+    uint32_t len;
+};
+
 void ssh_buffer_set_secure(ssh_buffer buffer);
+int ssh_buffer_reserve(ssh_buffer buffer, uint32_t headroom, uint32_t tailroom);
 int ssh_buffer_add_ssh_string(ssh_buffer buffer, ssh_string string);
 int ssh_buffer_add_u8(ssh_buffer buffer, uint8_t data);
 int ssh_buffer_add_u16(ssh_buffer buffer, uint16_t data);
@@ -64,5 +73,6 @@ ssh_string ssh_buffer_get_ssh_string(ssh_buffer buffer);
 /* ssh_buffer_pass_bytes acts as if len bytes have been read (used for padding) */
 uint32_t ssh_buffer_pass_bytes_end(ssh_buffer buffer, uint32_t len);
 uint32_t ssh_buffer_pass_bytes(ssh_buffer buffer, uint32_t len);
+const void *ssh_buffer_pull(ssh_buffer buffer, uint32_t len);
 
 #endif /* BUFFER_H_ */
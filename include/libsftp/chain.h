@@ -0,0 +1,37 @@
+/**
+ * @file chain.h
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Segmented buffer for large payloads.
+ * The data is kept in a list of fixed-size segments, so a chain grows without
+ * moving what it holds. It is filled and read through iovecs, e.g. with
+ * preadv() and ssh_channel_writev(), and never needs to be contiguous.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef CHAIN_H
+#define CHAIN_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Bytes per segment, a class of the slab cache */
+#define SSH_CHAIN_SEGMENT_SIZE 32768
+
+typedef struct ssh_chain_struct *ssh_chain;
+
+ssh_chain ssh_chain_new(void);
+void ssh_chain_free(ssh_chain chain);
+void ssh_chain_reset(ssh_chain chain);
+uint32_t ssh_chain_get_len(ssh_chain chain);
+void *ssh_chain_head(ssh_chain chain, uint32_t len);
+int ssh_chain_add_data(ssh_chain chain, const void *data, uint32_t len);
+int ssh_chain_reserve(ssh_chain chain, uint32_t len, struct iovec *iov,
+                      int iovcnt);
+void ssh_chain_commit(ssh_chain chain, uint32_t len);
+int ssh_chain_iovec(ssh_chain chain, struct iovec *iov, int iovcnt);
+
+#endif /* CHAIN_H */
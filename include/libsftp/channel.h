@@ -12,12 +12,30 @@
 #ifndef CHANNEL_H
 #define CHANNEL_H
 
+#include <sys/uio.h>
+
 #include "libssh.h"
 
+enum ssh_channel_state_e {
+    SSH_CHANNEL_STATE_NOT_OPEN = 0,
+    SSH_CHANNEL_STATE_OPENING,
+    SSH_CHANNEL_STATE_OPEN_DENIED,
+    SSH_CHANNEL_STATE_OPEN,
+    SSH_CHANNEL_STATE_CLOSED,
+};
+
+enum ssh_channel_request_state_e {
+    SSH_CHANNEL_REQ_STATE_NONE = 0,
+    SSH_CHANNEL_REQ_STATE_PENDING,
+    SSH_CHANNEL_REQ_STATE_ACCEPTED,
+    SSH_CHANNEL_REQ_STATE_DENIED,
+};
+
 struct ssh_channel_struct {
     ssh_session session; /* SSH_SESSION pointer */
     uint32_t local_channel;
     uint32_t local_window;
+    uint32_t local_window_max; /* granted when all received data is read */
     int local_eof;
     uint32_t local_maxpacket;
 
@@ -25,7 +43,15 @@ struct ssh_channel_struct {
     uint32_t remote_window;
     int remote_eof; /* end of file received */
     uint32_t remote_maxpacket;
-    ssh_buffer out_buffer;
+    ssh_buffer out_buffer; /* data waiting for the remote window */
+
+    enum ssh_channel_state_e state;
+    enum ssh_channel_request_state_e request_state;
+    int local_close;  /* SSH_MSG_CHANNEL_CLOSE sent */
+    int remote_close; /* SSH_MSG_CHANNEL_CLOSE received */
+    ssh_buffer in_buffer; /* received data not read yet */
+    struct ssh_channel_stats stats; /* folded into the session's when freed */
+    struct ssh_channel_struct *next; /* next channel of the session */
 };
 
 typedef struct ssh_channel_struct *ssh_channel;
@@ -34,9 +60,21 @@ ssh_channel ssh_channel_new(ssh_session session);
 int ssh_channel_open_session(ssh_channel channel);
 int ssh_channel_request_sftp(ssh_channel channel);
 int ssh_channel_write(ssh_channel channel, const void *data, uint32_t len);
+int ssh_channel_writev(ssh_channel channel, const struct iovec *iov,
+                       int iovcnt);
 int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count);
+int ssh_channel_read_nonblocking(ssh_channel channel, void *dest,
+                                 uint32_t count);
 int ssh_channel_eof(ssh_channel channel);
+int ssh_channel_send_close(ssh_channel channel);
 int ssh_channel_close(ssh_channel channel);
 void ssh_channel_free(ssh_channel channel);
+int ssh_channel_dispatch(ssh_session session, uint8_t type);
+int ssh_channel_handle_packet(ssh_session session);
+int ssh_channel_handle_pending(ssh_session session);
+ssh_channel ssh_channel_accept_sftp(ssh_session session);
+int ssh_channel_get_stats(ssh_channel channel, struct ssh_channel_stats *stats);
+void ssh_channel_stats_sum(ssh_session session,
+                           struct ssh_channel_stats *stats);
 
 #endif /* CHANNEL_H */
\ No newline at end of file
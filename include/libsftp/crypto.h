@@ -21,6 +21,7 @@
 #define DIGEST_MAX_LEN 64
 #define AES_GCM_TAGLEN 16
 #define AES_GCM_IVLEN 12
+#define CTR_IV_MAX_LEN 16
 
 enum ssh_kdf_digest {
     SSH_KDF_SHA1 = 1,
@@ -126,6 +127,16 @@ struct ssh_crypto_struct {
     struct ssh_cipher_struct *in_cipher,
         *out_cipher;                   /* the cipher structures/objects */
     enum ssh_hmac_e in_hmac, out_hmac; /* the MAC algorithms used */
+    bool in_hmac_etm, out_hmac_etm;     /* encrypt-then-MAC */
+    HMACCTX in_hmac_ctx, out_hmac_ctx;  /* keyed once, see hmac_packet() */
+
+    /* zlib streams and state, see gzip.c */
+    void *compress_out_ctx;
+    void *compress_in_ctx;
+    int do_compress_out; /* compression is active for outgoing packets */
+    int do_compress_in;  /* compression is active for incoming packets */
+    int delayed_compress_out; /* zlib@openssh.com, start after user auth */
+    int delayed_compress_in;
 
     ssh_key server_pubkey;
     /* kex sent by server, client, and mutually elected methods */
@@ -152,7 +163,14 @@ struct ssh_cipher_struct {
 
     unsigned int keysize; /* bits of key used. != keylen */
     size_t tag_size;      /* overhead required for tag */
-    
+
+    /* CTR mode: the IV and the blocks done since the key was set. Blocks
+     * skipped with ssh_cipher_ctr_skip() are done by the crypto workers,
+     * `ctx` is moved past them before its next use. */
+    uint8_t ctr_iv[CTR_IV_MAX_LEN];
+    uint64_t ctr_blocks;
+    bool ctr_seek;
+
     /* sets the new key for immediate use */
     int (*set_encrypt_key)(struct ssh_cipher_struct *cipher, void *key,
                            void *IV);
@@ -182,6 +200,11 @@ int ssh_kdf(struct ssh_crypto_struct *crypto, unsigned char *key,
             size_t requested_len);
 
 void ssh_cipher_clear(struct ssh_cipher_struct *cipher);
+bool ssh_cipher_is_ctr(struct ssh_cipher_struct *cipher);
+void ssh_cipher_ctr_skip(struct ssh_cipher_struct *cipher, uint64_t blocks);
+int ssh_cipher_ctr_crypt(struct ssh_cipher_struct *cipher, EVP_CIPHER_CTX *ctx,
+                         const void *key, uint64_t block, uint8_t *data,
+                         size_t len);
 struct ssh_hmac_struct *ssh_get_hmactab(void);
 struct ssh_cipher_struct *ssh_get_ciphertab(void);
 const char *ssh_hmac_type_to_string(enum ssh_hmac_e hmac_type, bool etm);
@@ -219,6 +242,10 @@ void evp_final(EVPCTX ctx, unsigned char *md, unsigned int *mdlen);
 HMACCTX hmac_init(const void *key, int len, enum ssh_hmac_e type);
 void hmac_update(HMACCTX c, const void *data, unsigned long len);
 void hmac_final(HMACCTX ctx, unsigned char *hashmacbuf, unsigned int *len);
+int hmac_packet(HMACCTX ctx, uint32_t seq, const void *data, size_t len,
+                unsigned char *mac, unsigned int *maclen);
+void hmac_free(HMACCTX ctx);
+int secure_memcmp(const void *s1, const void *s2, size_t n);
 size_t hmac_digest_len(enum ssh_hmac_e type);
 
 #endif /* CRYPTO_H */
\ No newline at end of file
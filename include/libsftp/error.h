@@ -9,6 +9,7 @@
  * 
  */
 
+#include <stdint.h>
 #include <sys/types.h>
 #define ERR_BUF_MAX 1024
 
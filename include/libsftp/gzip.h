@@ -0,0 +1,26 @@
+/**
+ * @file gzip.h
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief SSH packet compression.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef GZIP_H
+#define GZIP_H
+
+#include "libssh.h"
+#include "buffer.h"
+
+#define SSH_COMPRESSION_LEVEL_DEFAULT 6
+
+struct ssh_crypto_struct;
+
+int compress_buffer(ssh_session session, ssh_buffer buf);
+int decompress_buffer(ssh_session session, ssh_buffer buf, size_t maxlen);
+void compress_cleanup(struct ssh_crypto_struct *crypto);
+
+#endif /* GZIP_H */
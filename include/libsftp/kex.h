@@ -39,5 +39,6 @@ int ssh_set_client_kex(ssh_session session);
 int ssh_send_kex(ssh_session session);
 int ssh_receive_kex(ssh_session session);
 int ssh_select_kex(ssh_session session);
+int ssh_rekey(ssh_session session, int peer_init);
 
 #endif /* KEX_H */
\ No newline at end of file
@@ -0,0 +1,224 @@
+/**
+ * @file layout.h
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Encoders and decoders of the messages on the data path.
+ * ssh_buffer_pack() and ssh_buffer_unpack() interpret their format string at
+ * run time. The layouts below are fixed, so each is written in one
+ * ssh_buffer_allocate() and read with ssh_buffer_pull(), field by field at
+ * known offsets. Decoded strings are views into the buffer they were read
+ * from.
+ * Everything else keeps the generic functions.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "buffer.h"
+#include "libsftp.h"
+
+static inline uint8_t *layout_put_u8(uint8_t *p, uint8_t v) {
+    *p = v;
+    return p + 1;
+}
+
+static inline uint8_t *layout_put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+static inline uint8_t *layout_put_u64(uint8_t *p, uint64_t v) {
+    p = layout_put_u32(p, v >> 32);
+    return layout_put_u32(p, v);
+}
+
+static inline uint8_t *layout_put_data(uint8_t *p, const void *data,
+                                       uint32_t len) {
+    memcpy(p, data, len);
+    return p + len;
+}
+
+/* a string: length and bytes */
+static inline uint8_t *layout_put_string(uint8_t *p, const void *data,
+                                         uint32_t len) {
+    p = layout_put_u32(p, len);
+    return layout_put_data(p, data, len);
+}
+
+static inline uint32_t layout_load_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           p[3];
+}
+
+static inline uint64_t layout_load_u64(const uint8_t *p) {
+    return (uint64_t)layout_load_u32(p) << 32 | layout_load_u32(p + 4);
+}
+
+static inline int layout_get_u32(ssh_buffer buffer, uint32_t *v) {
+    const uint8_t *p = ssh_buffer_pull(buffer, 4);
+
+    if (p == NULL) return SSH_ERROR;
+    *v = layout_load_u32(p);
+    return SSH_OK;
+}
+
+static inline int layout_get_string(ssh_buffer buffer,
+                                    struct ssh_string_view *view) {
+    if (layout_get_u32(buffer, &view->len) != SSH_OK) return SSH_ERROR;
+    view->data = ssh_buffer_pull(buffer, view->len);
+    return view->data != NULL ? SSH_OK : SSH_ERROR;
+}
+
+/**
+ * @brief "bddP": SSH_MSG_CHANNEL_DATA, recipient channel, data. Only the
+ * header is written, the `len` bytes of data are left to the caller.
+ *
+ * @return where the data goes, NULL on error.
+ */
+static inline uint8_t *layout_put_channel_data(ssh_buffer buffer,
+                                               uint32_t channel, uint32_t len) {
+    uint8_t *p = ssh_buffer_allocate(buffer, 1 + 4 + 4 + len);
+
+    if (p == NULL) return NULL;
+    p = layout_put_u8(p, SSH_MSG_CHANNEL_DATA);
+    p = layout_put_u32(p, channel);
+    return layout_put_u32(p, len);
+}
+
+/**
+ * @brief "bdd": SSH_MSG_CHANNEL_WINDOW_ADJUST, recipient channel, bytes.
+ */
+static inline int layout_put_window_adjust(ssh_buffer buffer, uint32_t channel,
+                                           uint32_t bytes) {
+    uint8_t *p = ssh_buffer_allocate(buffer, 1 + 4 + 4);
+
+    if (p == NULL) return SSH_ERROR;
+    p = layout_put_u8(p, SSH_MSG_CHANNEL_WINDOW_ADJUST);
+    p = layout_put_u32(p, channel);
+    layout_put_u32(p, bytes);
+    return SSH_OK;
+}
+
+/**
+ * @brief "dSqd": id, handle, offset, length of SSH_FXP_READ.
+ */
+static inline int layout_put_sftp_read(ssh_buffer buffer, uint32_t id,
+                                       ssh_string handle, uint64_t offset,
+                                       uint32_t len) {
+    uint32_t hlen = ssh_string_len(handle);
+    uint8_t *p = ssh_buffer_allocate(buffer, 4 + 4 + hlen + 8 + 4);
+
+    if (p == NULL) return SSH_ERROR;
+    p = layout_put_u32(p, id);
+    p = layout_put_string(p, ssh_string_data(handle), hlen);
+    p = layout_put_u64(p, offset);
+    layout_put_u32(p, len);
+    return SSH_OK;
+}
+
+/**
+ * @brief "dSqdP": id, handle, offset, data of SSH_FXP_WRITE.
+ */
+static inline int layout_put_sftp_write(ssh_buffer buffer, uint32_t id,
+                                        ssh_string handle, uint64_t offset,
+                                        const void *data, uint32_t len) {
+    uint32_t hlen = ssh_string_len(handle);
+    uint8_t *p = ssh_buffer_allocate(buffer, 4 + 4 + hlen + 8 + 4 + len);
+
+    if (p == NULL) return SSH_ERROR;
+    p = layout_put_u32(p, id);
+    p = layout_put_string(p, ssh_string_data(handle), hlen);
+    p = layout_put_u64(p, offset);
+    layout_put_string(p, data, len);
+    return SSH_OK;
+}
+
+/**
+ * @brief "qd": offset and length of SSH_FXP_READ, after id and handle.
+ */
+static inline int layout_get_sftp_read(ssh_buffer buffer, uint64_t *offset,
+                                       uint32_t *len) {
+    const uint8_t *p = ssh_buffer_pull(buffer, 8 + 4);
+
+    if (p == NULL) return SSH_ERROR;
+    *offset = layout_load_u64(p);
+    *len = layout_load_u32(p + 8);
+    return SSH_OK;
+}
+
+/**
+ * @brief "qS": offset and data of SSH_FXP_WRITE, after id and handle.
+ */
+static inline int layout_get_sftp_write(ssh_buffer buffer, uint64_t *offset,
+                                        struct ssh_string_view *data) {
+    const uint8_t *p = ssh_buffer_pull(buffer, 8);
+
+    if (p == NULL) return SSH_ERROR;
+    *offset = layout_load_u64(p);
+    return layout_get_string(buffer, data);
+}
+
+/**
+ * @brief "bddP": SSH_FXP_DATA, id, data.
+ */
+static inline int layout_put_sftp_data(ssh_buffer buffer, uint32_t id,
+                                       const void *data, uint32_t len) {
+    uint8_t *p = ssh_buffer_allocate(buffer, 1 + 4 + 4 + len);
+
+    if (p == NULL) return SSH_ERROR;
+    p = layout_put_u8(p, SSH_FXP_DATA);
+    p = layout_put_u32(p, id);
+    layout_put_string(p, data, len);
+    return SSH_OK;
+}
+
+/**
+ * @brief "dS": id and data of SSH_FXP_DATA, after the type.
+ */
+static inline int layout_get_sftp_data(ssh_buffer buffer, uint32_t *id,
+                                       struct ssh_string_view *data) {
+    if (layout_get_u32(buffer, id) != SSH_OK) return SSH_ERROR;
+    return layout_get_string(buffer, data);
+}
+
+/**
+ * @brief "bddss": SSH_FXP_STATUS, id, status code, message, language tag.
+ */
+static inline int layout_put_sftp_status(ssh_buffer buffer, uint32_t id,
+                                         uint32_t status, const char *message,
+                                         const char *lang) {
+    uint32_t mlen = strlen(message);
+    uint32_t llen = strlen(lang);
+    uint8_t *p = ssh_buffer_allocate(buffer, 1 + 4 + 4 + 4 + mlen + 4 + llen);
+
+    if (p == NULL) return SSH_ERROR;
+    p = layout_put_u8(p, SSH_FXP_STATUS);
+    p = layout_put_u32(p, id);
+    p = layout_put_u32(p, status);
+    p = layout_put_string(p, message, mlen);
+    layout_put_string(p, lang, llen);
+    return SSH_OK;
+}
+
+/**
+ * @brief "dd": id and status code of SSH_FXP_STATUS, after the type. The
+ * strings that follow are left in the buffer.
+ */
+static inline int layout_get_sftp_status(ssh_buffer buffer, uint32_t *id,
+                                         uint32_t *status) {
+    const uint8_t *p = ssh_buffer_pull(buffer, 4 + 4);
+
+    if (p == NULL) return SSH_ERROR;
+    *id = layout_load_u32(p);
+    *status = layout_load_u32(p + 4);
+    return SSH_OK;
+}
+
+#endif /* LAYOUT_H */
@@ -117,6 +117,39 @@ typedef struct sftp_file_struct* sftp_file;
 typedef struct sftp_packet_struct* sftp_packet;
 typedef struct sftp_attributes_struct* sftp_attributes;
 typedef struct sftp_status_struct* sftp_status;
+typedef struct ssh_pool_struct* ssh_pool;
+
+/* Request kinds with a latency histogram of their own */
+enum sftp_stats_op {
+    SFTP_STATS_OP_OPEN,
+    SFTP_STATS_OP_CLOSE,
+    SFTP_STATS_OP_READ,
+    SFTP_STATS_OP_WRITE,
+    SFTP_STATS_OP_STAT,
+    SFTP_STATS_OP_OTHER,
+    SFTP_STATS_OP_MAX,
+};
+
+/* Bucket i counts replies after [2^i, 2^(i+1)) microseconds, the first and
+ * the last bucket also count the shorter and the longer ones. */
+#define SFTP_STATS_LATENCY_BUCKETS 24
+
+struct sftp_latency_stats {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t buckets[SFTP_STATS_LATENCY_BUCKETS];
+};
+
+struct sftp_stats {
+    uint64_t requests;  /* packets sent */
+    uint64_t replies;   /* packets received */
+    uint64_t bytes_out; /* SFTP packets, length field included */
+    uint64_t bytes_in;
+    uint32_t outstanding;     /* requests not answered yet */
+    uint32_t outstanding_max; /* highest `outstanding` seen */
+    struct sftp_latency_stats latency[SFTP_STATS_OP_MAX];
+};
 
 
 /**
@@ -135,6 +168,18 @@ typedef struct sftp_status_struct* sftp_status;
  */
 API sftp_session sftp_new(ssh_session session);
 
+/**
+ * @brief Creates a sftp session on a connected byte stream, such as the
+ * socket of a mux master.
+ *
+ * @param fd            The stream, it is closed by sftp_free().
+ *
+ * @return              A new sftp session or NULL on error.
+ *
+ * @see sftp_mux_attach()
+ */
+API sftp_session sftp_new_fd(int fd);
+
 /**
  * @brief Close and deallocate a sftp session.
  * Internally, it close the underlying SSH channel.
@@ -247,4 +292,205 @@ API int32_t sftp_read(sftp_file file, void* buf, uint32_t count);
  */
 API int32_t sftp_write(sftp_file file, const void* buf, uint32_t count);
 
+/**
+ * @brief Start an asynchronous read from a file, at its current offset.
+ *
+ * Several reads may be outstanding, they hide the round trip to the server.
+ * The file offset moves on by `len` at once, so a read that comes back short
+ * leaves a hole: use it for files whose size is known.
+ *
+ * @param file          The opened sftp file handle to be read from.
+ *
+ * @param len           Size to read in bytes.
+ *
+ * @return              An identifier of the request, < 0 on error with ssh
+ *                      error set.
+ *
+ * @see sftp_async_read()
+ */
+API int sftp_async_read_begin(sftp_file file, uint32_t len);
+
+/**
+ * @brief Wait for an asynchronous read to complete.
+ *
+ * @param file          The opened sftp file handle to be read from.
+ *
+ * @param data          Pointer to buffer to recieve read data.
+ *
+ * @param len           Size of the buffer, at least the `len` passed to
+ *                      sftp_async_read_begin().
+ *
+ * @param id            The identifier returned by sftp_async_read_begin().
+ *
+ * @return              Number of bytes read, 0 at end of file, < 0 on error
+ *                      with ssh error set.
+ *
+ * @see sftp_async_read_begin()
+ */
+API int sftp_async_read(sftp_file file, void* data, uint32_t len,
+                        uint32_t id);
+
+/**
+ * @brief Start an asynchronous write to a file, at its current offset.
+ *
+ * @param file          Open sftp file handle to write to.
+ *
+ * @param buf           Pointer to buffer to write data, it may be reused
+ *                      as soon as this function returns.
+ *
+ * @param count         Size of buffer in bytes, SSH_FXP_MAXLEN at most.
+ *
+ * @return              An identifier of the request, < 0 on error with ssh
+ *                      error set.
+ *
+ * @see sftp_async_write()
+ */
+API int sftp_async_write_begin(sftp_file file, const void* buf,
+                               uint32_t count);
+
+/**
+ * @brief Wait for an asynchronous write to complete.
+ *
+ * @param file          Open sftp file handle to write to.
+ *
+ * @param id            The identifier returned by sftp_async_write_begin().
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh error
+ *                      set.
+ *
+ * @see sftp_async_write_begin()
+ */
+API int sftp_async_write(sftp_file file, uint32_t id);
+
+/**
+ * @brief Take a snapshot of the counters of a sftp session.
+ *
+ * The counters of the underlying ssh session are read with ssh_get_stats().
+ *
+ * @param sftp          The sftp session.
+ *
+ * @param stats         Filled with the counters since sftp_new().
+ *
+ * @return              SSH_OK on success, SSH_ERROR on invalid arguments.
+ */
+API int sftp_get_stats(sftp_session sftp, struct sftp_stats *stats);
+
+/**
+ * @brief Create a pool of authenticated sftp sessions.
+ *
+ * @param max_idle      Number of idle sessions kept per user, host and port.
+ *
+ * @param idle_timeout  Seconds after which an idle session is disconnected,
+ *                      0 keeps them until the pool is freed.
+ *
+ * @return              A new pool or NULL on error.
+ *
+ * @see ssh_pool_free()
+ */
+API ssh_pool ssh_pool_new(unsigned int max_idle, unsigned int idle_timeout);
+
+/**
+ * @brief Get an initialized sftp session from the pool.
+ *
+ * An idle session to the same user, host and port is reused, after a
+ * keepalive check if it has been idle for a while. Otherwise a new session
+ * is connected and authenticated with `password`.
+ *
+ * @param pool          The pool.
+ *
+ * @param host          The host to connect to, "user@host" or "host".
+ *
+ * @param port          The port to connect to.
+ *
+ * @param password      The password used if a new session is needed.
+ *
+ * @return              A sftp session, NULL on error with ssh error set.
+ *
+ * @see ssh_pool_put()
+ * @see ssh_pool_discard()
+ */
+API sftp_session ssh_pool_get(ssh_pool pool, const char *host,
+                              unsigned int port, const char *password);
+
+/**
+ * @brief Give a sftp session back to the pool for reuse. All its files must
+ * be closed.
+ *
+ * @param pool          The pool the session comes from.
+ *
+ * @param sftp          The sftp session.
+ */
+API void ssh_pool_put(ssh_pool pool, sftp_session sftp);
+
+/**
+ * @brief Give back a sftp session that must not be reused, e.g. after an
+ * error. It is disconnected and freed.
+ *
+ * @param pool          The pool the session comes from.
+ *
+ * @param sftp          The sftp session.
+ */
+API void ssh_pool_discard(ssh_pool pool, sftp_session sftp);
+
+/**
+ * @brief Disconnect the sessions that have been idle for too long.
+ * `ssh_pool_get` and `ssh_pool_put` do this as well.
+ *
+ * @param pool          The pool.
+ */
+API void ssh_pool_prune(ssh_pool pool);
+
+/**
+ * @brief Disconnect all sessions and free the pool.
+ *
+ * @param pool          The pool.
+ */
+API void ssh_pool_free(ssh_pool pool);
+
+/**
+ * @brief Share an authenticated session with the other processes of the
+ * host (like OpenSSH's ControlMaster).
+ *
+ * Listens on the UNIX socket `path`. Each process attaching with
+ * sftp_mux_attach() gets its own SFTP channel on `session`. This function
+ * only returns when the connection is lost or on error.
+ *
+ * @param session       The connected and authenticated ssh session.
+ *
+ * @param path          Path of the UNIX socket, only the owner may use it.
+ *
+ * @return              SSH_ERROR with ssh error set.
+ */
+API int ssh_mux_master(ssh_session session, const char *path);
+
+/**
+ * @brief Attach to a mux master. The returned session is used as one
+ * created by sftp_new(), starting with sftp_init().
+ *
+ * @param path          Path of the UNIX socket of the master.
+ *
+ * @return              A new sftp session or NULL on error with ssh error
+ *                      set.
+ *
+ * @see ssh_mux_master()
+ */
+API sftp_session sftp_mux_attach(const char *path);
+
+/**
+ * @brief Serve SFTP from a local directory on a server role session.
+ *
+ * Waits for the client to open a session channel with the "sftp" subsystem
+ * and answers its requests until it closes the channel. Paths are relative
+ * to `root` and may not contain "..".
+ *
+ * @param session       A session accepted with ssh_accept() and
+ *                      authenticated with ssh_server_auth_password().
+ *
+ * @param root          The served directory.
+ *
+ * @return              SSH_OK when the client closed the channel, SSH_ERROR
+ *                      on error with ssh error set.
+ */
+API int sftp_server_run(ssh_session session, const char *root);
+
 #endif /* SFTP_H */
\ No newline at end of file
@@ -115,8 +115,29 @@ enum ssh_options_e {
     SSH_OPTIONS_HOST,
     SSH_OPTIONS_PORT,
     SSH_OPTIONS_USER,
+    SSH_OPTIONS_REKEY_DATA, /* uint64_t, bytes before a new key exchange */
+    SSH_OPTIONS_REKEY_TIME, /* uint32_t, seconds before a new key exchange */
+    SSH_OPTIONS_COMPRESSION,       /* int, offer zlib compression if not 0 */
+    SSH_OPTIONS_COMPRESSION_LEVEL, /* int, zlib level from 1 to 9 */
+    SSH_OPTIONS_HOSTKEY, /* const char *, server role RSA host key (PEM) */
+    SSH_OPTIONS_NETEM, /* const char *, emulated link, e.g. "delay=25ms" */
+    SSH_OPTIONS_LOG_LEVEL, /* int, SSH_LOG_*, for the per packet messages */
+    SSH_OPTIONS_CRYPTO_THREADS, /* unsigned int, threads encrypting and
+                                   decrypting CTR packets, set once before
+                                   connecting, 0 (default) for none */
 };
 
+/* Log levels. Messages below the LOG_LEVEL the library was built with are
+ * compiled out, the default runtime level is that one or LIBSFTP_LOG_LEVEL
+ * ("debug" to "silent", or the number). */
+#define SSH_LOG_DEBUG 0
+#define SSH_LOG_INFO 1
+#define SSH_LOG_NOTICE 2
+#define SSH_LOG_WARNING 3
+#define SSH_LOG_ERROR 4
+#define SSH_LOG_CRITICAL 5
+#define SSH_LOG_SILENT 6
+
 
 /* ssh API */
 typedef struct ssh_session_struct *ssh_session;
@@ -125,11 +146,80 @@ API int ssh_options_set(ssh_session session, enum ssh_options_e type, const void
 API int ssh_connect(ssh_session session);
 API void ssh_disconnect(ssh_session session);
 API void ssh_free(ssh_session session);
+/* Threads. The library keeps no mutable state shared by sessions (errors
+ * are per thread), so independent sessions can be driven by different
+ * threads in parallel. A session, with its channels and sftp sessions, is
+ * used by one thread at a time: threads sharing one hold its lock around
+ * their calls. The lock is recursive. This includes ssh_get_stats(),
+ * sftp_get_stats() and the trace functions, which read state the transfer
+ * updates without locking: a thread reading them while another drives the
+ * session holds the lock, and waits for a blocking call to return. */
+API void ssh_session_lock(ssh_session session);
+API void ssh_session_unlock(ssh_session session);
+/* Level of the messages not tied to a session, and the default of new
+ * sessions */
+API int ssh_set_log_level(int level);
+/* Algorithms negotiated for what we send, NULL before the key exchange */
+API const char *ssh_get_cipher_out(ssh_session session);
+API const char *ssh_get_hmac_out(ssh_session session);
+API const char *ssh_get_compression_out(ssh_session session);
+
+/* Connection layer counters, of one channel or summed over a session */
+struct ssh_channel_stats {
+    uint64_t bytes_in;        /* channel data received */
+    uint64_t bytes_out;       /* channel data sent */
+    uint64_t window_stalls;   /* writes that waited for the peer's window */
+    uint64_t window_stall_ns; /* time spent waiting */
+    uint64_t window_adjusts_sent;     /* grow_window calls that sent one */
+    uint64_t window_adjusts_received;
+};
+
+/* Transport layer counters, times are in nanoseconds */
+struct ssh_stats {
+    uint64_t bytes_in; /* on the wire, MAC included */
+    uint64_t bytes_out;
+    uint64_t packets_in;
+    uint64_t packets_out;
+    uint64_t payload_in; /* uncompressed */
+    uint64_t payload_out;
+    uint64_t encrypt_ns;
+    uint64_t decrypt_ns;
+    uint64_t mac_in_ns;
+    uint64_t mac_out_ns;
+    uint64_t compress_ns;
+    uint64_t decompress_ns;
+    uint64_t rekeys;
+    uint64_t rekey_ns;
+    struct ssh_channel_stats channels; /* all channels, closed ones included */
+};
+
+/* Snapshot of the counters since ssh_new() */
+API int ssh_get_stats(ssh_session session, struct ssh_stats *stats);
+
+/* Binary event tracing into a ring of the last `events` events, see trace.h.
+ * The dump is read by tracedump. LIBSFTP_TRACE=prefix traces every session
+ * and dumps it to "prefix.<pid>.<n>" in ssh_free(). */
+API int ssh_trace_start(ssh_session session, unsigned int events);
+API int ssh_trace_dump(ssh_session session, const char *path);
+API void ssh_trace_stop(ssh_session session);
+
+/* Precomputed DH keypairs, shared by all sessions of the process */
+API int ssh_dh_keypool_start(unsigned int size);
+API void ssh_dh_keypool_stop(void);
 
 /* Authentication API */
 API int ssh_userauth_password(ssh_session session, const char *password);
 API void ssh_get_password(char *password);
 
+/* Server role, to run the library against itself (see server.c).
+ * `ssh_accept` takes over a connected fd and runs the transport layer,
+ * `ssh_server_auth_password` accepts `password`, or any if NULL. Call
+ * `ssh_server_init` before forking so that children share the ephemeral
+ * host key used when SSH_OPTIONS_HOSTKEY is not set. */
+API int ssh_server_init(void);
+API int ssh_accept(ssh_session session, int fd);
+API int ssh_server_auth_password(ssh_session session, const char *password);
+
 /* buffer API */
 typedef struct ssh_buffer_struct *ssh_buffer;
 API ssh_buffer ssh_buffer_new(void);
@@ -140,8 +230,15 @@ API uint32_t ssh_buffer_get_data(ssh_buffer buffer, void *data,
                                  uint32_t requestedlen);
 API void *ssh_buffer_get(ssh_buffer buffer);
 API uint32_t ssh_buffer_get_len(ssh_buffer buffer);
+/* Reallocations of all buffers of the process. Once its buffers have grown,
+ * a steady transfer makes none. */
+struct ssh_buffer_stats {
+    uint64_t grows;   /* data moved to a larger block */
+    uint64_t shrinks; /* blocks given back by ssh_buffer_reinit() */
+};
+API void ssh_buffer_get_stats(struct ssh_buffer_stats *stats);
 
-/* error API */
+/* error API, the last error of the calling thread */
 API char *ssh_get_error(void);
 API char *sftp_get_error(void);
 
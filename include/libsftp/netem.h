@@ -0,0 +1,38 @@
+/**
+ * @file netem.h
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Network emulation between the session and its socket.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef NETEM_H
+#define NETEM_H
+
+#include <stdint.h>
+
+/* Environment variable read by ssh_connect() when SSH_OPTIONS_NETEM is not
+ * set, the server role only emulates a link it is explicitly given */
+#define SSH_NETEM_ENV "LIBSFTP_NETEM"
+
+/* Applied to each direction independently, the RTT is twice the delay */
+struct ssh_netem_params {
+    uint64_t delay_us;  /* one-way delay */
+    uint64_t jitter_us; /* delay varies uniformly within +/- jitter */
+    uint64_t rate_bps;  /* bandwidth cap in bits per second, 0 for none */
+    double loss;        /* segment loss probability, from 0 to 1 */
+};
+
+typedef struct ssh_netem_struct *ssh_netem;
+
+int ssh_netem_parse(const char *spec, struct ssh_netem_params *params);
+
+ssh_netem ssh_netem_start(int fd, const struct ssh_netem_params *params,
+                          int *local_fd);
+
+void ssh_netem_stop(ssh_netem netem);
+
+#endif /* NETEM_H */
@@ -15,8 +15,16 @@
 #include "libssh.h"
 #include "crypto.h"
 
+/* Room kept in session->out_buffer around the payload: the packet length and
+ * padding length in front, the padding and the MAC behind */
+#define SSH_PACKET_HEADROOM 5
+#define SSH_PACKET_TAILROOM (32 + DIGEST_MAX_LEN)
+
 int ssh_packet_send(ssh_session session);
+int ssh_packet_send_later(ssh_session session);
 int ssh_packet_receive(ssh_session session);
+int ssh_packet_receive_nonblocking(ssh_session session);
+int ssh_packet_flush(ssh_session session);
 
 
 #endif /* PACKET_H */
@@ -0,0 +1,46 @@
+/**
+ * @file pipeline.h
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Packet encryption and decryption on worker threads.
+ * With a CTR cipher, the key stream of a packet only depends on its offset
+ * since the key was set, and its MAC on its sequence number, so packets can
+ * be processed in parallel. On receive, the packets that have arrived are
+ * split on the session thread (only the first block of each is decrypted
+ * there) and decrypted and verified by the workers. On send, data packets
+ * are queued to the workers and written in order when done, by the next
+ * send or before the session reads.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libssh.h"
+
+/* Packets in flight in each direction */
+#define SSH_PIPELINE_DEPTH 64
+#define SSH_PIPELINE_MAX_THREADS 64
+/* Bytes read ahead from the socket for a batch of received packets */
+#define SSH_PIPELINE_READ_AHEAD (SSH_PIPELINE_DEPTH * 32768)
+
+typedef struct ssh_pipeline_struct *ssh_pipeline;
+
+ssh_pipeline ssh_pipeline_new(unsigned int threads);
+void ssh_pipeline_free(ssh_pipeline pipeline);
+
+bool ssh_pipeline_decrypts(ssh_session session);
+bool ssh_pipeline_encrypts(ssh_session session, uint8_t type);
+bool ssh_pipeline_pending(ssh_session session);
+
+int ssh_pipeline_read(ssh_session session);
+int ssh_pipeline_send(ssh_session session);
+int ssh_pipeline_flush(ssh_session session);
+
+#endif /* PIPELINE_H */
@@ -39,4 +39,13 @@ struct ssh_signature_struct {
 
 typedef struct ssh_signature_struct *ssh_signature;
 
+ssh_key ssh_key_new(void);
+void ssh_key_free(ssh_key key);
+ssh_key ssh_key_dup(const ssh_key key);
+ssh_key ssh_pki_generate_rsa(int bits);
+ssh_key ssh_pki_import_privkey_file(const char *filename);
+ssh_string ssh_pki_export_pubkey_blob(const ssh_key key);
+ssh_string ssh_pki_do_sign(const ssh_key key, const unsigned char *hash,
+                           size_t hlen);
+
 #endif /* PKI_H */
\ No newline at end of file
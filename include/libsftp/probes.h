@@ -0,0 +1,48 @@
+/**
+ * @file probes.h
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief USDT probes of the "libsftp" provider, for bpftrace or SystemTap.
+ * Built with -DENABLE_USDT=ON (needs sys/sdt.h), a probe is a nop in the
+ * code and a note in the library, otherwise it is nothing. The arguments are
+ * evaluated in both cases of the ON build, keep them cheap.
+ *
+ *   packet__send(seq, type, size)       size on the wire, MAC included
+ *   packet__receive(seq, type, size)
+ *   window__grow(channel, bytes, window) WINDOW_ADJUST sent, local channel
+ *   window__adjust(channel, bytes, window) WINDOW_ADJUST received
+ *   window__stall__start(channel, window) write waiting for the peer's window
+ *   window__stall__done(channel, ns, rc)
+ *   sftp__request(id, type, size)
+ *   sftp__reply(id, type, size, ns)     ns: latency, 0 if the request was
+ *                                        not timed
+ *
+ * e.g. bpftrace -e 'usdt:./build/src/libsftp.so:libsftp:sftp__reply
+ *                   { @us = hist(arg3 / 1000); }' -p <pid>
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define SSH_PROBE1(name, a) DTRACE_PROBE1(libsftp, name, a)
+#define SSH_PROBE2(name, a, b) DTRACE_PROBE2(libsftp, name, a, b)
+#define SSH_PROBE3(name, a, b, c) DTRACE_PROBE3(libsftp, name, a, b, c)
+#define SSH_PROBE4(name, a, b, c, d) DTRACE_PROBE4(libsftp, name, a, b, c, d)
+
+#else
+
+#define SSH_PROBE1(name, a) do {} while (0)
+#define SSH_PROBE2(name, a, b) do {} while (0)
+#define SSH_PROBE3(name, a, b, c) do {} while (0)
+#define SSH_PROBE4(name, a, b, c, d) do {} while (0)
+
+#endif /* ENABLE_USDT */
+
+#endif /* probes.h */
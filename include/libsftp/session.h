@@ -12,7 +12,9 @@
 #ifndef SESSION_H
 #define SESSION_H
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <time.h>
 #include "libssh.h"
 #include "socket.h"
 #include "string.h"
@@ -20,14 +22,18 @@
 #include "pki.h"
 #include "crypto.h"
 #include "channel.h"
+#include "pipeline.h"
+#include "trace.h"
 
 struct ssh_session_struct {
+    pthread_mutex_t lock; /* recursive, see ssh_session_lock() */
     ssh_socket socket;
     char *server_id_str;
     char *client_id_str;
     int protoversion;
     int server;
     int client;
+    int authenticated;
     uint32_t send_seq;
     uint32_t recv_seq;
 
@@ -52,8 +58,21 @@ struct ssh_session_struct {
     struct ssh_crypto_struct *current_crypto; /* currently used crypto */
     struct ssh_crypto_struct *next_crypto;  /* next_crypto is going to be used after a SSH_MSG_NEWKEYS */
 
-    /* we only support one channel per session now */
-    ssh_channel channel;
+    /* re-key state */
+    int kex_running;       /* a key exchange is in progress */
+    ssh_buffer in_pending; /* non-kex packets received during re-key, each
+                              prefixed with its 32-bit length */
+    uint64_t kex_bytes;    /* bytes sent and received with current keys */
+    time_t kex_time;       /* time the current keys were taken into use */
+
+    struct ssh_stats stats; /* see ssh_get_stats() */
+    ssh_trace trace;        /* NULL unless tracing */
+    ssh_pipeline pipeline;  /* NULL unless SSH_OPTIONS_CRYPTO_THREADS */
+
+    ssh_key hostkey; /* server role: key signing the exchange hash */
+
+    ssh_channel channels; /* channels of the session, newest first */
+    uint32_t maxchannel;  /* last local channel number handed out */
 
     /* Some options set by user */
     struct {
@@ -63,11 +82,23 @@ struct ssh_session_struct {
         char *knownhosts;
         char *pubkey_accepted_types;
         char *custombanner;
+        char *hostkey; /* server role: PEM file of the RSA host key */
+        char *netem;   /* emulated link, the client falls back to
+                          LIBSFTP_NETEM */
         unsigned int port;
+        uint64_t rekey_data;
+        uint32_t rekey_time;
+        int compression;
+        int compressionlevel;
+        int log_level; /* SSH_LOG_*, of the per packet messages */
     } opts;
 };
 
 
 
 
+int send_id_str(ssh_session session);
+int receive_id_str(ssh_session session);
+int ssh_send_keepalive(ssh_session session, int timeout);
+
 #endif /* SESSION_H */
\ No newline at end of file
@@ -0,0 +1,34 @@
+/**
+ * @file slab.h
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Size-classed cache of the memory of buffers and strings.
+ * Blocks are rounded up to a power of two and, when freed, kept on a list of
+ * their class by the freeing thread, for the next allocation of that class on
+ * the same thread. A block is plain malloc memory, free() on it is fine.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/* Classes are the powers of two from SLAB_MIN_SIZE to SLAB_MAX_SIZE, larger
+ * blocks are not cached */
+#define SLAB_MIN_SHIFT 6
+#define SLAB_MAX_SHIFT 18
+#define SLAB_MIN_SIZE ((size_t)1 << SLAB_MIN_SHIFT)
+#define SLAB_MAX_SIZE ((size_t)1 << SLAB_MAX_SHIFT)
+/* Bytes kept per class and thread, at least SLAB_CLASS_MIN_BLOCKS blocks */
+#define SLAB_CLASS_BYTES (1024 * 1024)
+#define SLAB_CLASS_MIN_BLOCKS 4
+
+void *ssh_slab_alloc(size_t size);
+void *ssh_slab_grow(void *ptr, size_t used, size_t size, int secure);
+void ssh_slab_free(void *ptr);
+
+#endif /* SLAB_H */
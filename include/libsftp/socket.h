@@ -14,10 +14,16 @@
 
 #include <sys/socket.h>
 #include "libssh.h"
+#include "netem.h"
+
+/* Bytes read at once by ssh_socket_read_ahead() */
+#define SOCKET_READ_AHEAD_CHUNK 16384
 
 struct ssh_socket_struct {
     int fd;
     ssh_buffer in_buffer;
+    ssh_buffer out_buffer; /* packets written with the next write or read */
+    ssh_netem netem; /* emulated link in front of the socket, or NULL */
 };
 
 typedef struct ssh_socket_struct *ssh_socket;
@@ -33,8 +39,18 @@ void ssh_socket_close(ssh_socket s);
 
 void ssh_socket_set_fd(ssh_socket s, int fd);
 
+int ssh_socket_set_netem(ssh_socket s, const char *spec);
+
 int ssh_socket_write(ssh_socket s, const void *buffer, size_t len);
 
+int ssh_socket_write_later(ssh_socket s, const void *buffer, size_t len);
+
+int ssh_socket_flush(ssh_socket s);
+
 int ssh_socket_read(ssh_socket s, void *buffer, size_t len);
 
+int ssh_socket_read_ahead(ssh_socket s, size_t len, int blocking);
+
+int ssh_socket_wait(ssh_socket s, int timeout);
+
 #endif /* SOCKET_H */
\ No newline at end of file
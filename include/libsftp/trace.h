@@ -0,0 +1,106 @@
+/**
+ * @file trace.h
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Per-session ring buffer of binary events.
+ * Recording an event is a branch when tracing is off, and a clock read and
+ * a 32-byte store when it is on. The ring is written to a file with
+ * ssh_trace_dump() and read offline by tracedump.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "libssh.h"
+#include "util.h"
+
+/* Environment variable, trace every session and dump it to
+ * "<value>.<pid>.<n>" when freed */
+#define SSH_TRACE_ENV "LIBSFTP_TRACE"
+#define SSH_TRACE_DEFAULT_EVENTS 65536
+
+#define SSH_TRACE_MAGIC "SSHTRACE"
+#define SSH_TRACE_VERSION 1
+
+enum ssh_trace_kind {
+    SSH_TRACE_PACKET_SEND = 1,   /* type, wire size, seq */
+    SSH_TRACE_PACKET_RECV,       /* type, wire size, seq */
+    SSH_TRACE_WINDOW_STALL,      /* arg: local channel */
+    SSH_TRACE_WINDOW_ADJUST_OUT, /* size: bytes granted, arg: local channel */
+    SSH_TRACE_WINDOW_ADJUST_IN,  /* size: bytes granted, arg: local channel */
+    SSH_TRACE_REKEY,
+    SSH_TRACE_SFTP_REQUEST, /* type, size, arg: request id */
+    SSH_TRACE_SFTP_REPLY,   /* type, size, arg: request id, dur: latency */
+};
+
+/* Fixed size, host byte order */
+struct ssh_trace_event {
+    uint64_t ts_ns;  /* CLOCK_MONOTONIC at the start */
+    uint32_t dur_ns; /* 0 for instant events */
+    uint32_t seq;    /* packet sequence number */
+    uint32_t size;
+    uint32_t arg;
+    uint16_t kind;   /* enum ssh_trace_kind */
+    uint8_t type;    /* SSH or SFTP message type */
+    uint8_t pad;
+    uint32_t reserved;
+};
+
+/* File layout: this header, then `count` events, oldest first */
+struct ssh_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+    uint64_t count;
+    uint64_t dropped; /* overwritten when the ring wrapped */
+    uint32_t server;  /* recorded by a server role session */
+    uint32_t reserved;
+};
+
+struct ssh_trace_struct {
+    struct ssh_trace_event *events;
+    uint64_t mask; /* capacity - 1, a power of two */
+    uint64_t head; /* events recorded so far */
+};
+
+typedef struct ssh_trace_struct *ssh_trace;
+
+ssh_trace ssh_trace_new(unsigned int events);
+void ssh_trace_free(ssh_trace trace);
+int ssh_trace_write(ssh_trace trace, const char *path, int server);
+void ssh_trace_env_start(ssh_session session);
+void ssh_trace_env_dump(ssh_session session);
+
+/**
+ * @brief Append an event, the oldest one is overwritten when the ring is
+ * full. `trace` may be NULL. An instant event is stamped here if
+ * `start_ns` is 0.
+ */
+static inline void ssh_trace_record(ssh_trace trace, enum ssh_trace_kind kind,
+                                    uint8_t type, uint32_t seq, uint32_t size,
+                                    uint32_t arg, uint64_t start_ns,
+                                    uint64_t end_ns) {
+    struct ssh_trace_event *e;
+
+    if (trace == NULL) return;
+    if (start_ns == 0) start_ns = end_ns = ssh_time_ns();
+
+    e = &trace->events[trace->head++ & trace->mask];
+    e->ts_ns = start_ns;
+    e->dur_ns = end_ns - start_ns > UINT32_MAX ? UINT32_MAX
+                                               : (uint32_t)(end_ns - start_ns);
+    e->seq = seq;
+    e->size = size;
+    e->arg = arg;
+    e->kind = kind;
+    e->type = type;
+    e->pad = 0;
+    e->reserved = 0;
+}
+
+#endif /* TRACE_H */
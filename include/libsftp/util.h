@@ -12,6 +12,7 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #ifdef LINUX
@@ -83,6 +84,8 @@
 
 void explicit_bzero(void *s, size_t n);
 
+uint64_t ssh_time_ns(void);
+
 char *ssh_get_local_username(void); 
 char *ssh_get_home_dir(void);
 
@@ -0,0 +1,363 @@
+/**
+ * @file microbench.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Microbenchmarks of the per-packet hot paths.
+ * Times ssh_buffer_pack/ssh_buffer_unpack and the encrypt and decrypt paths
+ * of ssh_packet_send/ssh_packet_receive for payloads from 64 B to 256 KiB,
+ * and reports ns/op and bytes/cycle as JSON. The packet functions run on a
+ * real session pair set up in-process: the sender writes to /dev/null, the
+ * receiver is fed packets captured beforehand from its socket buffer, so no
+ * network is involved. Build with -DLOG_LEVEL=WARNING.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "libsftp/buffer.h"
+#include "libsftp/libsftp.h"
+#include "libsftp/packet.h"
+#include "libsftp/session.h"
+#include "libsftp/string.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+/* Bytes moved per size and function, in as many operations as needed */
+#define MICRO_BYTES (32 * 1024 * 1024)
+#define MICRO_MIN_OPS 128
+#define MICRO_MAX_OPS 16384
+
+static const uint32_t sizes[] = {64,    256,   1024,  4096,
+                                 16384, 32768, 65536, 262144};
+
+static FILE *msg;
+static int first_result = 1;
+
+struct micro_timer {
+    uint64_t ns;
+    uint64_t cycles;
+    struct timespec ts;
+    uint64_t tsc;
+};
+
+static inline void timer_start(struct micro_timer *t) {
+#ifdef HAVE_TSC
+    t->tsc = __rdtsc();
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &t->ts);
+}
+
+static inline void timer_stop(struct micro_timer *t) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#ifdef HAVE_TSC
+    t->cycles += __rdtsc() - t->tsc;
+#endif
+    t->ns += (ts.tv_sec - t->ts.tv_sec) * 1000000000ULL + ts.tv_nsec -
+             t->ts.tv_nsec;
+}
+
+static uint32_t micro_ops(uint32_t size) {
+    uint32_t ops = MICRO_BYTES / size;
+
+    if (ops < MICRO_MIN_OPS) ops = MICRO_MIN_OPS;
+    if (ops > MICRO_MAX_OPS) ops = MICRO_MAX_OPS;
+    return ops;
+}
+
+static void report(const char *function, const char *detail, uint32_t size,
+                   uint32_t ops, const struct micro_timer *t) {
+    double ns = (double)t->ns / ops;
+
+    printf("%s\n    {\"function\": \"%s\", \"detail\": \"%s\", "
+           "\"size\": %u, \"ops\": %u, \"ns_per_op\": %.1f, ",
+           first_result ? "" : ",", function, detail, size, ops, ns);
+    first_result = 0;
+#ifdef HAVE_TSC
+    printf("\"bytes_per_cycle\": %.3f}", (double)size * ops / t->cycles);
+#else
+    printf("\"bytes_per_cycle\": null}");
+#endif
+    fflush(stdout);
+
+    fprintf(msg, "%-20s %-6s %7u B %10.1f ns/op %9.1f MB/s\n", function,
+            detail, size, ns, size / ns * 1e3);
+}
+
+/**
+ * @brief CHANNEL_DATA as channel.c builds it, and as sftp.c reads SSH_FXP_DATA.
+ */
+static int bench_buffer(uint32_t size) {
+    struct micro_timer pack = {0}, unpack = {0};
+    ssh_buffer buffer;
+    ssh_string str;
+    uint32_t ops = micro_ops(size);
+    uint32_t channel;
+    uint8_t type;
+    uint8_t *data;
+    uint32_t i;
+    int rc = SSH_OK;
+
+    buffer = ssh_buffer_new();
+    data = calloc(1, size);
+    if (buffer == NULL || data == NULL) {
+        rc = SSH_ERROR;
+        goto out;
+    }
+
+    for (i = 0; i < ops && rc == SSH_OK; i++) {
+        ssh_buffer_reinit(buffer);
+
+        timer_start(&pack);
+        rc = ssh_buffer_pack(buffer, "bddP", SSH_MSG_CHANNEL_DATA, 0, size,
+                             (size_t)size, data);
+        timer_stop(&pack);
+        if (rc != SSH_OK) break;
+
+        timer_start(&unpack);
+        rc = ssh_buffer_unpack(buffer, "bdS", &type, &channel, &str);
+        timer_stop(&unpack);
+        ssh_string_free(str);
+    }
+
+    if (rc == SSH_OK) {
+        report("ssh_buffer_pack", "bddP", size, ops, &pack);
+        report("ssh_buffer_unpack", "bdS", size, ops, &unpack);
+    }
+
+out:
+    ssh_buffer_free(buffer);
+    free(data);
+    return rc;
+}
+
+/**
+ * @brief Send `ops` CHANNEL_DATA packets of `size` bytes.
+ */
+static int send_packets(ssh_session session, uint32_t size, uint32_t ops,
+                        uint8_t *data, struct micro_timer *t) {
+    uint32_t i;
+
+    for (i = 0; i < ops; i++) {
+        if (ssh_buffer_pack(session->out_buffer, "bdP", SSH_MSG_CHANNEL_DATA,
+                            0, (size_t)size, data) != SSH_OK) {
+            return SSH_ERROR;
+        }
+
+        if (t != NULL) timer_start(t);
+        if (ssh_packet_send(session) != SSH_OK) return SSH_ERROR;
+        if (t != NULL) timer_stop(t);
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Decrypt path: packets encrypted by `client` are replayed from the
+ * socket buffer of `server`. Both must be at the same sequence number.
+ */
+static int bench_receive(ssh_session client, ssh_session server,
+                         uint32_t size, uint8_t *data) {
+    struct micro_timer t = {0};
+    uint32_t ops = micro_ops(size);
+    char path[] = "/tmp/microbench.XXXXXX";
+    int client_fd = client->socket->fd;
+    uint8_t chunk[65536];
+    ssize_t n;
+    uint32_t i;
+    int fd;
+    int rc = SSH_ERROR;
+
+    fd = mkstemp(path);
+    if (fd < 0) return SSH_ERROR;
+    unlink(path);
+
+    /* capture */
+    client->socket->fd = fd;
+    rc = send_packets(client, size, ops, data, NULL);
+    client->socket->fd = client_fd;
+    if (rc != SSH_OK) goto out;
+
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+        ssh_buffer_add_data(server->socket->in_buffer, chunk, n);
+    }
+
+    for (i = 0; i < ops; i++) {
+        timer_start(&t);
+        rc = ssh_packet_receive(server);
+        timer_stop(&t);
+        if (rc != SSH_OK) goto out;
+    }
+    report("ssh_packet_receive", "decrypt", size, ops, &t);
+
+out:
+    close(fd);
+    return rc;
+}
+
+/**
+ * @brief Encrypt path, the packets go to /dev/null.
+ */
+static int bench_send(ssh_session client, uint32_t size, uint8_t *data) {
+    struct micro_timer t = {0};
+    uint32_t ops = micro_ops(size);
+    int client_fd = client->socket->fd;
+    int fd;
+    int rc;
+
+    fd = open("/dev/null", O_WRONLY);
+    if (fd < 0) return SSH_ERROR;
+
+    client->socket->fd = fd;
+    rc = send_packets(client, size, ops, data, &t);
+    client->socket->fd = client_fd;
+    close(fd);
+
+    if (rc == SSH_OK) report("ssh_packet_send", "encrypt", size, ops, &t);
+    return rc;
+}
+
+struct server_arg {
+    int listen_fd;
+    ssh_session session;
+    int rc;
+};
+
+static void *server_thread(void *arg) {
+    struct server_arg *s = arg;
+    int fd;
+
+    s->rc = SSH_ERROR;
+    fd = accept(s->listen_fd, NULL, NULL);
+    if (fd < 0) return NULL;
+
+    if (ssh_accept(s->session, fd) == SSH_OK &&
+        ssh_server_auth_password(s->session, NULL) == SSH_OK) {
+        s->rc = SSH_OK;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Connect two sessions of this process over loopback.
+ */
+static int session_pair(ssh_session client, ssh_session server) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    struct server_arg s;
+    pthread_t thread;
+    uint64_t no_rekey = 0;
+    int port;
+    int rc;
+
+    s.session = server;
+    s.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s.listen_fd < 0) return SSH_ERROR;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(s.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(s.listen_fd, 1) < 0 ||
+        getsockname(s.listen_fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        close(s.listen_fd);
+        return SSH_ERROR;
+    }
+    port = ntohs(addr.sin_port);
+
+    if (pthread_create(&thread, NULL, server_thread, &s) != 0) {
+        close(s.listen_fd);
+        return SSH_ERROR;
+    }
+
+    /* the byte counts would start a re-key in the middle of a run */
+    ssh_options_set(client, SSH_OPTIONS_REKEY_DATA, &no_rekey);
+    ssh_options_set(server, SSH_OPTIONS_REKEY_DATA, &no_rekey);
+    ssh_options_set(client, SSH_OPTIONS_HOST, "127.0.0.1");
+    ssh_options_set(client, SSH_OPTIONS_PORT, &port);
+    ssh_options_set(client, SSH_OPTIONS_USER, "micro");
+
+    rc = ssh_connect(client);
+    if (rc == SSH_OK) rc = ssh_userauth_password(client, "");
+
+    pthread_join(thread, NULL);
+    close(s.listen_fd);
+
+    return rc == SSH_OK && s.rc == SSH_OK ? SSH_OK : SSH_ERROR;
+}
+
+int main(int argc, char *argv[]) {
+    ssh_session client = NULL, server = NULL;
+    uint8_t *data = NULL;
+    size_t i;
+    int devnull;
+    int rc = 1;
+
+    (void)argc;
+    (void)argv;
+
+    msg = fdopen(dup(STDERR_FILENO), "w");
+    setvbuf(msg, NULL, _IOLBF, 0);
+    devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+
+    data = calloc(1, sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    client = ssh_new();
+    server = ssh_new();
+    if (data == NULL || client == NULL || server == NULL) goto out;
+
+    if (session_pair(client, server) != SSH_OK) {
+        fprintf(msg, "can not set up a session pair: %s\n", ssh_get_error());
+        goto out;
+    }
+    fprintf(msg, "%s, %s\n", ssh_get_cipher_out(client),
+            ssh_get_hmac_out(client));
+
+    printf("{\n  \"cipher\": \"%s\",\n  \"mac\": \"%s\",\n  \"results\": [",
+           ssh_get_cipher_out(client), ssh_get_hmac_out(client));
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (bench_buffer(sizes[i]) != SSH_OK) goto out;
+    }
+
+    /* receive first: afterwards the client is ahead of the server */
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (bench_receive(client, server, sizes[i], data) != SSH_OK) {
+            fprintf(msg, "receive of %u bytes failed: %s\n", sizes[i],
+                    ssh_get_error());
+            goto out;
+        }
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (bench_send(client, sizes[i], data) != SSH_OK) {
+            fprintf(msg, "send of %u bytes failed: %s\n", sizes[i],
+                    ssh_get_error());
+            goto out;
+        }
+    }
+    rc = 0;
+
+out:
+    printf("\n  ]\n}\n");
+    ssh_free(client);
+    ssh_free(server);
+    free(data);
+    return rc;
+}
@@ -0,0 +1,179 @@
+/**
+ * @file server.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Loopback SFTP server built on the library, a stand-in for sshd when
+ * benchmarking or testing the client without a network.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "libsftp/libsftp.h"
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-p port] [-k hostkey.pem] [-P password] [-j threads]\n"
+            "          [-1] [root]\n"
+            "  serves the directory root (default .) on 127.0.0.1:port\n"
+            "  (default 2222), any password is accepted without -P,\n"
+            "  -j encrypts on that many threads per connection and\n"
+            "  -1 exits after the first connection\n",
+            prog);
+}
+
+/**
+ * @brief Run one connection, in its own process.
+ */
+int serve(int fd, const char *hostkey, const char *password,
+          unsigned int crypto_threads, const char *root) {
+    ssh_session session;
+    int compression = 1;
+    int rc = SSH_ERROR;
+
+    session = ssh_new();
+    if (session == NULL) {
+        close(fd);
+        return SSH_ERROR;
+    }
+
+    /* the client picks, offering compression does not force it */
+    ssh_options_set(session, SSH_OPTIONS_COMPRESSION, &compression);
+
+    if (hostkey != NULL &&
+        ssh_options_set(session, SSH_OPTIONS_HOSTKEY, hostkey) != SSH_OK) {
+        close(fd);
+        goto out;
+    }
+
+    if (crypto_threads > 0 &&
+        ssh_options_set(session, SSH_OPTIONS_CRYPTO_THREADS,
+                        &crypto_threads) != SSH_OK) {
+        close(fd);
+        goto out;
+    }
+
+    rc = ssh_accept(session, fd);
+    if (rc != SSH_OK) goto out;
+
+    rc = ssh_server_auth_password(session, password);
+    if (rc != SSH_OK) goto out;
+
+    rc = sftp_server_run(session, root);
+
+out:
+    if (rc != SSH_OK) {
+        fprintf(stderr, "connection failed: %s\n", ssh_get_error());
+    }
+    ssh_disconnect(session);
+    ssh_free(session);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    const char *hostkey = NULL;
+    const char *password = NULL;
+    const char *root = ".";
+    unsigned int crypto_threads = 0;
+    int port = 2222;
+    int once = 0;
+    int listen_fd;
+    int fd;
+    int opt;
+    int on = 1;
+
+    while ((opt = getopt(argc, argv, "p:k:P:j:1h")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'k':
+                hostkey = optarg;
+                break;
+            case 'P':
+                password = optarg;
+                break;
+            case 'j':
+                crypto_threads = atoi(optarg);
+                break;
+            case '1':
+                once = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) root = argv[optind];
+
+    /* generated once, shared by the connection processes */
+    if (hostkey == NULL && ssh_server_init() != SSH_OK) {
+        fprintf(stderr, "can not generate host key: %s\n", ssh_get_error());
+        return 1;
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 16) < 0) {
+        perror("bind");
+        close(listen_fd);
+        return 1;
+    }
+    fprintf(stdout, "serving %s on 127.0.0.1:%d\n", root, port);
+    fflush(stdout);
+
+    if (once) {
+        fd = accept(listen_fd, NULL, NULL);
+        close(listen_fd);
+        if (fd < 0) return 1;
+        return serve(fd, hostkey, password, crypto_threads, root) == SSH_OK ? 0 : 1;
+    }
+
+    /* no zombies, connections are not waited for */
+    signal(SIGCHLD, SIG_IGN);
+    while (1) {
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+
+        switch (fork()) {
+            case -1:
+                perror("fork");
+                close(fd);
+                break;
+            case 0:
+                close(listen_fd);
+                exit(serve(fd, hostkey, password, crypto_threads, root) == SSH_OK ? 0 : 1);
+            default:
+                close(fd);
+                break;
+        }
+    }
+
+    close(listen_fd);
+    return 1;
+}
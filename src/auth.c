@@ -58,7 +58,7 @@ int ssh_request_auth(ssh_session session) {
  * @param password
  */
 void ssh_get_password(char *password) {
-    static struct termios oldt, newt;
+    struct termios oldt, newt;
     int max_len = 100;
     int i = 0;
     uint8_t c;
@@ -99,7 +99,6 @@ void ssh_get_password(char *password) {
 int ssh_userauth_password(ssh_session session, const char *password) {
     int rc;
     uint8_t type;
-    static int cnt = 0;
     LOG_INFO("Trying password authentication...");
     rc = ssh_buffer_pack(session->out_buffer, "bsssbs",
                          SSH_MSG_USERAUTH_REQUEST, session->opts.username,
@@ -139,6 +138,16 @@ int ssh_userauth_password(ssh_session session, const char *password) {
             case SSH_MSG_USERAUTH_SUCCESS:
                 // LAB: insert your code here.
                 LOG_NOTICE("Authentication success!");
+                session->authenticated = 1;
+                /* zlib@openssh.com starts right after SSH_MSG_USERAUTH_SUCCESS */
+                if (session->current_crypto->delayed_compress_in) {
+                    LOG_INFO("enabling delayed compression in");
+                    session->current_crypto->do_compress_in = 1;
+                }
+                if (session->current_crypto->delayed_compress_out) {
+                    LOG_INFO("enabling delayed compression out");
+                    session->current_crypto->do_compress_out = 1;
+                }
                 return SSH_OK;
             case SSH_MSG_USERAUTH_PASSWD_CHANGEREQ:
                 LOG_INFO("Password change required!");
@@ -32,6 +32,7 @@
 
 #include "libsftp/bignum.h"
 #include "libsftp/buffer.h"
+#include "libsftp/slab.h"
 #include "libsftp/util.h"
 
 /*
@@ -40,16 +41,37 @@
  * ^            ^                  ^                       ^]
  * \_data points\_pos points here  \_used points here |    /
  *   here                                          Allocated
+ *
+ * With a headroom, an empty buffer starts at pos = used = headroom so that a
+ * header can be prepended in place, and growing keeps tailroom bytes free
+ * after used for what is appended last (padding, MAC).
+ *
+ * The struct and the data come from the slab cache. A secure buffer is wiped
+ * before its memory is reused or given back.
+ *
+ * ssh_buffer_reinit() keeps a block above BUFFER_SHRINK_SIZE while it is put
+ * to use: only after BUFFER_SHRINK_AFTER uses in a row of at most a quarter
+ * of it is it shrunk, so a buffer reinitialized per packet or request does
+ * not shrink and grow again each time.
  */
 struct ssh_buffer_struct {
+    bool secure;
     size_t used;
     size_t allocated;
     size_t pos;
+    size_t headroom;
+    size_t tailroom;
+    size_t peak;             /* most `used` since the last reinit */
+    unsigned int small_uses; /* in a row, while above BUFFER_SHRINK_SIZE */
     uint8_t *data;
 };
 
 /* Buffer size maximum is 256M */
 #define BUFFER_SIZE_MAX 0x10000000
+#define BUFFER_SHRINK_SIZE 65536
+#define BUFFER_SHRINK_AFTER 64
+
+static struct ssh_buffer_stats buffer_stats;
 
 /**
  * @defgroup libssh_buffer The SSH buffer functions.
@@ -69,10 +91,11 @@ struct ssh_buffer_struct *ssh_buffer_new(void) {
     struct ssh_buffer_struct *buf = NULL;
     int rc;
 
-    buf = calloc(1, sizeof(struct ssh_buffer_struct));
+    buf = ssh_slab_alloc(sizeof(struct ssh_buffer_struct));
     if (buf == NULL) {
         return NULL;
     }
+    memset(buf, 0, sizeof(struct ssh_buffer_struct));
 
     /*
      * Always preallocate 64 bytes.
@@ -81,7 +104,7 @@ struct ssh_buffer_struct *ssh_buffer_new(void) {
      */
     rc = ssh_buffer_allocate_size(buf, 64 - 1);
     if (rc != 0) {
-        SAFE_FREE(buf);
+        ssh_slab_free(buf);
         return NULL;
     }
 
@@ -98,8 +121,41 @@ void ssh_buffer_free(struct ssh_buffer_struct *buffer) {
         return;
     }
 
-    SAFE_FREE(buffer->data);
-    SAFE_FREE(buffer);
+    if (buffer->secure && buffer->allocated > 0) {
+        explicit_bzero(buffer->data, buffer->allocated);
+    }
+    ssh_slab_free(buffer->data);
+    ssh_slab_free(buffer);
+}
+
+/**
+ * @brief Sets the buffer as secure.
+ *
+ * A secure buffer will never leave cleartext data in the heap
+ * after being reallocated or freed.
+ *
+ * @param[in] buffer buffer to set secure.
+ */
+void ssh_buffer_set_secure(ssh_buffer buffer) {
+    buffer->secure = true;
+}
+
+/**
+ * @brief Get the reallocation counters of all buffers of the process.
+ *
+ * @param[out] stats
+ */
+void ssh_buffer_get_stats(struct ssh_buffer_stats *stats) {
+    stats->grows = __atomic_load_n(&buffer_stats.grows, __ATOMIC_RELAXED);
+    stats->shrinks = __atomic_load_n(&buffer_stats.shrinks, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Record the data held for ssh_buffer_reinit(), which can not tell
+ * from `used`: a buffer read to the end is rewound to its headroom.
+ */
+static void buffer_mark_peak(struct ssh_buffer_struct *buffer) {
+    if (buffer->used > buffer->peak) buffer->peak = buffer->used;
 }
 
 static int realloc_buffer(struct ssh_buffer_struct *buffer, size_t needed) {
@@ -119,10 +175,15 @@ static int realloc_buffer(struct ssh_buffer_struct *buffer, size_t needed) {
         return -1;
     }
 
-    new = realloc(buffer->data, needed);
+    new = ssh_slab_grow(buffer->data, buffer->used, needed, buffer->secure);
     if (new == NULL) {
         return -1;
     }
+    buffer_mark_peak(buffer);
+    /* sizing an empty buffer moves nothing, it is not counted */
+    if (new != buffer->data && buffer->used > buffer->headroom) {
+        __atomic_fetch_add(&buffer_stats.grows, 1, __ATOMIC_RELAXED);
+    }
     buffer->data = new;
     buffer->allocated = needed;
     return 0;
@@ -133,20 +194,26 @@ static int realloc_buffer(struct ssh_buffer_struct *buffer, size_t needed) {
  * @param buffer SSH buffer
  */
 static void buffer_shift(ssh_buffer buffer) {
-    if (buffer->pos == 0) {
+    if (buffer->pos <= buffer->headroom) {
         return;
     }
-    memmove(buffer->data, buffer->data + buffer->pos,
+    memmove(buffer->data + buffer->headroom, buffer->data + buffer->pos,
             buffer->used - buffer->pos);
-    buffer->used -= buffer->pos;
-    buffer->pos = 0;
+    if (buffer->secure) {
+        /* the tail moved down, wipe where it was */
+        explicit_bzero(buffer->data + buffer->used -
+                           (buffer->pos - buffer->headroom),
+                       buffer->pos - buffer->headroom);
+    }
+    buffer->used -= buffer->pos - buffer->headroom;
+    buffer->pos = buffer->headroom;
 }
 
 /**
  * @brief Reinitialize a SSH buffer.
  *
- * In case the buffer has exceeded 64K in size, the buffer will be reallocated
- * to 64K.
+ * In case the buffer has exceeded 64K in size and has been used for much less
+ * for a while, the buffer will be reallocated to 64K.
  *
  * @param[in]  buffer   The buffer to reinitialize.
  *
@@ -157,23 +224,78 @@ int ssh_buffer_reinit(struct ssh_buffer_struct *buffer) {
         return -1;
     }
 
-    buffer->used = 0;
-    buffer->pos = 0;
+    if (buffer->secure && buffer->used > 0) {
+        explicit_bzero(buffer->data, buffer->used);
+    }
+
+    buffer_mark_peak(buffer);
+    if (buffer->allocated <= BUFFER_SHRINK_SIZE ||
+        buffer->peak > buffer->allocated / 4) {
+        buffer->small_uses = 0;
+    } else {
+        buffer->small_uses++;
+    }
+    buffer->used = buffer->headroom;
+    buffer->pos = buffer->headroom;
+    buffer->peak = buffer->headroom;
 
-    /* If the buffer is bigger then 64K, reset it to 64K */
-    if (buffer->allocated > 65536) {
-        int rc;
+    /* If the buffer is bigger then 64K and stays mostly unused, reset it to
+     * 64K */
+    if (buffer->small_uses >= BUFFER_SHRINK_AFTER) {
+        uint8_t *new;
 
-        /* -1 for realloc_buffer magic */
-        rc = realloc_buffer(buffer, 65536 - 1);
-        if (rc != 0) {
+        new = ssh_slab_alloc(BUFFER_SHRINK_SIZE);
+        if (new == NULL) {
             return -1;
         }
+        if (buffer->secure) {
+            explicit_bzero(buffer->data, buffer->allocated);
+        }
+        ssh_slab_free(buffer->data);
+        buffer->data = new;
+        buffer->allocated = BUFFER_SHRINK_SIZE;
+        buffer->small_uses = 0;
+        __atomic_fetch_add(&buffer_stats.shrinks, 1, __ATOMIC_RELAXED);
     }
 
     return 0;
 }
 
+/**
+ * @internal
+ *
+ * @brief Reserve room around the data of an empty buffer, kept across
+ * ssh_buffer_reinit(). A header of up to `headroom` bytes can then be
+ * prepended without moving the data, and the buffer grows with `tailroom`
+ * bytes to spare.
+ *
+ * @param[in]  buffer   The buffer, empty.
+ *
+ * @param[in]  headroom Bytes reserved before the data.
+ *
+ * @param[in]  tailroom Bytes kept free after the data when growing.
+ *
+ * @return              0 on success, < 0 on error.
+ */
+int ssh_buffer_reserve(struct ssh_buffer_struct *buffer, uint32_t headroom,
+                       uint32_t tailroom) {
+    if (buffer == NULL || buffer->used != buffer->pos) {
+        return -1;
+    }
+
+    if (buffer->allocated < (size_t)headroom + tailroom + 1) {
+        if (realloc_buffer(buffer, (size_t)headroom + tailroom) < 0) {
+            return -1;
+        }
+    }
+    buffer->headroom = headroom;
+    buffer->tailroom = tailroom;
+    buffer->pos = headroom;
+    buffer->used = headroom;
+
+    return 0;
+}
+
 /**
  * @brief Add data at the tail of a buffer.
  *
@@ -200,16 +322,16 @@ int ssh_buffer_add_data(struct ssh_buffer_struct *buffer, const void *data,
     }
 
     if (buffer->allocated < (buffer->used + len)) {
-        if (buffer->pos > 0) {
-            buffer_shift(buffer);
-        }
-        if (realloc_buffer(buffer, buffer->used + len) < 0) {
+        buffer_shift(buffer);
+        if (realloc_buffer(buffer, buffer->used + len + buffer->tailroom) <
+            0) {
             return -1;
         }
     }
 
     memcpy(buffer->data + buffer->used, data, len);
     buffer->used += len;
+    buffer_mark_peak(buffer);
     return 0;
 }
 
@@ -224,9 +346,7 @@ int ssh_buffer_add_data(struct ssh_buffer_struct *buffer, const void *data,
  */
 int ssh_buffer_allocate_size(struct ssh_buffer_struct *buffer, uint32_t len) {
     if (buffer->allocated < len) {
-        if (buffer->pos > 0) {
-            buffer_shift(buffer);
-        }
+        buffer_shift(buffer);
         if (realloc_buffer(buffer, len) < 0) {
             return -1;
         }
@@ -255,17 +375,16 @@ void *ssh_buffer_allocate(struct ssh_buffer_struct *buffer, uint32_t len) {
     }
 
     if (buffer->allocated < (buffer->used + len)) {
-        if (buffer->pos > 0) {
-            buffer_shift(buffer);
-        }
-
-        if (realloc_buffer(buffer, buffer->used + len) < 0) {
+        buffer_shift(buffer);
+        if (realloc_buffer(buffer, buffer->used + len + buffer->tailroom) <
+            0) {
             return NULL;
         }
     }
 
     ptr = buffer->data + buffer->used;
     buffer->used += len;
+    buffer_mark_peak(buffer);
 
     return ptr;
 }
@@ -421,6 +540,7 @@ int ssh_buffer_prepend_data(struct ssh_buffer_struct *buffer, const void *data,
     memcpy(buffer->data, data, len);
     buffer->used += len - buffer->pos;
     buffer->pos = 0;
+    buffer_mark_peak(buffer);
     return 0;
 }
 
@@ -497,12 +617,40 @@ uint32_t ssh_buffer_pass_bytes(struct ssh_buffer_struct *buffer, uint32_t len) {
     /* if the buffer is empty after having passed the whole bytes into it, we
      * can clean it */
     if (buffer->pos == buffer->used) {
-        buffer->pos = 0;
-        buffer->used = 0;
+        buffer->pos = buffer->headroom;
+        buffer->used = buffer->headroom;
     }
     return len;
 }
 
+/**
+ * @internal
+ *
+ * @brief Take bytes at the head of the buffer without copying them.
+ *
+ * @param[in]  buffer   The buffer to read.
+ *
+ * @param[in]  len      The number of bytes to take.
+ *
+ * @return              A pointer to the bytes, valid until the buffer is
+ *                      written to, NULL if the buffer is shorter.
+ */
+const void *ssh_buffer_pull(struct ssh_buffer_struct *buffer, uint32_t len) {
+    const void *data;
+
+    if (ssh_buffer_validate_length(buffer, len) != SSH_OK) {
+        return NULL;
+    }
+
+    data = buffer->data + buffer->pos;
+    buffer->pos += len;
+    if (buffer->pos == buffer->used) {
+        buffer->pos = buffer->headroom;
+        buffer->used = buffer->headroom;
+    }
+    return data;
+}
+
 /**
  * @internal
  *
@@ -650,7 +798,7 @@ struct ssh_string_struct *ssh_buffer_get_ssh_string(
     stringlen = ssh_buffer_get_data(buffer, ssh_string_data(str), hostlen);
     if (stringlen != hostlen) {
         /* should never happen */
-        SAFE_FREE(str);
+        ssh_string_free(str);
         return NULL;
     }
 
@@ -853,7 +1001,9 @@ int ssh_buffer_pack_va(struct ssh_buffer_struct *buffer, const char *format,
                     break;
                 }
                 rc = ssh_buffer_add_ssh_string(buffer, o.string);
-                SAFE_FREE(o.string);
+                if (buffer->secure) ssh_string_burn(o.string);
+                ssh_string_free(o.string);
+                o.string = NULL;
                 break;
             case 't':
                 cstring = va_arg(ap, char *);
@@ -946,6 +1096,7 @@ int ssh_buffer_unpack_va(struct ssh_buffer_struct *buffer, const char *format,
         uint32_t *dword;
         uint64_t *qword;
         ssh_string *string;
+        struct ssh_string_view *view;
         char **cstring;
         bignum *bignum;
         void **data;
@@ -1021,6 +1172,23 @@ int ssh_buffer_unpack_va(struct ssh_buffer_struct *buffer, const char *format,
                 rc = *o.string != NULL ? SSH_OK : SSH_ERROR;
                 o.string = NULL;
                 break;
+            case 'V': {
+                uint32_t u32len = 0;
+
+                o.view = va_arg(ap, struct ssh_string_view *);
+                rlen = ssh_buffer_get_u32(buffer, &u32len);
+                if (rlen != 4) {
+                    break;
+                }
+                len = ntohl(u32len);
+                o.view->data = ssh_buffer_pull(buffer, len);
+                if (o.view->data == NULL) {
+                    break;
+                }
+                o.view->len = len;
+                rc = SSH_OK;
+                break;
+            }
             case 's': {
                 uint32_t u32len = 0;
 
@@ -1130,7 +1298,8 @@ cleanup:
                     break;
                 case 'S':
                     o.string = va_arg(ap_copy, ssh_string *);
-                    SAFE_FREE(*o.string);
+                    ssh_string_free(*o.string);
+                    *o.string = NULL;
                     break;
                 case 's':
                     o.cstring = va_arg(ap_copy, char **);
@@ -1161,6 +1330,8 @@ cleanup:
  *                         'd': uint32_t * (pulled in network byte order)
  *                         'q': uint64_t * (pulled in network byte order)
  *                         'S': ssh_string *
+ *                         'V': struct ssh_string_view * (SSH string left in
+ *                              the buffer, no copy)
  *                         's': char ** (C string, pulled as SSH string)
  *                         'P': size_t, void ** (len of data, pointer to data)
  *                              only pulls data.
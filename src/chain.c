@@ -0,0 +1,202 @@
+/**
+ * @file chain.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Segmented buffer for large payloads.
+ * Every segment but the last is full, so the segment and offset of a byte
+ * follow from its position. Segments come from the slab cache; a reset keeps
+ * the first one and gives the others back.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "libsftp/chain.h"
+
+#include "libsftp/libssh.h"
+#include "libsftp/slab.h"
+#include "libsftp/util.h"
+
+/* Largest chain, as BUFFER_SIZE_MAX of ssh_buffer */
+#define CHAIN_SIZE_MAX 0x10000000
+
+struct ssh_chain_struct {
+    uint8_t **segments;
+    uint32_t nsegments; /* allocated */
+    uint32_t capacity;  /* of `segments` */
+    uint32_t len;       /* bytes held */
+};
+
+ssh_chain ssh_chain_new(void) {
+    return calloc(1, sizeof(struct ssh_chain_struct));
+}
+
+/**
+ * @brief Keep the first `keep` segments, give the others back.
+ */
+static void chain_trim(ssh_chain chain, uint32_t keep) {
+    while (chain->nsegments > keep) {
+        chain->nsegments--;
+        ssh_slab_free(chain->segments[chain->nsegments]);
+    }
+}
+
+void ssh_chain_free(ssh_chain chain) {
+    if (chain == NULL) return;
+
+    chain_trim(chain, 0);
+    SAFE_FREE(chain->segments);
+    SAFE_FREE(chain);
+}
+
+/**
+ * @brief Empty the chain.
+ *
+ * @param chain
+ */
+void ssh_chain_reset(ssh_chain chain) {
+    chain_trim(chain, 1);
+    chain->len = 0;
+}
+
+uint32_t ssh_chain_get_len(ssh_chain chain) {
+    return chain->len;
+}
+
+/**
+ * @brief Get the first `len` bytes, to read or patch a header in place.
+ *
+ * @param chain
+ * @param len
+ * @return pointer to the bytes, NULL if the chain is empty, shorter or
+ * `len` is more than a segment.
+ */
+void *ssh_chain_head(ssh_chain chain, uint32_t len) {
+    if (chain->nsegments == 0) return NULL;
+    if (len > chain->len || len > SSH_CHAIN_SEGMENT_SIZE) return NULL;
+    return chain->segments[0];
+}
+
+/**
+ * @brief Make room for `len` more bytes.
+ *
+ * @return SSH_OK, SSH_ERROR on error.
+ */
+static int chain_grow(ssh_chain chain, uint32_t len) {
+    uint32_t needed;
+    uint8_t **segments;
+
+    if (len > CHAIN_SIZE_MAX - chain->len) return SSH_ERROR;
+    needed = (chain->len + len + SSH_CHAIN_SEGMENT_SIZE - 1) /
+             SSH_CHAIN_SEGMENT_SIZE;
+
+    if (needed > chain->capacity) {
+        segments = realloc(chain->segments, needed * sizeof(uint8_t *));
+        if (segments == NULL) return SSH_ERROR;
+        chain->segments = segments;
+        chain->capacity = needed;
+    }
+    while (chain->nsegments < needed) {
+        chain->segments[chain->nsegments] =
+            ssh_slab_alloc(SSH_CHAIN_SEGMENT_SIZE);
+        if (chain->segments[chain->nsegments] == NULL) return SSH_ERROR;
+        chain->nsegments++;
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Describe `len` bytes from position `pos` as iovecs.
+ *
+ * @return number of iovecs, -1 if more than `iovcnt` are needed.
+ */
+static int chain_spans(ssh_chain chain, uint32_t pos, uint32_t len,
+                       struct iovec *iov, int iovcnt) {
+    uint32_t seg = pos / SSH_CHAIN_SEGMENT_SIZE;
+    uint32_t off = pos % SSH_CHAIN_SEGMENT_SIZE;
+    uint32_t n;
+    int i = 0;
+
+    while (len > 0) {
+        if (i == iovcnt) return -1;
+        n = MIN(len, SSH_CHAIN_SEGMENT_SIZE - off);
+        iov[i].iov_base = chain->segments[seg] + off;
+        iov[i].iov_len = n;
+        i++;
+        seg++;
+        off = 0;
+        len -= n;
+    }
+    return i;
+}
+
+/**
+ * @brief Append data.
+ *
+ * @param chain
+ * @param data
+ * @param len
+ * @return SSH_OK, SSH_ERROR on error.
+ */
+int ssh_chain_add_data(ssh_chain chain, const void *data, uint32_t len) {
+    struct iovec iov[1];
+    uint32_t n;
+
+    if (chain_grow(chain, len) != SSH_OK) return SSH_ERROR;
+    while (len > 0) {
+        chain_spans(chain, chain->len, MIN(len, SSH_CHAIN_SEGMENT_SIZE), iov,
+                    1);
+        n = iov[0].iov_len;
+        memcpy(iov[0].iov_base, data, n);
+        chain->len += n;
+        data = (const uint8_t *)data + n;
+        len -= n;
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Get the space for `len` more bytes as iovecs, to be filled and then
+ * added with ssh_chain_commit().
+ *
+ * @param chain
+ * @param len
+ * @param iov
+ * @param iovcnt
+ * @return number of iovecs, SSH_ERROR on error or if more than `iovcnt` are
+ * needed.
+ */
+int ssh_chain_reserve(ssh_chain chain, uint32_t len, struct iovec *iov,
+                      int iovcnt) {
+    int n;
+
+    if (chain_grow(chain, len) != SSH_OK) return SSH_ERROR;
+    n = chain_spans(chain, chain->len, len, iov, iovcnt);
+    return n < 0 ? SSH_ERROR : n;
+}
+
+/**
+ * @brief Add `len` bytes written in the space from ssh_chain_reserve().
+ *
+ * @param chain
+ * @param len
+ */
+void ssh_chain_commit(ssh_chain chain, uint32_t len) {
+    chain->len += len;
+}
+
+/**
+ * @brief Describe the data as iovecs.
+ *
+ * @param chain
+ * @param iov
+ * @param iovcnt
+ * @return number of iovecs, SSH_ERROR if more than `iovcnt` are needed.
+ */
+int ssh_chain_iovec(ssh_chain chain, struct iovec *iov, int iovcnt) {
+    int n;
+
+    n = chain_spans(chain, 0, chain->len, iov, iovcnt);
+    return n < 0 ? SSH_ERROR : n;
+}
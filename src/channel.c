@@ -13,10 +13,13 @@
 #include "libsftp/channel.h"
 
 #include "libsftp/error.h"
+#include "libsftp/layout.h"
 #include "libsftp/libssh.h"
 #include "libsftp/logger.h"
 #include "libsftp/packet.h"
+#include "libsftp/probes.h"
 #include "libsftp/session.h"
+#include "libsftp/util.h"
 
 /**
  * RFC4253 section 6.1
@@ -28,17 +31,39 @@
 
 #define CHANNEL_MAX_PACKET 32768
 #define CHANNEL_INITIAL_WINDOW 64000
+/* Bytes a write may leave queued for the remote window without blocking */
+#define CHANNEL_QUEUE_MAX (1024 * 1024)
+/* Received bytes credited on top of the window while a write is blocked */
+#define CHANNEL_WAIT_BUFFER_MAX (16 * 1024 * 1024)
 
 /**
- * @brief Get a new channel id.
- * @todo Since we only support one channel per session, returning 1 meets the
- * need. This function needs to be updated if we want to support arbitrary
- * number of channels in the future.
+ * @brief Get a new channel id. Ids are not reused within a session, so a
+ * late message for a freed channel can not reach a newer one.
  *
  * @param session
  * @return uint32_t
  */
-static uint32_t channel_new_id(ssh_session session) { return 1; }
+static uint32_t channel_new_id(ssh_session session) {
+    return ++session->maxchannel;
+}
+
+/**
+ * @brief Find the channel a message is addressed to.
+ *
+ * @param session
+ * @param id local channel number
+ * @return ssh_channel, NULL if there is no such channel.
+ */
+static ssh_channel channel_from_id(ssh_session session, uint32_t id) {
+    ssh_channel channel;
+
+    for (channel = session->channels; channel != NULL;
+         channel = channel->next) {
+        if (channel->local_channel == id) return channel;
+    }
+
+    return NULL;
+}
 
 /**
  * @brief Open a channel by sending a SSH_CHANNEL_OPEN message and
@@ -61,17 +86,12 @@ static uint32_t channel_new_id(ssh_session session) { return 1; }
 static int channel_open(ssh_channel channel, const char *type, uint32_t window,
                         uint32_t maxpacket, ssh_buffer payload) {
     ssh_session session = channel->session;
-    uint8_t reply_type;
-    uint32_t recipient_channel;
-    uint32_t reason_code;
-    char *description = NULL;
-    ssh_string req;
-    bool want;
     int rc;
 
     channel->local_channel = channel_new_id(session);
     channel->local_maxpacket = maxpacket;
     channel->local_window = window;
+    channel->local_window_max = window;
 
     rc = ssh_buffer_pack(session->out_buffer, "bsddd", SSH_MSG_CHANNEL_OPEN,
                          type, channel->local_channel, channel->local_window,
@@ -90,114 +110,16 @@ static int channel_open(ssh_channel channel, const char *type, uint32_t window,
     if (ssh_packet_send(session) != SSH_OK) {
         return SSH_ERROR;
     }
+    channel->state = SSH_CHANNEL_STATE_OPENING;
 
-    while (1) {
-        /* wait until the channel is opened or an error occurs */
-        rc = ssh_packet_receive(session);
+    /* wait until the channel is opened or an error occurs, messages for
+     * the other channels are dispatched meanwhile */
+    while (channel->state == SSH_CHANNEL_STATE_OPENING) {
+        rc = ssh_channel_handle_packet(session);
         if (rc != SSH_OK) return SSH_ERROR;
-
-        rc = ssh_buffer_get_u8(session->in_buffer, &reply_type);
-        switch (reply_type) {
-            case SSH_MSG_CHANNEL_OPEN_CONFIRMATION:
-                // LAB: insert your code here.
-                rc = ssh_buffer_unpack(session->in_buffer, "dddd", 
-                                       &recipient_channel, 
-                                       &channel->remote_channel,
-                                       &channel->remote_window,
-                                       &channel->remote_maxpacket);
-                if (rc != SSH_OK) {
-                    LOG_ERROR("cannot unpack buffer");
-                    return SSH_ERROR;
-                }
-                if (recipient_channel != channel->local_channel) {
-                    LOG_ERROR(
-                        "channel number in the reply %d does not match with "
-                        "the original %d",
-                        recipient_channel, channel->local_channel);
-                    return SSH_ERROR;
-                }
-                LOG_NOTICE("local channel #%u to remote channel #%u "
-                           "established", 
-                           channel->local_channel, channel->remote_channel);
-                LOG_NOTICE("local window size = %u, remote window size = %u", 
-                           channel->local_window, channel->remote_window);
-                return SSH_OK;
-
-            case SSH_MSG_CHANNEL_OPEN_FAILURE:
-                // LAB: insert your code here.
-                rc = ssh_buffer_unpack(session->in_buffer, "dds", 
-                                       &recipient_channel, &reason_code, 
-                                       &description);
-                if (rc != SSH_OK) {
-                    LOG_ERROR("cannot unpack buffer");
-                    return SSH_ERROR;
-                }
-                if (recipient_channel != channel->local_channel) {
-                    LOG_ERROR(
-                        "channel number in the reply %d does not match with "
-                        "the original %d",
-                        recipient_channel, channel->local_channel);
-                    return SSH_ERROR;
-                }
-                LOG_ERROR("channel open failed - reason code: %d, "
-                          "description: %s", reason_code, description);
-                SAFE_FREE(description);
-                return SSH_ERROR;
-
-            case SSH_MSG_GLOBAL_REQUEST:
-                /**
-                 * RFC 4254 Section 4
-                 * There are several kinds of requests that affect the state of
-                 * the remote end globally, independent of any channels.  An
-                 * example is a request to start TCP/IP forwarding for a
-                 * specific port.  Note that both the client and server MAY send
-                 * global requests at any time, and the receiver MUST respond
-                 * appropriately.  All such requests use the following format.
-                 *      byte      SSH_MSG_GLOBAL_REQUEST
-                 *      string    request name in US-ASCII only
-                 *      boolean   want reply
-                 *      ....      request-specific data follows
-                 *
-                 * The value of 'request name' follows the DNS extensibility
-                 * naming convention outlined in [SSH-ARCH].
-                 *
-                 */
-                // LAB: insert your code here.
-                rc = ssh_buffer_unpack(session->in_buffer, "Sb", &req, &want);
-                ssh_string_free(req);
-                if (rc != SSH_OK) {
-                    LOG_ERROR("cannot unpack buffer");
-                    return SSH_ERROR;
-                }
-                if (want) {
-                    /**
-                     * We don't support support the request, so we simply 
-                     * responds with SSH_MSG_REQUEST_FAILURE.
-                     */
-                    rc = ssh_buffer_pack(session->out_buffer, "b", 
-                                        SSH_MSG_REQUEST_FAILURE);
-                    if (rc != SSH_OK) {
-                        LOG_ERROR("can not create buffer");
-                        return SSH_ERROR;
-                    }
-                    if (ssh_packet_send(session) != SSH_OK) {
-                        ssh_buffer_reinit(session->out_buffer);
-                        LOG_ERROR("cannot send request reply");
-                        return SSH_ERROR;
-                    }
-                }
-                break;
-
-            default:
-                // LAB: insert your code here.
-                /* The other reply types are not supported. */
-                LOG_ERROR("reply type %d is not supported", reply_type);
-                return SSH_ERROR;
-
-        }
     }
 
-    return SSH_OK;
+    return channel->state == SSH_CHANNEL_STATE_OPEN ? SSH_OK : SSH_ERROR;
 }
 
 /**
@@ -212,9 +134,6 @@ static int channel_open(ssh_channel channel, const char *type, uint32_t window,
 static int channel_request(ssh_channel channel, const char *request, int reply,
                            ssh_buffer req_spec) {
     ssh_session session = channel->session;
-    uint8_t type;
-    uint32_t recipient_channel;
-    uint32_t bytes_to_add;
     int rc;
 
     rc = ssh_buffer_pack(session->out_buffer, "bdsb", SSH_MSG_CHANNEL_REQUEST,
@@ -237,38 +156,25 @@ static int channel_request(ssh_channel channel, const char *request, int reply,
 
     if (reply == 0) return SSH_OK;
 
-    while (1) {
-        /* wait for reply or an error occurs */
-        if (ssh_packet_receive(session) != SSH_OK) {
+    /* wait for reply or an error occurs */
+    channel->request_state = SSH_CHANNEL_REQ_STATE_PENDING;
+    while (channel->request_state == SSH_CHANNEL_REQ_STATE_PENDING) {
+        if (channel->remote_close) {
+            LOG_ERROR("channel %d closed during request %s",
+                      channel->local_channel, request);
             return SSH_ERROR;
         }
-
-        rc = ssh_buffer_unpack(session->in_buffer, "bd", &type,
-                               &recipient_channel);
-        if (recipient_channel != channel->local_channel) {
-            LOG_ERROR(
-                "channel number in the reply does not match with the "
-                "original");
+        if (ssh_channel_handle_packet(session) != SSH_OK) {
             return SSH_ERROR;
         }
+    }
 
-        switch (type) {
-            case SSH_MSG_CHANNEL_SUCCESS:
-                return SSH_OK;
-            case SSH_MSG_CHANNEL_FAILURE:
-                return SSH_ERROR;
-            case SSH_MSG_CHANNEL_WINDOW_ADJUST:
-                /* window adjust message could happen here */
-                ssh_buffer_unpack(session->in_buffer, "d", &bytes_to_add);
-                channel->remote_window += bytes_to_add;
-                LOG_NOTICE("remote window adjust to %d",
-                           channel->remote_window);
-                break;
-            default:
-                LOG_ERROR("received type %d during channel open", type);
-                return SSH_ERROR;
-        }
+    if (channel->request_state != SSH_CHANNEL_REQ_STATE_ACCEPTED) {
+        ssh_set_error(SSH_REQUEST_DENIED, "channel request %s denied",
+                      request);
+        return SSH_ERROR;
     }
+    return SSH_OK;
 
 error:
     ssh_buffer_reinit(session->out_buffer);
@@ -276,33 +182,59 @@ error:
 }
 
 /**
- * @brief Grow local channel window to at least `minimum_size`.
- * This function sends SSH_MSG_CHANNEL_WINDOW_ADJUST.
+ * @brief Give the peer credit for the data the application drained.
+ * The window granted, `local_window` and what waits in `in_buffer` beyond
+ * `slack` bytes, is brought back to `local_window_max` with one
+ * SSH_MSG_CHANNEL_WINDOW_ADJUST once half of it is drained, or sooner if it
+ * is short of the `needed` bytes a read waits for. The packet is written
+ * with the next one sent, or before the session blocks.
  *
  * @param channel
- * @param minimum_size
+ * @param needed
+ * @param slack received data that may be kept on top of the window
  * @return int
  */
-static int grow_window(ssh_channel channel, uint32_t minimum_size) {
+static int adjust_window(ssh_channel channel, uint32_t needed,
+                         uint32_t slack) {
     ssh_session session;
+    uint64_t granted;
+    uint32_t pending;
+    uint32_t credit;
     int rc;
 
     if (channel == NULL) return SSH_ERROR;
     session = channel->session;
 
-    if (channel->local_window >= minimum_size) return SSH_OK;
+    if (channel->remote_close) return SSH_OK;
+    /* a read larger than the window raises it for good */
+    if (needed > channel->local_window_max) {
+        channel->local_window_max = needed;
+    }
+
+    pending = ssh_buffer_get_len(channel->in_buffer);
+    granted = (uint64_t)channel->local_window +
+              (pending > slack ? pending - slack : 0);
+    if (granted >= channel->local_window_max) return SSH_OK;
+    credit = channel->local_window_max - granted;
+    if (credit < channel->local_window_max / 2 && granted >= needed) {
+        return SSH_OK;
+    }
 
-    rc = ssh_buffer_pack(session->out_buffer, "bdd",
-                         SSH_MSG_CHANNEL_WINDOW_ADJUST, channel->remote_channel,
-                         minimum_size - channel->local_window);
+    rc = layout_put_window_adjust(session->out_buffer, channel->remote_channel,
+                                  credit);
     if (rc != SSH_OK) {
         LOG_ERROR("can not pack buffer");
         goto error;
     }
 
-    if (ssh_packet_send(session) != SSH_OK) goto error;
+    if (ssh_packet_send_later(session) != SSH_OK) goto error;
 
-    channel->local_window = minimum_size;
+    ssh_trace_record(session->trace, SSH_TRACE_WINDOW_ADJUST_OUT, 0, 0, credit,
+                     channel->local_channel, 0, 0);
+    channel->local_window += credit;
+    SSH_PROBE3(window__grow, channel->local_channel, credit,
+               channel->local_window);
+    channel->stats.window_adjusts_sent++;
     return SSH_OK;
 
 error:
@@ -311,60 +243,139 @@ error:
 }
 
 /**
- * @brief Wait for WINDOW_ADJUST message to grow remote window.
+ * @brief Send up to `*len` bytes gathered from `*iov`, as far as the remote
+ * window allows. Each packet is copied straight from the iovecs into the
+ * output buffer. `*iov`, `*offset` (into `**iov`) and `*len` are moved past
+ * what was sent.
  *
  * @param channel
+ * @param iov
+ * @param offset
+ * @param len
+ * @return SSH_OK, SSH_ERROR on error.
+ */
+static int channel_send(ssh_channel channel, const struct iovec **iov,
+                        size_t *offset, uint32_t *len) {
+    ssh_session session = channel->session;
+    const struct iovec *v = *iov;
+    size_t effectivelen;
+    size_t maxpacketlen;
+    size_t n, chunk;
+    uint8_t *p;
+
+    /*
+     * Handle the max packet len from remote side
+     * be nice, 10 bytes for the headers
+     */
+    maxpacketlen = channel->remote_maxpacket - 10;
+
+    while (*len > 0 && channel->remote_window > 0) {
+        effectivelen = MIN(*len, channel->remote_window);
+        effectivelen = MIN(effectivelen, maxpacketlen);
+
+        p = layout_put_channel_data(session->out_buffer,
+                                    channel->remote_channel, effectivelen);
+        if (p == NULL) goto error;
+        for (n = effectivelen; n > 0;) {
+            chunk = MIN(n, v->iov_len - *offset);
+            p = layout_put_data(p, (const uint8_t *)v->iov_base + *offset,
+                                chunk);
+            n -= chunk;
+            *offset += chunk;
+            if (*offset == v->iov_len) {
+                v++;
+                *offset = 0;
+            }
+        }
+
+        if (ssh_packet_send(session) != SSH_OK) goto error;
+
+        channel->remote_window -= effectivelen;
+        channel->stats.bytes_out += effectivelen;
+        *len -= effectivelen;
+    }
+
+    *iov = v;
+    return SSH_OK;
+
+error:
+    *iov = v;
+    ssh_buffer_reinit(session->out_buffer);
+    return SSH_ERROR;
+}
+
+/**
+ * @brief Send the data queued in `channel->out_buffer`, as far as the remote
+ * window allows.
+ *
+ * @param channel
+ * @return SSH_OK, SSH_ERROR on error.
+ */
+static int channel_flush(ssh_channel channel) {
+    struct iovec iov;
+    const struct iovec *v = &iov;
+    size_t offset = 0;
+    uint32_t len;
+    int rc;
+
+    len = ssh_buffer_get_len(channel->out_buffer);
+    if (len == 0 || channel->remote_window == 0) return SSH_OK;
+
+    iov.iov_base = ssh_buffer_get(channel->out_buffer);
+    iov.iov_len = len;
+    rc = channel_send(channel, &v, &offset, &len);
+    ssh_buffer_pass_bytes(channel->out_buffer, iov.iov_len - len);
+    if (len == 0) ssh_buffer_reinit(channel->out_buffer);
+    return rc;
+}
+
+/**
+ * @brief Wait until at most `limit` bytes are queued for the remote window.
+ * The packets received meanwhile are dispatched, window adjusts send more of
+ * the queue. Up to CHANNEL_WAIT_BUFFER_MAX bytes of the data of the channel
+ * are kept and credited as if they were read, so that a peer blocked on
+ * writing to us can go on and read what we send. Past that no more credit is
+ * given, the peer can only adjust our window or close the channel.
+ *
+ * @param channel
+ * @param limit
  * @return int
  */
-static int wait_window(ssh_channel channel) {
+static int wait_window(ssh_channel channel, uint32_t limit) {
     ssh_session session;
-    uint8_t type;
-    uint32_t recipient_channel;
-    uint32_t bytes_to_add;
-    int rc;
+    uint64_t start, end;
+    int rc = SSH_OK;
 
     if (channel == NULL) return SSH_ERROR;
     session = channel->session;
 
-    type = 0;
-    while (type != SSH_MSG_CHANNEL_WINDOW_ADJUST) {
-        rc = ssh_packet_receive(session);
-        if (rc != SSH_OK || ssh_buffer_unpack(session->in_buffer, "bd", &type,
-                                              &recipient_channel) != SSH_OK)
-            return SSH_ERROR;
-        if (recipient_channel != channel->local_channel) {
-            LOG_ERROR(
-                "channel number in the reply %d does not match with the "
-                "original %d",
-                recipient_channel, channel->local_channel);
-            return SSH_ERROR;
-        }
+    if (ssh_buffer_get_len(channel->out_buffer) <= limit) return SSH_OK;
 
-        switch (type) {
-            case SSH_MSG_CHANNEL_DATA:
-                LOG_ERROR("channel %d received data on window waiting",
-                          channel->local_channel);
-                return SSH_ERROR;
-            case SSH_MSG_CHANNEL_WINDOW_ADJUST:
-                ssh_buffer_unpack(session->in_buffer, "d", &bytes_to_add);
-                LOG_NOTICE("remote window grows: +%d", bytes_to_add);
-                channel->remote_window += bytes_to_add;
-                return SSH_OK;
-            case SSH_MSG_CHANNEL_EOF:
-                LOG_ERROR("channel %d received EOF on window waiting",
-                          channel->local_channel);
-                return SSH_ERROR;
-            case SSH_MSG_CHANNEL_CLOSE:
-                LOG_ERROR("remote channel %d closed on window waiting",
-                          channel->remote_channel);
-                return SSH_ERROR;
-            default:
-                LOG_ERROR("unexpected message type %d on window waiting", type);
-                return SSH_ERROR;
+    channel->stats.window_stalls++;
+    SSH_PROBE2(window__stall__start, channel->local_channel,
+               channel->remote_window);
+    start = ssh_time_ns();
+
+    while (ssh_buffer_get_len(channel->out_buffer) > limit) {
+        if (channel->remote_eof || channel->remote_close) {
+            LOG_ERROR("remote channel %d closed on window waiting",
+                      channel->remote_channel);
+            rc = SSH_ERROR;
+            break;
+        }
+        if (adjust_window(channel, 0, CHANNEL_WAIT_BUFFER_MAX) != SSH_OK ||
+            ssh_channel_handle_packet(session) != SSH_OK) {
+            rc = SSH_ERROR;
+            break;
         }
     }
 
-    return SSH_OK;
+    end = ssh_time_ns();
+    channel->stats.window_stall_ns += end - start;
+    ssh_trace_record(session->trace, SSH_TRACE_WINDOW_STALL, 0, 0, 0,
+                     channel->local_channel, start, end);
+    SSH_PROBE3(window__stall__done, channel->local_channel, end - start, rc);
+    return rc;
 }
 
 /**
@@ -387,14 +398,18 @@ ssh_channel ssh_channel_new(ssh_session session) {
     }
 
     channel->out_buffer = ssh_buffer_new();
-    if (channel->out_buffer == NULL) {
+    channel->in_buffer = ssh_buffer_new();
+    if (channel->out_buffer == NULL || channel->in_buffer == NULL) {
         LOG_ERROR("can not create buffer");
+        ssh_buffer_free(channel->out_buffer);
+        ssh_buffer_free(channel->in_buffer);
         SAFE_FREE(channel);
         return NULL;
     }
 
     channel->session = session;
-    session->channel = channel;
+    channel->next = session->channels;
+    session->channels = channel;
 
     return channel;
 }
@@ -446,26 +461,36 @@ int ssh_channel_request_sftp(ssh_channel channel) {
 }
 
 /**
- * @brief Write data to the channel. This function would block until `len` bytes
- * of data are written.LOG_ERROR
+ * @brief Write data gathered from `iov` to the channel. What the remote
+ * window has no room for is queued, and sent as window adjusts arrive while
+ * the session goes on. This function only blocks if more than
+ * CHANNEL_QUEUE_MAX bytes are queued.
  *
  * @param channel
- * @param data
- * @param len
+ * @param iov
+ * @param iovcnt
  * @return bytes written, SSH_ERR on error.
  */
-int ssh_channel_write(ssh_channel channel, const void *data, uint32_t len) {
-    ssh_session session;
-    uint32_t origlen = len;
-    size_t effectivelen;
-    size_t maxpacketlen;
-    int rc;
-
-    if (channel == NULL || data == NULL || len > INT_MAX) {
+int ssh_channel_writev(ssh_channel channel, const struct iovec *iov,
+                       int iovcnt) {
+    uint64_t total = 0;
+    uint32_t len, origlen;
+    size_t offset = 0; /* into iov[0] */
+    size_t chunk;
+    int i, rc;
+
+    if (channel == NULL || iov == NULL || iovcnt < 0) {
         LOG_ERROR("param error");
         ssh_set_error(SSH_FATAL, "invalid params");
         return SSH_ERROR;
     }
+    for (i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    if (total > INT_MAX) {
+        LOG_ERROR("param error");
+        ssh_set_error(SSH_FATAL, "invalid params");
+        return SSH_ERROR;
+    }
+    len = origlen = total;
 
     if (channel->local_eof) {
         ssh_set_error(SSH_REQUEST_DENIED,
@@ -474,244 +499,136 @@ int ssh_channel_write(ssh_channel channel, const void *data, uint32_t len) {
         return SSH_ERROR;
     }
 
-    session = channel->session;
-    /*
-     * Handle the max packet len from remote side
-     * be nice, 10 bytes for the headers
-     */
-    maxpacketlen = channel->remote_maxpacket - 10;
+    if (channel->remote_close) {
+        ssh_set_error(SSH_REQUEST_DENIED, "channel %d:%d closed by peer",
+                      channel->local_channel, channel->remote_channel);
+        return SSH_ERROR;
+    }
+
+    /* not ahead of the data queued before */
+    if (ssh_buffer_get_len(channel->out_buffer) == 0) {
+        rc = channel_send(channel, &iov, &offset, &len);
+        if (rc != SSH_OK) return SSH_ERROR;
+    }
 
     while (len > 0) {
-        if (channel->remote_window < len) {
-            if (channel->remote_window == 0) {
-                /* can not send, wait for window adjust message */
-                rc = wait_window(channel);
-                if (rc != SSH_OK) goto error;
-            }
-            effectivelen = MIN(len, channel->remote_window);
-        } else {
-            effectivelen = len;
+        chunk = MIN(len, iov->iov_len - offset);
+        rc = ssh_buffer_add_data(channel->out_buffer,
+                                 (const uint8_t *)iov->iov_base + offset,
+                                 chunk);
+        if (rc < 0) {
+            ssh_set_error(SSH_FATAL, "buffer error");
+            return SSH_ERROR;
         }
-        effectivelen = MIN(effectivelen, maxpacketlen);
+        len -= chunk;
+        iov++;
+        offset = 0;
+    }
 
-        rc = ssh_buffer_pack(session->out_buffer, "bd", SSH_MSG_CHANNEL_DATA,
-                             channel->remote_channel);
-        if (rc != SSH_OK) goto error;
+    rc = wait_window(channel, CHANNEL_QUEUE_MAX);
+    if (rc != SSH_OK) return SSH_ERROR;
 
-        rc = ssh_buffer_pack(session->out_buffer, "dP", effectivelen,
-                             effectivelen, data);
-        if (rc != SSH_OK) goto error;
+    return origlen;
+}
 
-        rc = ssh_packet_send(session);
-        if (rc != SSH_OK) goto error;
+/**
+ * @brief Write data to the channel. This function would block until `len` bytes
+ * of data are written.
+ *
+ * @param channel
+ * @param data
+ * @param len
+ * @return bytes written, SSH_ERR on error.
+ */
+int ssh_channel_write(ssh_channel channel, const void *data, uint32_t len) {
+    struct iovec iov;
 
-        channel->remote_window -= effectivelen;
-        len -= effectivelen;
-        data = ((uint8_t *)data + effectivelen);
+    if (data == NULL) {
+        LOG_ERROR("param error");
+        ssh_set_error(SSH_FATAL, "invalid params");
+        return SSH_ERROR;
     }
-
-    return origlen;
-
-error:
-    ssh_buffer_reinit(session->out_buffer);
-    return SSH_ERROR;
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    return ssh_channel_writev(channel, &iov, 1);
 }
 
 /**
  * @brief Read data from channel. This function would block until `count` bytes
  * of data is read.
  *
- * @todo take care of static `buf`
  * @param channel
  * @param dest
  * @param count
- * @return bytes read, SSH_ERR on error.
+ * @return bytes read, SSH_EOF if the peer sent EOF before any data,
+ * SSH_ERR on error.
  */
 int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count) {
     ssh_session session;
-    static ssh_buffer buf = NULL;
-    ssh_string channel_data = NULL;
-    uint8_t type;
-    uint32_t recipient_channel;
-    uint32_t bytes_to_add;
     uint32_t effectivelen;
     uint32_t nread = 0;
-    ssh_string req;
-    bool want;
     int rc;
 
     if (channel == NULL) return SSH_ERROR;
     session = channel->session;
 
-    if (channel->remote_eof) return SSH_EOF;
-
-    if (buf == NULL) buf = ssh_buffer_new();
-
-    /* local window should be at least `count` size */
-    if (count >= channel->local_window) {
-        grow_window(channel, count);
-    }
+    /* the peer must be able to send `count` bytes */
+    if (adjust_window(channel, count, 0) != SSH_OK) return SSH_ERROR;
 
     while (count > 0) {
-        if (ssh_buffer_get_len(buf) > 0) {
-            /* try to read channel data from static buffer first */
-            // LAB: insert your code here.
-            /* data flow: session->in_buffer --> buf --> dest. */
-            uint32_t buf_len = ssh_buffer_get_len(buf);
-            effectivelen = MIN(buf_len, count);
-            ssh_buffer_get_data(buf, dest + nread, effectivelen);
+        if (ssh_buffer_get_len(channel->in_buffer) > 0) {
+            /* data flow: session->in_buffer --> channel->in_buffer --> dest,
+             * the dispatcher fills channel->in_buffer. */
+            effectivelen = MIN(ssh_buffer_get_len(channel->in_buffer), count);
+            ssh_buffer_get_data(channel->in_buffer, (uint8_t *)dest + nread,
+                                effectivelen);
             nread += effectivelen;
             count -= effectivelen;
-            LOG_DEBUG("read %d bytes from channel", effectivelen);
-
+            SESSION_LOG_DEBUG(session, "read %d bytes from channel",
+                              effectivelen);
+        } else if (channel->remote_eof || channel->remote_close) {
+            return nread > 0 ? (int)nread : SSH_EOF;
         } else {
-            /* static buffer has insufficient data, read another
-             * SSH_MSG_CHANNEL_DATA packet */
-            rc = ssh_packet_receive(session);
-            if (rc != SSH_OK) goto error;
-
-            rc = ssh_buffer_unpack(session->in_buffer, "bd", &type,
-                                   &recipient_channel);
-            if (recipient_channel != channel->local_channel) {
-                LOG_ERROR(
-                    "channel number in the reply %d does not match with the "
-                    "original %d",
-                    recipient_channel, channel->local_channel);
-                goto error;
-            }
-            switch (type) {
-                case SSH_MSG_CHANNEL_WINDOW_ADJUST:
-                    /* window adjust message could happen here */
-                    // LAB: insert your code here.
-                    /* Adjust remote window and try receiving packet again. */
-                    ssh_buffer_unpack(session->in_buffer, "d", &bytes_to_add);
-                    LOG_NOTICE("remote window grows: +%d", bytes_to_add);
-                    channel->remote_window += bytes_to_add;
-                    ssh_buffer_reinit(session->in_buffer);
-                    break;
-
-                case SSH_MSG_CHANNEL_DATA:
-                    // LAB: insert your code here.
-                    /* Window size is decreased here because client can still
-                       receive a relatively bigger packet when count is small 
-                       and store it to buf.
-                       We don't receive packets larger than window size and 
-                       maximun packet size. A correctly running server 
-                       shouln't send those packets. */
-                    ssh_buffer_unpack(session->in_buffer, "S", &channel_data);
-                    size_t buf_len = ssh_string_len(channel_data);
-                    if (buf_len > channel->local_maxpacket) {
-                        LOG_ERROR("received packet length %lu exceeds maximum "
-                                  "packet length %u",
-                                  buf_len, channel->local_maxpacket);
-                        goto error;
-                    }
-                    if (buf_len > channel->local_window) {
-                        LOG_ERROR("received packet length %lu exceeds "
-                                  "window size %u",
-                                  buf_len, channel->local_window);
-                        goto error;
-                    }
-                    channel->local_window -= buf_len;
-                    rc = ssh_buffer_add_data(buf, 
-                                             ssh_string_data(channel_data), 
-                                             buf_len);
-                    if (rc != 0) {
-                        LOG_ERROR("cannot add data to buf");
-                        goto error;
-                    }
-                    else {
-                        LOG_DEBUG("add %lu bytes to buf", buf_len);
-                    }
-                    ssh_string_free(channel_data);
-                    break;
-
-                case SSH_MSG_CHANNEL_EOF:
-                    // LAB: insert your code here.
-                    /* We should return SSH_EOF here. But I found that 
-                       `sftp_packet_read` cannot deal with SSH_EOF correctly
-                       when reading packet length and type. In this case, 
-                       `buffer` is not filled and getting data from it will 
-                       cause a segmentation fault. */
-                    channel->remote_eof = 1;
-                    return SSH_EOF;
-
-                case SSH_MSG_CHANNEL_CLOSE:
-                    // LAB: insert your code here.
-                    /* (RFC 4254 5.3) When either party wishes to terminate 
-                       the channel, it sends SSH_MSG_CHANNEL_CLOSE. Upon 
-                       receiving this message, a party MUST send back an 
-                       SSH_MSG_CHANNEL_CLOSE unless it has already sent this 
-                       message for the channel. */
-                    rc = ssh_channel_eof(channel);
-                    if (rc != SSH_OK) {
-                        return rc;
-                    }
-
-                    rc = ssh_buffer_pack(session->out_buffer, "bd", 
-                                         SSH_MSG_CHANNEL_CLOSE,
-                                         channel->remote_channel);
-                    if (rc != SSH_OK) {
-                        ssh_buffer_reinit(session->out_buffer);
-                        LOG_ERROR("can not create buffer");
-                        goto error;
-                    }
-
-                    rc = ssh_packet_send(session);
-                    if (rc != SSH_OK) {
-                        ssh_buffer_reinit(session->out_buffer);
-                        LOG_ERROR("send SSH_MSG_CHANNEL_CLOSE failed");
-                        goto error;
-                    }
-                    return nread;
-
-                case SSH_MSG_CHANNEL_REQUEST:
-                    // LAB: insert your code here.
-                    /* Always reply a failure since we don't support any other
-                       requests. */
-                    rc = ssh_buffer_unpack(session->in_buffer, "Sb", 
-                                           &req, &want);
-                    ssh_string_free(req);
-                    if (rc != SSH_OK) {
-                        LOG_ERROR("cannot unpack buffer");
-                        goto error;
-                    }
-                    if (want) {
-                        rc = ssh_buffer_pack(session->out_buffer, "bd", 
-                                             SSH_MSG_CHANNEL_FAILURE, 
-                                             channel->remote_channel);
-                        if (rc != SSH_OK) {
-                            LOG_ERROR("can not create buffer");
-                            return SSH_ERROR;
-                        }
-                        if (ssh_packet_send(session) != SSH_OK) {
-                            ssh_buffer_reinit(session->out_buffer);
-                            LOG_ERROR("cannot send request reply");
-                            return SSH_ERROR;
-                        }
-                    }
-                    break;
-
-                default:
-                    // LAB: insert your code here.
-                    LOG_ERROR("message type %d is not supported", type);
-                    goto error;
-
-            }
+            rc = ssh_channel_handle_packet(session);
+            if (rc != SSH_OK) return SSH_ERROR;
         }
     }
 
+    /* credit for what was drained, so the peer keeps answering pipelined
+     * requests; it goes out with the next of them */
+    if (adjust_window(channel, 0, 0) != SSH_OK) return SSH_ERROR;
+
     return nread;
+}
 
-error:
-    if (buf != NULL) ssh_buffer_free(buf);
-    if (channel_data != NULL) ssh_string_free(channel_data);
-    return SSH_ERROR;
+/**
+ * @brief Read the data already received on the channel, without waiting for
+ * the network. The local window is topped up as the data is consumed.
+ *
+ * @param channel
+ * @param dest
+ * @param count
+ * @return bytes read (0 if none is pending), SSH_EOF if the peer sent EOF and
+ * everything was read, SSH_ERROR on error.
+ */
+int ssh_channel_read_nonblocking(ssh_channel channel, void *dest,
+                                 uint32_t count) {
+    uint32_t pending;
+    uint32_t nread;
+
+    if (channel == NULL) return SSH_ERROR;
+
+    pending = ssh_buffer_get_len(channel->in_buffer);
+    if (pending == 0) {
+        if (channel->remote_eof || channel->remote_close) return SSH_EOF;
+        return 0;
+    }
+
+    nread = ssh_buffer_get_data(channel->in_buffer, dest, MIN(pending, count));
 
-cleanup:
-    if (buf != NULL) ssh_buffer_free(buf);
-    if (channel_data != NULL) ssh_string_free(channel_data);
-    return SSH_EOF;
+    if (adjust_window(channel, 0, 0) != SSH_OK) return SSH_ERROR;
+
+    return nread;
 }
 
 /**
@@ -733,6 +650,11 @@ int ssh_channel_eof(ssh_channel channel) {
         return SSH_OK;
     }
 
+    /* after the queued data, unless the peer is gone */
+    if (!channel->remote_close && wait_window(channel, 0) != SSH_OK) {
+        return SSH_ERROR;
+    }
+
     session = channel->session;
 
     rc = ssh_buffer_pack(session->out_buffer, "bd", SSH_MSG_CHANNEL_EOF,
@@ -753,26 +675,21 @@ error:
 }
 
 /**
- * @brief Close a SSH channel. Send SSH_CHANNEL_CLOSE and wait for reply.
- *
- * RFC 4254 section 5.3
- * The channel is considered closed for a
- * party when it has both sent and received SSH_MSG_CHANNEL_CLOSE, and
- * the party may then reuse the channel number.  A party MAY send
- * SSH_MSG_CHANNEL_CLOSE without having sent or receive
- * SSH_MSG_CHANNEL_EOF.
+ * @brief Send SSH_MSG_CHANNEL_EOF and SSH_MSG_CHANNEL_CLOSE without waiting
+ * for the peer. The channel is freed later, once `remote_close` is set.
  *
+ * @param channel
+ * @return int
  */
-int ssh_channel_close(ssh_channel channel) {
+int ssh_channel_send_close(ssh_channel channel) {
     ssh_session session;
-    uint8_t type;
-    uint32_t recipient_channel;
     int rc;
 
-    if (channel == NULL) {
+    if (channel == NULL || channel->session == NULL) {
         return SSH_ERROR;
     }
 
+    if (channel->local_close) return SSH_OK;
     session = channel->session;
 
     rc = ssh_channel_eof(channel);
@@ -787,24 +704,9 @@ int ssh_channel_close(ssh_channel channel) {
         goto error;
     }
 
-    rc = ssh_packet_send(session);
-
-    /* wait for SSH_MSG_CHANNEL_CLOSE reply */
-    type = 0;
-    while (type != SSH_MSG_CHANNEL_CLOSE) {
-        rc = ssh_packet_receive(session);
-        rc = ssh_buffer_unpack(session->in_buffer, "bd", &type,
-                               &recipient_channel);
-        if (recipient_channel != channel->local_channel) {
-            LOG_ERROR(
-                "channel number in the reply %d does not match with the "
-                "original %d",
-                recipient_channel, channel->local_channel);
-            return SSH_ERROR;
-        }
-        LOG_NOTICE("received code %d during channel close", type);
-    }
+    if (ssh_packet_send(session) != SSH_OK) goto error;
 
+    channel->local_close = 1;
     return SSH_OK;
 
 error:
@@ -812,14 +714,518 @@ error:
     return SSH_ERROR;
 }
 
+/**
+ * @brief Close a SSH channel. Send SSH_CHANNEL_CLOSE and wait for reply.
+ *
+ * RFC 4254 section 5.3
+ * The channel is considered closed for a
+ * party when it has both sent and received SSH_MSG_CHANNEL_CLOSE, and
+ * the party may then reuse the channel number.  A party MAY send
+ * SSH_MSG_CHANNEL_CLOSE without having sent or receive
+ * SSH_MSG_CHANNEL_EOF.
+ *
+ */
+int ssh_channel_close(ssh_channel channel) {
+    int rc;
+
+    rc = ssh_channel_send_close(channel);
+    if (rc != SSH_OK) {
+        return rc;
+    }
+
+    /* wait for SSH_MSG_CHANNEL_CLOSE reply */
+    while (!channel->remote_close) {
+        rc = ssh_channel_handle_packet(channel->session);
+        if (rc != SSH_OK) return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Add the counters of `from` to `to`.
+ *
+ * @param to
+ * @param from
+ */
+static void channel_stats_add(struct ssh_channel_stats *to,
+                              const struct ssh_channel_stats *from) {
+    to->bytes_in += from->bytes_in;
+    to->bytes_out += from->bytes_out;
+    to->window_stalls += from->window_stalls;
+    to->window_stall_ns += from->window_stall_ns;
+    to->window_adjusts_sent += from->window_adjusts_sent;
+    to->window_adjusts_received += from->window_adjusts_received;
+}
+
+/**
+ * @brief Take a snapshot of the counters of one channel.
+ *
+ * @param channel
+ * @param stats
+ * @return int
+ */
+int ssh_channel_get_stats(ssh_channel channel,
+                          struct ssh_channel_stats *stats) {
+    if (channel == NULL || stats == NULL) return SSH_ERROR;
+
+    *stats = channel->stats;
+    return SSH_OK;
+}
+
+/**
+ * @brief Add the counters of the channels of `session` to `stats`, the
+ * session keeps those of the freed ones.
+ *
+ * @param session
+ * @param stats
+ */
+void ssh_channel_stats_sum(ssh_session session,
+                           struct ssh_channel_stats *stats) {
+    ssh_channel channel;
+
+    *stats = session->stats.channels;
+    for (channel = session->channels; channel != NULL;
+         channel = channel->next) {
+        channel_stats_add(stats, &channel->stats);
+    }
+}
+
 /**
  * @brief Free the channel and deallocate its resource.
  *
  * @param channel
  */
 void ssh_channel_free(ssh_channel channel) {
+    ssh_channel *pp;
+
+    if (channel == NULL) return;
+
+    for (pp = &channel->session->channels; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == channel) {
+            *pp = channel->next;
+            break;
+        }
+    }
+
+    channel_stats_add(&channel->session->stats.channels, &channel->stats);
+
     ssh_buffer_free(channel->out_buffer);
-    channel->session->channel = NULL;
+    ssh_buffer_free(channel->in_buffer);
     channel->session = NULL;
     SAFE_FREE(channel);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Append the payload of SSH_MSG_CHANNEL_DATA to the channel.
+ *
+ * Window size is decreased here because we can still receive a relatively
+ * bigger packet than what the reader asked for and keep it in the channel.
+ * We don't accept packets larger than window size and maximum packet size.
+ * A correctly running server shouldn't send those packets.
+ *
+ * @param channel
+ * @return int
+ */
+static int channel_rcv_data(ssh_channel channel) {
+    ssh_session session = channel->session;
+    struct ssh_string_view data;
+    uint32_t len;
+    int rc;
+
+    /* straight from the packet to the channel */
+    rc = layout_get_string(session->in_buffer, &data);
+    if (rc != SSH_OK) {
+        LOG_ERROR("cannot unpack buffer");
+        return SSH_ERROR;
+    }
+    len = data.len;
+
+    if (len > channel->local_maxpacket) {
+        LOG_ERROR("received packet length %u exceeds maximum packet length %u",
+                  len, channel->local_maxpacket);
+        return SSH_ERROR;
+    }
+    if (len > channel->local_window) {
+        LOG_ERROR("received packet length %u exceeds window size %u", len,
+                  channel->local_window);
+        return SSH_ERROR;
+    }
+    channel->local_window -= len;
+    channel->stats.bytes_in += len;
+
+    rc = ssh_buffer_add_data(channel->in_buffer, data.data, len);
+    if (rc != 0) {
+        LOG_ERROR("cannot add data to channel buffer");
+        return SSH_ERROR;
+    }
+    SESSION_LOG_DEBUG(session, "add %u bytes to channel %d", len,
+                      channel->local_channel);
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Answer SSH_MSG_GLOBAL_REQUEST.
+ *
+ * RFC 4254 Section 4
+ * There are several kinds of requests that affect the state of
+ * the remote end globally, independent of any channels.  An
+ * example is a request to start TCP/IP forwarding for a
+ * specific port.  Note that both the client and server MAY send
+ * global requests at any time, and the receiver MUST respond
+ * appropriately.
+ *
+ * We don't support any of them, so we simply respond with
+ * SSH_MSG_REQUEST_FAILURE.
+ *
+ * @param session
+ * @return int
+ */
+static int channel_global_request(ssh_session session) {
+    struct ssh_string_view req;
+    bool want;
+    int rc;
+
+    rc = ssh_buffer_unpack(session->in_buffer, "Vb", &req, &want);
+    if (rc != SSH_OK) {
+        LOG_ERROR("cannot unpack buffer");
+        return SSH_ERROR;
+    }
+    if (!want) return SSH_OK;
+
+    rc = ssh_buffer_pack(session->out_buffer, "b", SSH_MSG_REQUEST_FAILURE);
+    if (rc != SSH_OK) {
+        LOG_ERROR("can not create buffer");
+        return SSH_ERROR;
+    }
+    if (ssh_packet_send(session) != SSH_OK) {
+        ssh_buffer_reinit(session->out_buffer);
+        LOG_ERROR("cannot send request reply");
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Answer SSH_MSG_CHANNEL_OPEN. Only a server accepts channels, and
+ * only of the "session" type.
+ *  byte      SSH_MSG_CHANNEL_OPEN
+ *  string    channel type in US-ASCII only
+ *  uint32    sender channel
+ *  uint32    initial window size
+ *  uint32    maximum packet size
+ *
+ * @see RFC4254 section 5.1
+ * @param session
+ * @return int
+ */
+static int channel_rcv_open(ssh_session session) {
+    ssh_channel channel = NULL;
+    char *type = NULL;
+    uint32_t sender, window, maxpacket;
+    int rc;
+
+    rc = ssh_buffer_unpack(session->in_buffer, "sddd", &type, &sender, &window,
+                           &maxpacket);
+    if (rc != SSH_OK) {
+        LOG_ERROR("cannot unpack buffer");
+        return SSH_ERROR;
+    }
+
+    if (!session->server || strcmp(type, "session") != 0) {
+        LOG_INFO("refusing channel of type %s", type);
+        SAFE_FREE(type);
+        rc = ssh_buffer_pack(session->out_buffer, "bddss",
+                             SSH_MSG_CHANNEL_OPEN_FAILURE, sender,
+                             SSH_OPEN_UNKNOWN_CHANNEL_TYPE,
+                             "unsupported channel type", "");
+        goto send;
+    }
+    SAFE_FREE(type);
+
+    channel = ssh_channel_new(session);
+    if (channel == NULL) return SSH_ERROR;
+
+    channel->local_channel = channel_new_id(session);
+    channel->local_window = CHANNEL_INITIAL_WINDOW;
+    channel->local_window_max = CHANNEL_INITIAL_WINDOW;
+    channel->local_maxpacket = CHANNEL_MAX_PACKET;
+    channel->remote_channel = sender;
+    channel->remote_window = window;
+    channel->remote_maxpacket = maxpacket;
+    channel->state = SSH_CHANNEL_STATE_OPEN;
+    LOG_NOTICE("local channel #%u to remote channel #%u established",
+               channel->local_channel, channel->remote_channel);
+
+    rc = ssh_buffer_pack(session->out_buffer, "bdddd",
+                         SSH_MSG_CHANNEL_OPEN_CONFIRMATION, sender,
+                         channel->local_channel, channel->local_window,
+                         channel->local_maxpacket);
+
+send:
+    if (rc != SSH_OK || ssh_packet_send(session) != SSH_OK) {
+        ssh_buffer_reinit(session->out_buffer);
+        LOG_ERROR("cannot send channel open reply");
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Answer SSH_MSG_CHANNEL_REQUEST. A server accepts the "sftp"
+ * subsystem once per channel, every other request fails.
+ *
+ * @param channel
+ * @return int
+ */
+static int channel_rcv_request(ssh_channel channel) {
+    ssh_session session = channel->session;
+    char *req = NULL;
+    char *subsystem = NULL;
+    uint8_t reply = SSH_MSG_CHANNEL_FAILURE;
+    bool want;
+    int rc;
+
+    rc = ssh_buffer_unpack(session->in_buffer, "sb", &req, &want);
+    if (rc != SSH_OK) {
+        LOG_ERROR("cannot unpack buffer");
+        return SSH_ERROR;
+    }
+
+    if (session->server && strcmp(req, "subsystem") == 0 &&
+        channel->request_state == SSH_CHANNEL_REQ_STATE_NONE &&
+        ssh_buffer_unpack(session->in_buffer, "s", &subsystem) == SSH_OK &&
+        strcmp(subsystem, "sftp") == 0) {
+        channel->request_state = SSH_CHANNEL_REQ_STATE_ACCEPTED;
+        reply = SSH_MSG_CHANNEL_SUCCESS;
+    }
+    LOG_INFO("channel %d: %s request %s", channel->local_channel,
+             reply == SSH_MSG_CHANNEL_SUCCESS ? "accepted" : "refused", req);
+    SAFE_FREE(req);
+    SAFE_FREE(subsystem);
+    if (!want) return SSH_OK;
+
+    rc = ssh_buffer_pack(session->out_buffer, "bd", reply,
+                         channel->remote_channel);
+    if (rc != SSH_OK) {
+        LOG_ERROR("can not create buffer");
+        return SSH_ERROR;
+    }
+    if (ssh_packet_send(session) != SSH_OK) {
+        ssh_buffer_reinit(session->out_buffer);
+        LOG_ERROR("cannot send request reply");
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Handle a connection layer message whose type byte has been read
+ * from `session->in_buffer`. Channel messages update the state of the
+ * channel they are addressed to, so several channels can share a session.
+ *
+ * @param session
+ * @param type
+ * @return SSH_OK if the message was handled, SSH_ERROR otherwise.
+ */
+int ssh_channel_dispatch(ssh_session session, uint8_t type) {
+    ssh_channel channel;
+    uint32_t recipient_channel;
+    uint32_t bytes_to_add;
+    uint32_t reason_code;
+    uint32_t data_type;
+    struct ssh_string_view data;
+    char *description = NULL;
+    int rc;
+
+    if (type == SSH_MSG_GLOBAL_REQUEST) {
+        return channel_global_request(session);
+    }
+
+    if (type == SSH_MSG_CHANNEL_OPEN) {
+        return channel_rcv_open(session);
+    }
+
+    if (type == SSH_MSG_DISCONNECT) {
+        rc = ssh_buffer_unpack(session->in_buffer, "ds", &reason_code,
+                               &description);
+        ssh_set_error(SSH_FATAL, "disconnected by peer, reason code %u: %s",
+                      rc == SSH_OK ? reason_code : 0,
+                      rc == SSH_OK ? description : "");
+        SAFE_FREE(description);
+        return SSH_ERROR;
+    }
+
+    if (type < SSH_MSG_CHANNEL_OPEN_CONFIRMATION ||
+        type > SSH_MSG_CHANNEL_FAILURE) {
+        LOG_ERROR("message type %d is not supported", type);
+        return SSH_ERROR;
+    }
+
+    rc = layout_get_u32(session->in_buffer, &recipient_channel);
+    if (rc != SSH_OK) {
+        LOG_ERROR("cannot unpack buffer");
+        return SSH_ERROR;
+    }
+
+    channel = channel_from_id(session, recipient_channel);
+    if (channel == NULL) {
+        LOG_ERROR("message type %d for unknown channel %u", type,
+                  recipient_channel);
+        return SSH_ERROR;
+    }
+
+    switch (type) {
+        case SSH_MSG_CHANNEL_OPEN_CONFIRMATION:
+            rc = ssh_buffer_unpack(session->in_buffer, "ddd",
+                                   &channel->remote_channel,
+                                   &channel->remote_window,
+                                   &channel->remote_maxpacket);
+            if (rc != SSH_OK) {
+                LOG_ERROR("cannot unpack buffer");
+                return SSH_ERROR;
+            }
+            channel->state = SSH_CHANNEL_STATE_OPEN;
+            LOG_NOTICE("local channel #%u to remote channel #%u established",
+                       channel->local_channel, channel->remote_channel);
+            LOG_NOTICE("local window size = %u, remote window size = %u",
+                       channel->local_window, channel->remote_window);
+            return SSH_OK;
+
+        case SSH_MSG_CHANNEL_OPEN_FAILURE:
+            rc = ssh_buffer_unpack(session->in_buffer, "ds", &reason_code,
+                                   &description);
+            if (rc != SSH_OK) {
+                LOG_ERROR("cannot unpack buffer");
+                return SSH_ERROR;
+            }
+            LOG_ERROR("channel open failed - reason code: %d, "
+                      "description: %s", reason_code, description);
+            SAFE_FREE(description);
+            channel->state = SSH_CHANNEL_STATE_OPEN_DENIED;
+            return SSH_OK;
+
+        case SSH_MSG_CHANNEL_WINDOW_ADJUST:
+            rc = layout_get_u32(session->in_buffer, &bytes_to_add);
+            if (rc != SSH_OK) return SSH_ERROR;
+            channel->remote_window += bytes_to_add;
+            channel->stats.window_adjusts_received++;
+            ssh_trace_record(session->trace, SSH_TRACE_WINDOW_ADJUST_IN, 0, 0,
+                             bytes_to_add, channel->local_channel, 0, 0);
+            SSH_PROBE3(window__adjust, channel->local_channel, bytes_to_add,
+                       channel->remote_window);
+            SESSION_LOG_DEBUG(session, "remote window grows: +%d",
+                              bytes_to_add);
+            return channel_flush(channel);
+
+        case SSH_MSG_CHANNEL_DATA:
+            return channel_rcv_data(channel);
+
+        case SSH_MSG_CHANNEL_EXTENDED_DATA:
+            /* stderr of the subsystem, only the window is accounted */
+            rc = ssh_buffer_unpack(session->in_buffer, "dV", &data_type,
+                                   &data);
+            if (rc != SSH_OK) return SSH_ERROR;
+            if (data.len > channel->local_window) return SSH_ERROR;
+            channel->local_window -= data.len;
+            LOG_INFO("channel %d: discarded %u bytes of extended data",
+                     channel->local_channel, data.len);
+            return SSH_OK;
+
+        case SSH_MSG_CHANNEL_EOF:
+            channel->remote_eof = 1;
+            return SSH_OK;
+
+        case SSH_MSG_CHANNEL_CLOSE:
+            /* (RFC 4254 5.3) Upon receiving this message, a party MUST send
+             * back an SSH_MSG_CHANNEL_CLOSE unless it has already sent this
+             * message for the channel. */
+            channel->remote_eof = 1;
+            channel->remote_close = 1;
+            channel->state = SSH_CHANNEL_STATE_CLOSED;
+            return ssh_channel_send_close(channel);
+
+        case SSH_MSG_CHANNEL_REQUEST:
+            return channel_rcv_request(channel);
+
+        case SSH_MSG_CHANNEL_SUCCESS:
+            channel->request_state = SSH_CHANNEL_REQ_STATE_ACCEPTED;
+            return SSH_OK;
+
+        case SSH_MSG_CHANNEL_FAILURE:
+            channel->request_state = SSH_CHANNEL_REQ_STATE_DENIED;
+            return SSH_OK;
+    }
+
+    return SSH_ERROR;
+}
+
+/**
+ * @brief Receive one packet and dispatch it, see `ssh_channel_dispatch`.
+ *
+ * @param session
+ * @return int
+ */
+int ssh_channel_handle_packet(ssh_session session) {
+    uint8_t type;
+    int rc;
+
+    rc = ssh_packet_receive(session);
+    if (rc != SSH_OK) return SSH_ERROR;
+
+    rc = ssh_buffer_get_u8(session->in_buffer, &type);
+    if (rc != sizeof(uint8_t)) return SSH_ERROR;
+
+    return ssh_channel_dispatch(session, type);
+}
+
+/**
+ * @brief Dispatch the packets that already arrived, without waiting for more.
+ *
+ * @param session
+ * @return int
+ */
+int ssh_channel_handle_pending(ssh_session session) {
+    uint8_t type;
+    int rc;
+
+    while (1) {
+        rc = ssh_packet_receive_nonblocking(session);
+        if (rc == SSH_AGAIN) return SSH_OK;
+        if (rc != SSH_OK) return SSH_ERROR;
+
+        rc = ssh_buffer_get_u8(session->in_buffer, &type);
+        if (rc != sizeof(uint8_t)) return SSH_ERROR;
+
+        rc = ssh_channel_dispatch(session, type);
+        if (rc != SSH_OK) return SSH_ERROR;
+    }
+}
+
+/**
+ * @brief Server role: wait until the client opened a session channel and
+ * started the "sftp" subsystem on it.
+ *
+ * @param session
+ * @return ssh_channel, NULL on error.
+ */
+ssh_channel ssh_channel_accept_sftp(ssh_session session) {
+    ssh_channel channel;
+
+    if (session == NULL || !session->server) return NULL;
+
+    while (1) {
+        for (channel = session->channels; channel != NULL;
+             channel = channel->next) {
+            if (channel->state == SSH_CHANNEL_STATE_OPEN &&
+                channel->request_state == SSH_CHANNEL_REQ_STATE_ACCEPTED) {
+                return channel;
+            }
+        }
+        if (ssh_channel_handle_packet(session) != SSH_OK) return NULL;
+    }
+}
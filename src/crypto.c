@@ -13,6 +13,7 @@
 
 #include "libsftp/crypto.h"
 #include "libsftp/dh.h"
+#include "libsftp/gzip.h"
 #include "libsftp/libssh.h"
 #include "libsftp/session.h"
 #include "libsftp/util.h"
@@ -87,6 +88,7 @@ void ssh_cipher_clear(struct ssh_cipher_struct *cipher) {
     if (cipher->cleanup != NULL) {
         cipher->cleanup(cipher);
     }
+    explicit_bzero(cipher->ctr_iv, sizeof(cipher->ctr_iv));
 }
 
 static void cipher_free(struct ssh_cipher_struct *cipher) {
@@ -139,11 +141,18 @@ int ssh_crypto_set_algo(ssh_session session) {
     const char *wanted = NULL;
     struct ssh_cipher_struct *ssh_ciphertab = ssh_get_ciphertab();
     struct ssh_hmac_struct *ssh_hmactab = ssh_get_hmactab();
+    /* "out" is server to client when we are the server */
+    int crypt_out = session->server ? SSH_CRYPT_S_C : SSH_CRYPT_C_S;
+    int crypt_in = session->server ? SSH_CRYPT_C_S : SSH_CRYPT_S_C;
+    int mac_out = session->server ? SSH_MAC_S_C : SSH_MAC_C_S;
+    int mac_in = session->server ? SSH_MAC_C_S : SSH_MAC_S_C;
+    int comp_out = session->server ? SSH_COMP_S_C : SSH_COMP_C_S;
+    int comp_in = session->server ? SSH_COMP_C_S : SSH_COMP_S_C;
     size_t i = 0;
     int cmp;
 
     /* out cipher*/
-    wanted = session->next_crypto->kex_methods[SSH_CRYPT_C_S];
+    wanted = session->next_crypto->kex_methods[crypt_out];
     for (i = 0; ssh_ciphertab[i].name != NULL; ++i) {
         cmp = strcmp(wanted, ssh_ciphertab[i].name);
         if (cmp == 0) {
@@ -154,7 +163,7 @@ int ssh_crypto_set_algo(ssh_session session) {
     session->next_crypto->out_cipher = cipher_new(i);
 
     /* out mac */
-    wanted = session->next_crypto->kex_methods[SSH_MAC_C_S];
+    wanted = session->next_crypto->kex_methods[mac_out];
     for (i = 0; ssh_hmactab[i].name != NULL; i++) {
         cmp = strcmp(wanted, ssh_hmactab[i].name);
         if (cmp == 0) {
@@ -163,9 +172,10 @@ int ssh_crypto_set_algo(ssh_session session) {
     }
     if (ssh_hmactab[i].name == NULL) goto error;
     session->next_crypto->out_hmac = ssh_hmactab[i].hmac_type;
+    session->next_crypto->out_hmac_etm = ssh_hmactab[i].etm;
 
     /* in cipher */
-    wanted = session->next_crypto->kex_methods[SSH_CRYPT_S_C];
+    wanted = session->next_crypto->kex_methods[crypt_in];
     for (i = 0; ssh_ciphertab[i].name != NULL; ++i) {
         cmp = strcmp(wanted, ssh_ciphertab[i].name);
         if (cmp == 0) {
@@ -176,7 +186,7 @@ int ssh_crypto_set_algo(ssh_session session) {
     session->next_crypto->in_cipher = cipher_new(i);
 
     /* in mac */
-    wanted = session->next_crypto->kex_methods[SSH_MAC_S_C];
+    wanted = session->next_crypto->kex_methods[mac_in];
     for (i = 0; ssh_hmactab[i].name != NULL; i++) {
         cmp = strcmp(wanted, ssh_hmactab[i].name);
         if (cmp == 0) {
@@ -185,6 +195,24 @@ int ssh_crypto_set_algo(ssh_session session) {
     }
     if (ssh_hmactab[i].name == NULL) goto error;
     session->next_crypto->in_hmac = ssh_hmactab[i].hmac_type;
+    session->next_crypto->in_hmac_etm = ssh_hmactab[i].etm;
+
+    /* compression */
+    wanted = session->next_crypto->kex_methods[comp_out];
+    if (strcmp(wanted, "zlib") == 0) {
+        session->next_crypto->do_compress_out = 1;
+    } else if (strcmp(wanted, "zlib@openssh.com") == 0) {
+        session->next_crypto->delayed_compress_out = 1;
+        session->next_crypto->do_compress_out = session->authenticated;
+    }
+
+    wanted = session->next_crypto->kex_methods[comp_in];
+    if (strcmp(wanted, "zlib") == 0) {
+        session->next_crypto->do_compress_in = 1;
+    } else if (strcmp(wanted, "zlib@openssh.com") == 0) {
+        session->next_crypto->delayed_compress_in = 1;
+        session->next_crypto->do_compress_in = session->authenticated;
+    }
 
     return SSH_OK;
 
@@ -218,6 +246,8 @@ void crypto_free(struct ssh_crypto_struct *crypto) {
     SAFE_FREE(crypto->decryptIV);
     SAFE_FREE(crypto->encryptMAC);
     SAFE_FREE(crypto->decryptMAC);
+    hmac_free(crypto->in_hmac_ctx);
+    hmac_free(crypto->out_hmac_ctx);
     if (crypto->encryptkey != NULL) {
         explicit_bzero(crypto->encryptkey, crypto->out_cipher->keysize / 8);
         SAFE_FREE(crypto->encryptkey);
@@ -230,6 +260,8 @@ void crypto_free(struct ssh_crypto_struct *crypto) {
     cipher_free(crypto->in_cipher);
     cipher_free(crypto->out_cipher);
 
+    compress_cleanup(crypto);
+
     for (i = 0; i < SSH_KEX_METHODS; i++) {
         SAFE_FREE(crypto->client_kex.methods[i]);
         SAFE_FREE(crypto->server_kex.methods[i]);
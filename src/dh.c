@@ -11,9 +11,12 @@
 
 #include "libsftp/dh.h"
 
+#include <pthread.h>
+
 #include "libsftp/bignum.h"
 #include "libsftp/buffer.h"
 #include "libsftp/crypto.h"
+#include "libsftp/error.h"
 #include "libsftp/logger.h"
 #include "libsftp/packet.h"
 #include "libsftp/pki.h"
@@ -26,6 +29,9 @@
  */
 #define DH_SECURITY_BITS 512
 
+/* Upper bound of precomputed client keypairs kept by the key pool */
+#define DH_KEYPOOL_MAX 64
+
 struct dh_keypair {
     bignum priv_key;
     bignum pub_key;
@@ -40,6 +46,27 @@ struct dh_ctx {
 
 static bignum ssh_dh_generator;
 static bignum ssh_dh_group14;
+static pthread_once_t dh_group_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Precomputed client keypairs. A background thread keeps the pool filled so
+ * that `dh_send_init` does not have to run the modular exponentiation in the
+ * critical path of the handshake, `dh_send_reply` draws from it as well in
+ * server role. Each keypair is handed out exactly once.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t worker;
+    struct dh_keypair keys[DH_KEYPOOL_MAX];
+    size_t count; /* number of ready keypairs */
+    size_t size;  /* wanted number of ready keypairs */
+    int running;  /* the worker is to keep the pool filled */
+    int started;  /* the worker thread is not joined yet */
+} dh_keypool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
 
 static unsigned char p_group14_value[] = {
     0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xC9, 0x0F, 0xDA, 0xA2,
@@ -80,6 +107,8 @@ static void dh_free_modulus(struct dh_ctx *ctx);
 static void dh_free_generator(struct dh_ctx *ctx);
 static int dh_init_keypair(struct dh_keypair *keypair);
 static void dh_free_keypair(struct dh_keypair *keypair);
+static int dh_gen_keypair(const_bignum modulus, const_bignum generator,
+                          bignum priv_key, bignum pub_key);
 
 static void ssh_dh_debug_crypto(struct ssh_crypto_struct *c) {
 #ifdef DEBUG_CRYPTO
@@ -102,24 +131,48 @@ static void ssh_dh_debug_crypto(struct ssh_crypto_struct *c) {
 #endif
 }
 
+/**
+ * @brief Build the group 14 parameters shared by all DH contexts. They are
+ * never modified, each context works on its own copy.
+ */
+static void dh_group_init(void) {
+    ssh_dh_generator = bignum_new();
+    if (ssh_dh_generator == NULL) return;
+    if (bignum_set_word(ssh_dh_generator, 2) != 1) {
+        bignum_safe_free(ssh_dh_generator);
+        return;
+    }
+
+    bignum_bin2bn(p_group14_value, P_GROUP14_LEN, &ssh_dh_group14);
+}
+
 static int dh_init(ssh_session session) {
     struct ssh_crypto_struct *crypto = session->next_crypto;
-    const_bignum pubkey;
     struct dh_ctx *ctx = NULL;
+    bignum modulus = NULL;
+    bignum generator = NULL;
     int rc;
 
-    ssh_dh_generator = bignum_new();
-    rc = bignum_set_word(ssh_dh_generator, 2);
-    if (rc != 1) return SSH_ERROR;
+    pthread_once(&dh_group_once, dh_group_init);
+    if (ssh_dh_generator == NULL || ssh_dh_group14 == NULL) return SSH_ERROR;
 
-    bignum_bin2bn(p_group14_value, P_GROUP14_LEN, &ssh_dh_group14);
-    if (ssh_dh_group14 == NULL) return SSH_ERROR;
+    bignum_dup(ssh_dh_group14, &modulus);
+    bignum_dup(ssh_dh_generator, &generator);
+    if (modulus == NULL || generator == NULL) {
+        bignum_safe_free(modulus);
+        bignum_safe_free(generator);
+        return SSH_ERROR;
+    }
 
     /* DH context initialization */
     ctx = calloc(1, sizeof(*ctx));
-    if (ctx == NULL) return SSH_ERROR;
+    if (ctx == NULL) {
+        bignum_safe_free(modulus);
+        bignum_safe_free(generator);
+        return SSH_ERROR;
+    }
 
-    rc = dh_set_parameters(ctx, ssh_dh_group14, ssh_dh_generator);
+    rc = dh_set_parameters(ctx, modulus, generator);
     crypto->dh_ctx = ctx;
     if (rc != SSH_OK) {
         dh_cleanup(crypto);
@@ -187,12 +240,19 @@ void dh_cleanup(struct ssh_crypto_struct *crypto) {
     dh_free_generator(ctx);
     SAFE_FREE(ctx);
     crypto->dh_ctx = NULL;
-
-    bignum_safe_free(ssh_dh_generator);
-    bignum_safe_free(ssh_dh_group14);
 }
 
-static int dh_keypair_gen_keys(struct dh_ctx *dh_ctx, int peer) {
+/**
+ * @brief Generate a random private key x and its public key g^x mod p.
+ *
+ * @param modulus
+ * @param generator
+ * @param priv_key  allocated bignum receiving the private key
+ * @param pub_key   allocated bignum receiving the public key
+ * @return int
+ */
+static int dh_gen_keypair(const_bignum modulus, const_bignum generator,
+                          bignum priv_key, bignum pub_key) {
     bignum tmp = NULL;
     bignum_CTX ctx = NULL;
     int rc = 0;
@@ -207,7 +267,7 @@ static int dh_keypair_gen_keys(struct dh_ctx *dh_ctx, int peer) {
     if (tmp == NULL) {
         goto error;
     }
-    p_bits = bignum_num_bits(dh_ctx->modulus);
+    p_bits = bignum_num_bits(modulus);
     /* we need at most DH_SECURITY_BITS */
     bits = MIN(DH_SECURITY_BITS * 2, p_bits);
     /* ensure we're not too close of p so rnd()%p stays uniform */
@@ -218,13 +278,12 @@ static int dh_keypair_gen_keys(struct dh_ctx *dh_ctx, int peer) {
     if (rc != 1) {
         goto error;
     }
-    rc = bignum_mod(dh_ctx->keypair[peer].priv_key, tmp, dh_ctx->modulus, ctx);
+    rc = bignum_mod(priv_key, tmp, modulus, ctx);
     if (rc != 1) {
         goto error;
     }
     /* Now compute the corresponding public key */
-    rc = bignum_mod_exp(dh_ctx->keypair[peer].pub_key, dh_ctx->generator,
-                        dh_ctx->keypair[peer].priv_key, dh_ctx->modulus, ctx);
+    rc = bignum_mod_exp(pub_key, generator, priv_key, modulus, ctx);
     if (rc != 1) {
         goto error;
     }
@@ -237,6 +296,159 @@ error:
     return SSH_ERROR;
 }
 
+static int dh_keypair_gen_keys(struct dh_ctx *dh_ctx, int peer) {
+    return dh_gen_keypair(dh_ctx->modulus, dh_ctx->generator,
+                          dh_ctx->keypair[peer].priv_key,
+                          dh_ctx->keypair[peer].pub_key);
+}
+
+/**
+ * @brief Background worker refilling the client keypair pool.
+ */
+static void *dh_keypool_worker(void *arg) {
+    struct dh_keypair keypair;
+    int rc;
+
+    (void)arg;
+
+    pthread_mutex_lock(&dh_keypool.lock);
+    while (dh_keypool.running) {
+        if (dh_keypool.count >= dh_keypool.size) {
+            pthread_cond_wait(&dh_keypool.cond, &dh_keypool.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&dh_keypool.lock);
+
+        /* the expensive part runs without holding the lock */
+        rc = dh_init_keypair(&keypair);
+        if (rc == SSH_OK) {
+            rc = dh_gen_keypair(ssh_dh_group14, ssh_dh_generator,
+                                keypair.priv_key, keypair.pub_key);
+            if (rc != SSH_OK) {
+                dh_free_keypair(&keypair);
+            }
+        }
+
+        pthread_mutex_lock(&dh_keypool.lock);
+        if (rc != SSH_OK) {
+            LOG_WARNING("can not precompute DH keypair, key pool stopped");
+            break;
+        }
+        if (dh_keypool.count < DH_KEYPOOL_MAX) {
+            dh_keypool.keys[dh_keypool.count++] = keypair;
+        } else {
+            dh_free_keypair(&keypair);
+        }
+    }
+    /* stopped or failed, either way the pool has no producer any more and
+     * can be started again */
+    dh_keypool.running = 0;
+    pthread_cond_broadcast(&dh_keypool.cond);
+    pthread_mutex_unlock(&dh_keypool.lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Take a precomputed client keypair out of the pool.
+ *
+ * @param priv  receives the private key, owned by the caller
+ * @param pub   receives the public key, owned by the caller
+ * @return SSH_OK if a keypair was ready, SSH_AGAIN otherwise.
+ */
+static int dh_keypool_take(bignum *priv, bignum *pub) {
+    int rc = SSH_AGAIN;
+
+    pthread_mutex_lock(&dh_keypool.lock);
+    if (dh_keypool.count > 0) {
+        dh_keypool.count--;
+        *priv = dh_keypool.keys[dh_keypool.count].priv_key;
+        *pub = dh_keypool.keys[dh_keypool.count].pub_key;
+        dh_keypool.keys[dh_keypool.count].priv_key = NULL;
+        dh_keypool.keys[dh_keypool.count].pub_key = NULL;
+        /* wake up the worker to refill the slot */
+        pthread_cond_signal(&dh_keypool.cond);
+        rc = SSH_OK;
+    }
+    pthread_mutex_unlock(&dh_keypool.lock);
+
+    return rc;
+}
+
+/**
+ * @brief Start the background thread precomputing client DH keypairs.
+ * Calling it again while the pool is running only changes its size.
+ *
+ * @param size number of keypairs to keep ready, at most DH_KEYPOOL_MAX
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_dh_keypool_start(unsigned int size) {
+    int rc;
+
+    if (size == 0 || size > DH_KEYPOOL_MAX) {
+        ssh_set_error(SSH_REQUEST_DENIED, "invalid key pool size %u", size);
+        return SSH_ERROR;
+    }
+
+    pthread_once(&dh_group_once, dh_group_init);
+    if (ssh_dh_generator == NULL || ssh_dh_group14 == NULL) return SSH_ERROR;
+
+    pthread_mutex_lock(&dh_keypool.lock);
+    dh_keypool.size = size;
+    if (dh_keypool.running) {
+        pthread_cond_signal(&dh_keypool.cond);
+        pthread_mutex_unlock(&dh_keypool.lock);
+        return SSH_OK;
+    }
+    if (dh_keypool.started) {
+        /* a worker that gave up, it is gone or about to be */
+        dh_keypool.started = 0;
+        pthread_mutex_unlock(&dh_keypool.lock);
+        pthread_join(dh_keypool.worker, NULL);
+        pthread_mutex_lock(&dh_keypool.lock);
+        if (dh_keypool.running) {
+            pthread_mutex_unlock(&dh_keypool.lock);
+            return SSH_OK;
+        }
+    }
+
+    dh_keypool.running = 1;
+    rc = pthread_create(&dh_keypool.worker, NULL, dh_keypool_worker, NULL);
+    if (rc != 0) {
+        dh_keypool.running = 0;
+        pthread_mutex_unlock(&dh_keypool.lock);
+        ssh_set_error(SSH_FATAL, "can not start key pool thread");
+        return SSH_ERROR;
+    }
+    dh_keypool.started = 1;
+    pthread_mutex_unlock(&dh_keypool.lock);
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Stop the key pool thread and burn the keypairs not handed out.
+ */
+void ssh_dh_keypool_stop(void) {
+    pthread_mutex_lock(&dh_keypool.lock);
+    if (!dh_keypool.started) {
+        pthread_mutex_unlock(&dh_keypool.lock);
+        return;
+    }
+    dh_keypool.running = 0;
+    pthread_cond_broadcast(&dh_keypool.cond);
+    pthread_mutex_unlock(&dh_keypool.lock);
+
+    pthread_join(dh_keypool.worker, NULL);
+
+    pthread_mutex_lock(&dh_keypool.lock);
+    dh_keypool.started = 0;
+    while (dh_keypool.count > 0) {
+        dh_free_keypair(&dh_keypool.keys[--dh_keypool.count]);
+    }
+    pthread_mutex_unlock(&dh_keypool.lock);
+}
+
 static int dh_keypair_get_keys(struct dh_ctx *ctx, int peer, const_bignum *priv,
                                const_bignum *pub) {
     if (((peer != DH_CLIENT_KEYPAIR) && (peer != DH_SERVER_KEYPAIR)) ||
@@ -364,13 +576,20 @@ static int dh_compute_session_id(ssh_session session) {
 
     buf = ssh_buffer_new();
     if (buf == NULL) return SSH_ERROR;
+    /* holds the shared secret */
+    ssh_buffer_set_secure(buf);
 
     rc = ssh_buffer_pack(buf, "ss", session->client_id_str,
                          session->server_id_str);
     if (rc != SSH_OK) goto error;
 
-    server_hash = session->in_hashbuf;
-    client_hash = session->out_hashbuf;
+    if (session->server) {
+        server_hash = session->out_hashbuf;
+        client_hash = session->in_hashbuf;
+    } else {
+        server_hash = session->in_hashbuf;
+        client_hash = session->out_hashbuf;
+    }
 
     rc = ssh_buffer_pack(
         buf, "dPdPS", ssh_buffer_get_len(client_hash),
@@ -447,10 +666,17 @@ static int dh_gen_session_keys(ssh_session session) {
 
     IV_len = crypto->digest_len;
 
-    enckey_cli_to_srv_len = crypto->out_cipher->keysize / 8;
-    enckey_srv_to_cli_len = crypto->in_cipher->keysize / 8;
-    intkey_cli_to_srv_len = hmac_digest_len(crypto->out_hmac);
-    intkey_srv_to_cli_len = hmac_digest_len(crypto->in_hmac);
+    if (session->server) {
+        enckey_cli_to_srv_len = crypto->in_cipher->keysize / 8;
+        enckey_srv_to_cli_len = crypto->out_cipher->keysize / 8;
+        intkey_cli_to_srv_len = hmac_digest_len(crypto->in_hmac);
+        intkey_srv_to_cli_len = hmac_digest_len(crypto->out_hmac);
+    } else {
+        enckey_cli_to_srv_len = crypto->out_cipher->keysize / 8;
+        enckey_srv_to_cli_len = crypto->in_cipher->keysize / 8;
+        intkey_cli_to_srv_len = hmac_digest_len(crypto->out_hmac);
+        intkey_srv_to_cli_len = hmac_digest_len(crypto->in_hmac);
+    }
 
     IV_cli_to_srv = malloc(IV_len);
     IV_srv_to_cli = malloc(IV_len);
@@ -496,12 +722,21 @@ static int dh_gen_session_keys(ssh_session session) {
         goto error;
     }
 
-    crypto->encryptIV = IV_cli_to_srv;
-    crypto->decryptIV = IV_srv_to_cli;
-    crypto->encryptkey = enckey_cli_to_srv;
-    crypto->decryptkey = enckey_srv_to_cli;
-    crypto->encryptMAC = intkey_cli_to_srv;
-    crypto->decryptMAC = intkey_srv_to_cli;
+    if (session->server) {
+        crypto->encryptIV = IV_srv_to_cli;
+        crypto->decryptIV = IV_cli_to_srv;
+        crypto->encryptkey = enckey_srv_to_cli;
+        crypto->decryptkey = enckey_cli_to_srv;
+        crypto->encryptMAC = intkey_srv_to_cli;
+        crypto->decryptMAC = intkey_cli_to_srv;
+    } else {
+        crypto->encryptIV = IV_cli_to_srv;
+        crypto->decryptIV = IV_srv_to_cli;
+        crypto->encryptkey = enckey_cli_to_srv;
+        crypto->decryptkey = enckey_srv_to_cli;
+        crypto->encryptMAC = intkey_cli_to_srv;
+        crypto->decryptMAC = intkey_srv_to_cli;
+    }
 
     /* Initialize the encryption and decryption keys in next_crypto */
     rc = session->next_crypto->in_cipher->set_decrypt_key(
@@ -522,6 +757,26 @@ static int dh_gen_session_keys(ssh_session session) {
         return SSH_ERROR;
     }
 
+    /* MAC keys, hashed once for all the packets */
+    if (hmac_digest_len(crypto->in_hmac) > 0) {
+        crypto->in_hmac_ctx = hmac_init(crypto->decryptMAC,
+                                        hmac_digest_len(crypto->in_hmac),
+                                        crypto->in_hmac);
+        if (crypto->in_hmac_ctx == NULL) {
+            crypto->used = 0;
+            return SSH_ERROR;
+        }
+    }
+    if (hmac_digest_len(crypto->out_hmac) > 0) {
+        crypto->out_hmac_ctx = hmac_init(crypto->encryptMAC,
+                                         hmac_digest_len(crypto->out_hmac),
+                                         crypto->out_hmac);
+        if (crypto->out_hmac_ctx == NULL) {
+            crypto->used = 0;
+            return SSH_ERROR;
+        }
+    }
+
     return SSH_OK;
 
 error:
@@ -536,6 +791,33 @@ error:
     return SSH_ERROR;
 }
 
+/**
+ * @brief Set our keypair, a precomputed one if the key pool has one ready,
+ * otherwise it is generated here.
+ *
+ * @param ctx
+ * @param peer DH_CLIENT_KEYPAIR or DH_SERVER_KEYPAIR, depending on our role
+ * @return int
+ */
+static int dh_keypair_take(struct dh_ctx *ctx, int peer) {
+    bignum priv = NULL, pub = NULL;
+    int rc;
+
+    if (dh_keypool_take(&priv, &pub) != SSH_OK) {
+        return dh_keypair_gen_keys(ctx, peer);
+    }
+
+    rc = dh_keypair_set_keys(ctx, peer, priv, pub);
+    if (rc != SSH_OK) {
+        bignum_safe_free(priv);
+        bignum_safe_free(pub);
+        return rc;
+    }
+    LOG_DEBUG("using precomputed DH keypair");
+
+    return SSH_OK;
+}
+
 /**
  * @brief Send client DH initialization message.
  *  byte      SSH_MSG_KEXDH_INIT
@@ -551,7 +833,7 @@ static int dh_send_init(ssh_session session) {
     const_bignum pubkey;
     int rc;
 
-    rc = dh_keypair_gen_keys(crypto->dh_ctx, DH_CLIENT_KEYPAIR);
+    rc = dh_keypair_take(crypto->dh_ctx, DH_CLIENT_KEYPAIR);
     if (rc != SSH_OK) return rc;
 
     rc = dh_keypair_get_keys(crypto->dh_ctx, DH_CLIENT_KEYPAIR, NULL, &pubkey);
@@ -623,7 +905,98 @@ static int dh_receive_reply(ssh_session session) {
 }
 
 /**
- * @brief Wait for SSH_MSG_NEWKEYS from server and put newly generated session
+ * @brief Server role: wait for the client DH initialization message.
+ *
+ * @param session
+ * @return int
+ */
+static int dh_receive_init(ssh_session session) {
+    struct ssh_crypto_struct *crypto = session->next_crypto;
+    bignum client_pubkey = NULL;
+    uint8_t type;
+    int rc;
+
+    rc = ssh_packet_receive(session);
+    if (rc != SSH_OK) return rc;
+
+    ssh_buffer_get_u8(session->in_buffer, &type);
+    if (type != SSH_MSG_KEXDH_INIT) return SSH_ERROR;
+
+    rc = ssh_buffer_unpack(session->in_buffer, "B", &client_pubkey);
+    if (rc != SSH_OK) return rc;
+
+    rc = dh_keypair_set_keys(crypto->dh_ctx, DH_CLIENT_KEYPAIR, NULL,
+                             client_pubkey);
+    if (rc != SSH_OK) {
+        bignum_safe_free(client_pubkey);
+        return rc;
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Server role: compute the session keys and answer the client.
+ *  byte      SSH_MSG_KEXDH_REPLY
+ *  string    server public host key (K_S)
+ *  mpint     f
+ *  string    signature of H
+ *
+ * @see RFC 4253 section 8
+ * @param session
+ * @return int
+ */
+static int dh_send_reply(ssh_session session) {
+    struct ssh_crypto_struct *crypto = session->next_crypto;
+    const_bignum pubkey;
+    int rc;
+
+    if (session->hostkey == NULL) {
+        ssh_set_error(SSH_FATAL, "no host key");
+        return SSH_ERROR;
+    }
+
+    rc = dh_keypair_take(crypto->dh_ctx, DH_SERVER_KEYPAIR);
+    if (rc != SSH_OK) return rc;
+
+    rc = dh_keypair_get_keys(crypto->dh_ctx, DH_SERVER_KEYPAIR, NULL, &pubkey);
+    if (rc != SSH_OK) return rc;
+
+    rc = dh_compute_shared_secret(crypto->dh_ctx, DH_SERVER_KEYPAIR,
+                                  DH_CLIENT_KEYPAIR, &crypto->shared_secret);
+    if (rc != SSH_OK) return rc;
+
+    crypto->server_pubkey_blob = ssh_pki_export_pubkey_blob(session->hostkey);
+    if (crypto->server_pubkey_blob == NULL) return SSH_ERROR;
+
+    rc = dh_compute_session_id(session);
+    if (rc != SSH_OK) return rc;
+
+    crypto->dh_server_signature = ssh_pki_do_sign(
+        session->hostkey, crypto->secret_hash, crypto->digest_len);
+    if (crypto->dh_server_signature == NULL) return SSH_ERROR;
+
+    rc = ssh_buffer_pack(session->out_buffer, "bSBS", SSH_MSG_KEXDH_REPLY,
+                         crypto->server_pubkey_blob, pubkey,
+                         crypto->dh_server_signature);
+    rc |= ssh_packet_send(session);
+    if (rc != SSH_OK) return rc;
+
+    rc = ssh_crypto_set_algo(session);
+    if (rc != SSH_OK) return rc;
+
+    rc = dh_gen_session_keys(session);
+    if (rc != SSH_OK) return rc;
+
+    rc = ssh_buffer_add_u8(session->out_buffer, SSH_MSG_NEWKEYS);
+    rc |= ssh_packet_send(session);
+    if (rc != SSH_OK) return rc;
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Wait for SSH_MSG_NEWKEYS from the peer and put newly generated session
  * keys into use.
  * @see RFC 4253 section 8
  * @param session
@@ -643,14 +1016,18 @@ static int dh_set_new_keys(ssh_session session) {
     /* NEWKEYS received, now its time to activate encryption */
     // LAB: insert your code here.
     // Activate encryption. Change the current crypto struct to next_crypto.
-    SAFE_FREE(session->current_crypto);
+    crypto_free(session->current_crypto);
     session->current_crypto = crypto;
     LOG_DEBUG("Encryption activated, current_crypto = %p", session->current_crypto);
     session->current_crypto->used = SSH_DIRECTION_BOTH;
-    
-    /* next_crypto should be deprecated from now if re-kex is not supportes */
+
+    /* a re-key creates its own next_crypto, see `ssh_rekey` */
     session->next_crypto = NULL;
-    
+
+    /* restart the re-key thresholds for the new keys */
+    session->kex_bytes = 0;
+    session->kex_time = time(NULL);
+
     return SSH_OK;
 }
 
@@ -667,6 +1044,20 @@ int ssh_dh_handshake(ssh_session session) {
     rc = dh_init(session);
     if (rc != SSH_OK) goto error;
 
+    if (session->server) {
+        /* receive KEXDH_INIT, send KEXDH_REPLY and NEWKEYS */
+        rc = dh_receive_init(session);
+        if (rc != SSH_OK) goto error;
+
+        rc = dh_send_reply(session);
+        if (rc != SSH_OK) goto error;
+
+        rc = dh_set_new_keys(session);
+        if (rc != SSH_OK) goto error;
+
+        return SSH_OK;
+    }
+
     /* send KEXDH_INIT */
     rc = dh_send_init(session);
     if (rc != SSH_OK) goto error;
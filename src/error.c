@@ -16,20 +16,23 @@
 #include <stdarg.h>
 #include <stdio.h>
 
-char err_msg[ERR_BUF_MAX];
+/* Each thread has its own error, so that sessions driven by different
+ * threads do not overwrite each other's */
+static __thread char err_msg[ERR_BUF_MAX];
 
-
-char* ssh_error_names[] = {"NO ERROR", "REQUEST DENIED", "FATAL", "INTERRUPT"};
+static const char *ssh_error_names[] = {"NO ERROR", "REQUEST DENIED", "FATAL",
+                                        "INTERRUPT"};
 
 void ssh_set_error(uint8_t code, char* format, ...) {
-    ZERO(err_msg, ERR_BUF_MAX);
+    va_list args;
+    int len;
 
-    strcpy(err_msg, ssh_error_names[code]);
-    strcat(err_msg, ": ");
+    len = snprintf(err_msg, ERR_BUF_MAX, "%s: ",
+                   code <= SSH_EINTR ? ssh_error_names[code] : "UNKNOWN");
+    if (len < 0 || len >= ERR_BUF_MAX) return;
 
-    va_list args;
     va_start(args, format);
-    vsprintf(&err_msg[strlen(err_msg)], format, args);
+    vsnprintf(&err_msg[len], ERR_BUF_MAX - len, format, args);
     va_end(args);
 }
 
@@ -39,4 +42,4 @@ char* ssh_get_error(void) {
 
 char* sftp_get_error(void) {
     return err_msg;
-}
\ No newline at end of file
+}
@@ -0,0 +1,333 @@
+/**
+ * @file gzip.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief SSH packet compression ("zlib" and "zlib@openssh.com").
+ * Each direction is one zlib stream that lives as long as the keys it was
+ * negotiated with, every packet is flushed with Z_PARTIAL_FLUSH.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "libsftp/gzip.h"
+
+#include <zlib.h>
+
+#include "libsftp/crypto.h"
+#include "libsftp/error.h"
+#include "libsftp/logger.h"
+#include "libsftp/session.h"
+
+/* Output room added at a time when a packet does not fit in what was
+ * estimated */
+#define BLOCKSIZE 16384
+
+/**
+ * Outgoing payloads that do not compress (already compressed or encrypted
+ * files) only cost CPU. After COMPRESS_PROBE_LEN bytes, if the stream saved
+ * less than COMPRESS_MIN_SAVING percent, the level drops to 0 (stored
+ * blocks, still a valid stream for the peer) for COMPRESS_SKIP_LEN bytes
+ * before the configured level is probed again.
+ */
+#define COMPRESS_PROBE_LEN (256 * 1024)
+#define COMPRESS_SKIP_LEN (16 * 1024 * 1024)
+#define COMPRESS_MIN_SAVING 10
+
+struct ssh_compress_struct {
+    z_stream stream;
+    int level;      /* level the stream runs with */
+    int want_level; /* level to switch to before the next packet */
+    uint64_t probe_in;  /* bytes fed in the current window */
+    uint64_t probe_out; /* bytes produced in the current window */
+    ssh_buffer scratch; /* output of the last packet, kept for the next */
+};
+
+static void freecompress(struct ssh_compress_struct *ctx, int deflating) {
+    if (deflating) {
+        deflateEnd(&ctx->stream);
+    } else {
+        inflateEnd(&ctx->stream);
+    }
+    ssh_buffer_free(ctx->scratch);
+    SAFE_FREE(ctx);
+}
+
+static struct ssh_compress_struct *initcompress(int level) {
+    struct ssh_compress_struct *ctx;
+    int rc;
+
+    ctx = calloc(1, sizeof(struct ssh_compress_struct));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    rc = deflateInit(&ctx->stream, level);
+    if (rc != Z_OK) {
+        SAFE_FREE(ctx);
+        ssh_set_error(SSH_FATAL, "status %d initialising zlib deflate", rc);
+        return NULL;
+    }
+    ctx->level = level;
+    ctx->want_level = level;
+
+    ctx->scratch = ssh_buffer_new();
+    if (ctx->scratch == NULL) {
+        freecompress(ctx, 1);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static struct ssh_compress_struct *initdecompress(void) {
+    struct ssh_compress_struct *ctx;
+    int rc;
+
+    ctx = calloc(1, sizeof(struct ssh_compress_struct));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    rc = inflateInit(&ctx->stream);
+    if (rc != Z_OK) {
+        SAFE_FREE(ctx);
+        ssh_set_error(SSH_FATAL, "status %d initialising zlib inflate", rc);
+        return NULL;
+    }
+
+    ctx->scratch = ssh_buffer_new();
+    if (ctx->scratch == NULL) {
+        freecompress(ctx, 0);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+/**
+ * @brief Pick the level for the next packets from the ratio observed on the
+ * last window, see COMPRESS_PROBE_LEN.
+ *
+ * @param ctx
+ * @param level configured compression level
+ */
+static void compress_adapt(struct ssh_compress_struct *ctx, int level) {
+    if (ctx->level != 0) {
+        if (ctx->probe_in < COMPRESS_PROBE_LEN) return;
+        if (ctx->probe_out * 100 >
+            ctx->probe_in * (100 - COMPRESS_MIN_SAVING)) {
+            LOG_INFO("compression ratio %lu/%lu is poor, pausing compression",
+                     ctx->probe_out, ctx->probe_in);
+            ctx->want_level = 0;
+        }
+    } else {
+        if (ctx->probe_in < COMPRESS_SKIP_LEN) return;
+        LOG_INFO("probing compression level %d again", level);
+        ctx->want_level = level;
+    }
+    ctx->probe_in = 0;
+    ctx->probe_out = 0;
+}
+
+/**
+ * @brief Give the stream `len` more bytes of output room at the end of
+ * `dest`, to be trimmed with `ssh_buffer_pass_bytes_end(dest, avail_out)`.
+ *
+ * @return SSH_OK, SSH_ERROR on error.
+ */
+static int gzip_out_room(z_stream *stream, ssh_buffer dest, uint32_t len) {
+    uint8_t *out = ssh_buffer_allocate(dest, len);
+
+    if (out == NULL) return SSH_ERROR;
+    stream->next_out = out;
+    stream->avail_out = len;
+    return SSH_OK;
+}
+
+/**
+ * @brief Deflate `source` into the scratch buffer of the stream. The room is
+ * estimated with deflateBound(), so the scratch buffer reaches its size on
+ * the first large packets and is not reallocated afterwards.
+ *
+ * @return the scratch buffer, NULL on error.
+ */
+static ssh_buffer gzip_compress(ssh_session session, ssh_buffer source) {
+    struct ssh_crypto_struct *crypto = session->current_crypto;
+    struct ssh_compress_struct *ctx = crypto->compress_out_ctx;
+    void *in_ptr = ssh_buffer_get(source);
+    uint32_t in_size = ssh_buffer_get_len(source);
+    ssh_buffer dest;
+    z_stream *zout;
+    uint32_t room;
+    int status;
+
+    if (ctx == NULL) {
+        ctx = initcompress(session->opts.compressionlevel);
+        if (ctx == NULL) {
+            return NULL;
+        }
+        crypto->compress_out_ctx = ctx;
+    }
+    zout = &ctx->stream;
+    dest = ctx->scratch;
+    if (ssh_buffer_reinit(dest) < 0) return NULL;
+
+    if (ctx->want_level != ctx->level) {
+        /* may flush what was buffered with the former level */
+        if (gzip_out_room(zout, dest, BLOCKSIZE) != SSH_OK) return NULL;
+        status = deflateParams(zout, ctx->want_level, Z_DEFAULT_STRATEGY);
+        ssh_buffer_pass_bytes_end(dest, zout->avail_out);
+        if (status != Z_OK) {
+            ssh_set_error(SSH_FATAL, "status %d changing zlib level", status);
+            return NULL;
+        }
+        ctx->level = ctx->want_level;
+    }
+
+    zout->next_in = in_ptr;
+    zout->avail_in = in_size;
+    /* the bound is for Z_FINISH, a partial flush adds an empty block */
+    room = deflateBound(zout, in_size) + 16;
+    do {
+        if (gzip_out_room(zout, dest, room) != SSH_OK) return NULL;
+        status = deflate(zout, Z_PARTIAL_FLUSH);
+        ssh_buffer_pass_bytes_end(dest, zout->avail_out);
+        if (status != Z_OK) {
+            ssh_set_error(SSH_FATAL, "status %d deflating zlib packet", status);
+            return NULL;
+        }
+        room = BLOCKSIZE;
+    } while (zout->avail_out == 0);
+
+    ctx->probe_in += in_size;
+    ctx->probe_out += ssh_buffer_get_len(dest);
+    compress_adapt(ctx, session->opts.compressionlevel);
+
+    return dest;
+}
+
+/**
+ * @brief Compress the payload of an outgoing packet in place.
+ *
+ * @param session
+ * @param buf
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+int compress_buffer(ssh_session session, ssh_buffer buf) {
+    ssh_buffer dest = NULL;
+
+    dest = gzip_compress(session, buf);
+    if (dest == NULL) {
+        return SSH_ERROR;
+    }
+
+    if (ssh_buffer_reinit(buf) < 0) {
+        return SSH_ERROR;
+    }
+
+    if (ssh_buffer_add_data(buf, ssh_buffer_get(dest),
+                            ssh_buffer_get_len(dest)) < 0) {
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Inflate `source` into the scratch buffer of the stream, which keeps
+ * the size of the largest packet.
+ *
+ * @return the scratch buffer, NULL on error.
+ */
+static ssh_buffer gzip_decompress(ssh_session session, ssh_buffer source,
+                                  size_t maxlen) {
+    struct ssh_crypto_struct *crypto = session->current_crypto;
+    struct ssh_compress_struct *ctx = crypto->compress_in_ctx;
+    void *in_ptr = ssh_buffer_get(source);
+    uint32_t in_size = ssh_buffer_get_len(source);
+    ssh_buffer dest;
+    z_stream *zin;
+    int status;
+
+    if (ctx == NULL) {
+        ctx = initdecompress();
+        if (ctx == NULL) {
+            return NULL;
+        }
+        crypto->compress_in_ctx = ctx;
+    }
+    zin = &ctx->stream;
+    dest = ctx->scratch;
+    if (ssh_buffer_reinit(dest) < 0) return NULL;
+
+    zin->next_in = in_ptr;
+    zin->avail_in = in_size;
+
+    do {
+        if (gzip_out_room(zin, dest, BLOCKSIZE) != SSH_OK) return NULL;
+        status = inflate(zin, Z_PARTIAL_FLUSH);
+        ssh_buffer_pass_bytes_end(dest, zin->avail_out);
+        if (status != Z_OK && status != Z_BUF_ERROR) {
+            ssh_set_error(SSH_FATAL, "status %d inflating zlib packet",
+                          status);
+            return NULL;
+        }
+        if (ssh_buffer_get_len(dest) > maxlen) {
+            /* Size of packet exceeded, avoid a denial of service attack */
+            return NULL;
+        }
+    } while (zin->avail_out == 0);
+
+    return dest;
+}
+
+/**
+ * @brief Decompress the payload of an incoming packet in place.
+ *
+ * @param session
+ * @param buf
+ * @param maxlen maximum size of the decompressed payload
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+int decompress_buffer(ssh_session session, ssh_buffer buf, size_t maxlen) {
+    ssh_buffer dest = NULL;
+
+    dest = gzip_decompress(session, buf, maxlen);
+    if (dest == NULL) {
+        return SSH_ERROR;
+    }
+
+    if (ssh_buffer_reinit(buf) < 0) {
+        return SSH_ERROR;
+    }
+
+    if (ssh_buffer_add_data(buf, ssh_buffer_get(dest),
+                            ssh_buffer_get_len(dest)) < 0) {
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Release the zlib streams of a crypto struct.
+ *
+ * @param crypto
+ */
+void compress_cleanup(struct ssh_crypto_struct *crypto) {
+    struct ssh_compress_struct *ctx;
+
+    ctx = crypto->compress_out_ctx;
+    if (ctx != NULL) {
+        freecompress(ctx, 1);
+        crypto->compress_out_ctx = NULL;
+    }
+
+    ctx = crypto->compress_in_ctx;
+    if (ctx != NULL) {
+        freecompress(ctx, 0);
+        crypto->compress_in_ctx = NULL;
+    }
+}
@@ -11,15 +11,19 @@
 
 #include "libsftp/kex.h"
 
+#include "libsftp/dh.h"
 #include "libsftp/error.h"
 #include "libsftp/libcrypto.h"
 #include "libsftp/libssh.h"
 #include "libsftp/logger.h"
 #include "libsftp/packet.h"
 #include "libsftp/session.h"
+#include "libsftp/util.h"
 
 /**
- * We only support one specific cipher suite,
+ * We only support one specific cipher suite, plus optional compression, see
+ * `ssh_set_client_kex`. The MAC is preferably encrypt-then-MAC, checked
+ * before the packet is decrypted.
  *
  */
 const char *supported_methods[] = {
@@ -27,16 +31,36 @@ const char *supported_methods[] = {
     "ssh-rsa",                       /* public key algorithm */
     "aes256-ctr",                    /* cipher algorithm client to server */
     "aes256-ctr",                    /* cipher algorithm server to client */
-    "hmac-sha1",                     /* MAC algorithm client to server */
-    "hmac-sha1",                     /* MAC algorithm server to client */
-    "none", /* compression algorithm client to server */
+    "hmac-sha1-etm@openssh.com,hmac-sha1", /* MAC client to server */
+    "hmac-sha1-etm@openssh.com,hmac-sha1", /* MAC server to client */
     "none", /* compression algorithm client to server */
+    "none", /* compression algorithm server to client */
     "",     /* languages client to server */
     ""};    /* languages server to client */
 
+/* compression methods offered with SSH_OPTIONS_COMPRESSION */
+#define COMPRESSION_METHODS "zlib@openssh.com,zlib,none"
+
+/**
+ * @brief Our own KEXINIT, `server_kex` when the session runs in server role.
+ */
+static struct ssh_kex_struct *kex_local(ssh_session session) {
+    return session->server ? &session->next_crypto->server_kex
+                           : &session->next_crypto->client_kex;
+}
+
+/**
+ * @brief The KEXINIT received from the peer.
+ */
+static struct ssh_kex_struct *kex_peer(ssh_session session) {
+    return session->server ? &session->next_crypto->client_kex
+                           : &session->next_crypto->server_kex;
+}
+
 static int hashbufout_add_cookie(ssh_session session) {
     int rc;
 
+    ssh_buffer_free(session->out_hashbuf);
     session->out_hashbuf = ssh_buffer_new();
     if (session->out_hashbuf == NULL) {
         return SSH_ERROR;
@@ -53,8 +77,8 @@ static int hashbufout_add_cookie(ssh_session session) {
         return SSH_ERROR;
     }
 
-    if (ssh_buffer_add_data(session->out_hashbuf,
-                            session->next_crypto->client_kex.cookie, 16) < 0) {
+    if (ssh_buffer_add_data(session->out_hashbuf, kex_local(session)->cookie,
+                            16) < 0) {
         ssh_buffer_reinit(session->out_hashbuf);
         return SSH_ERROR;
     }
@@ -65,6 +89,7 @@ static int hashbufout_add_cookie(ssh_session session) {
 static int hashbufin_add_cookie(ssh_session session, unsigned char *cookie) {
     int rc;
 
+    ssh_buffer_free(session->in_hashbuf);
     session->in_hashbuf = ssh_buffer_new();
     if (session->in_hashbuf == NULL) {
         return SSH_ERROR;
@@ -89,8 +114,15 @@ static int hashbufin_add_cookie(ssh_session session, unsigned char *cookie) {
     return SSH_OK;
 }
 
+/**
+ * @brief Fill our KEXINIT with the supported methods and a fresh cookie.
+ * Despite the name it fills `server_kex` in server role.
+ *
+ * @param session
+ * @return int
+ */
 int ssh_set_client_kex(ssh_session session) {
-    struct ssh_kex_struct *client = &session->next_crypto->client_kex;
+    struct ssh_kex_struct *client = kex_local(session);
     int rc;
 
     rc = ssh_get_random(client->cookie, 16, 0);
@@ -102,7 +134,13 @@ int ssh_set_client_kex(ssh_session session) {
     memset(client->methods, 0, SSH_KEX_METHODS * sizeof(char **));
 
     for (int i = 0; i < SSH_KEX_METHODS; i++) {
-        client->methods[i] = strdup(supported_methods[i]);
+        if ((i == SSH_COMP_C_S || i == SSH_COMP_S_C) &&
+            session->opts.compression) {
+            client->methods[i] = strdup(COMPRESSION_METHODS);
+        } else {
+            client->methods[i] = strdup(supported_methods[i]);
+        }
+        if (client->methods[i] == NULL) return SSH_ERROR;
     }
     return SSH_OK;
 }
@@ -114,7 +152,7 @@ int ssh_set_client_kex(ssh_session session) {
  * @return int 
  */
 int ssh_send_kex(ssh_session session) {
-    struct ssh_kex_struct *kex = &session->next_crypto->client_kex;
+    struct ssh_kex_struct *kex = kex_local(session);
     ssh_string str = NULL;
     int rc;
 
@@ -151,13 +189,14 @@ error:
 }
 
 /**
- * @brief Wait for algorithm negotiation reply.
- * 
- * @param session 
- * @return int 
+ * @brief Parse the peer SSH_MSG_KEXINIT in `in_buffer`, message type
+ * excluded.
+ *
+ * @param session
+ * @return int
  */
-int ssh_receive_kex(ssh_session session) {
-    uint8_t msg_type = 0;
+static int kex_parse_kexinit(ssh_session session) {
+    struct ssh_kex_struct *peer = kex_peer(session);
     ssh_string str = NULL;
     char *strings[SSH_KEX_METHODS] = {0};
     int rc = SSH_ERROR;
@@ -165,21 +204,10 @@ int ssh_receive_kex(ssh_session session) {
     uint32_t reserved;
     size_t len;
 
-    rc = ssh_packet_receive(session);
-    if (rc != SSH_OK) goto error;
-
-    ssh_buffer_get_u8(session->in_buffer, &msg_type); // Get msg type.
-    if (msg_type != SSH_MSG_KEXINIT) {
-        LOG_ERROR("wrong msg type: received %d expected %d", msg_type,
-                  SSH_MSG_KEXINIT);
-        goto error;
-    }
-
-    len = ssh_buffer_get_data(session->in_buffer,
-                              session->next_crypto->server_kex.cookie, 16); // Get cookie.
+    len = ssh_buffer_get_data(session->in_buffer, peer->cookie, 16); // Get cookie.
     if (len != 16) goto error;
 
-    rc = hashbufin_add_cookie(session, session->next_crypto->server_kex.cookie);
+    rc = hashbufin_add_cookie(session, peer->cookie);
     if (rc != SSH_OK) goto error;
 
     // Get name-lists.
@@ -216,9 +244,9 @@ int ssh_receive_kex(ssh_session session) {
         ssh_packet_receive(session);
     }
 
-    /* copy the server kex info into the array of strings */
+    /* copy the peer kex info into the array of strings */
     for (int i = 0; i < SSH_KEX_METHODS; i++) {
-        session->next_crypto->server_kex.methods[i] = strings[i];
+        peer->methods[i] = strings[i];
     }
 
     return SSH_OK;
@@ -226,12 +254,62 @@ int ssh_receive_kex(ssh_session session) {
 error:
     ssh_string_free(str);
     for (int i = 0; i < SSH_KEX_METHODS; i++) {
-        session->next_crypto->server_kex.methods[i] = NULL;
+        peer->methods[i] = NULL;
         SAFE_FREE(strings[i]);
     }
     return SSH_ERROR;
 }
 
+/**
+ * @brief Wait for algorithm negotiation reply.
+ * 
+ * @param session 
+ * @return int 
+ */
+int ssh_receive_kex(ssh_session session) {
+    uint8_t msg_type = 0;
+    int rc;
+
+    rc = ssh_packet_receive(session);
+    if (rc != SSH_OK) return SSH_ERROR;
+
+    ssh_buffer_get_u8(session->in_buffer, &msg_type); // Get msg type.
+    if (msg_type != SSH_MSG_KEXINIT) {
+        LOG_ERROR("wrong msg type: received %d expected %d", msg_type,
+                  SSH_MSG_KEXINIT);
+        return SSH_ERROR;
+    }
+
+    return kex_parse_kexinit(session);
+}
+
+/**
+ * @brief Find the first algorithm of `client` name-list that is also in
+ * `server` name-list.
+ * @see RFC 4253 section 7.1
+ *
+ * @param client
+ * @param server
+ * @return char* allocated algorithm name, NULL if there is none in common.
+ */
+static char *kex_match(const char *client, const char *server) {
+    const char *c, *s;
+    size_t clen, slen;
+
+    for (c = client; *c != '\0'; c += clen + (c[clen] == ',')) {
+        clen = strcspn(c, ",");
+        if (clen == 0) continue;
+        for (s = server; *s != '\0'; s += slen + (s[slen] == ',')) {
+            slen = strcspn(s, ",");
+            if (slen == clen && strncmp(c, s, clen) == 0) {
+                return strndup(c, clen);
+            }
+        }
+    }
+
+    return NULL;
+}
+
 /**
  * @brief Select an agreed cipher suite based on both ends' negotiation messages.
  * 
@@ -245,15 +323,16 @@ int ssh_select_kex(ssh_session session) {
     for (int i = 0; i < SSH_KEX_METHODS; ++i) {
         /* select negotiated algorithms and store them in `next_crypto->kex_methods` */
         // LAB: insert your code here.
-        if(strstr(server->methods[i], client->methods[i]) != NULL){
-            session->next_crypto->kex_methods[i] = strdup(client->methods[i]);
+        session->next_crypto->kex_methods[i] =
+            kex_match(client->methods[i], server->methods[i]);
+        if (session->next_crypto->kex_methods[i] != NULL) {
             LOG_INFO("Select kex method %d: %s", i+1, session->next_crypto->kex_methods[i]);
-        }
-        else{
-            session->next_crypto->kex_methods[i] = NULL;
+        } else if (i < SSH_LANG_C_S) {
+            /* languages may be empty on both sides */
             LOG_ERROR("No common kex method");
             LOG_ERROR("Server kex method %d: %s", i+1, server->methods[i]);
             LOG_ERROR("Client kex method %d: %s", i+1, client->methods[i]);
+            goto error;
         }
     }
     session->next_crypto->kex_type = SSH_KEX_DH_GROUP14_SHA256;
@@ -264,4 +343,94 @@ error:
         SAFE_FREE(session->next_crypto->kex_methods[i]);
     }
     return SSH_ERROR;
+}
+
+/**
+ * @brief Exchange new session keys on an established connection.
+ * @see RFC 4253 section 9
+ *
+ * Non-kex packets the peer sends before its SSH_MSG_KEXINIT are queued in
+ * `in_pending` by `ssh_packet_receive` and handed to the upper layer once
+ * the new keys are in use, so a transfer is not interrupted.
+ *
+ * @param session
+ * @param peer_init 1 if the peer SSH_MSG_KEXINIT (message type excluded)
+ *                  is already in `in_buffer`, 0 if we start the re-key.
+ * @return int
+ */
+int ssh_rekey(ssh_session session, int peer_init) {
+    struct ssh_crypto_struct *current = session->current_crypto;
+    ssh_buffer saved = session->out_buffer;
+    uint64_t start = ssh_time_ns();
+    uint64_t end;
+    int rc = SSH_ERROR;
+
+    if (current == NULL || session->kex_running) return SSH_ERROR;
+
+    LOG_NOTICE("%s re-key", peer_init ? "peer initiated" : "starting");
+
+    session->next_crypto = crypto_new();
+    if (session->next_crypto == NULL) return SSH_ERROR;
+
+    /* the session identifier stays the one of the first key exchange */
+    session->next_crypto->session_id_len = current->session_id_len;
+    session->next_crypto->session_id = malloc(current->session_id_len);
+    if (session->next_crypto->session_id == NULL) goto error;
+    memcpy(session->next_crypto->session_id, current->session_id,
+           current->session_id_len);
+
+    /* keep a packet the caller may be building out of the key exchange */
+    session->out_buffer = ssh_buffer_new();
+    if (session->out_buffer == NULL ||
+        ssh_buffer_reserve(session->out_buffer, SSH_PACKET_HEADROOM,
+                           SSH_PACKET_TAILROOM) < 0) {
+        goto error;
+    }
+
+    session->kex_running = 1;
+
+    if (peer_init) {
+        rc = kex_parse_kexinit(session);
+        if (rc != SSH_OK) goto error;
+    }
+
+    rc = ssh_set_client_kex(session);
+    if (rc != SSH_OK) goto error;
+
+    rc = ssh_send_kex(session);
+    if (rc != SSH_OK) goto error;
+
+    if (!peer_init) {
+        rc = ssh_receive_kex(session);
+        if (rc != SSH_OK) goto error;
+    }
+
+    rc = ssh_select_kex(session);
+    if (rc != SSH_OK) goto error;
+
+    rc = ssh_dh_handshake(session);
+    if (rc != SSH_OK) goto error;
+
+    session->kex_running = 0;
+    ssh_buffer_free(session->out_buffer);
+    session->out_buffer = saved;
+
+    end = ssh_time_ns();
+    session->stats.rekeys++;
+    session->stats.rekey_ns += end - start;
+    ssh_trace_record(session->trace, SSH_TRACE_REKEY, 0, 0, 0, peer_init,
+                     start, end);
+    LOG_NOTICE("re-key succeed");
+    return SSH_OK;
+
+error:
+    session->kex_running = 0;
+    if (session->out_buffer != saved) {
+        ssh_buffer_free(session->out_buffer);
+        session->out_buffer = saved;
+    }
+    crypto_free(session->next_crypto);
+    session->next_crypto = NULL;
+    ssh_set_error(SSH_FATAL, "re-key failed");
+    return SSH_ERROR;
 }
\ No newline at end of file
@@ -337,6 +337,45 @@ void hmac_final(HMACCTX ctx, unsigned char *hashmacbuf, unsigned int *len) {
 #endif
 }
 
+/**
+ * @brief MAC of packet `seq`: HMAC(key, seq || data), with `ctx` from
+ * hmac_init(). The keyed state is kept, so `ctx` is not freed and is used
+ * again for the next packet without hashing the key again.
+ *
+ * @param ctx
+ * @param seq
+ * @param data
+ * @param len
+ * @param[out] mac
+ * @param[out] maclen
+ * @return SSH_OK, SSH_ERROR on error.
+ */
+int hmac_packet(HMACCTX ctx, uint32_t seq, const void *data, size_t len,
+                unsigned char *mac, unsigned int *maclen) {
+    seq = htonl(seq);
+
+    if (HMAC_Init_ex(ctx, NULL, 0, NULL, NULL) != 1 ||
+        HMAC_Update(ctx, (const unsigned char *)&seq, sizeof(uint32_t)) != 1 ||
+        HMAC_Update(ctx, data, len) != 1 || HMAC_Final(ctx, mac, maclen) != 1) {
+        return SSH_ERROR;
+    }
+    return SSH_OK;
+}
+
+void hmac_free(HMACCTX ctx) {
+    HMAC_CTX_free(ctx);
+}
+
+/**
+ * @brief Compare two MACs in a time that does not depend on where they
+ * differ.
+ *
+ * @return 0 if equal.
+ */
+int secure_memcmp(const void *s1, const void *s2, size_t n) {
+    return CRYPTO_memcmp(s1, s2, n);
+}
+
 static void evp_cipher_init(struct ssh_cipher_struct *cipher) {
     if (cipher->ctx == NULL) {
         cipher->ctx = EVP_CIPHER_CTX_new();
@@ -373,6 +412,104 @@ static void evp_cipher_init(struct ssh_cipher_struct *cipher) {
     }
 }
 
+bool ssh_cipher_is_ctr(struct ssh_cipher_struct *cipher) {
+    if (cipher == NULL) return false;
+
+    switch (cipher->ciphertype) {
+        case SSH_AES128_CTR:
+        case SSH_AES192_CTR:
+        case SSH_AES256_CTR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Counter block `block` blocks after `IV`, a big endian integer.
+ *
+ * @param IV
+ * @param block
+ * @param out
+ */
+static void ctr_iv_add(const uint8_t *IV, uint64_t block, uint8_t *out) {
+    unsigned int sum, carry = 0;
+    int i;
+
+    for (i = AES_BLOCK_SIZE - 1; i >= 0; i--) {
+        sum = IV[i] + (unsigned int)(block & 0xff) + carry;
+        out[i] = sum & 0xff;
+        carry = sum >> 8;
+        block >>= 8;
+    }
+}
+
+static void evp_cipher_ctr_reset(struct ssh_cipher_struct *cipher, void *IV) {
+    cipher->ctr_blocks = 0;
+    cipher->ctr_seek = false;
+    if (ssh_cipher_is_ctr(cipher)) {
+        memcpy(cipher->ctr_iv, IV, AES_BLOCK_SIZE);
+    }
+}
+
+/**
+ * @brief Move `ctx` to the block following the skipped ones.
+ *
+ * @param cipher
+ */
+static void evp_cipher_ctr_seek(struct ssh_cipher_struct *cipher) {
+    uint8_t iv[AES_BLOCK_SIZE];
+
+    ctr_iv_add(cipher->ctr_iv, cipher->ctr_blocks, iv);
+    if (EVP_CipherInit_ex(cipher->ctx, NULL, NULL, NULL, iv, -1) != 1) {
+        LOG_WARNING("EVP_CipherInit_ex failed");
+    }
+    cipher->ctr_seek = false;
+}
+
+/**
+ * @brief Reserve the next `blocks` blocks of the key stream for
+ * `ssh_cipher_ctr_crypt`, the cipher goes on after them.
+ *
+ * @param cipher
+ * @param blocks
+ */
+void ssh_cipher_ctr_skip(struct ssh_cipher_struct *cipher, uint64_t blocks) {
+    cipher->ctr_blocks += blocks;
+    cipher->ctr_seek = true;
+}
+
+/**
+ * @brief Encrypt or decrypt `data` in place with the key stream starting at
+ * block `block` of `cipher`, on a context of the calling thread. `cipher`
+ * is only read.
+ *
+ * @param cipher a CTR cipher whose key is set
+ * @param ctx
+ * @param key the key given to the cipher
+ * @param block
+ * @param data
+ * @param len
+ * @return SSH_OK or SSH_ERROR
+ */
+int ssh_cipher_ctr_crypt(struct ssh_cipher_struct *cipher, EVP_CIPHER_CTX *ctx,
+                         const void *key, uint64_t block, uint8_t *data,
+                         size_t len) {
+    uint8_t iv[AES_BLOCK_SIZE];
+    int outlen = 0;
+
+    ctr_iv_add(cipher->ctr_iv, block, iv);
+    if (EVP_EncryptInit_ex(ctx, cipher->cipher, NULL, key, iv) != 1) {
+        return SSH_ERROR;
+    }
+    if (EVP_EncryptUpdate(ctx, data, &outlen, data, (int)len) != 1 ||
+        outlen != (int)len) {
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
 static int evp_cipher_set_encrypt_key(struct ssh_cipher_struct *cipher,
                                       void *key, void *IV) {
     int rc;
@@ -385,6 +522,7 @@ static int evp_cipher_set_encrypt_key(struct ssh_cipher_struct *cipher,
         LOG_WARNING("EVP_EncryptInit_ex failed");
         return SSH_ERROR;
     }
+    evp_cipher_ctr_reset(cipher, IV);
 
 #ifdef HAVE_OPENSSL_EVP_AES_GCM
     /* For AES-GCM we need to set IV in specific way */
@@ -416,6 +554,7 @@ static int evp_cipher_set_decrypt_key(struct ssh_cipher_struct *cipher,
         LOG_WARNING("EVP_DecryptInit_ex failed");
         return SSH_ERROR;
     }
+    evp_cipher_ctr_reset(cipher, IV);
 
 #ifdef HAVE_OPENSSL_EVP_AES_GCM
     /* For AES-GCM we need to set IV in specific way */
@@ -441,6 +580,9 @@ static void evp_cipher_encrypt(struct ssh_cipher_struct *cipher, void *in,
     int outlen = 0;
     int rc = 0;
 
+    if (cipher->ctr_seek) evp_cipher_ctr_seek(cipher);
+    cipher->ctr_blocks += len / cipher->blocksize;
+
     rc = EVP_EncryptUpdate(cipher->ctx, (unsigned char *)out, &outlen,
                            (unsigned char *)in, (int)len);
     if (rc != 1) {
@@ -459,6 +601,9 @@ static void evp_cipher_decrypt(struct ssh_cipher_struct *cipher, void *in,
     int outlen = 0;
     int rc = 0;
 
+    if (cipher->ctr_seek) evp_cipher_ctr_seek(cipher);
+    cipher->ctr_blocks += len / cipher->blocksize;
+
     rc = EVP_DecryptUpdate(cipher->ctx, (unsigned char *)out, &outlen,
                            (unsigned char *)in, (int)len);
     if (rc != 1) {
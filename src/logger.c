@@ -0,0 +1,368 @@
+/**
+ * @file logger.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Log writer.
+ * The caller formats its message and queues it, a writer thread adds the
+ * time and the decorations and writes it to stderr. When the queue is full
+ * the message is dropped, except from ERROR up, which is written at once.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "libsftp/logger.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <strings.h>
+
+#include "libsftp/libssh.h"
+#include "libsftp/util.h"
+
+int ssh_log_level = LOG_LEVEL;
+
+struct log_entry {
+    struct timespec ts;
+    int level;
+    char *line; /* "func (file:line) - message" */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_mutex_t write_lock; /* held while writing, keeps the order */
+    struct log_entry entries[LOG_QUEUE_SIZE];
+    unsigned int head;  /* oldest entry */
+    unsigned int count;
+    uint64_t dropped;
+    int writer_started; /* 0: not yet, 1: running, -1: could not start */
+} log_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .write_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_once_t log_init_once = PTHREAD_ONCE_INIT;
+
+static const char *level_names[] = {"[DEBUG]",   "[INFO]",  "[NOTICE]",
+                                    "[WARNING]", "[ERROR]", "[CRITICAL]"};
+static const char *level_colours[] = {DEBUG_COLOUR,   INFO_COLOUR,
+                                      NOTICE_COLOUR,  WARNING_COLOUR,
+                                      ERROR_COLOUR,   CRITICAL_COLOUR};
+
+int ssh_set_log_level(int level) {
+    if (level < DEBUG || level > SILENT) return SSH_ERROR;
+
+    ssh_log_init();
+    ssh_log_level = level;
+    return SSH_OK;
+}
+
+/**
+ * @brief Parse a level name ("debug" to "silent") or number.
+ *
+ * @param level
+ * @return the level, -1 if invalid.
+ */
+int ssh_log_parse_level(const char *level) {
+    static const char *names[] = {"debug",   "info",     "notice", "warning",
+                                  "error",   "critical", "silent"};
+    char *end;
+    long n;
+    int i;
+
+    if (level == NULL || *level == '\0') return -1;
+
+    n = strtol(level, &end, 10);
+    if (*end == '\0') return n >= DEBUG && n <= SILENT ? (int)n : -1;
+
+    for (i = 0; i <= SILENT; i++) {
+        if (strcasecmp(level, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Write one entry in the format of the original emit_log. The caller
+ * holds `write_lock`.
+ *
+ * @param e
+ */
+static void log_write(const struct log_entry *e) {
+    char time_sec[80];
+    char line[1024];
+    struct tm tm;
+    time_t t = e->ts.tv_sec;
+    int len;
+
+    localtime_r(&t, &tm);
+    strftime(time_sec, sizeof(time_sec), TIME_FORMAT, &tm);
+
+    len = snprintf(line, sizeof(line), "%s%s:%ld %10s %s%s%s",
+                   DISPLAY_COLOUR ? level_colours[e->level] : "", time_sec,
+                   e->ts.tv_nsec / 1000, level_names[e->level], e->line,
+                   DISPLAY_ENDING ? MSG_ENDING : "",
+                   DISPLAY_RESET ? RESET_COLOUR : "");
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(line)) {
+        /* long message, write it in pieces */
+        fprintf(stderr, "%s%s:%ld %10s %s%s%s",
+                DISPLAY_COLOUR ? level_colours[e->level] : "", time_sec,
+                e->ts.tv_nsec / 1000, level_names[e->level], e->line,
+                DISPLAY_ENDING ? MSG_ENDING : "",
+                DISPLAY_RESET ? RESET_COLOUR : "");
+        fflush(stderr);
+        return;
+    }
+    if (write(STDERR_FILENO, line, len) < 0) {
+        /* nowhere to report it */
+    }
+}
+
+/**
+ * @brief Take every queued entry, oldest first. The caller holds `lock`.
+ *
+ * @param batch
+ * @return number of entries
+ */
+static unsigned int log_take(struct log_entry *batch) {
+    unsigned int n = log_queue.count;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        batch[i] = log_queue.entries[(log_queue.head + i) % LOG_QUEUE_SIZE];
+    }
+    log_queue.head = (log_queue.head + n) % LOG_QUEUE_SIZE;
+    log_queue.count = 0;
+    return n;
+}
+
+/**
+ * @brief Write a batch taken from the queue and free it, then report the
+ * messages dropped meanwhile. The caller holds `write_lock`.
+ *
+ * @param batch
+ * @param n
+ * @param dropped
+ */
+static void log_write_batch(struct log_entry *batch, unsigned int n,
+                            uint64_t dropped) {
+    struct log_entry note;
+    char text[128];
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        log_write(&batch[i]);
+        free(batch[i].line);
+    }
+
+    if (dropped > 0) {
+        snprintf(text, sizeof(text), "%s - %llu log messages dropped",
+                 __func__, (unsigned long long)dropped);
+        clock_gettime(CLOCK_REALTIME, &note.ts);
+        note.level = WARNING;
+        note.line = text;
+        log_write(&note);
+    }
+}
+
+static void *log_writer(void *arg) {
+    static struct log_entry batch[LOG_QUEUE_SIZE];
+    uint64_t dropped;
+    unsigned int n;
+
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&log_queue.lock);
+        while (log_queue.count == 0 && log_queue.dropped == 0) {
+            pthread_cond_wait(&log_queue.cond, &log_queue.lock);
+        }
+        pthread_mutex_unlock(&log_queue.lock);
+
+        /* write_lock first, log_flush() may have written them meanwhile */
+        pthread_mutex_lock(&log_queue.write_lock);
+        pthread_mutex_lock(&log_queue.lock);
+        n = log_take(batch);
+        dropped = log_queue.dropped;
+        log_queue.dropped = 0;
+        pthread_mutex_unlock(&log_queue.lock);
+
+        log_write_batch(batch, n, dropped);
+        pthread_mutex_unlock(&log_queue.write_lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Write what is still queued, at exit.
+ */
+static void log_flush(void) {
+    static struct log_entry batch[LOG_QUEUE_SIZE];
+    uint64_t dropped;
+    unsigned int n;
+
+    pthread_mutex_lock(&log_queue.write_lock);
+    pthread_mutex_lock(&log_queue.lock);
+    n = log_take(batch);
+    dropped = log_queue.dropped;
+    log_queue.dropped = 0;
+    pthread_mutex_unlock(&log_queue.lock);
+
+    log_write_batch(batch, n, dropped);
+    pthread_mutex_unlock(&log_queue.write_lock);
+}
+
+static void log_atfork_prepare(void) {
+    pthread_mutex_lock(&log_queue.write_lock);
+    pthread_mutex_lock(&log_queue.lock);
+}
+
+static void log_atfork_parent(void) {
+    pthread_mutex_unlock(&log_queue.lock);
+    pthread_mutex_unlock(&log_queue.write_lock);
+}
+
+/**
+ * @brief The writer thread is not copied by fork(), the child starts its
+ * own. The messages of the parent are left to the parent.
+ */
+static void log_atfork_child(void) {
+    while (log_queue.count > 0) {
+        free(log_queue.entries[log_queue.head].line);
+        log_queue.head = (log_queue.head + 1) % LOG_QUEUE_SIZE;
+        log_queue.count--;
+    }
+    log_queue.dropped = 0;
+    log_queue.writer_started = 0;
+
+    /* the parent's writer may have been waiting on the condition, whose
+     * state is not usable here */
+    pthread_mutex_init(&log_queue.lock, NULL);
+    pthread_mutex_init(&log_queue.write_lock, NULL);
+    pthread_cond_init(&log_queue.cond, NULL);
+}
+
+static void log_init(void) {
+    const char *env = getenv(LOG_LEVEL_ENV);
+    int level;
+
+    if (env != NULL) {
+        level = ssh_log_parse_level(env);
+        if (level >= 0) ssh_log_level = level;
+    }
+
+    pthread_atfork(log_atfork_prepare, log_atfork_parent, log_atfork_child);
+    atexit(log_flush);
+}
+
+/**
+ * @brief Read LIBSFTP_LOG_LEVEL and get ready to queue messages.
+ */
+void ssh_log_init(void) {
+    pthread_once(&log_init_once, log_init);
+}
+
+/**
+ * @brief Start the writer thread if it is not running. The caller holds
+ * `lock`.
+ *
+ * @return whether the thread is running
+ */
+static int log_writer_start(void) {
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (log_queue.writer_started != 0) return log_queue.writer_started > 0;
+
+    log_queue.writer_started = -1;
+    if (pthread_attr_init(&attr) != 0) return 0;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, log_writer, NULL) == 0) {
+        log_queue.writer_started = 1;
+    }
+    pthread_attr_destroy(&attr);
+
+    return log_queue.writer_started > 0;
+}
+
+/**
+ * @brief Format "func (file:line) - message" into a new string.
+ *
+ * @return the string, NULL on error.
+ */
+static char *log_format(const char *file, const char *func, int line,
+                        const char *format, va_list ap) {
+    char prefix[256];
+    char *text;
+    va_list copy;
+    int plen, mlen;
+
+    plen = snprintf(prefix, sizeof(prefix), "%s%s%s%s%s%.d%s%s%s",
+                    DISPLAY_FUNC ? func : "", DISPLAY_FUNC ? " " : "",
+                    DISPLAY_FUNC && (DISPLAY_FILE || DISPLAY_LINE) ? "(" : "",
+                    DISPLAY_FILE ? file : "",
+                    DISPLAY_FILE && DISPLAY_LINE ? ":" : "",
+                    DISPLAY_LINE ? line : 0,
+                    DISPLAY_FUNC && (DISPLAY_FILE || DISPLAY_LINE) ? ") " : "",
+                    DISPLAY_BORDER ? BORDER : "", DISPLAY_BORDER ? " " : "");
+    if (plen < 0) return NULL;
+    plen = MIN(plen, (int)sizeof(prefix) - 1);
+
+    va_copy(copy, ap);
+    mlen = DISPLAY_MESSAGE ? vsnprintf(NULL, 0, format, copy) : 0;
+    va_end(copy);
+    if (mlen < 0) return NULL;
+
+    text = malloc(plen + mlen + 1);
+    if (text == NULL) return NULL;
+    memcpy(text, prefix, plen);
+    text[plen] = '\0';
+    if (DISPLAY_MESSAGE) vsnprintf(text + plen, mlen + 1, format, ap);
+
+    return text;
+}
+
+void ssh_log_emit(int level, const char *file, const char *func, int line,
+                  const char *format, ...) {
+    struct log_entry e;
+    va_list ap;
+
+    if (level < DEBUG || level > CRITICAL) return;
+    ssh_log_init();
+
+    clock_gettime(CLOCK_REALTIME, &e.ts);
+    e.level = level;
+
+    va_start(ap, format);
+    e.line = log_format(file, func, line, format, ap);
+    va_end(ap);
+    if (e.line == NULL) return;
+
+    pthread_mutex_lock(&log_queue.lock);
+    if (log_queue.count < LOG_QUEUE_SIZE && log_writer_start()) {
+        log_queue.entries[(log_queue.head + log_queue.count) % LOG_QUEUE_SIZE] =
+            e;
+        log_queue.count++;
+        pthread_cond_signal(&log_queue.cond);
+        pthread_mutex_unlock(&log_queue.lock);
+        return;
+    }
+    if (level < ERROR && log_queue.writer_started > 0) {
+        log_queue.dropped++;
+        pthread_mutex_unlock(&log_queue.lock);
+        free(e.line);
+        return;
+    }
+    pthread_mutex_unlock(&log_queue.lock);
+
+    /* no writer, or an error that must not be lost: after the queue */
+    log_flush();
+    pthread_mutex_lock(&log_queue.write_lock);
+    log_write(&e);
+    pthread_mutex_unlock(&log_queue.write_lock);
+    free(e.line);
+}
@@ -0,0 +1,377 @@
+/**
+ * @file mux.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Connection sharing over a UNIX domain socket.
+ * A master process owns the SSH session and listens on a local socket. Every
+ * process attaching to the socket gets its own SFTP channel on the shared
+ * session, the master relays the raw SFTP stream between the two, so the
+ * attached processes skip the key exchange and user authentication.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "libsftp/channel.h"
+#include "libsftp/error.h"
+#include "libsftp/libsftp.h"
+#include "libsftp/logger.h"
+#include "libsftp/packet.h"
+#include "libsftp/session.h"
+#include "libsftp/socket.h"
+#include "libsftp/util.h"
+
+#define MUX_MAX_CLIENTS 64
+#define MUX_BUFFER_SIZE 32768
+
+struct mux_client {
+    int fd; /* -1 once the attached process went away */
+    ssh_channel channel;
+    struct mux_client *next;
+};
+
+static int mux_sockaddr(struct sockaddr_un *addr, const char *path) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        ssh_set_error(SSH_REQUEST_DENIED, "mux socket path too long: %s",
+                      path);
+        return SSH_ERROR;
+    }
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+
+    return SSH_OK;
+}
+
+static int mux_connect(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (mux_sockaddr(&addr, path) != SSH_OK) return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        ssh_set_error(SSH_FATAL, "can not create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ssh_set_error(SSH_FATAL, "can not connect to mux master %s: %s", path,
+                      strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Listen on `path`, only the owner may connect. A socket file left by
+ * a dead master is replaced, a live master is not.
+ *
+ * @param path
+ * @return listening fd, -1 on error.
+ */
+static int mux_listen(const char *path) {
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd;
+    int rc;
+
+    if (mux_sockaddr(&addr, path) != SSH_OK) return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        ssh_set_error(SSH_FATAL, "can not create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    mask = umask(0177);
+    rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (rc < 0 && errno == EADDRINUSE) {
+        rc = mux_connect(path);
+        if (rc >= 0) {
+            close(rc);
+            umask(mask);
+            close(fd);
+            ssh_set_error(SSH_REQUEST_DENIED,
+                          "a mux master is already listening on %s", path);
+            return -1;
+        }
+        unlink(path);
+        rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    umask(mask);
+
+    if (rc < 0 || listen(fd, MUX_MAX_CLIENTS) < 0) {
+        ssh_set_error(SSH_FATAL, "can not listen on %s: %s", path,
+                      strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Open an SFTP channel for a newly attached process.
+ *
+ * @param session
+ * @param fd
+ * @return struct mux_client*
+ */
+static struct mux_client *mux_client_new(ssh_session session, int fd) {
+    struct mux_client *client;
+
+    client = calloc(1, sizeof(struct mux_client));
+    if (client == NULL) {
+        close(fd);
+        return NULL;
+    }
+    client->fd = fd;
+
+    client->channel = ssh_channel_new(session);
+    if (client->channel == NULL) goto error;
+
+    if (ssh_channel_open_session(client->channel) != SSH_OK ||
+        ssh_channel_request_sftp(client->channel) != SSH_OK) {
+        goto error;
+    }
+
+    LOG_NOTICE("mux: client %d attached to channel #%u", fd,
+               client->channel->local_channel);
+    return client;
+
+error:
+    LOG_ERROR("mux: can not open a channel for client %d", fd);
+    if (client->channel != NULL) {
+        if (client->channel->state == SSH_CHANNEL_STATE_OPEN) {
+            ssh_channel_close(client->channel);
+        }
+        ssh_channel_free(client->channel);
+    }
+    close(fd);
+    SAFE_FREE(client);
+    return NULL;
+}
+
+/**
+ * @brief The attached process went away or its channel was closed by the
+ * server. The channel is freed once the server confirmed the close.
+ *
+ * @param client
+ */
+static void mux_client_detach(struct mux_client *client) {
+    if (client->fd >= 0) {
+        LOG_NOTICE("mux: client %d detached from channel #%u", client->fd,
+                   client->channel->local_channel);
+        close(client->fd);
+        client->fd = -1;
+    }
+    ssh_channel_send_close(client->channel);
+}
+
+/**
+ * @brief Hand the data received on the channel to the attached process.
+ *
+ * @param client
+ */
+static void mux_client_flush(struct mux_client *client) {
+    uint8_t buffer[MUX_BUFFER_SIZE];
+    uint32_t nwrite;
+    ssize_t n;
+    int nread;
+
+    while (client->fd >= 0) {
+        nread = ssh_channel_read_nonblocking(client->channel, buffer,
+                                             sizeof(buffer));
+        if (nread == 0) return;
+        if (nread < 0) {
+            mux_client_detach(client);
+            return;
+        }
+
+        for (nwrite = 0; nwrite < (uint32_t)nread; nwrite += n) {
+            n = send(client->fd, buffer + nwrite, nread - nwrite,
+                     MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            if (n < 0) {
+                mux_client_detach(client);
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Forward what the attached process wrote to its channel.
+ *
+ * @param client
+ */
+static void mux_client_forward(struct mux_client *client) {
+    uint8_t buffer[MUX_BUFFER_SIZE];
+    ssize_t n;
+
+    do {
+        n = read(client->fd, buffer, sizeof(buffer));
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0 || ssh_channel_write(client->channel, buffer, n) != n) {
+        mux_client_detach(client);
+    }
+}
+
+/**
+ * @brief Free the clients whose channel is closed on both sides.
+ *
+ * @param clients
+ */
+static void mux_client_reap(struct mux_client **clients) {
+    struct mux_client **pp = clients;
+    struct mux_client *client;
+
+    while (*pp != NULL) {
+        client = *pp;
+        if (client->channel->remote_close && client->fd >= 0 &&
+            ssh_buffer_get_len(client->channel->in_buffer) == 0) {
+            mux_client_detach(client);
+        }
+        if (client->fd < 0 && client->channel->remote_close) {
+            *pp = client->next;
+            ssh_channel_free(client->channel);
+            SAFE_FREE(client);
+        } else {
+            pp = &client->next;
+        }
+    }
+}
+
+int ssh_mux_master(ssh_session session, const char *path) {
+    struct pollfd pfds[MUX_MAX_CLIENTS + 2];
+    struct mux_client *clients = NULL;
+    struct mux_client *client;
+    unsigned int nclients;
+    int listen_fd;
+    int nfds;
+    int fd;
+    int rc;
+
+    if (session == NULL || path == NULL) {
+        ssh_set_error(SSH_REQUEST_DENIED, "invalid params");
+        return SSH_ERROR;
+    }
+
+    listen_fd = mux_listen(path);
+    if (listen_fd < 0) return SSH_ERROR;
+    LOG_NOTICE("mux: master listening on %s", path);
+
+    while (1) {
+        /* also picks up what was received while writing to a channel */
+        if (ssh_channel_handle_pending(session) != SSH_OK) {
+            LOG_ERROR("mux: connection to %s lost", session->opts.host);
+            break;
+        }
+
+        for (client = clients; client != NULL; client = client->next) {
+            mux_client_flush(client);
+        }
+        mux_client_reap(&clients);
+
+        /* pfds[0] is the session, pfds[1] the listening socket */
+        pfds[0].fd = session->socket->fd;
+        pfds[0].events = POLLIN;
+        pfds[0].revents = 0;
+        pfds[1].fd = listen_fd;
+        pfds[1].events = POLLIN;
+        pfds[1].revents = 0;
+        nfds = 2;
+        nclients = 0;
+        for (client = clients; client != NULL; client = client->next) {
+            nclients++;
+            if (client->fd < 0) continue;
+            pfds[nfds].fd = client->fd;
+            pfds[nfds].events = POLLIN;
+            pfds[nfds].revents = 0;
+            nfds++;
+        }
+        if (nclients >= MUX_MAX_CLIENTS) pfds[1].fd = -1;
+
+        /* data queued to the crypto workers before waiting */
+        if (ssh_packet_flush(session) != SSH_OK) {
+            LOG_ERROR("mux: connection to %s lost", session->opts.host);
+            break;
+        }
+
+        do {
+            rc = poll(pfds, nfds, -1);
+        } while (rc < 0 && errno == EINTR);
+        if (rc < 0) {
+            ssh_set_error(SSH_FATAL, "mux poll error: %s", strerror(errno));
+            break;
+        }
+
+        nfds = 2;
+        for (client = clients; client != NULL; client = client->next) {
+            if (client->fd < 0) continue;
+            if (pfds[nfds++].revents != 0) {
+                mux_client_forward(client);
+            }
+        }
+
+        if (pfds[1].revents != 0) {
+            fd = accept(listen_fd, NULL, NULL);
+            if (fd < 0) continue;
+            client = mux_client_new(session, fd);
+            if (client != NULL) {
+                client->next = clients;
+                clients = client;
+            }
+        }
+    }
+
+    while (clients != NULL) {
+        client = clients;
+        clients = client->next;
+        if (client->fd >= 0) close(client->fd);
+        ssh_channel_free(client->channel);
+        SAFE_FREE(client);
+    }
+    close(listen_fd);
+    unlink(path);
+
+    return SSH_ERROR;
+}
+
+sftp_session sftp_mux_attach(const char *path) {
+    sftp_session sftp;
+    int fd;
+
+    if (path == NULL) {
+        ssh_set_error(SSH_REQUEST_DENIED, "invalid params");
+        return NULL;
+    }
+
+    fd = mux_connect(path);
+    if (fd < 0) return NULL;
+
+    sftp = sftp_new_fd(fd);
+    if (sftp == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    return sftp;
+}
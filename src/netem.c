@@ -0,0 +1,474 @@
+/**
+ * @file netem.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Network emulation between the session and its socket.
+ * The session is handed one end of a socketpair, a relay thread moves the
+ * bytes between the other end and the real socket, holding each chunk back
+ * until the emulated link would have delivered it. Like a TCP connection the
+ * relay never drops or reorders data: a lost segment costs a retransmission
+ * timeout and holds back what follows it.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "libsftp/netem.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsftp/error.h"
+#include "libsftp/libssh.h"
+#include "libsftp/logger.h"
+#include "libsftp/util.h"
+
+/* Loss is drawn for every segment of this size */
+#define NETEM_SEGMENT 1448
+
+/* At most this much is taken from a source at once */
+#define NETEM_CHUNK 16384
+
+/* A lost segment is delivered after the minimum RTO of Linux TCP */
+#define NETEM_RTO_US 200000
+
+/* Bounds of the bytes queued in one direction, the source is not read while
+ * the queue is full so that the sender sees backpressure */
+#define NETEM_QUEUE_MIN (256 * 1024)
+#define NETEM_QUEUE_MAX (16 * 1024 * 1024)
+
+struct netem_chunk {
+    uint64_t due; /* delivery time in microseconds, monotonic */
+    uint32_t len;
+    uint32_t off; /* bytes already delivered */
+    struct netem_chunk *next;
+    uint8_t data[];
+};
+
+/* One direction of the emulated link */
+struct netem_pipe {
+    int src;
+    int dst;
+    int eof;            /* src reached end of file */
+    uint64_t link_free; /* the link is done sending what was queued */
+    uint64_t last_due;  /* chunks are delivered in order */
+    uint32_t queued;
+    struct netem_chunk *head;
+    struct netem_chunk *tail;
+};
+
+struct ssh_netem_struct {
+    struct ssh_netem_params params;
+    int net_fd;   /* the real socket */
+    int relay_fd; /* our end of the socketpair */
+    uint32_t queue_max;
+    unsigned int seed;
+    pthread_t thread;
+    struct netem_pipe up;   /* session to network */
+    struct netem_pipe down; /* network to session */
+};
+
+static uint64_t netem_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Parse a number followed by one of `units`.
+ *
+ * @param value
+ * @param units suffixes and their multipliers, NULL terminated
+ * @param scales
+ * @param out
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+static int netem_parse_value(const char *value, const char *const *units,
+                             const double *scales, double *out) {
+    char *end;
+    double x;
+    int i;
+
+    errno = 0;
+    x = strtod(value, &end);
+    if (errno != 0 || end == value || x < 0) return SSH_ERROR;
+
+    for (i = 0; units[i] != NULL; i++) {
+        if (strcasecmp(end, units[i]) == 0) {
+            *out = x * scales[i];
+            return SSH_OK;
+        }
+    }
+
+    return SSH_ERROR;
+}
+
+/**
+ * @brief Parse a comma separated list of key=value, tc-netem style:
+ *  delay=50ms     one-way delay (us, ms or s, ms if omitted)
+ *  jitter=5ms     the delay varies within +/- jitter
+ *  rate=10mbit    bandwidth (bit, kbit, mbit or gbit per second)
+ *  loss=0.5%      segment loss probability (in percent)
+ * e.g. "delay=25ms,rate=100mbit" emulates a 50 ms RTT, 100 Mbit/s path.
+ *
+ * @param spec
+ * @param params
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_netem_parse(const char *spec, struct ssh_netem_params *params) {
+    static const char *const time_units[] = {"", "us", "ms", "s", NULL};
+    static const double time_scales[] = {1000, 1, 1000, 1000000};
+    static const char *const rate_units[] = {"",     "bit",  "kbit",
+                                             "mbit", "gbit", NULL};
+    static const double rate_scales[] = {1, 1, 1e3, 1e6, 1e9};
+    static const char *const loss_units[] = {"", "%", NULL};
+    static const double loss_scales[] = {0.01, 0.01};
+    char *copy, *token, *saveptr, *value;
+    double x;
+    int rc = SSH_OK;
+
+    ZERO_STRUCTP(params);
+
+    copy = strdup(spec);
+    if (copy == NULL) return SSH_ERROR;
+
+    for (token = strtok_r(copy, ",", &saveptr); token != NULL;
+         token = strtok_r(NULL, ",", &saveptr)) {
+        value = strchr(token, '=');
+        if (value == NULL) {
+            rc = SSH_ERROR;
+            break;
+        }
+        *value++ = '\0';
+
+        if (strcmp(token, "delay") == 0) {
+            rc = netem_parse_value(value, time_units, time_scales, &x);
+            params->delay_us = x;
+        } else if (strcmp(token, "jitter") == 0) {
+            rc = netem_parse_value(value, time_units, time_scales, &x);
+            params->jitter_us = x;
+        } else if (strcmp(token, "rate") == 0) {
+            rc = netem_parse_value(value, rate_units, rate_scales, &x);
+            params->rate_bps = x;
+        } else if (strcmp(token, "loss") == 0) {
+            rc = netem_parse_value(value, loss_units, loss_scales, &x);
+            if (x > 1) rc = SSH_ERROR;
+            params->loss = x;
+        } else {
+            rc = SSH_ERROR;
+        }
+        if (rc != SSH_OK) break;
+    }
+
+    SAFE_FREE(copy);
+    if (rc != SSH_OK) {
+        ssh_set_error(SSH_REQUEST_DENIED, "invalid netem spec: %s", spec);
+    }
+    return rc;
+}
+
+/**
+ * @brief When the link delivers `len` bytes handed to it `now`.
+ *
+ * @param netem
+ * @param pipe
+ * @param len
+ * @param now
+ * @return uint64_t
+ */
+static uint64_t netem_schedule(ssh_netem netem, struct netem_pipe *pipe,
+                               uint32_t len, uint64_t now) {
+    const struct ssh_netem_params *params = &netem->params;
+    int64_t delay = params->delay_us;
+    uint64_t due;
+    uint32_t seg;
+
+    /* serialization on a link that may still be busy */
+    if (pipe->link_free < now) pipe->link_free = now;
+    if (params->rate_bps > 0) {
+        pipe->link_free += (uint64_t)len * 8 * 1000000 / params->rate_bps;
+    }
+
+    if (params->jitter_us > 0) {
+        delay += (int64_t)(rand_r(&netem->seed) % (2 * params->jitter_us + 1)) -
+                 (int64_t)params->jitter_us;
+        if (delay < 0) delay = 0;
+    }
+    due = pipe->link_free + delay;
+
+    if (params->loss > 0) {
+        for (seg = 0; seg < len; seg += NETEM_SEGMENT) {
+            if (rand_r(&netem->seed) / (RAND_MAX + 1.0) < params->loss) {
+                due += NETEM_RTO_US;
+                break;
+            }
+        }
+    }
+
+    /* TCP delivers in order, a late chunk holds back the next ones */
+    if (due < pipe->last_due) due = pipe->last_due;
+    pipe->last_due = due;
+
+    return due;
+}
+
+/**
+ * @brief Take what is readable from the source and queue it.
+ *
+ * @param netem
+ * @param pipe
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+static int netem_fill(ssh_netem netem, struct netem_pipe *pipe) {
+    struct netem_chunk *chunk;
+    ssize_t n;
+
+    chunk = malloc(sizeof(struct netem_chunk) + NETEM_CHUNK);
+    if (chunk == NULL) return SSH_ERROR;
+
+    n = read(pipe->src, chunk->data, NETEM_CHUNK);
+    if (n <= 0) {
+        SAFE_FREE(chunk);
+        if (n == 0) {
+            pipe->eof = 1;
+            return SSH_OK;
+        }
+        return errno == EAGAIN || errno == EINTR ? SSH_OK : SSH_ERROR;
+    }
+
+    chunk->len = n;
+    chunk->off = 0;
+    chunk->next = NULL;
+    chunk->due = netem_schedule(netem, pipe, n, netem_now());
+
+    if (pipe->tail == NULL) {
+        pipe->head = chunk;
+    } else {
+        pipe->tail->next = chunk;
+    }
+    pipe->tail = chunk;
+    pipe->queued += n;
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Deliver the chunks that are due. Stops early if the destination
+ * can not take more.
+ *
+ * @param pipe
+ * @param now
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+static int netem_flush(struct netem_pipe *pipe, uint64_t now) {
+    struct netem_chunk *chunk;
+    ssize_t n;
+
+    while ((chunk = pipe->head) != NULL && chunk->due <= now) {
+        n = send(pipe->dst, chunk->data + chunk->off, chunk->len - chunk->off,
+                 MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) {
+            n = write(pipe->dst, chunk->data + chunk->off,
+                      chunk->len - chunk->off);
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR ? SSH_OK : SSH_ERROR;
+        }
+
+        chunk->off += n;
+        if (chunk->off < chunk->len) return SSH_OK;
+
+        pipe->head = chunk->next;
+        if (pipe->head == NULL) pipe->tail = NULL;
+        pipe->queued -= chunk->len;
+        SAFE_FREE(chunk);
+    }
+
+    return SSH_OK;
+}
+
+static void netem_pipe_free(struct netem_pipe *pipe) {
+    struct netem_chunk *chunk;
+
+    while ((chunk = pipe->head) != NULL) {
+        pipe->head = chunk->next;
+        SAFE_FREE(chunk);
+    }
+    pipe->tail = NULL;
+    pipe->queued = 0;
+}
+
+/**
+ * @brief Poll events wanted on a fd that is `src` of one direction and `dst`
+ * of the other.
+ */
+static short netem_events(ssh_netem netem, struct netem_pipe *in,
+                          struct netem_pipe *out, uint64_t now) {
+    short events = 0;
+
+    if (!in->eof && in->queued < netem->queue_max) events |= POLLIN;
+    /* due but not delivered: the destination is full */
+    if (out->head != NULL && out->head->due <= now) events |= POLLOUT;
+
+    return events;
+}
+
+/**
+ * @brief Milliseconds until the next chunk is due, -1 if none.
+ */
+static int netem_timeout(struct netem_pipe *pipe, uint64_t now) {
+    if (pipe->head == NULL || pipe->head->due <= now) return -1;
+    return (pipe->head->due - now + 999) / 1000;
+}
+
+static void *netem_relay(void *arg) {
+    ssh_netem netem = arg;
+    struct pollfd pfds[2];
+    uint64_t now;
+    int shut = 0;
+    int timeout, t;
+    int rc;
+
+    while (1) {
+        now = netem_now();
+        if (netem_flush(&netem->up, now) != SSH_OK ||
+            netem_flush(&netem->down, now) != SSH_OK) {
+            LOG_ERROR("netem: write error: %s", strerror(errno));
+            break;
+        }
+
+        /* the session closed its end and everything reached the network */
+        if (netem->up.eof && netem->up.head == NULL) break;
+        /* the network closed, pass the end of file on to the session */
+        if (netem->down.eof && netem->down.head == NULL && !shut) {
+            shutdown(netem->relay_fd, SHUT_WR);
+            shut = 1;
+        }
+
+        pfds[0].fd = netem->relay_fd;
+        pfds[0].events = netem_events(netem, &netem->up, &netem->down, now);
+        pfds[1].fd = netem->net_fd;
+        pfds[1].events = netem_events(netem, &netem->down, &netem->up, now);
+        /* nothing wanted, don't wake up on POLLHUP */
+        if (pfds[0].events == 0) pfds[0].fd = -1;
+        if (pfds[1].events == 0) pfds[1].fd = -1;
+        pfds[0].revents = pfds[1].revents = 0;
+
+        timeout = netem_timeout(&netem->up, now);
+        t = netem_timeout(&netem->down, now);
+        if (timeout < 0 || (t >= 0 && t < timeout)) timeout = t;
+
+        rc = poll(pfds, 2, timeout);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc < 0) {
+            LOG_ERROR("netem: poll error: %s", strerror(errno));
+            break;
+        }
+
+        if ((pfds[0].events & POLLIN) && pfds[0].revents != 0 &&
+            netem_fill(netem, &netem->up) != SSH_OK) {
+            LOG_ERROR("netem: read error: %s", strerror(errno));
+            break;
+        }
+        if ((pfds[1].events & POLLIN) && pfds[1].revents != 0 &&
+            netem_fill(netem, &netem->down) != SSH_OK) {
+            LOG_ERROR("netem: read error: %s", strerror(errno));
+            break;
+        }
+    }
+
+    /* whatever happened, the session must not wait for more */
+    shutdown(netem->relay_fd, SHUT_RDWR);
+    return NULL;
+}
+
+/**
+ * @brief Put an emulated link in front of the connected socket `fd`.
+ *
+ * @param fd connected socket, owned by the relay from now on
+ * @param params
+ * @param local_fd [out] fd the session reads from and writes to instead
+ * @return ssh_netem, NULL on error.
+ */
+ssh_netem ssh_netem_start(int fd, const struct ssh_netem_params *params,
+                          int *local_fd) {
+    ssh_netem netem;
+    uint64_t bdp;
+    int sv[2] = {-1, -1};
+
+    netem = calloc(1, sizeof(struct ssh_netem_struct));
+    if (netem == NULL) return NULL;
+    netem->params = *params;
+    netem->net_fd = fd;
+    netem->seed = (unsigned int)(netem_now() ^ getpid());
+
+    /* twice the bandwidth-delay product keeps the link busy */
+    bdp = params->rate_bps / 8 * (2 * params->delay_us + params->jitter_us) /
+          1000000;
+    netem->queue_max = params->rate_bps > 0 ? 2 * bdp : NETEM_QUEUE_MAX;
+    if (netem->queue_max < NETEM_QUEUE_MIN) netem->queue_max = NETEM_QUEUE_MIN;
+    if (netem->queue_max > NETEM_QUEUE_MAX) netem->queue_max = NETEM_QUEUE_MAX;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        ssh_set_error(SSH_FATAL, "netem: socketpair failed: %s",
+                      strerror(errno));
+        goto error;
+    }
+    netem->relay_fd = sv[1];
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+
+    netem->up.src = sv[1];
+    netem->up.dst = fd;
+    netem->down.src = fd;
+    netem->down.dst = sv[1];
+
+    if (pthread_create(&netem->thread, NULL, netem_relay, netem) != 0) {
+        ssh_set_error(SSH_FATAL, "netem: can not start the relay thread");
+        goto error;
+    }
+
+    LOG_NOTICE("netem: delay %llu us, jitter %llu us, rate %llu bit/s, "
+               "loss %.3f%%",
+               (unsigned long long)params->delay_us,
+               (unsigned long long)params->jitter_us,
+               (unsigned long long)params->rate_bps, params->loss * 100);
+
+    *local_fd = sv[0];
+    return netem;
+
+error:
+    if (sv[0] >= 0) close(sv[0]);
+    if (sv[1] >= 0) close(sv[1]);
+    SAFE_FREE(netem);
+    return NULL;
+}
+
+/**
+ * @brief Wait for the relay to deliver what the session wrote before closing
+ * its end, then close the real socket.
+ *
+ * @param netem
+ */
+void ssh_netem_stop(ssh_netem netem) {
+    if (netem == NULL) return;
+
+    pthread_join(netem->thread, NULL);
+    close(netem->relay_fd);
+    close(netem->net_fd);
+    netem_pipe_free(&netem->up);
+    netem_pipe_free(&netem->down);
+    SAFE_FREE(netem);
+}
@@ -15,9 +15,14 @@
 
 #include "libsftp/crypto.h"
 #include "libsftp/error.h"
+#include "libsftp/gzip.h"
+#include "libsftp/kex.h"
 #include "libsftp/logger.h"
+#include "libsftp/pipeline.h"
+#include "libsftp/probes.h"
 #include "libsftp/session.h"
 #include "libsftp/socket.h"
+#include "libsftp/util.h"
 
 /**
  * RFC 4253 section 6 SSH packet format
@@ -29,65 +34,71 @@
  * byte[m]   mac (Message Authentication Code - MAC); m = mac_length
  */
 
+/* Upper bound of a decompressed payload */
+#define MAX_PACKET_LEN 262144
+
 /**
- * @brief Encrypt a packet.
+ * @brief Encrypt a packet in place and compute its MAC, over the plaintext,
+ * or over the ciphertext with encrypt-then-MAC where the length field is
+ * left in clear.
  *
  * @param session
  * @param data
  * @param len
- * @return unsigned char* computed MAC
+ * @param[out] mac computed MAC, NULL before the first key exchange
+ * @return SSH_OK, SSH_ERROR on error.
  */
-static unsigned char *packet_encrypt(ssh_session session, void *data,
-                                     uint32_t len) {
+static int packet_encrypt(ssh_session session, void *data, uint32_t len,
+                          unsigned char **mac) {
     struct ssh_crypto_struct *crypto = NULL;
     struct ssh_cipher_struct *cipher = NULL;
-    HMACCTX ctx = NULL;
-    char *out = NULL;
     unsigned int finallen, blocksize;
-    uint32_t seq, lenfield_blocksize;
-    enum ssh_hmac_e type;
+    uint32_t lenfield_blocksize, skip;
+    uint64_t start;
+    int rc;
 
+    *mac = NULL;
     crypto = ssh_get_crypto(session, SSH_DIRECTION_OUT);
     if (crypto == NULL) {
-        return NULL; /* nothing to do here */
+        return SSH_OK; /* nothing to do here */
     }
 
     blocksize = crypto->out_cipher->blocksize;
     lenfield_blocksize = crypto->out_cipher->lenfield_blocksize;
-    type = crypto->out_hmac;
+    skip = crypto->out_hmac_etm ? sizeof(uint32_t) : 0;
 
-    if ((len - lenfield_blocksize) % blocksize != 0) {
+    if ((len - skip - lenfield_blocksize) % blocksize != 0) {
         ssh_set_error(SSH_FATAL,
                       "Cryptographic functions must be set"
                       " on at least one blocksize (received %d)",
                       len);
-        return NULL;
-    }
-    out = calloc(1, len);
-    if (out == NULL) {
-        return NULL;
+        return SSH_ERROR;
     }
-
-    seq = ntohl(session->send_seq);
     cipher = crypto->out_cipher;
 
-    ctx = hmac_init(crypto->encryptMAC, hmac_digest_len(type), type);
-    if (ctx == NULL) {
-        SAFE_FREE(out);
-        return NULL;
+    if (!crypto->out_hmac_etm) {
+        start = ssh_time_ns();
+        rc = hmac_packet(crypto->out_hmac_ctx, session->send_seq, data, len,
+                         crypto->hmacbuf, &finallen);
+        session->stats.mac_out_ns += ssh_time_ns() - start;
+        if (rc != SSH_OK) return SSH_ERROR;
     }
 
-    hmac_update(ctx, (unsigned char *)&seq, sizeof(uint32_t));
-    hmac_update(ctx, data, len);
-    hmac_final(ctx, crypto->hmacbuf, &finallen);
-
-    cipher->encrypt(cipher, (uint8_t *)data, out, len);
-    memcpy((uint8_t *)data, out, len);
-
-    explicit_bzero(out, len);
-    SAFE_FREE(out);
+    start = ssh_time_ns();
+    cipher->encrypt(cipher, (uint8_t *)data + skip, (uint8_t *)data + skip,
+                    len - skip);
+    session->stats.encrypt_ns += ssh_time_ns() - start;
+
+    if (crypto->out_hmac_etm) {
+        start = ssh_time_ns();
+        rc = hmac_packet(crypto->out_hmac_ctx, session->send_seq, data, len,
+                         crypto->hmacbuf, &finallen);
+        session->stats.mac_out_ns += ssh_time_ns() - start;
+        if (rc != SSH_OK) return SSH_ERROR;
+    }
 
-    return crypto->hmacbuf;
+    *mac = crypto->hmacbuf;
+    return SSH_OK;
 }
 
 /**
@@ -105,6 +116,7 @@ static int packet_decrypt(ssh_session session, uint8_t *destination,
                           size_t encrypted_size) {
     struct ssh_crypto_struct *crypto = NULL;
     struct ssh_cipher_struct *cipher = NULL;
+    uint64_t start_ns;
 
     if (encrypted_size < 0) {
         return SSH_ERROR;
@@ -124,80 +136,71 @@ static int packet_decrypt(ssh_session session, uint8_t *destination,
         return SSH_ERROR;
     }
 
+    start_ns = ssh_time_ns();
     cipher->decrypt(cipher, source + start, destination, encrypted_size);
+    session->stats.decrypt_ns += ssh_time_ns() - start_ns;
 
     return SSH_OK;
 }
 
 /**
- * @brief Decrypt the first block of a packet to get the packet length since
- * packet length is also encrypted.
+ * @brief Decrypt the first block of a packet in place to get the packet
+ * length since packet length is also encrypted.
  *
  * @param session
- * @param destination
- * @param source
+ * @param data
  * @return uint32_t
  */
-static uint32_t packet_decrypt_len(ssh_session session, uint8_t *destination,
-                                   uint8_t *source) {
+static uint32_t packet_decrypt_len(ssh_session session, uint8_t *data) {
     struct ssh_crypto_struct *crypto = NULL;
     uint32_t packet_len;
     int rc;
 
     crypto = ssh_get_crypto(session, SSH_DIRECTION_IN);
     if (crypto != NULL) {
-        rc = packet_decrypt(session, destination, source, 0,
+        rc = packet_decrypt(session, data, data, 0,
                             crypto->in_cipher->blocksize);
         if (rc != SSH_OK) {
             return 0;
         }
-    } else {
-        memcpy(destination, source, 8);
     }
-    memcpy(&packet_len, destination, sizeof(packet_len));
+    memcpy(&packet_len, data, sizeof(packet_len));
 
     return ntohl(packet_len);
 }
 
 /**
- * @brief Integrity check.
+ * @brief Integrity check, with the keyed MAC context of the session and a
+ * comparison in constant time.
  *
  * @param session
  * @param data
  * @param len
  * @param mac
- * @param type
  * @return int
  */
 static int packet_hmac_verify(ssh_session session, const void *data, size_t len,
-                              uint8_t *mac, enum ssh_hmac_e type) {
+                              const uint8_t *mac) {
     struct ssh_crypto_struct *crypto = NULL;
     unsigned char hmacbuf[DIGEST_MAX_LEN] = {0};
-    HMACCTX ctx;
     unsigned int hmaclen;
-    uint32_t seq;
+    uint64_t start;
+    int rc;
 
     crypto = ssh_get_crypto(session, SSH_DIRECTION_IN);
     if (crypto == NULL) {
         return SSH_ERROR;
     }
 
-    ctx = hmac_init(crypto->decryptMAC, hmac_digest_len(type), type);
-    if (ctx == NULL) {
+    start = ssh_time_ns();
+    rc = hmac_packet(crypto->in_hmac_ctx, session->recv_seq, data, len,
+                     hmacbuf, &hmaclen);
+    session->stats.mac_in_ns += ssh_time_ns() - start;
+    if (rc != SSH_OK) {
         return SSH_ERROR;
     }
 
-    seq = htonl(session->recv_seq);
-
-    hmac_update(ctx, (unsigned char *)&seq, sizeof(uint32_t));
-    hmac_update(ctx, data, len);
-    hmac_final(ctx, hmacbuf, &hmaclen);
-
-    // ssh_log_hexdump("received mac", mac, hmaclen);
-    // ssh_log_hexdump("Computed mac", hmacbuf, hmaclen);
-    // ssh_log_hexdump("seq", (unsigned char *)&seq, sizeof(uint32_t));
-
-    if (memcmp(mac, hmacbuf, hmaclen) == 0) {
+    if (secure_memcmp(mac, hmacbuf, hmaclen) == 0) {
         return SSH_OK;
     }
 
@@ -207,27 +210,35 @@ static int packet_hmac_verify(ssh_session session, const void *data, size_t len,
 /**
  * @brief Read a binary packet from socket and decrypt it if key exchange is
  * completed. Extract the SSH message packet and store it in the session's
- * in_buffer
+ * in_buffer. The packet is read straight into in_buffer and decrypted in
+ * place there. With encrypt-then-MAC the MAC is checked first, and nothing
+ * is decrypted of a packet that fails it.
  * @param session
  * @return success or not
  */
-int ssh_packet_receive(ssh_session session) {
-    uint8_t *data = NULL;
+static int packet_read(ssh_session session) {
     uint32_t blocksize = 8;
     uint32_t lenfield_blocksize = 8;
     size_t current_macsize = 0;
+    uint32_t first_read;
+    bool etm = false;
     uint8_t *ptr = NULL;
-    int to_be_read;
+    uint32_t to_be_read;
     int rc;
-    uint8_t *cleartext_packet = NULL;
-    uint8_t *packet_second_block = NULL;
     uint8_t *mac = NULL;
     size_t packet_remaining;
     uint32_t packet_len;
     uint8_t padding;
     size_t processed = 0; /* number of byte processed from the callback */
     struct ssh_crypto_struct *crypto = NULL;
+    uint64_t start;
+    uint64_t trace_start = 0;
     bool ok;
+
+    /* the peer may be waiting for them */
+    rc = ssh_pipeline_flush(session);
+    if (rc != SSH_OK) goto error;
+
     // if(session->current_crypto)
     //     LOG_DEBUG("Cuurent crypto's used: %d", session->current_crypto->used);
     crypto = ssh_get_crypto(session, SSH_DIRECTION_IN);
@@ -235,6 +246,17 @@ int ssh_packet_receive(ssh_session session) {
         current_macsize = hmac_digest_len(crypto->in_hmac);
         blocksize = crypto->in_cipher->blocksize;
         lenfield_blocksize = crypto->in_cipher->lenfield_blocksize;
+        etm = crypto->in_hmac_etm;
+    }
+
+    if (ssh_pipeline_decrypts(session)) {
+        rc = ssh_pipeline_read(session);
+        if (rc != SSH_OK) goto error;
+        if (session->trace != NULL) trace_start = ssh_time_ns();
+        memcpy(&packet_len, ssh_buffer_get(session->in_buffer),
+               sizeof(uint32_t));
+        packet_len = ntohl(packet_len);
+        goto decrypted;
     }
 
     if (lenfield_blocksize == 0) {
@@ -242,10 +264,6 @@ int ssh_packet_receive(ssh_session session) {
     }
     // LOG_DEBUG("lenfield_blocksize: %d", lenfield_blocksize);
 
-    data = calloc(lenfield_blocksize, sizeof(uint8_t));
-
-    ssh_socket_read(session->socket, data, lenfield_blocksize);
-
     if (session->in_buffer) {
         rc = ssh_buffer_reinit(session->in_buffer);
         if (rc < 0) {
@@ -258,60 +276,85 @@ int ssh_packet_receive(ssh_session session) {
         }
     }
 
-    ptr = ssh_buffer_allocate(session->in_buffer, lenfield_blocksize);
+    /* with encrypt-then-MAC the length field is not encrypted */
+    first_read = etm ? sizeof(uint32_t) : lenfield_blocksize;
+    ptr = ssh_buffer_allocate(session->in_buffer, first_read);
     if (ptr == NULL) {
         goto error;
     }
-    packet_len = packet_decrypt_len(session, ptr, data);
-    to_be_read =
-        packet_len - lenfield_blocksize + sizeof(uint32_t) + current_macsize;
-    // LOG_DEBUG("packet_len: %d", packet_len);
-    // LOG_DEBUG("to_be_read: %d", to_be_read);
-    // LOG_DEBUG("current_macsize: %d", current_macsize);
-
-    data = realloc(data, to_be_read * sizeof(uint8_t) + 1);
-    ssh_socket_read(session->socket, data, to_be_read);
+    rc = ssh_socket_read(session->socket, ptr, first_read);
+    if (rc != SSH_OK) goto error;
+    /* the packet has started to arrive, the wait for it is not traced */
+    if (session->trace != NULL) trace_start = ssh_time_ns();
+
+    if (etm) {
+        memcpy(&packet_len, ptr, sizeof(uint32_t));
+        packet_len = ntohl(packet_len);
+    } else {
+        packet_len = packet_decrypt_len(session, ptr);
+    }
+    /* the padding length and at least four bytes of padding, a whole
+     * block, and with encrypt-then-MAC whole blocks after the length */
+    if (packet_len < 1 + 4 || packet_len + sizeof(uint32_t) < first_read ||
+        packet_len > MAX_PACKET_LEN || (etm && packet_len % blocksize != 0)) {
+        ssh_set_error(SSH_FATAL, "invalid packet length %u", packet_len);
+        goto error;
+    }
+    to_be_read = packet_len - first_read + sizeof(uint32_t) + current_macsize;
 
-    ptr = ssh_buffer_allocate(session->in_buffer, to_be_read - current_macsize);
+    ptr = ssh_buffer_allocate(session->in_buffer, to_be_read);
     if (ptr == NULL) goto error;
+    rc = ssh_socket_read(session->socket, ptr, to_be_read);
+    if (rc != SSH_OK) goto error;
 
     if (crypto != NULL) {
-        mac = data + to_be_read - current_macsize;
-        rc =
-            packet_decrypt(session, ptr, data, 0, to_be_read - current_macsize);
+        mac = ptr + to_be_read - current_macsize;
+        if (etm) {
+            /* verify MAC over the ciphertext, see `packet_hmac_verify` */
+            rc = packet_hmac_verify(session, ssh_buffer_get(session->in_buffer),
+                                    packet_len + sizeof(uint32_t), mac);
+            if (rc != SSH_OK) {
+                LOG_ERROR("MAC verification failed");
+                ssh_set_error(SSH_FATAL, "hmac error");
+                goto error;
+            }
+            ptr = (uint8_t *)ssh_buffer_get(session->in_buffer) +
+                  sizeof(uint32_t);
+            rc = packet_decrypt(session, ptr, ptr, 0, packet_len);
+        } else {
+            rc = packet_decrypt(session, ptr, ptr, 0,
+                                to_be_read - current_macsize);
+        }
         if (rc != SSH_OK) {
             ssh_set_error(SSH_FATAL, "decryption error");
             goto error;
         }
-        /* verify MAC, see `packet_hmac_verify` */
-        // LAB: insert your code here.
-        // LOG_DEBUG("Unencrypted packet: %p", ptr);
-        // ssh_log_hexdump("Unencrypted packet", ptr, to_be_read - current_macsize);
-        // LOG_DEBUG("In buffer: %p", session->in_buffer);
-        // ssh_log_hexdump("In buffer", ssh_buffer_get(session->in_buffer),
-        //                 packet_len);
-        // LOG_DEBUG("MAC type: %d", crypto->in_hmac);
-        rc = packet_hmac_verify(session, ssh_buffer_get(session->in_buffer), packet_len+4, mac,
-                                crypto->in_hmac);
- 
-        if (rc != SSH_OK) {
-            LOG_ERROR("MAC verification failed");
-            ssh_set_error(SSH_FATAL, "hmac error");
-            goto error;
+        if (!etm) {
+            /* verify MAC, see `packet_hmac_verify` */
+            rc = packet_hmac_verify(session, ssh_buffer_get(session->in_buffer),
+                                    packet_len + sizeof(uint32_t), mac);
+            if (rc != SSH_OK) {
+                LOG_ERROR("MAC verification failed");
+                ssh_set_error(SSH_FATAL, "hmac error");
+                goto error;
+            }
         }
-    } else {
-        memcpy(ptr, data, to_be_read - current_macsize);
+        ssh_buffer_pass_bytes_end(session->in_buffer, current_macsize);
     }
 
-    SAFE_FREE(data);
     /* decryption completed */
     /* now decrypted packet is in in_buffer, extract payload and discard others
      */
+decrypted:
 
     /* skip the size field which has been processed before */
     ssh_buffer_pass_bytes(session->in_buffer, sizeof(uint32_t));
 
     rc = ssh_buffer_get_u8(session->in_buffer, &padding);
+    if (rc != sizeof(uint8_t)) {
+        ssh_set_error(SSH_FATAL, "packet too short");
+        goto error;
+    }
 
     /* There MUST be at least four bytes of padding.  The
      padding SHOULD consist of random bytes.  The maximum amount of
@@ -324,10 +367,38 @@ int ssh_packet_receive(ssh_session session) {
     }
     ssh_buffer_pass_bytes_end(session->in_buffer, padding);
 
+    if (crypto != NULL && crypto->do_compress_in &&
+        ssh_buffer_get_len(session->in_buffer) > 0) {
+        start = ssh_time_ns();
+        rc = decompress_buffer(session, session->in_buffer, MAX_PACKET_LEN);
+        session->stats.decompress_ns += ssh_time_ns() - start;
+        if (rc != SSH_OK) {
+            ssh_set_error(SSH_FATAL, "decompression error");
+            goto error;
+        }
+    }
+
+    ssh_trace_record(session->trace, SSH_TRACE_PACKET_RECV,
+                     ssh_buffer_get_len(session->in_buffer) > 0
+                         ? ((uint8_t *)ssh_buffer_get(session->in_buffer))[0]
+                         : 0,
+                     session->recv_seq,
+                     packet_len + sizeof(uint32_t) + current_macsize, 0,
+                     trace_start, trace_start ? ssh_time_ns() : 0);
+    SSH_PROBE3(packet__receive, session->recv_seq,
+               ssh_buffer_get_len(session->in_buffer) > 0
+                   ? ((uint8_t *)ssh_buffer_get(session->in_buffer))[0]
+                   : 0,
+               packet_len + sizeof(uint32_t) + current_macsize);
+
     session->recv_seq++;
+    session->kex_bytes += packet_len + sizeof(uint32_t) + current_macsize;
+    session->stats.bytes_in += packet_len + sizeof(uint32_t) + current_macsize;
+    session->stats.packets_in++;
+    session->stats.payload_in += ssh_buffer_get_len(session->in_buffer);
 
-    LOG_DEBUG(
-        "packet: received [type=%u, len=%u, padding_size=%hhd,"
+    SESSION_LOG_DEBUG(
+        session, "packet: received [type=%u, len=%u, padding_size=%hhd,"
         "payload=%u]",
         ((uint8_t *)ssh_buffer_get(session->in_buffer))[0], packet_len, padding,
         ssh_buffer_get_len(session->in_buffer));
@@ -335,36 +406,191 @@ int ssh_packet_receive(ssh_session session) {
     return SSH_OK;
 
 error:
-    SAFE_FREE(data);
     LOG_ERROR("packet receive error");
     return SSH_ERROR;
 }
 
+/**
+ * @brief Move the oldest packet queued during a re-key into `in_buffer`.
+ *
+ * @param session
+ * @return int
+ */
+static int packet_pop_pending(ssh_session session) {
+    uint32_t len;
+    int rc;
+
+    rc = ssh_buffer_get_u32(session->in_pending, &len);
+    if (rc != sizeof(uint32_t)) return SSH_ERROR;
+    len = ntohl(len);
+    if (len > ssh_buffer_get_len(session->in_pending)) return SSH_ERROR;
+
+    rc = ssh_buffer_reinit(session->in_buffer);
+    if (rc < 0) return SSH_ERROR;
+    rc = ssh_buffer_add_data(session->in_buffer,
+                             ssh_buffer_get(session->in_pending), len);
+    if (rc < 0) return SSH_ERROR;
+    ssh_buffer_pass_bytes(session->in_pending, len);
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Receive the next packet for the upper layer into `in_buffer`.
+ *
+ * Transport messages are handled here: SSH_MSG_IGNORE and SSH_MSG_DEBUG are
+ * dropped, and a SSH_MSG_KEXINIT on an established connection starts a
+ * re-key. While a key exchange is running, only key exchange messages are
+ * returned, the others are queued and returned after it.
+ *
+ * @param session
+ * @param blocking whether to wait for a packet to arrive
+ * @return success or not, SSH_AGAIN if not `blocking` and there is no packet.
+ */
+static int packet_receive(ssh_session session, int blocking) {
+    uint32_t len;
+    uint8_t type;
+    int rc;
+
+    while (1) {
+        if (!session->kex_running &&
+            ssh_buffer_get_len(session->in_pending) > 0) {
+            return packet_pop_pending(session);
+        }
+
+        if (!blocking && !session->kex_running &&
+            !ssh_pipeline_pending(session)) {
+            rc = ssh_socket_wait(session->socket, 0);
+            if (rc == 0) return SSH_AGAIN;
+            if (rc < 0) return SSH_ERROR;
+        }
+
+        rc = packet_read(session);
+        if (rc != SSH_OK) return rc;
+
+        len = ssh_buffer_get_len(session->in_buffer);
+        if (len == 0) return SSH_OK;
+        type = ((uint8_t *)ssh_buffer_get(session->in_buffer))[0];
+
+        switch (type) {
+            case SSH_MSG_IGNORE:
+            case SSH_MSG_DEBUG:
+                break;
+            case SSH_MSG_KEXINIT:
+                if (session->kex_running || session->current_crypto == NULL) {
+                    return SSH_OK;
+                }
+                ssh_buffer_pass_bytes(session->in_buffer, sizeof(uint8_t));
+                rc = ssh_rekey(session, 1);
+                if (rc != SSH_OK) return rc;
+                break;
+            default:
+                if (!session->kex_running || type < SSH_MSG_USERAUTH_REQUEST) {
+                    return SSH_OK;
+                }
+                /* the server sent it before its SSH_MSG_KEXINIT */
+                rc = ssh_buffer_pack(session->in_pending, "dP", len, len,
+                                     ssh_buffer_get(session->in_buffer));
+                if (rc != SSH_OK) return SSH_ERROR;
+                SESSION_LOG_DEBUG(session,
+                                  "packet: queued [type=%u, len=%u] during "
+                                  "re-key",
+                                  type, len);
+                break;
+        }
+    }
+}
+
+int ssh_packet_receive(ssh_session session) {
+    return packet_receive(session, 1);
+}
+
+/**
+ * @brief Write the packets still queued to the crypto workers or left for
+ * later, before waiting for the peer without reading.
+ *
+ * @param session
+ * @return int
+ */
+int ssh_packet_flush(ssh_session session) {
+    if (ssh_pipeline_flush(session) != SSH_OK) return SSH_ERROR;
+    return ssh_socket_flush(session->socket);
+}
+
+/**
+ * @brief Like `ssh_packet_receive`, but return SSH_AGAIN instead of waiting
+ * when no packet has arrived. A packet that has partly arrived is still
+ * waited for.
+ *
+ * @param session
+ * @return int
+ */
+int ssh_packet_receive_nonblocking(ssh_session session) {
+    return packet_receive(session, 0);
+}
+
+/**
+ * @brief Whether the current keys reached the data or time limit of
+ * `opts.rekey_data` and `opts.rekey_time`.
+ *
+ * @param session
+ * @return bool
+ */
+static bool packet_need_rekey(ssh_session session) {
+    if (session->kex_running || session->current_crypto == NULL) {
+        return false;
+    }
+    if (session->opts.rekey_data != 0 &&
+        session->kex_bytes >= session->opts.rekey_data) {
+        return true;
+    }
+    if (session->opts.rekey_time != 0 &&
+        time(NULL) - session->kex_time >= session->opts.rekey_time) {
+        return true;
+    }
+    return false;
+}
+
 /**
  * @brief Encapsulate a binary packet from payload and encrypt it if key
- * exchange is completed. Send the encrypted packet to the socket.
+ * exchange is completed. Send the encrypted packet to the socket, or if
+ * `defer`, leave it to be written with the next packet or before the next
+ * wait for the peer.
  *
  * @param session
+ * @param defer
  * @return int
  */
-int ssh_packet_send(ssh_session session) {
+static int packet_send(ssh_session session, int defer) {
     unsigned int blocksize = 8;
     unsigned int lenfield_blocksize = 0;
+    unsigned int etm_offset = 0;
     enum ssh_hmac_e hmac_type = SSH_HMAC_NONE;
     struct ssh_crypto_struct *crypto = NULL;
     unsigned char *hmac = NULL;
-    uint8_t padding_data[32] = {0};
+    uint8_t *padding;
     uint8_t padding_size;
-    uint32_t finallen, payload_size;
+    uint32_t finallen, payload_size, wire_len;
     uint8_t header[5] = {0};
-    uint8_t type, *payload;
+    uint8_t type, *payload, *wire;
+    uint64_t start;
+    uint64_t trace_start = 0;
     int rc;
 
+    if (packet_need_rekey(session)) {
+        rc = ssh_rekey(session, 0);
+        if (rc != SSH_OK) return rc;
+    }
+
+    if (session->trace != NULL) trace_start = ssh_time_ns();
+
     crypto = ssh_get_crypto(session, SSH_DIRECTION_OUT);
     if (crypto) {
         blocksize = crypto->out_cipher->blocksize;
         lenfield_blocksize = crypto->out_cipher->lenfield_blocksize;
         hmac_type = crypto->out_hmac;
+        /* with encrypt-then-MAC the length field is not encrypted */
+        if (crypto->out_hmac_etm) etm_offset = sizeof(uint32_t);
     }
 
     payload_size = ssh_buffer_get_len(session->out_buffer);
@@ -375,19 +601,25 @@ int ssh_packet_send(ssh_session session) {
     payload = (uint8_t *)ssh_buffer_get(session->out_buffer);
     type = payload[0]; /* type is the first byte of the packet now */
 
-    padding_size =
-        (blocksize -
-         ((blocksize - lenfield_blocksize + payload_size + 5) % blocksize));
-    if (padding_size < 4) {
-        /* why? */
-        padding_size += blocksize;
-    }
+    session->stats.payload_out += payload_size;
 
-    if (crypto != NULL) {
-        if (!ssh_get_random(padding_data, padding_size, 0)) {
-            ssh_set_error(SSH_FATAL, "PRNG error");
+    if (crypto != NULL && crypto->do_compress_out) {
+        start = ssh_time_ns();
+        rc = compress_buffer(session, session->out_buffer);
+        session->stats.compress_ns += ssh_time_ns() - start;
+        if (rc != SSH_OK) {
+            ssh_set_error(SSH_FATAL, "compression error");
             return SSH_ERROR;
         }
+        payload_size = ssh_buffer_get_len(session->out_buffer);
+    }
+
+    padding_size = (blocksize - ((blocksize - lenfield_blocksize +
+                                  payload_size + 5 - etm_offset) %
+                                 blocksize));
+    if (padding_size < 4) {
+        /* why? */
+        padding_size += blocksize;
     }
 
     finallen = payload_size + padding_size + 1;
@@ -395,27 +627,62 @@ int ssh_packet_send(ssh_session session) {
     *((uint32_t *)&header[0]) = htonl(finallen);
     header[4] = padding_size;
 
+    /* both in the room reserved around the payload, see ssh_new() */
     rc = ssh_buffer_prepend_data(session->out_buffer, header, sizeof(header));
     if (rc < 0) return SSH_ERROR;
-    rc = ssh_buffer_add_data(session->out_buffer, padding_data, padding_size);
-    if (rc < 0) return SSH_ERROR;
+    padding = ssh_buffer_allocate(session->out_buffer, padding_size);
+    if (padding == NULL) return SSH_ERROR;
+    if (crypto != NULL) {
+        if (!ssh_get_random(padding, padding_size, 0)) {
+            ssh_set_error(SSH_FATAL, "PRNG error");
+            return SSH_ERROR;
+        }
+    } else {
+        memset(padding, 0, padding_size);
+    }
 
-    hmac = packet_encrypt(session, ssh_buffer_get(session->out_buffer),
-                          ssh_buffer_get_len(session->out_buffer));
-    if (hmac != NULL) {
-        rc = ssh_buffer_add_data(session->out_buffer, hmac,
-                                 hmac_digest_len(hmac_type));
+    if (ssh_pipeline_encrypts(session, type)) {
+        /* written when encrypted, by a later send or before a read */
+        rc = ssh_pipeline_send(session);
+        if (rc != SSH_OK) return SSH_ERROR;
+        wire_len = ssh_buffer_get_len(session->out_buffer) +
+                   hmac_digest_len(hmac_type);
+    } else {
+        /* after the packets queued before it */
+        rc = ssh_pipeline_flush(session);
+        if (rc != SSH_OK) return SSH_ERROR;
+
+        rc = packet_encrypt(session, ssh_buffer_get(session->out_buffer),
+                            ssh_buffer_get_len(session->out_buffer), &hmac);
+        if (rc != SSH_OK) return SSH_ERROR;
+        if (hmac != NULL) {
+            rc = ssh_buffer_add_data(session->out_buffer, hmac,
+                                     hmac_digest_len(hmac_type));
+            if (rc < 0) return SSH_ERROR;
+        }
+
+        wire = ssh_buffer_get(session->out_buffer);
+        wire_len = ssh_buffer_get_len(session->out_buffer);
+        if (defer) {
+            rc = ssh_socket_write_later(session->socket, wire, wire_len);
+        } else {
+            rc = ssh_socket_write(session->socket, wire, wire_len);
+        }
         if (rc < 0) return SSH_ERROR;
     }
 
-    rc = ssh_socket_write(session->socket, ssh_buffer_get(session->out_buffer),
-                          ssh_buffer_get_len(session->out_buffer));
-    if (rc < 0) return SSH_ERROR;
+    ssh_trace_record(session->trace, SSH_TRACE_PACKET_SEND, type,
+                     session->send_seq, wire_len, 0, trace_start,
+                     trace_start ? ssh_time_ns() : 0);
+    SSH_PROBE3(packet__send, session->send_seq, type, wire_len);
 
     session->send_seq++;
+    session->kex_bytes += wire_len;
+    session->stats.bytes_out += wire_len;
+    session->stats.packets_out++;
 
-    LOG_DEBUG(
-        "packet: wrote [type=%u, len=%u, padding_size=%hhd,"
+    SESSION_LOG_DEBUG(
+        session, "packet: wrote [type=%u, len=%u, padding_size=%hhd,"
         "payload=%u]",
         type, finallen, padding_size, payload_size);
 
@@ -427,4 +694,26 @@ int ssh_packet_send(ssh_session session) {
     }
 
     return SSH_OK;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Send the packet in `out_buffer`.
+ *
+ * @param session
+ * @return int
+ */
+int ssh_packet_send(ssh_session session) {
+    return packet_send(session, 0);
+}
+
+/**
+ * @brief Send the packet in `out_buffer` with the next one, for packets
+ * the peer does not answer and can wait for, as window adjusts. It is
+ * written at the latest before the session waits for the peer.
+ *
+ * @param session
+ * @return int
+ */
+int ssh_packet_send_later(ssh_session session) {
+    return packet_send(session, 1);
+}
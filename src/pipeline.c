@@ -0,0 +1,621 @@
+/**
+ * @file pipeline.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Packet encryption and decryption on worker threads.
+ * Jobs go through two rings, one per direction, in sequence order. The
+ * session thread queues jobs at the tail and consumes them at the head once
+ * done, the workers take them in order from both rings.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "libsftp/pipeline.h"
+
+#include <pthread.h>
+
+#include "libsftp/crypto.h"
+#include "libsftp/error.h"
+#include "libsftp/logger.h"
+#include "libsftp/session.h"
+#include "libsftp/socket.h"
+#include "libsftp/util.h"
+
+/* Largest packet_length accepted from the peer */
+#define PIPELINE_MAX_PACKET_LEN 262144
+
+enum pipeline_job_state {
+    PIPELINE_JOB_QUEUED,
+    PIPELINE_JOB_RUNNING,
+    PIPELINE_JOB_DONE
+};
+
+struct pipeline_job {
+    uint8_t *data;   /* the packet from its length field, then its MAC */
+    size_t size;     /* allocated */
+    uint32_t len;    /* of the packet, MAC excluded */
+    uint32_t skip;   /* bytes at the start already decrypted, or in clear */
+    uint32_t seq;
+    uint64_t block;  /* key stream block of data[skip] */
+    int encrypt;
+    bool etm;        /* encrypt-then-MAC */
+    struct ssh_cipher_struct *cipher;
+    const void *key;
+    const void *mac_key;
+    enum ssh_hmac_e hmac;
+
+    enum pipeline_job_state state;
+    int rc;
+    uint64_t cipher_ns;
+    uint64_t mac_ns;
+};
+
+/* MAC key state of a worker, for one direction. It is keyed again only when
+ * the key of a job differs, after a key exchange. */
+struct pipeline_mac {
+    HMACCTX ctx;
+    enum ssh_hmac_e type;
+    uint8_t key[DIGEST_MAX_LEN];
+};
+
+struct pipeline_ring {
+    struct pipeline_job jobs[SSH_PIPELINE_DEPTH];
+    unsigned int head;  /* oldest job */
+    unsigned int count; /* jobs from head on */
+    unsigned int taken; /* jobs from head on taken by the workers */
+};
+
+struct ssh_pipeline_struct {
+    pthread_mutex_t lock; /* ring positions and job states */
+    pthread_cond_t work;  /* a job was queued, or stop */
+    pthread_cond_t done;  /* a job is done */
+    pthread_t threads[SSH_PIPELINE_MAX_THREADS];
+    unsigned int nthreads;
+    int stop;
+
+    struct pipeline_ring in;
+    struct pipeline_ring out;
+    EVP_CIPHER_CTX *ctx; /* first blocks of received packets */
+};
+
+/**
+ * @brief Keyed MAC context for `key`.
+ *
+ * @return HMACCTX, NULL on error.
+ */
+static HMACCTX pipeline_mac_ctx(struct pipeline_mac *mac, const void *key,
+                                enum ssh_hmac_e type) {
+    size_t len = hmac_digest_len(type);
+
+    if (mac->ctx != NULL && mac->type == type &&
+        memcmp(mac->key, key, len) == 0) {
+        return mac->ctx;
+    }
+
+    hmac_free(mac->ctx);
+    mac->ctx = hmac_init(key, len, type);
+    if (mac->ctx == NULL) return NULL;
+    mac->type = type;
+    memcpy(mac->key, key, len);
+    return mac->ctx;
+}
+
+static int pipeline_crypt(struct pipeline_job *job, EVP_CIPHER_CTX *ctx) {
+    uint64_t start = ssh_time_ns();
+    int rc;
+
+    rc = ssh_cipher_ctr_crypt(job->cipher, ctx, job->key, job->block,
+                              job->data + job->skip, job->len - job->skip);
+    job->cipher_ns += ssh_time_ns() - start;
+    return rc;
+}
+
+/**
+ * @brief Decrypt and verify, or sign and encrypt, a packet. The MAC is of the
+ * plaintext, or with encrypt-then-MAC of the ciphertext: it is then checked
+ * before anything is decrypted.
+ *
+ * @param job
+ * @param ctx cipher context of the calling thread
+ * @param mac MAC state of the calling thread for the job's direction
+ * @return SSH_OK, SSH_ERROR on error or wrong MAC
+ */
+static int pipeline_run(struct pipeline_job *job, EVP_CIPHER_CTX *ctx,
+                        struct pipeline_mac *mac) {
+    unsigned char digest[DIGEST_MAX_LEN];
+    unsigned int maclen = 0;
+    HMACCTX hctx;
+    uint64_t start;
+    int rc;
+
+    job->cipher_ns = 0;
+    hctx = pipeline_mac_ctx(mac, job->mac_key, job->hmac);
+    if (hctx == NULL) return SSH_ERROR;
+
+    /* encrypt before the MAC with etm, decrypt before it without */
+    if (job->encrypt == job->etm) {
+        rc = pipeline_crypt(job, ctx);
+        if (rc != SSH_OK) return rc;
+    }
+
+    start = ssh_time_ns();
+    rc = hmac_packet(hctx, job->seq, job->data, job->len, digest, &maclen);
+    job->mac_ns = ssh_time_ns() - start;
+    if (rc != SSH_OK) return rc;
+
+    if (job->encrypt) {
+        memcpy(job->data + job->len, digest, maclen);
+    } else if (secure_memcmp(digest, job->data + job->len, maclen) != 0) {
+        return SSH_ERROR;
+    }
+
+    if (job->encrypt != job->etm) {
+        rc = pipeline_crypt(job, ctx);
+    }
+    return rc;
+}
+
+/**
+ * @brief Next queued job, received packets first. The caller holds `lock`.
+ *
+ * @param pipeline
+ * @return struct pipeline_job*, NULL if none.
+ */
+static struct pipeline_job *pipeline_take(ssh_pipeline pipeline) {
+    struct pipeline_ring *rings[] = {&pipeline->in, &pipeline->out};
+    struct pipeline_ring *ring;
+    size_t i;
+
+    for (i = 0; i < sizeof(rings) / sizeof(rings[0]); i++) {
+        ring = rings[i];
+        if (ring->taken < ring->count) {
+            ring->taken++;
+            return &ring->jobs[(ring->head + ring->taken - 1) %
+                               SSH_PIPELINE_DEPTH];
+        }
+    }
+    return NULL;
+}
+
+static void *pipeline_worker(void *arg) {
+    ssh_pipeline pipeline = arg;
+    struct pipeline_job *job;
+    struct pipeline_mac macs[2]; /* received, sent */
+    EVP_CIPHER_CTX *ctx;
+
+    ctx = EVP_CIPHER_CTX_new();
+    memset(macs, 0, sizeof(macs));
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (!pipeline->stop) {
+        job = pipeline_take(pipeline);
+        if (job == NULL) {
+            pthread_cond_wait(&pipeline->work, &pipeline->lock);
+            continue;
+        }
+        job->state = PIPELINE_JOB_RUNNING;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        job->rc = ctx != NULL ? pipeline_run(job, ctx, &macs[job->encrypt])
+                              : SSH_ERROR;
+
+        pthread_mutex_lock(&pipeline->lock);
+        job->state = PIPELINE_JOB_DONE;
+        pthread_cond_broadcast(&pipeline->done);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    EVP_CIPHER_CTX_free(ctx);
+    hmac_free(macs[0].ctx);
+    hmac_free(macs[1].ctx);
+    explicit_bzero(macs, sizeof(macs));
+    return NULL;
+}
+
+ssh_pipeline ssh_pipeline_new(unsigned int threads) {
+    ssh_pipeline pipeline;
+
+    if (threads == 0 || threads > SSH_PIPELINE_MAX_THREADS) return NULL;
+
+    pipeline = calloc(1, sizeof(struct ssh_pipeline_struct));
+    if (pipeline == NULL) return NULL;
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->work, NULL);
+    pthread_cond_init(&pipeline->done, NULL);
+
+    pipeline->ctx = EVP_CIPHER_CTX_new();
+    if (pipeline->ctx == NULL) goto error;
+
+    for (; pipeline->nthreads < threads; pipeline->nthreads++) {
+        if (pthread_create(&pipeline->threads[pipeline->nthreads], NULL,
+                           pipeline_worker, pipeline) != 0) {
+            goto error;
+        }
+    }
+
+    return pipeline;
+
+error:
+    ssh_set_error(SSH_FATAL, "can not start %u crypto threads", threads);
+    ssh_pipeline_free(pipeline);
+    return NULL;
+}
+
+static void pipeline_ring_free(struct pipeline_ring *ring) {
+    size_t i;
+
+    for (i = 0; i < SSH_PIPELINE_DEPTH; i++) {
+        if (ring->jobs[i].data == NULL) continue;
+        explicit_bzero(ring->jobs[i].data, ring->jobs[i].size);
+        SAFE_FREE(ring->jobs[i].data);
+    }
+}
+
+/**
+ * @brief Stop the workers and free the pipeline. Packets still queued for
+ * sending are dropped.
+ *
+ * @param pipeline
+ */
+void ssh_pipeline_free(ssh_pipeline pipeline) {
+    unsigned int i;
+
+    if (pipeline == NULL) return;
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->stop = 1;
+    pthread_cond_broadcast(&pipeline->work);
+    pthread_mutex_unlock(&pipeline->lock);
+    for (i = 0; i < pipeline->nthreads; i++) {
+        pthread_join(pipeline->threads[i], NULL);
+    }
+
+    pipeline_ring_free(&pipeline->in);
+    pipeline_ring_free(&pipeline->out);
+    if (pipeline->ctx != NULL) EVP_CIPHER_CTX_free(pipeline->ctx);
+    pthread_cond_destroy(&pipeline->done);
+    pthread_cond_destroy(&pipeline->work);
+    pthread_mutex_destroy(&pipeline->lock);
+    SAFE_FREE(pipeline);
+}
+
+/**
+ * @brief Crypto of `direction` if its packets can go through the workers:
+ * CTR mode with a MAC.
+ *
+ * @param session
+ * @param direction
+ * @return struct ssh_crypto_struct*, NULL if not.
+ */
+static struct ssh_crypto_struct *pipeline_crypto(
+    ssh_session session, enum ssh_crypto_direction_e direction) {
+    struct ssh_crypto_struct *crypto;
+
+    if (session->pipeline == NULL) return NULL;
+
+    crypto = ssh_get_crypto(session, direction);
+    if (crypto == NULL) return NULL;
+
+    if (direction == SSH_DIRECTION_IN) {
+        if (!ssh_cipher_is_ctr(crypto->in_cipher) ||
+            hmac_digest_len(crypto->in_hmac) == 0) {
+            return NULL;
+        }
+    } else if (!ssh_cipher_is_ctr(crypto->out_cipher) ||
+               hmac_digest_len(crypto->out_hmac) == 0) {
+        return NULL;
+    }
+    return crypto;
+}
+
+bool ssh_pipeline_decrypts(ssh_session session) {
+    return ssh_pipeline_pending(session) ||
+           pipeline_crypto(session, SSH_DIRECTION_IN) != NULL;
+}
+
+/**
+ * @brief Whether a packet of `type` is sent through the workers. Only
+ * channel data is, the other packets are rare and may change the keys.
+ *
+ * @param session
+ * @param type
+ * @return bool
+ */
+bool ssh_pipeline_encrypts(ssh_session session, uint8_t type) {
+    return type == SSH_MSG_CHANNEL_DATA &&
+           pipeline_crypto(session, SSH_DIRECTION_OUT) != NULL;
+}
+
+/**
+ * @brief Whether received packets are ready for `ssh_pipeline_read`.
+ *
+ * @param session
+ * @return bool
+ */
+bool ssh_pipeline_pending(ssh_session session) {
+    return session->pipeline != NULL && session->pipeline->in.count > 0;
+}
+
+static int pipeline_job_reserve(struct pipeline_job *job, size_t size) {
+    uint8_t *data;
+
+    if (job->size >= size) return SSH_OK;
+
+    data = realloc(job->data, size);
+    if (data == NULL) return SSH_ERROR;
+    job->data = data;
+    job->size = size;
+    return SSH_OK;
+}
+
+static void pipeline_queue(ssh_pipeline pipeline, struct pipeline_ring *ring) {
+    pthread_mutex_lock(&pipeline->lock);
+    ring->jobs[(ring->head + ring->count) % SSH_PIPELINE_DEPTH].state =
+        PIPELINE_JOB_QUEUED;
+    ring->count++;
+    pthread_cond_signal(&pipeline->work);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+/**
+ * @brief Wait for the oldest job of `ring` and remove it. The caller reads
+ * its result before the next job is queued.
+ *
+ * @param pipeline
+ * @param ring
+ * @param wait if 0, return NULL instead of waiting
+ * @return struct pipeline_job*, NULL if not done.
+ */
+static struct pipeline_job *pipeline_done(ssh_pipeline pipeline,
+                                          struct pipeline_ring *ring,
+                                          int wait) {
+    struct pipeline_job *job = &ring->jobs[ring->head];
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (job->state != PIPELINE_JOB_DONE) {
+        if (!wait) {
+            pthread_mutex_unlock(&pipeline->lock);
+            return NULL;
+        }
+        pthread_cond_wait(&pipeline->done, &pipeline->lock);
+    }
+    ring->head = (ring->head + 1) % SSH_PIPELINE_DEPTH;
+    ring->count--;
+    ring->taken--;
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return job;
+}
+
+/**
+ * @brief Split the packets that have arrived, at least one, and queue them
+ * to the workers. During a key exchange only one is, the packets after
+ * SSH_MSG_NEWKEYS use the next keys (its type can not be seen here with
+ * compression).
+ *
+ * @param session
+ * @return SSH_OK or SSH_ERROR
+ */
+static int pipeline_fill(ssh_session session) {
+    ssh_pipeline pipeline = session->pipeline;
+    struct ssh_crypto_struct *crypto;
+    struct ssh_cipher_struct *cipher;
+    struct pipeline_job *job;
+    ssh_socket s = session->socket;
+    uint8_t first[CTR_IV_MAX_LEN];
+    uint32_t blocksize, packet_len;
+    uint32_t seq = session->recv_seq;
+    size_t maclen, total, offset = 0;
+    uint64_t block;
+    uint8_t *data;
+    bool etm;
+    int rc;
+
+    crypto = ssh_get_crypto(session, SSH_DIRECTION_IN);
+    cipher = crypto->in_cipher;
+    blocksize = cipher->blocksize;
+    maclen = hmac_digest_len(crypto->in_hmac);
+    etm = crypto->in_hmac_etm;
+    block = cipher->ctr_blocks;
+
+    /* wait for one block, then take what else has arrived */
+    rc = ssh_socket_read_ahead(s, blocksize, 1);
+    if (rc < 0) return SSH_ERROR;
+    rc = ssh_socket_read_ahead(s, SSH_PIPELINE_READ_AHEAD, 0);
+    if (rc < 0) return SSH_ERROR;
+
+    while (pipeline->in.count < SSH_PIPELINE_DEPTH &&
+           ssh_buffer_get_len(s->in_buffer) >= offset + blocksize) {
+        data = (uint8_t *)ssh_buffer_get(s->in_buffer) + offset;
+        memcpy(first, data, blocksize);
+        /* with encrypt-then-MAC the length field is in clear, and the rest
+         * is decrypted once the MAC is checked */
+        if (!etm) {
+            rc = ssh_cipher_ctr_crypt(cipher, pipeline->ctx,
+                                      crypto->decryptkey, block, first,
+                                      blocksize);
+            if (rc != SSH_OK) {
+                ssh_set_error(SSH_FATAL, "decryption error");
+                return SSH_ERROR;
+            }
+        }
+        memcpy(&packet_len, first, sizeof(uint32_t));
+        packet_len = ntohl(packet_len);
+        /* at least the padding length and four bytes of padding */
+        if (packet_len < 1 + 4 || packet_len > PIPELINE_MAX_PACKET_LEN ||
+            (packet_len + (etm ? 0 : sizeof(uint32_t))) % blocksize != 0) {
+            ssh_set_error(SSH_FATAL, "invalid packet length %u", packet_len);
+            return SSH_ERROR;
+        }
+
+        total = sizeof(uint32_t) + packet_len + maclen;
+        if (ssh_buffer_get_len(s->in_buffer) < offset + total) {
+            /* the rest of the batch waits for the next call */
+            if (pipeline->in.count > 0) break;
+            rc = ssh_socket_read_ahead(s, offset + total, 1);
+            if (rc < 0) return SSH_ERROR;
+            data = (uint8_t *)ssh_buffer_get(s->in_buffer) + offset;
+        }
+
+        job = &pipeline->in.jobs[(pipeline->in.head + pipeline->in.count) %
+                                 SSH_PIPELINE_DEPTH];
+        if (pipeline_job_reserve(job, total) != SSH_OK) return SSH_ERROR;
+        memcpy(job->data, first, blocksize);
+        memcpy(job->data + blocksize, data + blocksize, total - blocksize);
+        job->len = sizeof(uint32_t) + packet_len;
+        job->skip = etm ? sizeof(uint32_t) : blocksize;
+        job->seq = seq++;
+        job->block = etm ? block : block + 1;
+        job->encrypt = 0;
+        job->etm = etm;
+        job->cipher = cipher;
+        job->key = crypto->decryptkey;
+        job->mac_key = crypto->decryptMAC;
+        job->hmac = crypto->in_hmac;
+        pipeline_queue(pipeline, &pipeline->in);
+
+        block += (job->len - (etm ? sizeof(uint32_t) : 0)) / blocksize;
+        offset += total;
+        if (session->kex_running) break;
+    }
+
+    ssh_buffer_pass_bytes(s->in_buffer, offset);
+    ssh_cipher_ctr_skip(cipher, block - cipher->ctr_blocks);
+    return SSH_OK;
+}
+
+/**
+ * @brief Put the next received packet, decrypted and verified, into
+ * `in_buffer`, from its length field on, without the MAC.
+ *
+ * @param session
+ * @return SSH_OK or SSH_ERROR
+ */
+int ssh_pipeline_read(ssh_session session) {
+    ssh_pipeline pipeline = session->pipeline;
+    struct pipeline_job *job;
+    int rc;
+
+    if (pipeline->in.count == 0) {
+        rc = pipeline_fill(session);
+        if (rc != SSH_OK) return rc;
+    }
+
+    job = pipeline_done(pipeline, &pipeline->in, 1);
+    session->stats.decrypt_ns += job->cipher_ns;
+    session->stats.mac_in_ns += job->mac_ns;
+    if (job->rc != SSH_OK) {
+        LOG_ERROR("MAC verification failed");
+        ssh_set_error(SSH_FATAL, "hmac error");
+        return SSH_ERROR;
+    }
+
+    rc = ssh_buffer_reinit(session->in_buffer);
+    if (rc < 0) return SSH_ERROR;
+    rc = ssh_buffer_add_data(session->in_buffer, job->data, job->len);
+    if (rc < 0) return SSH_ERROR;
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Write the oldest packet queued for sending.
+ *
+ * @param session
+ * @param wait if 0, return SSH_AGAIN if it is not encrypted yet
+ * @return SSH_OK, SSH_AGAIN or SSH_ERROR
+ */
+static int pipeline_write(ssh_session session, int wait) {
+    ssh_pipeline pipeline = session->pipeline;
+    struct pipeline_job *job;
+
+    job = pipeline_done(pipeline, &pipeline->out, wait);
+    if (job == NULL) return SSH_AGAIN;
+
+    session->stats.encrypt_ns += job->cipher_ns;
+    session->stats.mac_out_ns += job->mac_ns;
+    if (job->rc != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "encryption error");
+        return SSH_ERROR;
+    }
+
+    if (ssh_socket_write(session->socket, job->data,
+                         job->len + hmac_digest_len(job->hmac)) < 0) {
+        return SSH_ERROR;
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Queue the packet in `out_buffer`, padded but not encrypted, to the
+ * workers, and write the packets done meanwhile. `send_seq` is the
+ * sequence number of the packet.
+ *
+ * @param session
+ * @return SSH_OK or SSH_ERROR
+ */
+int ssh_pipeline_send(ssh_session session) {
+    ssh_pipeline pipeline = session->pipeline;
+    struct ssh_crypto_struct *crypto;
+    struct pipeline_job *job;
+    uint32_t len;
+    int rc;
+
+    crypto = ssh_get_crypto(session, SSH_DIRECTION_OUT);
+    len = ssh_buffer_get_len(session->out_buffer);
+
+    if (pipeline->out.count == SSH_PIPELINE_DEPTH) {
+        rc = pipeline_write(session, 1);
+        if (rc != SSH_OK) return rc;
+    }
+
+    job = &pipeline->out.jobs[(pipeline->out.head + pipeline->out.count) %
+                              SSH_PIPELINE_DEPTH];
+    if (pipeline_job_reserve(job, len + hmac_digest_len(crypto->out_hmac)) !=
+        SSH_OK) {
+        return SSH_ERROR;
+    }
+    memcpy(job->data, ssh_buffer_get(session->out_buffer), len);
+    job->len = len;
+    /* with encrypt-then-MAC the length field is left in clear */
+    job->skip = crypto->out_hmac_etm ? sizeof(uint32_t) : 0;
+    job->seq = session->send_seq;
+    job->block = crypto->out_cipher->ctr_blocks;
+    job->encrypt = 1;
+    job->etm = crypto->out_hmac_etm;
+    job->cipher = crypto->out_cipher;
+    job->key = crypto->encryptkey;
+    job->mac_key = crypto->encryptMAC;
+    job->hmac = crypto->out_hmac;
+    ssh_cipher_ctr_skip(crypto->out_cipher,
+                        (len - job->skip) / crypto->out_cipher->blocksize);
+    pipeline_queue(pipeline, &pipeline->out);
+
+    while (pipeline->out.count > 0) {
+        rc = pipeline_write(session, 0);
+        if (rc == SSH_AGAIN) break;
+        if (rc != SSH_OK) return rc;
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Write all the packets queued for sending.
+ *
+ * @param session
+ * @return SSH_OK or SSH_ERROR
+ */
+int ssh_pipeline_flush(ssh_session session) {
+    int rc;
+
+    if (session->pipeline == NULL) return SSH_OK;
+
+    while (session->pipeline->out.count > 0) {
+        rc = pipeline_write(session, 1);
+        if (rc != SSH_OK) return rc;
+    }
+    return SSH_OK;
+}
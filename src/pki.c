@@ -0,0 +1,219 @@
+/**
+ * @file pki.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Host keys of the server role.
+ * Only what the in-tree test server needs: an "ssh-rsa" key loaded from a PEM
+ * file or generated on the fly, its public key blob and signatures on the
+ * exchange hash.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "libsftp/pki.h"
+
+#include <openssl/pem.h>
+#include <stdio.h>
+
+#include "libsftp/buffer.h"
+#include "libsftp/error.h"
+#include "libsftp/logger.h"
+#include "libsftp/string.h"
+#include "libsftp/util.h"
+
+ssh_key ssh_key_new(void) {
+    ssh_key key;
+
+    key = calloc(1, sizeof(struct ssh_key_struct));
+    if (key == NULL) return NULL;
+
+    key->type = SSH_KEYTYPE_UNKNOWN;
+    key->type_c = "unknown";
+
+    return key;
+}
+
+void ssh_key_free(ssh_key key) {
+    if (key == NULL) return;
+
+    RSA_free(key->rsa);
+    DSA_free(key->dsa);
+    SAFE_FREE(key);
+}
+
+static ssh_key pki_key_from_rsa(RSA *rsa) {
+    ssh_key key;
+
+    key = ssh_key_new();
+    if (key == NULL) {
+        RSA_free(rsa);
+        return NULL;
+    }
+
+    key->type = SSH_KEYTYPE_RSA;
+    key->type_c = "ssh-rsa";
+    key->rsa = rsa;
+
+    return key;
+}
+
+/**
+ * @brief Another reference to the same key material, freed independently.
+ *
+ * @param key
+ * @return ssh_key, NULL on error.
+ */
+ssh_key ssh_key_dup(const ssh_key key) {
+    if (key == NULL || key->type != SSH_KEYTYPE_RSA) return NULL;
+
+    if (RSA_up_ref(key->rsa) != 1) return NULL;
+    return pki_key_from_rsa(key->rsa);
+}
+
+/**
+ * @brief Generate an RSA key pair.
+ *
+ * @param bits modulus size
+ * @return ssh_key, NULL on error.
+ */
+ssh_key ssh_pki_generate_rsa(int bits) {
+    BIGNUM *e = NULL;
+    RSA *rsa = NULL;
+    int rc;
+
+    e = BN_new();
+    rsa = RSA_new();
+    if (e == NULL || rsa == NULL) goto error;
+
+    rc = BN_set_word(e, RSA_F4);
+    if (rc != 1) goto error;
+
+    rc = RSA_generate_key_ex(rsa, bits, e, NULL);
+    if (rc != 1) goto error;
+
+    BN_free(e);
+    return pki_key_from_rsa(rsa);
+
+error:
+    ssh_set_error(SSH_FATAL, "can not generate a %d bits RSA key", bits);
+    BN_free(e);
+    RSA_free(rsa);
+    return NULL;
+}
+
+/**
+ * @brief Load an unencrypted RSA private key in PEM format.
+ *
+ * @param filename
+ * @return ssh_key, NULL on error.
+ */
+ssh_key ssh_pki_import_privkey_file(const char *filename) {
+    RSA *rsa;
+    FILE *fp;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        ssh_set_error(SSH_REQUEST_DENIED, "can not open host key %s",
+                      filename);
+        return NULL;
+    }
+
+    rsa = PEM_read_RSAPrivateKey(fp, NULL, NULL, NULL);
+    fclose(fp);
+    if (rsa == NULL) {
+        ssh_set_error(SSH_REQUEST_DENIED, "%s is not an RSA private key",
+                      filename);
+        return NULL;
+    }
+
+    return pki_key_from_rsa(rsa);
+}
+
+static ssh_string pki_buffer_to_string(ssh_buffer buffer) {
+    ssh_string str;
+
+    str = ssh_string_new(ssh_buffer_get_len(buffer));
+    if (str == NULL) return NULL;
+
+    ssh_string_fill(str, ssh_buffer_get(buffer), ssh_buffer_get_len(buffer));
+    return str;
+}
+
+/**
+ * @brief Public key blob sent in SSH_MSG_KEXDH_REPLY.
+ *  string    "ssh-rsa"
+ *  mpint     e
+ *  mpint     n
+ *
+ * @see RFC 4253 section 6.6
+ * @param key
+ * @return ssh_string
+ */
+ssh_string ssh_pki_export_pubkey_blob(const ssh_key key) {
+    const BIGNUM *n, *e;
+    ssh_buffer buffer;
+    ssh_string blob = NULL;
+    int rc;
+
+    if (key == NULL || key->type != SSH_KEYTYPE_RSA) return NULL;
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) return NULL;
+
+    RSA_get0_key(key->rsa, &n, &e, NULL);
+    rc = ssh_buffer_pack(buffer, "sBB", key->type_c, e, n);
+    if (rc == SSH_OK) {
+        blob = pki_buffer_to_string(buffer);
+    }
+
+    ssh_buffer_free(buffer);
+    return blob;
+}
+
+/**
+ * @brief Sign the exchange hash H.
+ *  string    "ssh-rsa"
+ *  string    rsa_signature_blob
+ *
+ * @see RFC 4253 section 6.6
+ * @param key
+ * @param hash
+ * @param hlen
+ * @return ssh_string signature blob, NULL on error.
+ */
+ssh_string ssh_pki_do_sign(const ssh_key key, const unsigned char *hash,
+                           size_t hlen) {
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    unsigned char *sig = NULL;
+    unsigned int slen = 0;
+    ssh_buffer buffer = NULL;
+    ssh_string blob = NULL;
+    int rc;
+
+    if (key == NULL || key->type != SSH_KEYTYPE_RSA) return NULL;
+
+    /* "ssh-rsa" signs with SHA-1 */
+    sha1(hash, hlen, digest);
+
+    sig = malloc(RSA_size(key->rsa));
+    buffer = ssh_buffer_new();
+    if (sig == NULL || buffer == NULL) goto out;
+
+    rc = RSA_sign(NID_sha1, digest, sizeof(digest), sig, &slen, key->rsa);
+    if (rc != 1) {
+        ssh_set_error(SSH_FATAL, "RSA signature failed");
+        goto out;
+    }
+
+    rc = ssh_buffer_pack(buffer, "sdP", key->type_c, slen, (size_t)slen, sig);
+    if (rc == SSH_OK) {
+        blob = pki_buffer_to_string(buffer);
+    }
+
+out:
+    SAFE_FREE(sig);
+    ssh_buffer_free(buffer);
+    return blob;
+}
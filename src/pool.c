@@ -0,0 +1,303 @@
+/**
+ * @file pool.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Pool of authenticated SFTP sessions.
+ * Sessions handed back to the pool stay connected and are reused by the next
+ * `ssh_pool_get` for the same user, host and port, which saves the TCP
+ * connect, key exchange and user authentication of short transfers.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "libsftp/error.h"
+#include "libsftp/libsftp.h"
+#include "libsftp/logger.h"
+#include "libsftp/session.h"
+#include "libsftp/util.h"
+
+/* An idle session older than this is checked before being reused */
+#define POOL_CHECK_INTERVAL 5
+/* Milliseconds to wait for a keepalive reply */
+#define POOL_CHECK_TIMEOUT 3000
+
+struct ssh_pool_entry {
+    sftp_session sftp;
+    ssh_session session;
+    char *host; /* user@host as given to `ssh_pool_get` */
+    unsigned int port;
+    time_t last_used;
+    struct ssh_pool_entry *next;
+};
+
+struct ssh_pool_struct {
+    pthread_mutex_t lock;
+    struct ssh_pool_entry *idle; /* ready to be handed out, newest first */
+    struct ssh_pool_entry *busy; /* handed out */
+    unsigned int max_idle;       /* idle sessions kept per user/host/port */
+    unsigned int idle_timeout;   /* seconds before an idle session is closed */
+};
+
+static void pool_entry_free(struct ssh_pool_entry *entry) {
+    if (entry == NULL) return;
+
+    sftp_free(entry->sftp);
+    ssh_disconnect(entry->session);
+    ssh_free(entry->session);
+    SAFE_FREE(entry->host);
+    SAFE_FREE(entry);
+}
+
+static void pool_entry_list_free(struct ssh_pool_entry *list) {
+    struct ssh_pool_entry *next;
+
+    while (list != NULL) {
+        next = list->next;
+        pool_entry_free(list);
+        list = next;
+    }
+}
+
+static int pool_entry_match(struct ssh_pool_entry *entry, const char *host,
+                            unsigned int port) {
+    return entry->port == port && strcmp(entry->host, host) == 0;
+}
+
+/**
+ * @brief Unlink idle entries older than `idle_timeout`. Called with the lock
+ * held, the caller frees the returned list without it.
+ *
+ * @param pool
+ * @param now
+ * @return struct ssh_pool_entry* expired entries
+ */
+static struct ssh_pool_entry *pool_expire(ssh_pool pool, time_t now) {
+    struct ssh_pool_entry **pp = &pool->idle;
+    struct ssh_pool_entry *expired = NULL;
+    struct ssh_pool_entry *entry;
+
+    while (*pp != NULL) {
+        entry = *pp;
+        if (pool->idle_timeout != 0 &&
+            now - entry->last_used >= pool->idle_timeout) {
+            *pp = entry->next;
+            entry->next = expired;
+            expired = entry;
+        } else {
+            pp = &entry->next;
+        }
+    }
+
+    return expired;
+}
+
+/**
+ * @brief Connect, authenticate and start SFTP on a new session.
+ *
+ * @param host
+ * @param port
+ * @param password
+ * @return struct ssh_pool_entry*
+ */
+static struct ssh_pool_entry *pool_entry_new(const char *host,
+                                             unsigned int port,
+                                             const char *password) {
+    struct ssh_pool_entry *entry;
+    int rc;
+
+    entry = calloc(1, sizeof(struct ssh_pool_entry));
+    if (entry == NULL) return NULL;
+
+    entry->host = strdup(host);
+    entry->port = port;
+    entry->session = ssh_new();
+    if (entry->host == NULL || entry->session == NULL) goto error;
+
+    rc = ssh_options_set(entry->session, SSH_OPTIONS_HOST, host);
+    rc |= ssh_options_set(entry->session, SSH_OPTIONS_PORT, &port);
+    if (rc != SSH_OK) goto error;
+
+    rc = ssh_connect(entry->session);
+    if (rc != SSH_OK) goto error;
+
+    rc = ssh_userauth_password(entry->session, password);
+    if (rc != SSH_OK) goto error;
+
+    entry->sftp = sftp_new(entry->session);
+    if (entry->sftp == NULL) goto error;
+
+    rc = sftp_init(entry->sftp);
+    if (rc != SSH_OK) goto error;
+
+    LOG_INFO("pool: new session to %s:%u", host, port);
+    return entry;
+
+error:
+    LOG_ERROR("pool: can not create session to %s:%u", host, port);
+    pool_entry_free(entry);
+    return NULL;
+}
+
+ssh_pool ssh_pool_new(unsigned int max_idle, unsigned int idle_timeout) {
+    ssh_pool pool;
+
+    pool = calloc(1, sizeof(struct ssh_pool_struct));
+    if (pool == NULL) {
+        ssh_set_error(SSH_FATAL, "can not create pool");
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->max_idle = max_idle;
+    pool->idle_timeout = idle_timeout;
+
+    return pool;
+}
+
+sftp_session ssh_pool_get(ssh_pool pool, const char *host, unsigned int port,
+                          const char *password) {
+    struct ssh_pool_entry **pp;
+    struct ssh_pool_entry *entry;
+    struct ssh_pool_entry *expired;
+    time_t now;
+
+    if (pool == NULL || host == NULL) {
+        ssh_set_error(SSH_REQUEST_DENIED, "invalid params");
+        return NULL;
+    }
+
+    while (1) {
+        now = time(NULL);
+        entry = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        expired = pool_expire(pool, now);
+        for (pp = &pool->idle; *pp != NULL; pp = &(*pp)->next) {
+            if (pool_entry_match(*pp, host, port)) {
+                entry = *pp;
+                *pp = entry->next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_entry_list_free(expired);
+
+        if (entry == NULL) {
+            entry = pool_entry_new(host, port, password);
+            if (entry == NULL) return NULL;
+            break;
+        }
+
+        /* the server or a middlebox may have dropped a quiet connection */
+        if (now - entry->last_used < POOL_CHECK_INTERVAL ||
+            ssh_send_keepalive(entry->session, POOL_CHECK_TIMEOUT) == SSH_OK) {
+            break;
+        }
+        LOG_NOTICE("pool: dropping dead session to %s:%u", host, port);
+        pool_entry_free(entry);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    entry->next = pool->busy;
+    pool->busy = entry;
+    pthread_mutex_unlock(&pool->lock);
+
+    return entry->sftp;
+}
+
+/**
+ * @brief Unlink the busy entry of `sftp`.
+ *
+ * @param pool
+ * @param sftp
+ * @return struct ssh_pool_entry*, NULL if `sftp` is not from this pool.
+ */
+static struct ssh_pool_entry *pool_take_busy(ssh_pool pool,
+                                             sftp_session sftp) {
+    struct ssh_pool_entry **pp;
+    struct ssh_pool_entry *entry = NULL;
+
+    for (pp = &pool->busy; *pp != NULL; pp = &(*pp)->next) {
+        if ((*pp)->sftp == sftp) {
+            entry = *pp;
+            *pp = entry->next;
+            entry->next = NULL;
+            break;
+        }
+    }
+
+    return entry;
+}
+
+void ssh_pool_put(ssh_pool pool, sftp_session sftp) {
+    struct ssh_pool_entry *entry;
+    struct ssh_pool_entry *expired;
+    struct ssh_pool_entry *it;
+    unsigned int count = 0;
+    time_t now = time(NULL);
+
+    if (pool == NULL || sftp == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    entry = pool_take_busy(pool, sftp);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        LOG_ERROR("pool: session %p does not belong to the pool", sftp);
+        return;
+    }
+
+    expired = pool_expire(pool, now);
+    for (it = pool->idle; it != NULL; it = it->next) {
+        if (pool_entry_match(it, entry->host, entry->port)) count++;
+    }
+    if (count < pool->max_idle) {
+        entry->last_used = now;
+        entry->next = pool->idle;
+        pool->idle = entry;
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    /* pool is full for this host */
+    pool_entry_free(entry);
+    pool_entry_list_free(expired);
+}
+
+void ssh_pool_discard(ssh_pool pool, sftp_session sftp) {
+    struct ssh_pool_entry *entry;
+
+    if (pool == NULL || sftp == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    entry = pool_take_busy(pool, sftp);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_entry_free(entry);
+}
+
+void ssh_pool_prune(ssh_pool pool) {
+    struct ssh_pool_entry *expired;
+
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    expired = pool_expire(pool, time(NULL));
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_entry_list_free(expired);
+}
+
+void ssh_pool_free(ssh_pool pool) {
+    if (pool == NULL) return;
+
+    pool_entry_list_free(pool->idle);
+    pool_entry_list_free(pool->busy);
+    pthread_mutex_destroy(&pool->lock);
+    SAFE_FREE(pool);
+}
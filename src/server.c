@@ -0,0 +1,274 @@
+/**
+ * @file server.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Server role of the SSH transport and user authentication layers.
+ * It runs the same packet, kex and crypto code as the client with the
+ * directions swapped (see `session->server`), so the library can be measured
+ * against itself over loopback or a socketpair, without a remote sshd.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "libsftp/error.h"
+#include "libsftp/kex.h"
+#include "libsftp/dh.h"
+#include "libsftp/libssh.h"
+#include "libsftp/logger.h"
+#include "libsftp/packet.h"
+#include "libsftp/pki.h"
+#include "libsftp/session.h"
+#include "libsftp/socket.h"
+
+/* Size of the host key generated when SSH_OPTIONS_HOSTKEY is not set */
+#define SERVER_EPHEMERAL_KEY_BITS 2048
+
+/* USERAUTH_REQUESTs accepted before the connection is dropped */
+#define SERVER_MAX_AUTH_TRIES 6
+
+static ssh_key server_ephemeral_key;
+static pthread_once_t server_key_once = PTHREAD_ONCE_INIT;
+
+static void server_ephemeral_key_init(void) {
+    LOG_NOTICE("generating a %d bits ephemeral host key",
+               SERVER_EPHEMERAL_KEY_BITS);
+    server_ephemeral_key = ssh_pki_generate_rsa(SERVER_EPHEMERAL_KEY_BITS);
+}
+
+int ssh_server_init(void) {
+    pthread_once(&server_key_once, server_ephemeral_key_init);
+    return server_ephemeral_key != NULL ? SSH_OK : SSH_ERROR;
+}
+
+/**
+ * @brief Load the host key given with SSH_OPTIONS_HOSTKEY, or take a
+ * reference on the ephemeral one.
+ *
+ * @param session
+ * @return int
+ */
+static int server_set_hostkey(ssh_session session) {
+    if (session->hostkey != NULL) return SSH_OK;
+
+    if (session->opts.hostkey != NULL) {
+        session->hostkey = ssh_pki_import_privkey_file(session->opts.hostkey);
+    } else if (ssh_server_init() == SSH_OK) {
+        session->hostkey = ssh_key_dup(server_ephemeral_key);
+    }
+
+    return session->hostkey != NULL ? SSH_OK : SSH_ERROR;
+}
+
+/**
+ * @brief Wait for the client to ask for the user authentication service.
+ *
+ * @param session
+ * @return int
+ */
+static int server_accept_service(ssh_session session) {
+    char *service = NULL;
+    uint8_t type;
+    int rc;
+
+    rc = ssh_packet_receive(session);
+    if (rc != SSH_OK) return rc;
+
+    rc = ssh_buffer_unpack(session->in_buffer, "bs", &type, &service);
+    if (rc != SSH_OK || type != SSH_MSG_SERVICE_REQUEST ||
+        strcmp(service, "ssh-userauth") != 0) {
+        LOG_ERROR("unexpected service request");
+        SAFE_FREE(service);
+        return SSH_ERROR;
+    }
+    SAFE_FREE(service);
+
+    rc = ssh_buffer_pack(session->out_buffer, "bs", SSH_MSG_SERVICE_ACCEPT,
+                         "ssh-userauth");
+    rc |= ssh_packet_send(session);
+    if (rc != SSH_OK) {
+        ssh_buffer_reinit(session->out_buffer);
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int ssh_accept(ssh_session session, int fd) {
+    int nodelay = 1;
+    int rc;
+
+    if (session == NULL || fd < 0) return SSH_ERROR;
+
+    session->server = 1;
+    ssh_socket_set_fd(session->socket, fd);
+    /* fails harmlessly on a socketpair */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    rc = ssh_socket_set_netem(session->socket, session->opts.netem);
+    if (rc != SSH_OK) {
+        LOG_ERROR("can not set up network emulation");
+        goto error;
+    }
+
+    rc = server_set_hostkey(session);
+    if (rc != SSH_OK) {
+        LOG_ERROR("no host key");
+        goto error;
+    }
+
+    /* 1. version exchange */
+    rc = send_id_str(session);
+    if (rc == SSH_ERROR) {
+        LOG_ERROR("can not send server id string");
+        goto error;
+    }
+
+    rc = receive_id_str(session);
+    if (rc == SSH_ERROR) {
+        LOG_ERROR("failed to receive client id str");
+        goto error;
+    }
+
+    /* 2. algorithm negotiation, both sides send their KEXINIT at once */
+    rc = ssh_set_client_kex(session);
+    rc |= ssh_send_kex(session);
+    if (rc != SSH_OK) {
+        LOG_ERROR("can not send server kex init message");
+        goto error;
+    }
+
+    rc = ssh_receive_kex(session);
+    if (rc != SSH_OK) {
+        LOG_ERROR("can not receive client kex init message");
+        goto error;
+    }
+
+    rc = ssh_select_kex(session);
+    if (rc != SSH_OK) {
+        LOG_ERROR("can not select an agreed cipher suite");
+        goto error;
+    }
+
+    /* 3. Diffie-Hellman key exchange */
+    rc = ssh_dh_handshake(session);
+    if (rc != SSH_OK) {
+        LOG_ERROR("can not perform DH handshake");
+        goto error;
+    }
+    LOG_NOTICE("DH handshake succeed");
+
+    /* 4. user authentication service */
+    rc = server_accept_service(session);
+    if (rc != SSH_OK) goto error;
+
+    return SSH_OK;
+
+error:
+    ssh_socket_close(session->socket);
+    ssh_set_error(SSH_REQUEST_DENIED, "ssh accept failed");
+    return SSH_ERROR;
+}
+
+/**
+ * @brief Answer a USERAUTH_REQUEST with SSH_MSG_USERAUTH_FAILURE, password
+ * being the only method that can continue.
+ *
+ * @param session
+ * @return int
+ */
+static int server_auth_failure(ssh_session session) {
+    int rc;
+
+    rc = ssh_buffer_pack(session->out_buffer, "bsb", SSH_MSG_USERAUTH_FAILURE,
+                         "password", 0);
+    rc |= ssh_packet_send(session);
+    if (rc != SSH_OK) {
+        ssh_buffer_reinit(session->out_buffer);
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int ssh_server_auth_password(ssh_session session, const char *password) {
+    char *user = NULL, *service = NULL, *method = NULL, *given = NULL;
+    uint8_t change;
+    uint8_t type;
+    int tries;
+    int rc;
+
+    if (session == NULL || !session->server) return SSH_ERROR;
+
+    for (tries = 0; tries < SERVER_MAX_AUTH_TRIES; tries++) {
+        rc = ssh_packet_receive(session);
+        if (rc != SSH_OK) return SSH_ERROR;
+
+        ssh_buffer_get_u8(session->in_buffer, &type);
+        if (type != SSH_MSG_USERAUTH_REQUEST) {
+            LOG_ERROR("unexpected message %d during authentication", type);
+            return SSH_ERROR;
+        }
+
+        rc = ssh_buffer_unpack(session->in_buffer, "sss", &user, &service,
+                               &method);
+        if (rc != SSH_OK) return SSH_ERROR;
+
+        if (strcmp(service, "ssh-connection") == 0 &&
+            strcmp(method, "password") == 0 &&
+            ssh_buffer_unpack(session->in_buffer, "bs", &change, &given) ==
+                SSH_OK &&
+            !change && (password == NULL || strcmp(password, given) == 0)) {
+            break;
+        }
+
+        LOG_INFO("authentication of %s with %s failed", user, method);
+        SAFE_FREE(user);
+        SAFE_FREE(service);
+        SAFE_FREE(method);
+        if (given != NULL) {
+            explicit_bzero(given, strlen(given));
+            SAFE_FREE(given);
+        }
+        if (server_auth_failure(session) != SSH_OK) return SSH_ERROR;
+    }
+
+    if (tries == SERVER_MAX_AUTH_TRIES) {
+        ssh_set_error(SSH_REQUEST_DENIED, "too many authentication failures");
+        return SSH_ERROR;
+    }
+
+    explicit_bzero(given, strlen(given));
+    SAFE_FREE(given);
+    SAFE_FREE(service);
+    SAFE_FREE(method);
+    SAFE_FREE(session->opts.username);
+    session->opts.username = user;
+
+    rc = ssh_buffer_add_u8(session->out_buffer, SSH_MSG_USERAUTH_SUCCESS);
+    rc |= ssh_packet_send(session);
+    if (rc != SSH_OK) {
+        ssh_buffer_reinit(session->out_buffer);
+        return SSH_ERROR;
+    }
+
+    LOG_NOTICE("user %s authenticated", session->opts.username);
+    session->authenticated = 1;
+    /* zlib@openssh.com starts right after SSH_MSG_USERAUTH_SUCCESS */
+    if (session->current_crypto->delayed_compress_in) {
+        LOG_INFO("enabling delayed compression in");
+        session->current_crypto->do_compress_in = 1;
+    }
+    if (session->current_crypto->delayed_compress_out) {
+        LOG_INFO("enabling delayed compression out");
+        session->current_crypto->do_compress_out = 1;
+    }
+
+    return SSH_OK;
+}
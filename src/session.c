@@ -13,20 +13,28 @@
 
 #include "libsftp/session.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "libsftp/auth.h"
 #include "libsftp/dh.h"
 #include "libsftp/error.h"
+#include "libsftp/gzip.h"
 #include "libsftp/kex.h"
 #include "libsftp/knownhosts.h"
 #include "libsftp/logger.h"
+#include "libsftp/packet.h"
 
 /* We name the client identification string as the following in our
  * implementation */
 #define CLIENT_ID_STR "SSH-2.0-minissh_0.1.0"
 
+/* Renew session keys after 1 GB of traffic or one hour, like OpenSSH */
+#define REKEY_DATA_DEFAULT (1ULL << 30)
+#define REKEY_TIME_DEFAULT 3600
+
 ssh_session ssh_new(void) {
+    pthread_mutexattr_t attr;
     ssh_session session;
     int rc;
 
@@ -35,6 +43,15 @@ ssh_session ssh_new(void) {
         return NULL;
     }
 
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    rc = pthread_mutex_init(&session->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0) {
+        SAFE_FREE(session);
+        return NULL;
+    }
+
     session->next_crypto = crypto_new();
     if (session->next_crypto == NULL) {
         goto err;
@@ -46,7 +63,9 @@ ssh_session ssh_new(void) {
     }
 
     session->out_buffer = ssh_buffer_new();
-    if (session->out_buffer == NULL) {
+    if (session->out_buffer == NULL ||
+        ssh_buffer_reserve(session->out_buffer, SSH_PACKET_HEADROOM,
+                           SSH_PACKET_TAILROOM) < 0) {
         goto err;
     }
 
@@ -55,11 +74,24 @@ ssh_session ssh_new(void) {
         goto err;
     }
 
+    session->in_pending = ssh_buffer_new();
+    if (session->in_pending == NULL) {
+        goto err;
+    }
+
     /* OPTIONS */
     session->opts.username = ssh_get_local_username();
     session->opts.port = 22;
     session->opts.sshdir = ssh_get_home_dir();
     session->opts.knownhosts = ssh_get_known_hosts();
+    session->opts.rekey_data = REKEY_DATA_DEFAULT;
+    session->opts.rekey_time = REKEY_TIME_DEFAULT;
+    session->opts.compressionlevel = SSH_COMPRESSION_LEVEL_DEFAULT;
+
+    ssh_log_init();
+    session->opts.log_level = ssh_log_level;
+
+    ssh_trace_env_start(session);
 
     return session;
 
@@ -71,13 +103,159 @@ err:
 void ssh_free(ssh_session session) {
     if (session == NULL) return;
 
+    ssh_trace_env_dump(session);
+    ssh_trace_free(session->trace);
+    /* its jobs point to the keys */
+    ssh_pipeline_free(session->pipeline);
+
     ssh_socket_free(session->socket);
     session->socket = NULL;
 
     ssh_buffer_free(session->in_buffer);
     ssh_buffer_free(session->out_buffer);
+    ssh_buffer_free(session->in_pending);
+    ssh_buffer_free(session->in_hashbuf);
+    ssh_buffer_free(session->out_hashbuf);
 
+    crypto_free(session->current_crypto);
     crypto_free(session->next_crypto);
+
+    SAFE_FREE(session->server_id_str);
+    SAFE_FREE(session->client_id_str);
+    ssh_string_free(session->banner);
+    SAFE_FREE(session->opts.username);
+    SAFE_FREE(session->opts.host);
+    SAFE_FREE(session->opts.sshdir);
+    SAFE_FREE(session->opts.knownhosts);
+    SAFE_FREE(session->opts.pubkey_accepted_types);
+    SAFE_FREE(session->opts.custombanner);
+    SAFE_FREE(session->opts.hostkey);
+    SAFE_FREE(session->opts.netem);
+    ssh_key_free(session->hostkey);
+    pthread_mutex_destroy(&session->lock);
+    SAFE_FREE(session);
+}
+
+void ssh_session_lock(ssh_session session) {
+    if (session != NULL) pthread_mutex_lock(&session->lock);
+}
+
+void ssh_session_unlock(ssh_session session) {
+    if (session != NULL) pthread_mutex_unlock(&session->lock);
+}
+
+/**
+ * @brief Method negotiated for the outgoing direction.
+ *
+ * @param session
+ * @param c_s the client to server index, the server to client one follows
+ * @return const char*, NULL before the key exchange.
+ */
+static const char *ssh_get_method_out(ssh_session session,
+                                      enum ssh_kex_types_e c_s) {
+    if (session == NULL || session->current_crypto == NULL) return NULL;
+
+    return session->current_crypto->kex_methods[session->server ? c_s + 1
+                                                                : c_s];
+}
+
+const char *ssh_get_cipher_out(ssh_session session) {
+    return ssh_get_method_out(session, SSH_CRYPT_C_S);
+}
+
+const char *ssh_get_hmac_out(ssh_session session) {
+    return ssh_get_method_out(session, SSH_MAC_C_S);
+}
+
+const char *ssh_get_compression_out(ssh_session session) {
+    return ssh_get_method_out(session, SSH_COMP_C_S);
+}
+
+/**
+ * @brief Take a snapshot of the counters of a session. The connection layer
+ * ones are summed over its channels.
+ *
+ * @param session
+ * @param stats
+ * @return int
+ */
+int ssh_get_stats(ssh_session session, struct ssh_stats *stats) {
+    if (session == NULL || stats == NULL) return SSH_ERROR;
+
+    *stats = session->stats;
+    ssh_channel_stats_sum(session, &stats->channels);
+    return SSH_OK;
+}
+
+/**
+ * @brief Send SSH_MSG_DISCONNECT and close the connection. The session
+ * still has to be freed with `ssh_free`.
+ *
+ * @param session
+ */
+void ssh_disconnect(ssh_session session) {
+    int rc;
+
+    if (session == NULL || session->socket == NULL) return;
+
+    if (session->socket->fd > 0 && session->current_crypto != NULL) {
+        rc = ssh_buffer_pack(session->out_buffer, "bdss", SSH_MSG_DISCONNECT,
+                             SSH_DISCONNECT_BY_APPLICATION, "Bye Bye", "");
+        if (rc == SSH_OK) {
+            ssh_packet_send(session);
+        }
+        ssh_buffer_reinit(session->out_buffer);
+    }
+
+    ssh_socket_close(session->socket);
+}
+
+/**
+ * @brief Check that the server still answers with a keepalive@openssh.com
+ * global request. Both SSH_MSG_REQUEST_SUCCESS and SSH_MSG_REQUEST_FAILURE
+ * prove the connection alive.
+ *
+ * @param session
+ * @param timeout milliseconds to wait for each reply packet
+ * @return SSH_OK if the server replied, SSH_ERROR otherwise.
+ */
+int ssh_send_keepalive(ssh_session session, int timeout) {
+    uint8_t type;
+    int rc;
+
+    rc = ssh_buffer_pack(session->out_buffer, "bsb", SSH_MSG_GLOBAL_REQUEST,
+                         "keepalive@openssh.com", 1);
+    if (rc != SSH_OK) goto error;
+
+    rc = ssh_packet_send(session);
+    if (rc != SSH_OK) goto error;
+
+    while (1) {
+        rc = ssh_socket_wait(session->socket, timeout);
+        if (rc != 1) {
+            LOG_WARNING("no keepalive reply from %s", session->opts.host);
+            return SSH_ERROR;
+        }
+
+        rc = ssh_packet_receive(session);
+        if (rc != SSH_OK) return SSH_ERROR;
+
+        ssh_buffer_get_u8(session->in_buffer, &type);
+        switch (type) {
+            case SSH_MSG_REQUEST_SUCCESS:
+            case SSH_MSG_REQUEST_FAILURE:
+                return SSH_OK;
+            default:
+                /* the server may check us the same way, or send data */
+                rc = ssh_channel_dispatch(session, type);
+                if (rc != SSH_OK) return SSH_ERROR;
+                break;
+        }
+    }
+
+error:
+    ssh_buffer_reinit(session->out_buffer);
+    return SSH_ERROR;
 }
 
 int ssh_options_set(ssh_session session, enum ssh_options_e type,
@@ -143,6 +321,103 @@ int ssh_options_set(ssh_session session, enum ssh_options_e type,
                 }
             }
             break;
+        case SSH_OPTIONS_REKEY_DATA:
+            if (value == NULL) {
+                return SSH_ERROR;
+            } else {
+                uint64_t *x = (uint64_t *)value;
+                /* 0 disables data based re-key */
+                session->opts.rekey_data = *x;
+            }
+            break;
+        case SSH_OPTIONS_REKEY_TIME:
+            if (value == NULL) {
+                return SSH_ERROR;
+            } else {
+                uint32_t *x = (uint32_t *)value;
+                /* 0 disables time based re-key */
+                session->opts.rekey_time = *x;
+            }
+            break;
+        case SSH_OPTIONS_COMPRESSION:
+            if (value == NULL) {
+                return SSH_ERROR;
+            } else {
+                int *x = (int *)value;
+                session->opts.compression = *x != 0;
+            }
+            break;
+        case SSH_OPTIONS_COMPRESSION_LEVEL:
+            if (value == NULL) {
+                return SSH_ERROR;
+            } else {
+                int *x = (int *)value;
+                if (*x < 1 || *x > 9) {
+                    ssh_set_error(SSH_REQUEST_DENIED,
+                                  "invalid compression level %d", *x);
+                    return SSH_ERROR;
+                }
+                session->opts.compressionlevel = *x;
+            }
+            break;
+        case SSH_OPTIONS_HOSTKEY:
+            v = value;
+            if (v == NULL || v[0] == '\0') {
+                return SSH_ERROR;
+            } else {
+                SAFE_FREE(session->opts.hostkey);
+                session->opts.hostkey = strdup(v);
+                if (session->opts.hostkey == NULL) {
+                    return SSH_ERROR;
+                }
+            }
+            break;
+        case SSH_OPTIONS_NETEM:
+            v = value;
+            if (v == NULL || v[0] == '\0') {
+                return SSH_ERROR;
+            } else {
+                SAFE_FREE(session->opts.netem);
+                session->opts.netem = strdup(v);
+                if (session->opts.netem == NULL) {
+                    return SSH_ERROR;
+                }
+            }
+            break;
+        case SSH_OPTIONS_LOG_LEVEL:
+            if (value == NULL) {
+                return SSH_ERROR;
+            } else {
+                int *x = (int *)value;
+                if (*x < SSH_LOG_DEBUG || *x > SSH_LOG_SILENT) {
+                    ssh_set_error(SSH_REQUEST_DENIED, "invalid log level %d",
+                                  *x);
+                    return SSH_ERROR;
+                }
+                session->opts.log_level = *x;
+            }
+            break;
+        case SSH_OPTIONS_CRYPTO_THREADS:
+            if (value == NULL) {
+                return SSH_ERROR;
+            } else {
+                unsigned int *x = (unsigned int *)value;
+                if (*x > SSH_PIPELINE_MAX_THREADS) {
+                    ssh_set_error(SSH_REQUEST_DENIED,
+                                  "invalid number of crypto threads %u", *x);
+                    return SSH_ERROR;
+                }
+                if (session->pipeline != NULL) {
+                    ssh_set_error(SSH_REQUEST_DENIED,
+                                  "crypto threads are already running");
+                    return SSH_ERROR;
+                }
+                if (*x > 0) {
+                    session->pipeline = ssh_pipeline_new(*x);
+                    if (session->pipeline == NULL) return SSH_ERROR;
+                }
+            }
+            break;
         default:
             ssh_set_error(SSH_REQUEST_DENIED, "unknown option %d", type);
             return SSH_ERROR;
@@ -153,7 +428,7 @@ int ssh_options_set(ssh_session session, enum ssh_options_e type,
 }
 
 /**
- * @brief Send client identification string.
+ * @brief Send our identification string, the server one in server role.
  *
  * @param session
  * @return int
@@ -163,20 +438,24 @@ int send_id_str(ssh_session session) {
     const char *terminator = "\r\n";
     /* The maximum banner length is 255 for SSH2 */
     char buffer[256] = {0};
+    char **own_id_str;
     size_t len;
     int rc = SSH_ERROR;
 
-    session->client_id_str = strdup(id_str);
-    LOG_DEBUG("Client id str: %s", session->client_id_str);
-    snprintf(buffer, sizeof(buffer), "%s%s", session->client_id_str,
-             terminator);
+    own_id_str =
+        session->server ? &session->server_id_str : &session->client_id_str;
+    *own_id_str = strdup(id_str);
+    if (*own_id_str == NULL) return SSH_ERROR;
+    LOG_DEBUG("%s id str: %s", session->server ? "Server" : "Client",
+              *own_id_str);
+    snprintf(buffer, sizeof(buffer), "%s%s", *own_id_str, terminator);
 
     rc = ssh_socket_write(session->socket, buffer, strlen(buffer));
     return rc;
 }
 
 /**
- * @brief Wait for server identification string and store it.
+ * @brief Wait for the peer identification string and store it.
  *
  * @param session
  * @return int
@@ -208,6 +487,11 @@ int receive_id_str(ssh_session session) {
             }
             // Remove the terminator "\r\n" and store the id string in session->server_id_str.
             buffer[i-1] = '\0';
+            if (session->server) {
+                session->client_id_str = strdup(buffer);
+                LOG_INFO("Client id str: %s", session->client_id_str);
+                return SSH_OK;
+            }
             session->server_id_str = strdup(buffer);
             LOG_INFO("Server id str: %s", session->server_id_str);
             return SSH_OK;
@@ -226,6 +510,7 @@ int receive_id_str(ssh_session session) {
  * @return SSH_OK on success, SSH_ERR on error.
  */
 int ssh_connect(ssh_session session) {
+    const char *netem;
     int rc;
 
     if (session == NULL) return SSH_ERROR;
@@ -247,6 +532,16 @@ int ssh_connect(ssh_session session) {
 
     LOG_DEBUG("connected to server by fd %d", session->socket->fd);
 
+    /* only the client falls back to the environment: a server started from
+     * the same one would add a second link on top of it */
+    netem = session->opts.netem;
+    if (netem == NULL) netem = getenv(SSH_NETEM_ENV);
+    rc = ssh_socket_set_netem(session->socket, netem);
+    if (rc == SSH_ERROR) {
+        LOG_ERROR("can not set up network emulation");
+        goto error;
+    }
+
     /**
      * 2. SSH Transport Layer
      *
@@ -10,31 +10,52 @@
  *
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include "libsftp/buffer.h"
 #include "libsftp/error.h"
+#include "libsftp/layout.h"
 #include "libsftp/libsftp.h"
 #include "libsftp/logger.h"
+#include "libsftp/probes.h"
 #include "libsftp/session.h"
 #include "libsftp/util.h"
 
 /* Buffer size maximum is 256M */
 #define SFTP_PACKET_SIZE_MAX 0x10000000
-#define SFTP_BUFFER_SIZE_MAX 16384
+/* Length and type in front of every packet */
+#define SFTP_HEADER_LEN 5
+
+/* Requests whose latency is tracked at a time, by id modulo the size */
+#define SFTP_STATS_SLOTS 256
+
+struct sftp_request_slot {
+    uint32_t id;
+    uint8_t op; /* enum sftp_stats_op */
+    uint8_t used;
+    uint64_t start_ns;
+};
 
 struct sftp_session_struct {
     ssh_session session;
     uint32_t id_counter;
     uint32_t version;
     ssh_channel channel;
+    int fd; /* stream to a mux master, used instead of `channel` */
+    sftp_packet replies; /* read while waiting for another request id */
+    struct sftp_stats stats;
+    struct sftp_request_slot inflight[SFTP_STATS_SLOTS];
 };
 
 struct sftp_packet_struct {
     sftp_session sftp;
     uint8_t type;
     ssh_buffer payload;
+    struct sftp_packet_struct *next;
 };
 
 /* file handle */
@@ -85,6 +106,8 @@ static void sftp_file_free(sftp_file file);
 static sftp_status sftp_parse_status(sftp_packet packet);
 static sftp_file sftp_parse_handle(sftp_packet packet, uint32_t orig_id);
 static sftp_packet sftp_packet_read(sftp_session sftp);
+static sftp_packet sftp_packet_read_id(sftp_session sftp, uint32_t id);
+static int sftp_packet_peek_id(sftp_packet packet, uint32_t *id);
 static int32_t sftp_packet_write(sftp_session sftp, uint8_t type,
                                  ssh_buffer payload);
 
@@ -92,6 +115,24 @@ static uint32_t sftp_get_new_id(sftp_session sftp) {
     return ++sftp->id_counter;
 }
 
+/**
+ * @brief Create a buffer for a request payload, with room for the header
+ * sftp_packet_write() puts in front of it.
+ *
+ * @return ssh_buffer
+ */
+static ssh_buffer sftp_buffer_new(void) {
+    ssh_buffer buffer;
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) return NULL;
+    if (ssh_buffer_reserve(buffer, SFTP_HEADER_LEN, 0) < 0) {
+        ssh_buffer_free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
 sftp_session sftp_new(ssh_session session) {
     sftp_session sftp;
 
@@ -108,6 +149,7 @@ sftp_session sftp_new(ssh_session session) {
     /* Skip: SFTP extended data */
 
     sftp->session = session;
+    sftp->fd = -1;
     sftp->channel = ssh_channel_new(session);
     if (sftp->channel == NULL) {
         LOG_ERROR("can not create ssh channel");
@@ -132,6 +174,23 @@ error:
     return NULL;
 }
 
+sftp_session sftp_new_fd(int fd) {
+    sftp_session sftp;
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    sftp = calloc(1, sizeof(struct sftp_session_struct));
+    if (sftp == NULL) {
+        LOG_ERROR("can not create sftp session");
+        return NULL;
+    }
+    sftp->fd = fd;
+
+    return sftp;
+}
+
 int sftp_init(sftp_session sftp) {
     sftp_packet response = NULL;
     ssh_buffer buffer = NULL;
@@ -141,7 +200,7 @@ int sftp_init(sftp_session sftp) {
     sftp->version = LIBSFTP_VERSION;
     sftp->id_counter = 0;
 
-    buffer = ssh_buffer_new();
+    buffer = sftp_buffer_new();
     if (buffer == NULL) {
         LOG_CRITICAL("can not create ssh buffer");
         ssh_set_error(SSH_FATAL, "buffer error");
@@ -159,13 +218,13 @@ int sftp_init(sftp_session sftp) {
         LOG_CRITICAL("can not send init request");
         ssh_set_error(SSH_FATAL, "init request error");
         ssh_buffer_free(buffer);
+        return SSH_ERROR;
     }
     ssh_buffer_free(buffer);
 
     response = sftp_packet_read(sftp);
     if (response == NULL) {
         ssh_set_error(SSH_FATAL, "can not read sftp packet");
-        ssh_buffer_free(buffer);
         return SSH_ERROR;
     }
 
@@ -212,7 +271,7 @@ sftp_file sftp_open(sftp_session sftp, const char *filename, int flags,
     uint32_t id;
     int rc;
 
-    buffer = ssh_buffer_new();
+    buffer = sftp_buffer_new();
     if (buffer == NULL) {
         LOG_CRITICAL("can not create ssh buffer");
         ssh_set_error(SSH_FATAL, "buffer error");
@@ -269,7 +328,6 @@ sftp_file sftp_open(sftp_session sftp, const char *filename, int flags,
     response = sftp_packet_read(sftp);
     if (response == NULL) {
         ssh_set_error(SSH_FATAL, "can not read sftp packet");
-        ssh_buffer_free(buffer);
         return NULL;
     }
 
@@ -330,7 +388,7 @@ int sftp_close(sftp_file file) {
     uint32_t id;
     int rc;
 
-    buffer = ssh_buffer_new();
+    buffer = sftp_buffer_new();
     if (buffer == NULL) {
         LOG_CRITICAL("can not create ssh buffer");
         ssh_set_error(SSH_FATAL, "buffer error");
@@ -357,7 +415,6 @@ int sftp_close(sftp_file file) {
     response = sftp_packet_read(sftp);
     if (response == NULL) {
         ssh_set_error(SSH_FATAL, "can not read sftp packet");
-        ssh_buffer_free(buffer);
         return SSH_ERROR;
     }
 
@@ -407,7 +464,7 @@ int32_t sftp_read(sftp_file file, void *buf, uint32_t count) {
     sftp_session sftp = file->sftp;
     sftp_packet response = NULL;
     sftp_status status = NULL;
-    ssh_string data = NULL;
+    struct ssh_string_view data;
     uint32_t recvlen;
     ssh_buffer buffer = NULL;
     uint32_t id;
@@ -416,7 +473,7 @@ int32_t sftp_read(sftp_file file, void *buf, uint32_t count) {
 
     if (file->eof) return 0;
 
-    buffer = ssh_buffer_new();
+    buffer = sftp_buffer_new();
     if (buffer == NULL) {
         LOG_CRITICAL("can not create ssh buffer");
         ssh_set_error(SSH_FATAL, "buffer error");
@@ -425,7 +482,7 @@ int32_t sftp_read(sftp_file file, void *buf, uint32_t count) {
 
     id = sftp_get_new_id(sftp);
 
-    rc = ssh_buffer_pack(buffer, "dSqd", id, file->handle, file->offset, count);
+    rc = layout_put_sftp_read(buffer, id, file->handle, file->offset, count);
     if (rc != SSH_OK) {
         LOG_CRITICAL("can not pack buffer");
         ssh_set_error(SSH_FATAL, "buffer error");
@@ -444,7 +501,6 @@ int32_t sftp_read(sftp_file file, void *buf, uint32_t count) {
     response = sftp_packet_read(sftp);
     if (response == NULL) {
         ssh_set_error(SSH_FATAL, "can not read sftp packet");
-        ssh_buffer_free(buffer);
         return SSH_ERROR;
     }
 
@@ -491,11 +547,11 @@ int32_t sftp_read(sftp_file file, void *buf, uint32_t count) {
             break;
 
         case SSH_FXP_DATA:
-            rc = ssh_buffer_unpack(response->payload, "dS", &recv_id, &data);
-            sftp_packet_free(response);
+            rc = layout_get_sftp_data(response->payload, &recv_id, &data);
             if (rc != SSH_OK) {
                 LOG_ERROR("can not parse server response");
                 ssh_set_error(SSH_FATAL, "buffer error");
+                sftp_packet_free(response);
                 break;
             }
 
@@ -504,24 +560,25 @@ int32_t sftp_read(sftp_file file, void *buf, uint32_t count) {
                           recv_id, id);
                 ssh_set_error(SSH_FATAL, "id mismatch (server: %d client: %d)", 
                               recv_id, id);
-                ssh_string_free(data);
+                sftp_packet_free(response);
                 break;
             }
 
-            recvlen = ssh_string_len(data);
+            recvlen = data.len;
             if (recvlen > count) {
                 LOG_ERROR("received too much data");
                 ssh_set_error(SSH_FATAL, "received too much data");
-                ssh_string_free(data);
+                sftp_packet_free(response);
                 break;
             }
 
-            memcpy(buf, ssh_string_data(data), recvlen);
+            /* `data` points into the payload */
+            memcpy(buf, data.data, recvlen);
+            sftp_packet_free(response);
             file->offset += recvlen;
             if (recvlen < count) {
                 file->eof = 1;
             }
-            ssh_string_free(data);
             return recvlen;
 
         default:
@@ -547,7 +604,7 @@ int32_t sftp_write(sftp_file file, const void *buf, uint32_t count) {
     int rc;
 
     while (nleft > 0) {
-        buffer = ssh_buffer_new();
+        buffer = sftp_buffer_new();
         if (buffer == NULL) {
             LOG_CRITICAL("can not create ssh buffer");
             ssh_set_error(SSH_FATAL, "buffer error");
@@ -558,8 +615,8 @@ int32_t sftp_write(sftp_file file, const void *buf, uint32_t count) {
 
         nwrite = MIN(nleft, SSH_FXP_MAXLEN);
 
-        rc = ssh_buffer_pack(buffer, "dSqdP", id, file->handle, file->offset,
-                             nwrite, nwrite, (char *)buf + (count - nleft));
+        rc = layout_put_sftp_write(buffer, id, file->handle, file->offset,
+                                   (const char *)buf + (count - nleft), nwrite);
         if (rc != SSH_OK) {
             LOG_CRITICAL("can not pack buffer");
             ssh_set_error(SSH_FATAL, "buffer error");
@@ -573,7 +630,6 @@ int32_t sftp_write(sftp_file file, const void *buf, uint32_t count) {
         response = sftp_packet_read(sftp);
         if (response == NULL) {
             ssh_set_error(SSH_FATAL, "can not read sftp packet");
-            ssh_buffer_free(buffer);
             return SSH_ERROR;
         }
 
@@ -598,7 +654,9 @@ int32_t sftp_write(sftp_file file, const void *buf, uint32_t count) {
                 }
                 switch (status->status) {
                     case SSH_FX_OK:
-                        LOG_DEBUG("write %d byte to remote file", nwrite);
+                        SESSION_LOG_DEBUG(sftp->session,
+                                          "write %d byte to remote file",
+                                          nwrite);
                         nleft -= nwrite;
                         file->offset += nwrite;
                         sftp_status_free(status);
@@ -625,18 +683,379 @@ int32_t sftp_write(sftp_file file, const void *buf, uint32_t count) {
     return count - nleft;
 }
 
+int sftp_async_read_begin(sftp_file file, uint32_t len) {
+    sftp_session sftp = file->sftp;
+    ssh_buffer buffer;
+    uint32_t id;
+    int rc;
+
+    buffer = sftp_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return SSH_ERROR;
+    }
+
+    id = sftp_get_new_id(sftp);
+
+    rc = layout_put_sftp_read(buffer, id, file->handle, file->offset, len);
+    if (rc != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return SSH_ERROR;
+    }
+
+    if (sftp_packet_write(sftp, SSH_FXP_READ, buffer) < 0) {
+        LOG_CRITICAL("can not send read request");
+        ssh_buffer_free(buffer);
+        return SSH_ERROR;
+    }
+    ssh_buffer_free(buffer);
+
+    /* the next request reads on, assuming this one is not short */
+    file->offset += len;
+
+    return id;
+}
+
+int sftp_async_read(sftp_file file, void *data, uint32_t len, uint32_t id) {
+    sftp_packet response;
+    sftp_status status;
+    struct ssh_string_view payload;
+    uint32_t recv_id;
+    uint32_t recvlen;
+    int rc;
+
+    response = sftp_packet_read_id(file->sftp, id);
+    if (response == NULL) return SSH_ERROR;
+
+    switch (response->type) {
+        case SSH_FXP_STATUS:
+            status = sftp_parse_status(response);
+            sftp_packet_free(response);
+            if (status == NULL) {
+                ssh_set_error(SSH_FATAL, "cannot parse status");
+                return SSH_ERROR;
+            }
+            if (status->status == SSH_FX_EOF) {
+                file->eof = 1;
+                sftp_status_free(status);
+                return 0;
+            }
+            LOG_CRITICAL("received status response - error code: %d, "
+                         "error message: %s",
+                         status->status, status->errormsg);
+            ssh_set_error(SSH_FATAL, "%s", status->errormsg);
+            sftp_status_free(status);
+            return SSH_ERROR;
+
+        case SSH_FXP_DATA:
+            rc = layout_get_sftp_data(response->payload, &recv_id, &payload);
+            if (rc != SSH_OK) {
+                ssh_set_error(SSH_FATAL, "buffer error");
+                sftp_packet_free(response);
+                return SSH_ERROR;
+            }
+
+            recvlen = payload.len;
+            if (recvlen > len) {
+                ssh_set_error(SSH_FATAL, "received too much data");
+                sftp_packet_free(response);
+                return SSH_ERROR;
+            }
+
+            /* `payload` points into the packet */
+            memcpy(data, payload.data, recvlen);
+            sftp_packet_free(response);
+            return recvlen;
+
+        default:
+            ssh_set_error(SSH_FATAL, "receive unexpected read response");
+            sftp_packet_free(response);
+            return SSH_ERROR;
+    }
+}
+
+int sftp_async_write_begin(sftp_file file, const void *buf, uint32_t count) {
+    sftp_session sftp = file->sftp;
+    ssh_buffer buffer;
+    uint32_t id;
+    int rc;
+
+    if (count > SSH_FXP_MAXLEN) {
+        ssh_set_error(SSH_REQUEST_DENIED, "write of %u bytes is too large",
+                      count);
+        return SSH_ERROR;
+    }
+
+    buffer = sftp_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return SSH_ERROR;
+    }
+
+    id = sftp_get_new_id(sftp);
+
+    rc = layout_put_sftp_write(buffer, id, file->handle, file->offset, buf,
+                               count);
+    if (rc != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return SSH_ERROR;
+    }
+
+    if (sftp_packet_write(sftp, SSH_FXP_WRITE, buffer) < 0) {
+        LOG_CRITICAL("can not send write request");
+        ssh_buffer_free(buffer);
+        return SSH_ERROR;
+    }
+    ssh_buffer_free(buffer);
+
+    file->offset += count;
+
+    return id;
+}
+
+int sftp_async_write(sftp_file file, uint32_t id) {
+    sftp_packet response;
+    sftp_status status;
+    int rc;
+
+    response = sftp_packet_read_id(file->sftp, id);
+    if (response == NULL) return SSH_ERROR;
+
+    status = sftp_parse_status(response);
+    sftp_packet_free(response);
+    if (status == NULL) {
+        ssh_set_error(SSH_FATAL, "receive unexpected write response");
+        return SSH_ERROR;
+    }
+
+    rc = status->status == SSH_FX_OK ? SSH_OK : SSH_ERROR;
+    if (rc != SSH_OK) {
+        LOG_CRITICAL("received status response - error code: %d, "
+                     "error message: %s",
+                     status->status, status->errormsg);
+        ssh_set_error(SSH_FATAL, "%s", status->errormsg);
+    }
+    sftp_status_free(status);
+
+    return rc;
+}
+
 void sftp_free(sftp_session sftp) {
+    sftp_packet packet;
+
     if (sftp == NULL) return;
+    while ((packet = sftp->replies) != NULL) {
+        sftp->replies = packet->next;
+        sftp_packet_free(packet);
+    }
     if (sftp->channel != NULL) {
         ssh_channel_eof(sftp->channel);
         ssh_channel_close(sftp->channel);
         ssh_channel_free(sftp->channel);
         sftp->channel = NULL;
     }
+    if (sftp->fd >= 0) {
+        close(sftp->fd);
+        sftp->fd = -1;
+    }
 
     SAFE_FREE(sftp);
 }
 
+/**
+ * @brief Read `count` bytes of the SFTP stream, from the channel or from the
+ * mux socket.
+ *
+ * @param sftp
+ * @param dest
+ * @param count
+ * @return bytes read, SSH_EOF if the stream ended before any data, SSH_ERROR
+ * on error.
+ */
+static int sftp_stream_read(sftp_session sftp, void *dest, uint32_t count) {
+    uint32_t nread = 0;
+    ssize_t n;
+
+    if (sftp->channel != NULL) {
+        return ssh_channel_read(sftp->channel, dest, count);
+    }
+
+    while (nread < count) {
+        n = read(sftp->fd, (uint8_t *)dest + nread, count - nread);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            ssh_set_error(SSH_FATAL, "mux socket read error: %s",
+                          strerror(errno));
+            return SSH_ERROR;
+        }
+        if (n == 0) return nread > 0 ? (int)nread : SSH_EOF;
+        nread += n;
+    }
+
+    return nread;
+}
+
+/**
+ * @brief Write `len` bytes of the SFTP stream, to the channel or to the mux
+ * socket.
+ *
+ * @param sftp
+ * @param data
+ * @param len
+ * @return bytes written, SSH_ERROR on error.
+ */
+static int sftp_stream_write(sftp_session sftp, const void *data,
+                             uint32_t len) {
+    uint32_t nwrite = 0;
+    ssize_t n;
+
+    if (sftp->channel != NULL) {
+        return ssh_channel_write(sftp->channel, data, len);
+    }
+
+    while (nwrite < len) {
+        n = send(sftp->fd, (const uint8_t *)data + nwrite, len - nwrite,
+                 MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            ssh_set_error(SSH_FATAL, "mux socket write error: %s",
+                          strerror(errno));
+            return SSH_ERROR;
+        }
+        nwrite += n;
+    }
+
+    return nwrite;
+}
+
+/**
+ * @brief Map a request type to the histogram its latency goes to.
+ *
+ * @param type
+ * @return enum sftp_stats_op
+ */
+static enum sftp_stats_op sftp_stats_op(uint8_t type) {
+    switch (type) {
+        case SSH_FXP_OPEN:
+        case SSH_FXP_OPENDIR:
+            return SFTP_STATS_OP_OPEN;
+        case SSH_FXP_CLOSE:
+            return SFTP_STATS_OP_CLOSE;
+        case SSH_FXP_READ:
+        case SSH_FXP_READDIR:
+            return SFTP_STATS_OP_READ;
+        case SSH_FXP_WRITE:
+            return SFTP_STATS_OP_WRITE;
+        case SSH_FXP_STAT:
+        case SSH_FXP_LSTAT:
+        case SSH_FXP_FSTAT:
+            return SFTP_STATS_OP_STAT;
+        default:
+            return SFTP_STATS_OP_OTHER;
+    }
+}
+
+/**
+ * @brief Account a request being sent. `payload` starts with the request id.
+ *
+ * @param sftp
+ * @param type
+ * @param payload
+ */
+static void sftp_stats_request(sftp_session sftp, uint8_t type,
+                               ssh_buffer payload) {
+    struct sftp_request_slot *slot;
+    uint64_t now;
+    uint32_t id;
+
+    if (type == SSH_FXP_INIT ||
+        ssh_buffer_get_len(payload) < sizeof(uint32_t)) {
+        return;
+    }
+    memcpy(&id, ssh_buffer_get(payload), sizeof(uint32_t));
+    id = ntohl(id);
+
+    sftp->stats.outstanding++;
+    if (sftp->stats.outstanding > sftp->stats.outstanding_max) {
+        sftp->stats.outstanding_max = sftp->stats.outstanding;
+    }
+
+    now = ssh_time_ns();
+    if (sftp->session != NULL) {
+        ssh_trace_record(sftp->session->trace, SSH_TRACE_SFTP_REQUEST, type,
+                         0, ssh_buffer_get_len(payload) + 5, id, now, now);
+    }
+    SSH_PROBE3(sftp__request, id, type, ssh_buffer_get_len(payload) + 5);
+
+    /* more than SFTP_STATS_SLOTS in flight, this one is not timed */
+    slot = &sftp->inflight[id % SFTP_STATS_SLOTS];
+    if (slot->used) return;
+    slot->id = id;
+    slot->op = sftp_stats_op(type);
+    slot->used = 1;
+    slot->start_ns = now;
+}
+
+/**
+ * @brief Account the reply to a request, adding its latency to the
+ * histogram of the request type.
+ *
+ * @param sftp
+ * @param packet
+ */
+static void sftp_stats_reply(sftp_session sftp, sftp_packet packet) {
+    struct sftp_request_slot *slot;
+    struct sftp_latency_stats *latency;
+    uint64_t now, us;
+    uint32_t id;
+    bool timed;
+    int bucket;
+
+    if (packet->type == SSH_FXP_VERSION ||
+        sftp_packet_peek_id(packet, &id) != SSH_OK) {
+        return;
+    }
+    if (sftp->stats.outstanding > 0) sftp->stats.outstanding--;
+
+    now = ssh_time_ns();
+    slot = &sftp->inflight[id % SFTP_STATS_SLOTS];
+    timed = slot->used && slot->id == id;
+
+    /* a timed reply spans its request in the trace */
+    if (sftp->session != NULL) {
+        ssh_trace_record(sftp->session->trace, SSH_TRACE_SFTP_REPLY,
+                         packet->type, 0,
+                         ssh_buffer_get_len(packet->payload) + 5, id,
+                         timed ? slot->start_ns : now, now);
+    }
+    SSH_PROBE4(sftp__reply, id, packet->type,
+               ssh_buffer_get_len(packet->payload) + 5,
+               timed ? now - slot->start_ns : 0);
+    if (!timed) return;
+    slot->used = 0;
+
+    us = (now - slot->start_ns) / 1000;
+    for (bucket = 0; bucket < SFTP_STATS_LATENCY_BUCKETS - 1 &&
+                     us >> (bucket + 1) != 0;
+         bucket++)
+        ;
+
+    latency = &sftp->stats.latency[slot->op];
+    latency->count++;
+    latency->total_us += us;
+    latency->max_us = MAX(latency->max_us, us);
+    latency->buckets[bucket]++;
+}
+
+int sftp_get_stats(sftp_session sftp, struct sftp_stats *stats) {
+    if (sftp == NULL || stats == NULL) return SSH_ERROR;
+
+    *stats = sftp->stats;
+    return SSH_OK;
+}
+
 /**
  * @brief Grap an SFTP packet from channel, extracting type and payload.
  *
@@ -644,44 +1063,46 @@ void sftp_free(sftp_session sftp) {
  * @return sftp_packet
  */
 sftp_packet sftp_packet_read(sftp_session sftp) {
-    uint8_t buffer[SFTP_BUFFER_SIZE_MAX];
+    uint8_t buffer[sizeof(uint32_t) + sizeof(uint8_t)];
+    uint8_t *p;
     uint32_t size;
     sftp_packet packet = sftp_packet_new(sftp);
     int nread;
-    bool is_eof;
-    int rc;
 
     if (packet == NULL) return NULL;
 
     /* read packet length and type */
-    nread = ssh_channel_read(sftp->channel, buffer,
-                             sizeof(uint32_t) + sizeof(uint8_t));
-    if (nread != sizeof(uint32_t) + sizeof(uint8_t) && nread != SSH_EOF) {
+    nread = sftp_stream_read(sftp, buffer, sizeof(uint32_t) + sizeof(uint8_t));
+    if (nread != sizeof(uint32_t) + sizeof(uint8_t)) {
         LOG_ERROR("can not read packet length and type");
         goto error;
     }
 
     size = ntohl(*(uint32_t *)buffer) - sizeof(uint8_t);
-    LOG_DEBUG("sftp packet size: %d", size);
+    SESSION_LOG_DEBUG(sftp->session, "sftp packet size: %d", size);
 
     packet->type = buffer[4];
 
-    rc = ssh_buffer_allocate_size(packet->payload, size);
-    if (rc != SSH_OK) goto error;
-
-    /* read packet payload */
-    while (size > 0 && size < SFTP_PACKET_SIZE_MAX) {
-        nread =
-            ssh_channel_read(sftp->channel, buffer, MIN(size, sizeof(buffer)));
-        if (nread == SSH_EOF) break;
-        if (nread < 0) goto error;
-
-        rc = ssh_buffer_add_data(packet->payload, buffer, nread);
-        if (rc != SSH_OK) goto error;
-
-        size -= nread;
+    /* read packet payload, in place */
+    if (size > 0 && size < SFTP_PACKET_SIZE_MAX) {
+        p = ssh_buffer_allocate(packet->payload, size);
+        if (p == NULL) goto error;
+        while (size > 0) {
+            nread = sftp_stream_read(sftp, p, size);
+            if (nread == SSH_EOF) break;
+            if (nread < 0) goto error;
+            p += nread;
+            size -= nread;
+        }
+        /* what the stream ended before */
+        ssh_buffer_pass_bytes_end(packet->payload, size);
     }
 
+    sftp->stats.replies++;
+    sftp->stats.bytes_in +=
+        sizeof(uint32_t) + sizeof(uint8_t) + ssh_buffer_get_len(packet->payload);
+    sftp_stats_reply(sftp, packet);
+
     return packet;
 
 error:
@@ -689,6 +1110,68 @@ error:
     return NULL;
 }
 
+/**
+ * @brief Peek at the request id a reply starts with.
+ *
+ * @param packet
+ * @param id
+ * @return SSH_OK on success, SSH_ERROR if the reply is too short.
+ */
+static int sftp_packet_peek_id(sftp_packet packet, uint32_t *id) {
+    if (ssh_buffer_get_len(packet->payload) < sizeof(uint32_t)) {
+        return SSH_ERROR;
+    }
+
+    memcpy(id, ssh_buffer_get(packet->payload), sizeof(uint32_t));
+    *id = ntohl(*id);
+    return SSH_OK;
+}
+
+/**
+ * @brief Get the reply to request `id`. With several requests outstanding
+ * the server may answer them in any order, the replies read meanwhile are
+ * kept for their own waiter.
+ *
+ * @param sftp
+ * @param id
+ * @return sftp_packet, NULL on error.
+ */
+static sftp_packet sftp_packet_read_id(sftp_session sftp, uint32_t id) {
+    sftp_packet *pp;
+    sftp_packet packet;
+    uint32_t recv_id;
+
+    for (pp = &sftp->replies; *pp != NULL; pp = &(*pp)->next) {
+        packet = *pp;
+        if (sftp_packet_peek_id(packet, &recv_id) == SSH_OK &&
+            recv_id == id) {
+            *pp = packet->next;
+            packet->next = NULL;
+            return packet;
+        }
+    }
+
+    while (1) {
+        packet = sftp_packet_read(sftp);
+        if (packet == NULL) {
+            ssh_set_error(SSH_FATAL, "can not read sftp packet");
+            return NULL;
+        }
+
+        if (sftp_packet_peek_id(packet, &recv_id) != SSH_OK) {
+            ssh_set_error(SSH_FATAL, "sftp reply too short");
+            sftp_packet_free(packet);
+            return NULL;
+        }
+        if (recv_id == id) return packet;
+
+        /* replies are mostly in order, append */
+        for (pp = &sftp->replies; *pp != NULL; pp = &(*pp)->next)
+            ;
+        *pp = packet;
+    }
+}
+
 /**
  * @brief Encapsulate an SFTP packet and write it into the channel.
  *
@@ -698,11 +1181,13 @@ error:
  * @return int32_t
  */
 int32_t sftp_packet_write(sftp_session sftp, uint8_t type, ssh_buffer payload) {
-    uint8_t header[5] = {0};
+    uint8_t header[SFTP_HEADER_LEN] = {0};
     uint32_t size;
     int nwrite;
     int rc;
 
+    sftp_stats_request(sftp, type, payload);
+
     size = ssh_buffer_get_len(payload) + sizeof(uint8_t);
     *(uint32_t *)header = htonl(size);
     header[4] = type;
@@ -713,13 +1198,15 @@ int32_t sftp_packet_write(sftp_session sftp, uint8_t type, ssh_buffer payload) {
         return SSH_ERROR;
     }
 
-    nwrite = ssh_channel_write(sftp->channel, ssh_buffer_get(payload),
+    nwrite = sftp_stream_write(sftp, ssh_buffer_get(payload),
                                ssh_buffer_get_len(payload));
     if (nwrite != ssh_buffer_get_len(payload)) {
         ssh_set_error(SSH_FATAL, "can not write sftp packet");
         return SSH_ERROR;
     }
 
+    sftp->stats.requests++;
+    sftp->stats.bytes_out += nwrite;
     return nwrite;
 }
 
@@ -812,7 +1299,7 @@ static sftp_status sftp_parse_status(sftp_packet packet) {
     status = calloc(1, sizeof(struct sftp_status_struct));
     if (status == NULL) return NULL;
 
-    rc = ssh_buffer_unpack(packet->payload, "dd", &status->id, &status->status);
+    rc = layout_get_sftp_status(packet->payload, &status->id, &status->status);
     if (rc != SSH_OK) {
         SAFE_FREE(status);
         return NULL;
@@ -0,0 +1,597 @@
+/**
+ * @file sftp_server.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Minimal SFTP version 3 server serving a local directory.
+ * Covers what the client side uses: open, close, read, write and stat of
+ * regular files, plus realpath for interactive clients. Paths are taken
+ * relative to the served directory and may not contain "..". Every other
+ * request gets SSH_FX_OP_UNSUPPORTED.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "libsftp/buffer.h"
+#include "libsftp/chain.h"
+#include "libsftp/channel.h"
+#include "libsftp/error.h"
+#include "libsftp/layout.h"
+#include "libsftp/libsftp.h"
+#include "libsftp/logger.h"
+#include "libsftp/session.h"
+#include "libsftp/util.h"
+
+#define SFTP_SERVER_MAX_HANDLES 64
+/* Largest SSH_FXP_READ answered in full, the client takes a short read as
+ * the end of the file */
+#define SFTP_SERVER_MAX_READ (1024 * 1024)
+#define SFTP_SERVER_MAX_PACKET (SFTP_SERVER_MAX_READ + 1024)
+/* Length, type, id and data length in front of the data of SSH_FXP_DATA */
+#define SFTP_SERVER_DATA_HEADER (4 + 1 + 4 + 4)
+/* Segments of the largest SSH_FXP_DATA, one more for the header */
+#define SFTP_SERVER_IOVECS (SFTP_SERVER_MAX_READ / SSH_CHAIN_SEGMENT_SIZE + 2)
+
+struct sftp_server_struct {
+    ssh_channel channel;
+    const char *root;
+    int fds[SFTP_SERVER_MAX_HANDLES]; /* -1 if the handle is free */
+    ssh_chain reply; /* SSH_FXP_DATA being sent */
+};
+
+typedef struct sftp_server_struct *sftp_server;
+
+/**
+ * @brief Read one request into `buffer`, length excluded.
+ *
+ * @param server
+ * @param buffer
+ * @return SSH_OK, SSH_EOF when the client closed the channel, SSH_ERROR on
+ * error.
+ */
+static int server_packet_read(sftp_server server, ssh_buffer buffer) {
+    uint8_t *p;
+    uint32_t size;
+    int nread;
+
+    nread = ssh_channel_read(server->channel, &size, sizeof(uint32_t));
+    if (nread == SSH_EOF) return SSH_EOF;
+    if (nread != sizeof(uint32_t)) return SSH_ERROR;
+
+    size = ntohl(size);
+    if (size == 0 || size > SFTP_SERVER_MAX_PACKET) {
+        LOG_ERROR("sftp request of %u bytes", size);
+        return SSH_ERROR;
+    }
+
+    /* sized once and read in place */
+    ssh_buffer_reinit(buffer);
+    p = ssh_buffer_allocate(buffer, size);
+    if (p == NULL) return SSH_ERROR;
+    while (size > 0) {
+        nread = ssh_channel_read(server->channel, p, size);
+        if (nread <= 0) return SSH_ERROR;
+        p += nread;
+        size -= nread;
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Prepend the length to the reply in `buffer` and send it.
+ *
+ * @param server
+ * @param buffer type and payload of the reply
+ * @return int
+ */
+static int server_packet_write(sftp_server server, ssh_buffer buffer) {
+    uint32_t size = htonl(ssh_buffer_get_len(buffer));
+    int rc;
+
+    rc = ssh_buffer_prepend_data(buffer, &size, sizeof(uint32_t));
+    if (rc != SSH_OK) return SSH_ERROR;
+
+    rc = ssh_channel_write(server->channel, ssh_buffer_get(buffer),
+                           ssh_buffer_get_len(buffer));
+    ssh_buffer_reinit(buffer);
+    return rc < 0 ? SSH_ERROR : SSH_OK;
+}
+
+static int server_send_status(sftp_server server, ssh_buffer out, uint32_t id,
+                              uint32_t status, const char *message) {
+    int rc;
+
+    rc = layout_put_sftp_status(out, id, status, message, "");
+    if (rc != SSH_OK) return SSH_ERROR;
+
+    return server_packet_write(server, out);
+}
+
+static int server_send_errno(sftp_server server, ssh_buffer out, uint32_t id,
+                             int err) {
+    uint32_t status;
+
+    switch (err) {
+        case ENOENT:
+        case ENOTDIR:
+            status = SSH_FX_NO_SUCH_FILE;
+            break;
+        case EACCES:
+        case EPERM:
+        case EROFS:
+            status = SSH_FX_PERMISSION_DENIED;
+            break;
+        default:
+            status = SSH_FX_FAILURE;
+            break;
+    }
+
+    return server_send_status(server, out, id, status, strerror(err));
+}
+
+/**
+ * @brief Map a client path below the served directory.
+ *
+ * @param server
+ * @param path
+ * @return char* allocated local path, NULL if `path` leaves the directory.
+ */
+static char *server_local_path(sftp_server server, const char *path) {
+    const char *p;
+    char *local;
+    size_t len;
+
+    for (p = path; *p != '\0'; p += len + (p[len] == '/')) {
+        len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.') return NULL;
+    }
+
+    while (*path == '/') path++;
+    len = strlen(server->root) + strlen(path) + 2;
+    local = malloc(len);
+    if (local == NULL) return NULL;
+    snprintf(local, len, "%s/%s", server->root, *path ? path : ".");
+
+    return local;
+}
+
+/**
+ * @brief Handle of a request, the index of the fd as a 32-bit integer.
+ *
+ * @param server
+ * @param in
+ * @return fd index, -1 if the handle is not valid.
+ */
+static int server_get_handle(sftp_server server, ssh_buffer in) {
+    struct ssh_string_view handle;
+    uint32_t index;
+
+    if (layout_get_string(in, &handle) != SSH_OK) return -1;
+    if (handle.len != sizeof(uint32_t)) return -1;
+    memcpy(&index, handle.data, sizeof(uint32_t));
+
+    index = ntohl(index);
+    if (index >= SFTP_SERVER_MAX_HANDLES || server->fds[index] < 0) return -1;
+    return index;
+}
+
+/**
+ * @brief Skip the ATTRS of SSH_FXP_OPEN, only the permissions are used.
+ *
+ * @param in
+ * @param mode
+ * @return int
+ */
+static int server_parse_attrs(ssh_buffer in, mode_t *mode) {
+    uint32_t flags, count, a, b;
+    uint64_t size;
+    struct ssh_string_view type, data;
+    int rc;
+
+    rc = ssh_buffer_unpack(in, "d", &flags);
+    if (rc == SSH_OK && (flags & SSH_FILEXFER_ATTR_SIZE)) {
+        rc = ssh_buffer_unpack(in, "q", &size);
+    }
+    if (rc == SSH_OK && (flags & SSH_FILEXFER_ATTR_UIDGID)) {
+        rc = ssh_buffer_unpack(in, "dd", &a, &b);
+    }
+    if (rc == SSH_OK && (flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
+        rc = ssh_buffer_unpack(in, "d", &a);
+        *mode = a & 07777;
+    }
+    if (rc == SSH_OK && (flags & SSH_FILEXFER_ATTR_ACMODTIME)) {
+        rc = ssh_buffer_unpack(in, "dd", &a, &b);
+    }
+    if (rc == SSH_OK && (flags & SSH_FILEXFER_ATTR_EXTENDED)) {
+        rc = ssh_buffer_unpack(in, "d", &count);
+        while (rc == SSH_OK && count-- > 0) {
+            rc = ssh_buffer_unpack(in, "VV", &type, &data);
+        }
+    }
+
+    return rc;
+}
+
+static int server_open(sftp_server server, ssh_buffer in, ssh_buffer out,
+                       uint32_t id) {
+    char *filename = NULL;
+    char *path = NULL;
+    uint32_t pflags;
+    uint32_t handle;
+    mode_t mode = 0644;
+    int flags;
+    int index;
+    int fd;
+    int rc;
+
+    rc = ssh_buffer_unpack(in, "sd", &filename, &pflags);
+    if (rc != SSH_OK || server_parse_attrs(in, &mode) != SSH_OK) {
+        SAFE_FREE(filename);
+        return server_send_status(server, out, id, SSH_FX_BAD_MESSAGE,
+                                  "bad open request");
+    }
+
+    path = server_local_path(server, filename);
+    SAFE_FREE(filename);
+    if (path == NULL) {
+        return server_send_status(server, out, id, SSH_FX_PERMISSION_DENIED,
+                                  "path outside of the served directory");
+    }
+
+    for (index = 0; index < SFTP_SERVER_MAX_HANDLES; index++) {
+        if (server->fds[index] < 0) break;
+    }
+    if (index == SFTP_SERVER_MAX_HANDLES) {
+        SAFE_FREE(path);
+        return server_send_status(server, out, id, SSH_FX_FAILURE,
+                                  "too many open files");
+    }
+
+    if ((pflags & SSH_FXF_READ) && (pflags & SSH_FXF_WRITE)) {
+        flags = O_RDWR;
+    } else if (pflags & SSH_FXF_WRITE) {
+        flags = O_WRONLY;
+    } else {
+        flags = O_RDONLY;
+    }
+    if (pflags & SSH_FXF_APPEND) flags |= O_APPEND;
+    if (pflags & SSH_FXF_CREAT) flags |= O_CREAT;
+    if (pflags & SSH_FXF_TRUNC) flags |= O_TRUNC;
+    if (pflags & SSH_FXF_EXCL) flags |= O_EXCL;
+
+    fd = open(path, flags, mode);
+    SAFE_FREE(path);
+    if (fd < 0) return server_send_errno(server, out, id, errno);
+    server->fds[index] = fd;
+
+    handle = htonl(index);
+    rc = ssh_buffer_pack(out, "bddP", SSH_FXP_HANDLE, id, sizeof(uint32_t),
+                         sizeof(uint32_t), &handle);
+    if (rc != SSH_OK) return SSH_ERROR;
+
+    return server_packet_write(server, out);
+}
+
+static int server_close(sftp_server server, ssh_buffer in, ssh_buffer out,
+                        uint32_t id) {
+    int index;
+    int rc;
+
+    index = server_get_handle(server, in);
+    if (index < 0) {
+        return server_send_status(server, out, id, SSH_FX_INVALID_HANDLE,
+                                  "invalid handle");
+    }
+
+    rc = close(server->fds[index]);
+    server->fds[index] = -1;
+    if (rc < 0) return server_send_errno(server, out, id, errno);
+
+    return server_send_status(server, out, id, SSH_FX_OK, "");
+}
+
+/**
+ * @brief Answer SSH_FXP_READ. The file is read with preadv() into the
+ * segments of `server->reply` and sent from there with ssh_channel_writev(),
+ * so large reads are neither moved nor copied into one contiguous buffer.
+ */
+static int server_read(sftp_server server, ssh_buffer in, ssh_buffer out,
+                       uint32_t id) {
+    struct iovec iov[SFTP_SERVER_IOVECS];
+    uint64_t offset;
+    uint32_t len;
+    uint8_t *p;
+    ssize_t n;
+    int iovcnt;
+    int index;
+    int rc;
+
+    index = server_get_handle(server, in);
+    if (index < 0) {
+        return server_send_status(server, out, id, SSH_FX_INVALID_HANDLE,
+                                  "invalid handle");
+    }
+
+    rc = layout_get_sftp_read(in, &offset, &len);
+    if (rc != SSH_OK) {
+        return server_send_status(server, out, id, SSH_FX_BAD_MESSAGE,
+                                  "bad read request");
+    }
+    len = MIN(len, SFTP_SERVER_MAX_READ);
+
+    /* read behind the header, filled in once the length is known */
+    ssh_chain_reset(server->reply);
+    iovcnt = ssh_chain_reserve(server->reply, SFTP_SERVER_DATA_HEADER, iov, 1);
+    if (iovcnt < 0) return SSH_ERROR;
+    ssh_chain_commit(server->reply, SFTP_SERVER_DATA_HEADER);
+    iovcnt = ssh_chain_reserve(server->reply, len, iov,
+                               SFTP_SERVER_IOVECS);
+    if (iovcnt < 0) return SSH_ERROR;
+    do {
+        n = preadv(server->fds[index], iov, iovcnt, offset);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        rc = errno;
+        if (n < 0) return server_send_errno(server, out, id, rc);
+        return server_send_status(server, out, id, SSH_FX_EOF, "EOF");
+    }
+    ssh_chain_commit(server->reply, n);
+
+    p = ssh_chain_head(server->reply, SFTP_SERVER_DATA_HEADER);
+    p = layout_put_u32(p, 1 + 4 + 4 + n);
+    p = layout_put_u8(p, SSH_FXP_DATA);
+    p = layout_put_u32(p, id);
+    layout_put_u32(p, n);
+
+    iovcnt = ssh_chain_iovec(server->reply, iov, SFTP_SERVER_IOVECS);
+    if (iovcnt < 0) return SSH_ERROR;
+    rc = ssh_channel_writev(server->channel, iov, iovcnt);
+    return rc < 0 ? SSH_ERROR : SSH_OK;
+}
+
+static int server_write(sftp_server server, ssh_buffer in, ssh_buffer out,
+                        uint32_t id) {
+    struct ssh_string_view data;
+    uint64_t offset;
+    size_t written = 0;
+    ssize_t n;
+    int index;
+    int rc;
+
+    index = server_get_handle(server, in);
+    if (index < 0) {
+        return server_send_status(server, out, id, SSH_FX_INVALID_HANDLE,
+                                  "invalid handle");
+    }
+
+    /* `data` points into the request */
+    rc = layout_get_sftp_write(in, &offset, &data);
+    if (rc != SSH_OK) {
+        return server_send_status(server, out, id, SSH_FX_BAD_MESSAGE,
+                                  "bad write request");
+    }
+
+    while (written < data.len) {
+        n = pwrite(server->fds[index], data.data + written,
+                   data.len - written, offset + written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return server_send_errno(server, out, id, errno);
+        written += n;
+    }
+
+    return server_send_status(server, out, id, SSH_FX_OK, "");
+}
+
+static int server_stat(sftp_server server, uint8_t type, ssh_buffer in,
+                       ssh_buffer out, uint32_t id) {
+    struct stat st;
+    char *filename = NULL;
+    char *path;
+    int index;
+    int rc;
+
+    if (type == SSH_FXP_FSTAT) {
+        index = server_get_handle(server, in);
+        if (index < 0) {
+            return server_send_status(server, out, id, SSH_FX_INVALID_HANDLE,
+                                      "invalid handle");
+        }
+        rc = fstat(server->fds[index], &st);
+    } else {
+        if (ssh_buffer_unpack(in, "s", &filename) != SSH_OK) {
+            return server_send_status(server, out, id, SSH_FX_BAD_MESSAGE,
+                                      "bad stat request");
+        }
+        path = server_local_path(server, filename);
+        SAFE_FREE(filename);
+        if (path == NULL) {
+            return server_send_status(server, out, id,
+                                      SSH_FX_PERMISSION_DENIED,
+                                      "path outside of the served directory");
+        }
+        rc = type == SSH_FXP_LSTAT ? lstat(path, &st) : stat(path, &st);
+        SAFE_FREE(path);
+    }
+    if (rc < 0) return server_send_errno(server, out, id, errno);
+
+    rc = ssh_buffer_pack(out, "bddqdddd", SSH_FXP_ATTRS, id,
+                         SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_UIDGID |
+                             SSH_FILEXFER_ATTR_PERMISSIONS |
+                             SSH_FILEXFER_ATTR_ACMODTIME,
+                         (uint64_t)st.st_size, (uint32_t)st.st_uid,
+                         (uint32_t)st.st_gid, (uint32_t)st.st_mode,
+                         (uint32_t)st.st_atime);
+    rc |= ssh_buffer_pack(out, "d", (uint32_t)st.st_mtime);
+    if (rc != SSH_OK) return SSH_ERROR;
+
+    return server_packet_write(server, out);
+}
+
+/**
+ * @brief Canonical form of a path, "/" being the served directory. Needed by
+ * interactive clients to find their working directory.
+ *
+ * @param server
+ * @param in
+ * @param out
+ * @param id
+ * @return int
+ */
+static int server_realpath(sftp_server server, ssh_buffer in, ssh_buffer out,
+                           uint32_t id) {
+    char *filename = NULL;
+    char *path;
+    const char *p;
+    size_t used = 0;
+    size_t len;
+    int rc;
+
+    if (ssh_buffer_unpack(in, "s", &filename) != SSH_OK) {
+        return server_send_status(server, out, id, SSH_FX_BAD_MESSAGE,
+                                  "bad realpath request");
+    }
+
+    path = malloc(strlen(filename) + 2);
+    if (path == NULL) {
+        SAFE_FREE(filename);
+        return SSH_ERROR;
+    }
+
+    /* resolve "." and ".." lexically, never above "/" */
+    for (p = filename; *p != '\0'; p += len + (p[len] == '/')) {
+        len = strcspn(p, "/");
+        if (len == 0 || (len == 1 && p[0] == '.')) continue;
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            while (used > 0 && path[--used] != '/');
+            continue;
+        }
+        path[used++] = '/';
+        memcpy(path + used, p, len);
+        used += len;
+    }
+    if (used == 0) path[used++] = '/';
+    path[used] = '\0';
+    SAFE_FREE(filename);
+
+    rc = ssh_buffer_pack(out, "bddssd", SSH_FXP_NAME, id, 1, path, path, 0);
+    SAFE_FREE(path);
+    if (rc != SSH_OK) return SSH_ERROR;
+
+    return server_packet_write(server, out);
+}
+
+/**
+ * @brief Answer one request.
+ *
+ * @param server
+ * @param in the request, length excluded
+ * @param out
+ * @return int
+ */
+static int server_handle(sftp_server server, ssh_buffer in, ssh_buffer out) {
+    uint32_t version;
+    uint32_t id;
+    uint8_t type;
+    int rc;
+
+    rc = ssh_buffer_unpack(in, "b", &type);
+    if (rc != SSH_OK) return SSH_ERROR;
+
+    if (type == SSH_FXP_INIT) {
+        rc = ssh_buffer_unpack(in, "d", &version);
+        if (rc != SSH_OK) return SSH_ERROR;
+        LOG_INFO("sftp client version %u", version);
+
+        rc = ssh_buffer_pack(out, "bd", SSH_FXP_VERSION, LIBSFTP_VERSION);
+        if (rc != SSH_OK) return SSH_ERROR;
+        return server_packet_write(server, out);
+    }
+
+    rc = layout_get_u32(in, &id);
+    if (rc != SSH_OK) return SSH_ERROR;
+
+    switch (type) {
+        case SSH_FXP_OPEN:
+            return server_open(server, in, out, id);
+        case SSH_FXP_CLOSE:
+            return server_close(server, in, out, id);
+        case SSH_FXP_READ:
+            return server_read(server, in, out, id);
+        case SSH_FXP_WRITE:
+            return server_write(server, in, out, id);
+        case SSH_FXP_REALPATH:
+            return server_realpath(server, in, out, id);
+        case SSH_FXP_STAT:
+        case SSH_FXP_LSTAT:
+        case SSH_FXP_FSTAT:
+            return server_stat(server, type, in, out, id);
+        default:
+            LOG_INFO("unsupported sftp request %d", type);
+            return server_send_status(server, out, id, SSH_FX_OP_UNSUPPORTED,
+                                      "operation not supported");
+    }
+}
+
+int sftp_server_run(ssh_session session, const char *root) {
+    struct sftp_server_struct server;
+    ssh_buffer in = NULL;
+    ssh_buffer out = NULL;
+    int rc = SSH_ERROR;
+    int i;
+
+    if (session == NULL || root == NULL || !session->authenticated) {
+        ssh_set_error(SSH_REQUEST_DENIED, "invalid params");
+        return SSH_ERROR;
+    }
+
+    memset(&server, 0, sizeof(server));
+    server.root = root;
+    for (i = 0; i < SFTP_SERVER_MAX_HANDLES; i++) {
+        server.fds[i] = -1;
+    }
+
+    server.channel = ssh_channel_accept_sftp(session);
+    if (server.channel == NULL) return SSH_ERROR;
+
+    in = ssh_buffer_new();
+    out = ssh_buffer_new();
+    server.reply = ssh_chain_new();
+    if (in == NULL || out == NULL || server.reply == NULL) goto out;
+    /* for the length server_packet_write() puts in front */
+    if (ssh_buffer_reserve(out, sizeof(uint32_t), 0) < 0) goto out;
+
+    while (1) {
+        rc = server_packet_read(&server, in);
+        if (rc == SSH_EOF) {
+            LOG_NOTICE("sftp client closed the channel");
+            rc = SSH_OK;
+            break;
+        }
+        if (rc != SSH_OK) break;
+
+        rc = server_handle(&server, in, out);
+        if (rc != SSH_OK) break;
+    }
+
+out:
+    for (i = 0; i < SFTP_SERVER_MAX_HANDLES; i++) {
+        if (server.fds[i] >= 0) close(server.fds[i]);
+    }
+    if (rc == SSH_OK) {
+        rc = ssh_channel_close(server.channel);
+    }
+    ssh_channel_free(server.channel);
+    ssh_buffer_free(in);
+    ssh_buffer_free(out);
+    ssh_chain_free(server.reply);
+
+    return rc;
+}
@@ -0,0 +1,178 @@
+/**
+ * @file slab.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Size-classed cache of the memory of buffers and strings.
+ * Each thread has its own lists, so allocation and free take no lock; a
+ * session being used by one thread at a time (see ssh_session_lock()), its
+ * buffers come back to the lists they were taken from. The class of a freed
+ * block is found from its usable size, which also makes it safe to hand in a
+ * block that was not allocated here.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "libsftp/slab.h"
+
+#include <pthread.h>
+#ifdef MACOS
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+
+#include "libsftp/util.h"
+
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+struct slab_block {
+    struct slab_block *next;
+};
+
+struct slab_cache {
+    struct slab_block *free[SLAB_CLASSES];
+    unsigned int count[SLAB_CLASSES];
+    int registered; /* for slab_cache_free() at thread exit */
+};
+
+static __thread struct slab_cache slab_cache;
+static pthread_key_t slab_key;
+static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+
+static size_t slab_usable_size(void *ptr) {
+#ifdef MACOS
+    return malloc_size(ptr);
+#else
+    return malloc_usable_size(ptr);
+#endif
+}
+
+/**
+ * @brief Release the blocks a thread kept, when it exits.
+ */
+static void slab_cache_free(void *arg) {
+    struct slab_cache *cache = arg;
+    struct slab_block *block;
+    int i;
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        while ((block = cache->free[i]) != NULL) {
+            cache->free[i] = block->next;
+            free(block);
+        }
+        cache->count[i] = 0;
+    }
+}
+
+static void slab_key_init(void) {
+    pthread_key_create(&slab_key, slab_cache_free);
+}
+
+/**
+ * @brief Smallest class holding `size` bytes.
+ *
+ * @return the class, -1 if the size is not cached.
+ */
+static int slab_class(size_t size) {
+    int shift = SLAB_MIN_SHIFT;
+
+    if (size > SLAB_MAX_SIZE) return -1;
+    while (((size_t)1 << shift) < size) shift++;
+    return shift - SLAB_MIN_SHIFT;
+}
+
+static unsigned int slab_class_max(int class) {
+    size_t n = SLAB_CLASS_BYTES >> (class + SLAB_MIN_SHIFT);
+
+    return n > SLAB_CLASS_MIN_BLOCKS ? n : SLAB_CLASS_MIN_BLOCKS;
+}
+
+/**
+ * @brief Allocate at least `size` bytes, rounded up to the class size.
+ *
+ * @param size
+ * @return the block, NULL on error.
+ */
+void *ssh_slab_alloc(size_t size) {
+    struct slab_block *block;
+    int class;
+
+    class = slab_class(size);
+    if (class < 0) return malloc(size);
+
+    block = slab_cache.free[class];
+    if (block != NULL) {
+        slab_cache.free[class] = block->next;
+        slab_cache.count[class]--;
+        return block;
+    }
+    return malloc((size_t)1 << (class + SLAB_MIN_SHIFT));
+}
+
+/**
+ * @brief Make a block at least `size` bytes long, keeping its first `used`
+ * bytes. The old block is wiped first if `secure`.
+ *
+ * @param ptr NULL for a new block
+ * @param used
+ * @param size
+ * @param secure
+ * @return the block, NULL on error (`ptr` is left as it was).
+ */
+void *ssh_slab_grow(void *ptr, size_t used, size_t size, int secure) {
+    void *new;
+
+    if (ptr != NULL && slab_usable_size(ptr) >= size) return ptr;
+
+    new = ssh_slab_alloc(size);
+    if (new == NULL) return NULL;
+    if (ptr != NULL) {
+        memcpy(new, ptr, used);
+        if (secure) explicit_bzero(ptr, slab_usable_size(ptr));
+        ssh_slab_free(ptr);
+    }
+    return new;
+}
+
+/**
+ * @brief Give a block back to the cache of the calling thread, or to free()
+ * if its class is full.
+ *
+ * @param ptr
+ */
+void ssh_slab_free(void *ptr) {
+    struct slab_block *block = ptr;
+    size_t size;
+    int class;
+
+    if (ptr == NULL) return;
+
+    /* the largest class the block can serve */
+    size = slab_usable_size(ptr);
+    if (size < SLAB_MIN_SIZE || size >= 2 * SLAB_MAX_SIZE) {
+        free(ptr);
+        return;
+    }
+    if (size >= SLAB_MAX_SIZE) {
+        class = SLAB_CLASSES - 1;
+    } else {
+        class = slab_class(size);
+        if (((size_t)1 << (class + SLAB_MIN_SHIFT)) > size) class--;
+    }
+
+    if (slab_cache.count[class] >= slab_class_max(class)) {
+        free(ptr);
+        return;
+    }
+    if (!slab_cache.registered) {
+        pthread_once(&slab_key_once, slab_key_init);
+        pthread_setspecific(slab_key, &slab_cache);
+        slab_cache.registered = 1;
+    }
+
+    block->next = slab_cache.free[class];
+    slab_cache.free[class] = block;
+    slab_cache.count[class]++;
+}
@@ -13,7 +13,12 @@
 
 #include <errno.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "libsftp/buffer.h"
@@ -46,24 +51,36 @@ static int getai(const char *host, int port, struct addrinfo **ai) {
 ssh_socket ssh_socket_new() {
     ssh_socket s = calloc(1, sizeof(struct ssh_socket_struct));
     s->in_buffer = ssh_buffer_new();
+    s->out_buffer = ssh_buffer_new();
     return s;
 }
 
 void ssh_socket_close(ssh_socket s) {
     if(s->fd > 0) {
         close(s->fd);
+        s->fd = -1;
+    }
+    /* after our end is closed, the relay flushes and exits */
+    if (s->netem != NULL) {
+        ssh_netem_stop(s->netem);
+        s->netem = NULL;
     }
 }
 
 void ssh_socket_free(ssh_socket s) {
     if (s == NULL) return;
+    ssh_socket_close(s);
     ssh_buffer_free(s->in_buffer);
+    ssh_buffer_free(s->out_buffer);
+    SAFE_FREE(s);
 }
 
 int ssh_socket_connect(ssh_socket s, const char *host, uint16_t port,
                        const char *bind_addr) {
-    int fd;
+    int fd = -1;
+    int err = 0;
     int rc;
+    int nodelay = 1;
 
     struct addrinfo *ai = NULL;
     struct addrinfo *itr = NULL;
@@ -76,43 +93,267 @@ int ssh_socket_connect(ssh_socket s, const char *host, uint16_t port,
 
     for (itr = ai; itr != NULL; itr = itr->ai_next) {
         fd = socket(itr->ai_family, itr->ai_socktype, itr->ai_protocol);
-        if (fd < 0) continue;
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
 
         rc = connect(fd, itr->ai_addr, itr->ai_addrlen);
         if (rc < 0) {
-            ssh_set_error(SSH_REQUEST_DENIED, "failed to connect: %s",
-                          strerror(errno));
+            err = errno;
             close(fd);
+            fd = -1;
             continue;
         }
+        /* channels interleave small packets (window adjusts, requests),
+         * don't let Nagle hold them behind unacknowledged data */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
         break;
     }
     freeaddrinfo(ai);
 
     ssh_socket_set_fd(s, fd);
+    if (fd < 0) {
+        /* no address could be connected to */
+        ssh_set_error(SSH_REQUEST_DENIED, "failed to connect to %s:%u: %s",
+                      host, port, strerror(err));
+        return SSH_ERROR;
+    }
     return SSH_OK;
 }
 
 void ssh_socket_set_fd(ssh_socket s, int fd) { s->fd = fd; }
 
+/**
+ * @brief Route the connected socket through an emulated link, for
+ * benchmarks under WAN conditions on a single box.
+ *
+ * @param s
+ * @param spec see ssh_netem_parse(), NULL or empty for none
+ * @return SSH_OK on success or if no emulation is asked for, SSH_ERROR on
+ * error.
+ */
+int ssh_socket_set_netem(ssh_socket s, const char *spec) {
+    struct ssh_netem_params params;
+    int fd;
+
+    if (spec == NULL || spec[0] == '\0' || s->netem != NULL) return SSH_OK;
+
+    if (ssh_netem_parse(spec, &params) != SSH_OK) return SSH_ERROR;
+
+    s->netem = ssh_netem_start(s->fd, &params, &fd);
+    if (s->netem == NULL) return SSH_ERROR;
+    s->fd = fd;
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Write `len` bytes, after what was left by ssh_socket_write_later(),
+ * both in the same system call.
+ *
+ * @param s
+ * @param buffer
+ * @param len
+ * @return `len`, SSH_ERROR on error.
+ */
 int ssh_socket_write(ssh_socket s, const void *buffer, size_t len) {
-    return write(s->fd, buffer, len);
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct iovec *first = iov;
+    int iovcnt = 0;
+    ssize_t rc;
+
+    if (ssh_buffer_get_len(s->out_buffer) > 0) {
+        iov[iovcnt].iov_base = ssh_buffer_get(s->out_buffer);
+        iov[iovcnt].iov_len = ssh_buffer_get_len(s->out_buffer);
+        iovcnt++;
+    }
+    if (len > 0) {
+        iov[iovcnt].iov_base = (void *)buffer;
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+    }
+
+    ZERO_STRUCT(msg);
+    while (iovcnt > 0) {
+        msg.msg_iov = first;
+        msg.msg_iovlen = iovcnt;
+        /* a peer gone away must be an error, not a SIGPIPE */
+        rc = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+        if (rc < 0 && errno == ENOTSOCK) rc = writev(s->fd, first, iovcnt);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            ssh_set_error(SSH_FATAL, "socket %d write error: %s", s->fd,
+                          strerror(errno));
+            ssh_buffer_reinit(s->out_buffer);
+            return SSH_ERROR;
+        }
+        while (iovcnt > 0 && (size_t)rc >= first->iov_len) {
+            rc -= first->iov_len;
+            first++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            first->iov_base = (uint8_t *)first->iov_base + rc;
+            first->iov_len -= rc;
+        }
+    }
+    ssh_buffer_reinit(s->out_buffer);
+
+    return len;
+}
+
+/**
+ * @brief Keep `len` bytes to be written in front of the next write, or before
+ * the socket is waited on. Small packets that need no immediate answer, as
+ * window adjusts, so do not cost a system call of their own.
+ *
+ * @param s
+ * @param buffer
+ * @param len
+ * @return SSH_OK, SSH_ERROR on error.
+ */
+int ssh_socket_write_later(ssh_socket s, const void *buffer, size_t len) {
+    if (ssh_buffer_add_data(s->out_buffer, buffer, len) < 0) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return SSH_ERROR;
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Write what was left by ssh_socket_write_later().
+ *
+ * @param s
+ * @return SSH_OK, SSH_ERROR on error.
+ */
+int ssh_socket_flush(ssh_socket s) {
+    if (ssh_buffer_get_len(s->out_buffer) == 0) return SSH_OK;
+    return ssh_socket_write(s, NULL, 0) < 0 ? SSH_ERROR : SSH_OK;
 }
 
+/**
+ * @brief Read `len` bytes. What was read ahead is taken first, the rest is
+ * read straight into `buffer`, together with up to SOCKET_READ_AHEAD_CHUNK
+ * bytes that follow it, kept for the next call. What is left to write is
+ * written before blocking, the peer may be waiting for it.
+ *
+ * @param s
+ * @param buffer
+ * @param len
+ * @return SSH_OK, SSH_ERROR on error.
+ */
 int ssh_socket_read(ssh_socket s, void *buffer, size_t len) {
-    int readn;
+    struct iovec iov[2];
+    size_t got, extra;
+    ssize_t readn;
+    uint8_t *ahead;
 
-    while (ssh_buffer_get_len(s->in_buffer) < len) {
-        char tmp[256];
-        readn = read(s->fd, tmp, sizeof(tmp));
+    got = MIN(len, ssh_buffer_get_len(s->in_buffer));
+    ssh_buffer_get_data(s->in_buffer, buffer, got);
+    if (got == len) return SSH_OK;
+
+    if (ssh_socket_flush(s) != SSH_OK) return SSH_ERROR;
+    ssh_buffer_reinit(s->in_buffer);
+    while (got < len) {
+        ahead = ssh_buffer_allocate(s->in_buffer, SOCKET_READ_AHEAD_CHUNK);
+        if (ahead == NULL) return SSH_ERROR;
+        iov[0].iov_base = (uint8_t *)buffer + got;
+        iov[0].iov_len = len - got;
+        iov[1].iov_base = ahead;
+        iov[1].iov_len = SOCKET_READ_AHEAD_CHUNK;
+
+        readn = readv(s->fd, iov, 2);
+        /* keep only what was read ahead */
+        extra = readn > (ssize_t)iov[0].iov_len ? readn - iov[0].iov_len : 0;
+        ssh_buffer_pass_bytes_end(s->in_buffer,
+                                  SOCKET_READ_AHEAD_CHUNK - extra);
+
+        if (readn < 0 && errno == EINTR) continue;
         if (readn < 0) {
             LOG_ERROR("read error on fd %d", s->fd);
             ssh_set_error(SSH_FATAL, "socket %d read error", s->fd);
             return SSH_ERROR;
         }
-        ssh_buffer_add_data(s->in_buffer, tmp, readn);
+        if (readn == 0) {
+            LOG_ERROR("connection closed on fd %d", s->fd);
+            ssh_set_error(SSH_FATAL, "socket %d closed by peer", s->fd);
+            return SSH_ERROR;
+        }
+        got += MIN((size_t)readn, iov[0].iov_len);
     }
 
-    ssh_buffer_get_data(s->in_buffer, buffer, len);
     return SSH_OK;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Buffer at least `len` bytes of the socket for `ssh_socket_read`.
+ * If not `blocking`, only what has already arrived is read, which may be
+ * less.
+ *
+ * @param s
+ * @param len
+ * @param blocking
+ * @return number of bytes buffered, SSH_ERROR on error.
+ */
+int ssh_socket_read_ahead(ssh_socket s, size_t len, int blocking) {
+    char tmp[SOCKET_READ_AHEAD_CHUNK];
+    struct pollfd pfd;
+    int readn;
+
+    if (blocking && ssh_socket_flush(s) != SSH_OK) return SSH_ERROR;
+    while (ssh_buffer_get_len(s->in_buffer) < len) {
+        if (!blocking) {
+            pfd.fd = s->fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 0) <= 0) break;
+        }
+        readn = read(s->fd, tmp, MIN(sizeof(tmp),
+                                     len - ssh_buffer_get_len(s->in_buffer)));
+        if (readn < 0 && errno == EINTR) continue;
+        if (readn < 0) {
+            ssh_set_error(SSH_FATAL, "socket %d read error", s->fd);
+            return SSH_ERROR;
+        }
+        if (readn == 0) {
+            /* what is buffered is still good */
+            if (!blocking) break;
+            ssh_set_error(SSH_FATAL, "socket %d closed by peer", s->fd);
+            return SSH_ERROR;
+        }
+        if (ssh_buffer_add_data(s->in_buffer, tmp, readn) < 0) {
+            return SSH_ERROR;
+        }
+    }
+
+    return ssh_buffer_get_len(s->in_buffer);
+}
+
+/**
+ * @brief Wait until data can be read from the socket. Unless only polling,
+ * what is left to write is written first.
+ *
+ * @param s
+ * @param timeout in milliseconds, -1 to wait forever, 0 to poll
+ * @return 1 if data is available, 0 on timeout, SSH_ERROR on error.
+ */
+int ssh_socket_wait(ssh_socket s, int timeout) {
+    struct pollfd pfd;
+    int rc;
+
+    if (ssh_buffer_get_len(s->in_buffer) > 0) return 1;
+    if (timeout != 0 && ssh_socket_flush(s) != SSH_OK) return SSH_ERROR;
+
+    pfd.fd = s->fd;
+    pfd.events = POLLIN;
+    do {
+        rc = poll(&pfd, 1, timeout);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        ssh_set_error(SSH_FATAL, "socket %d poll error", s->fd);
+        return SSH_ERROR;
+    }
+
+    return rc > 0 ? 1 : 0;
+}
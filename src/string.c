@@ -30,6 +30,7 @@
 #include <arpa/inet.h>
 #endif
 #include "libsftp/libssh.h"
+#include "libsftp/slab.h"
 #include "libsftp/string.h"
 #include "libsftp/util.h"
 
@@ -60,7 +61,7 @@ struct ssh_string_struct *ssh_string_new(size_t size) {
         return NULL;
     }
 
-    str = malloc(sizeof(struct ssh_string_struct) + size);
+    str = ssh_slab_alloc(sizeof(struct ssh_string_struct) + size);
     if (str == NULL) {
         return NULL;
     }
@@ -269,6 +270,6 @@ void *ssh_string_data(struct ssh_string_struct *s) {
  *
  * \param[in] s         The SSH string to delete.
  */
-void ssh_string_free(struct ssh_string_struct *s) { SAFE_FREE(s); }
+void ssh_string_free(struct ssh_string_struct *s) { ssh_slab_free(s); }
 
 /** @} */
@@ -0,0 +1,183 @@
+/**
+ * @file trace.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Per-session ring buffer of binary events.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "libsftp/trace.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "libsftp/error.h"
+#include "libsftp/logger.h"
+#include "libsftp/session.h"
+#include "libsftp/util.h"
+
+/* Sessions of this process dumped through SSH_TRACE_ENV so far */
+static unsigned int trace_env_count;
+
+/**
+ * @brief Create a ring holding the last `events` events, rounded up to a
+ * power of two.
+ *
+ * @param events
+ * @return ssh_trace, NULL on error.
+ */
+ssh_trace ssh_trace_new(unsigned int events) {
+    ssh_trace trace;
+    uint64_t capacity = 1;
+
+    while (capacity < events) capacity <<= 1;
+
+    trace = calloc(1, sizeof(struct ssh_trace_struct));
+    if (trace == NULL) return NULL;
+
+    trace->events = calloc(capacity, sizeof(struct ssh_trace_event));
+    if (trace->events == NULL) {
+        SAFE_FREE(trace);
+        return NULL;
+    }
+    trace->mask = capacity - 1;
+
+    return trace;
+}
+
+void ssh_trace_free(ssh_trace trace) {
+    if (trace == NULL) return;
+
+    SAFE_FREE(trace->events);
+    SAFE_FREE(trace);
+}
+
+/**
+ * @brief Write the events in the ring to `path`, oldest first.
+ *
+ * @param trace
+ * @param path
+ * @param server whether the session is a server role one
+ * @return int
+ */
+int ssh_trace_write(ssh_trace trace, const char *path, int server) {
+    struct ssh_trace_header header;
+    uint64_t capacity = trace->mask + 1;
+    uint64_t first, n;
+    FILE *f;
+
+    ZERO_STRUCT(header);
+    memcpy(header.magic, SSH_TRACE_MAGIC, sizeof(header.magic));
+    header.version = SSH_TRACE_VERSION;
+    header.event_size = sizeof(struct ssh_trace_event);
+    header.count = MIN(trace->head, capacity);
+    header.dropped = trace->head - header.count;
+    header.server = server ? 1 : 0;
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        ssh_set_error(SSH_FATAL, "can not open trace file %s", path);
+        return SSH_ERROR;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, f) != 1) goto error;
+
+    /* the ring from the oldest event to its end, then from its start */
+    first = header.dropped & trace->mask;
+    n = MIN(header.count, capacity - first);
+    if (fwrite(&trace->events[first], sizeof(struct ssh_trace_event), n, f) !=
+        n) {
+        goto error;
+    }
+    n = header.count - n;
+    if (n > 0 &&
+        fwrite(trace->events, sizeof(struct ssh_trace_event), n, f) != n) {
+        goto error;
+    }
+
+    if (fclose(f) != 0) {
+        ssh_set_error(SSH_FATAL, "can not write trace file %s", path);
+        return SSH_ERROR;
+    }
+    return SSH_OK;
+
+error:
+    fclose(f);
+    ssh_set_error(SSH_FATAL, "can not write trace file %s", path);
+    return SSH_ERROR;
+}
+
+/**
+ * @brief Start tracing a new session if SSH_TRACE_ENV is set.
+ *
+ * @param session
+ */
+void ssh_trace_env_start(ssh_session session) {
+    const char *path = getenv(SSH_TRACE_ENV);
+
+    if (path == NULL || *path == '\0') return;
+
+    session->trace = ssh_trace_new(SSH_TRACE_DEFAULT_EVENTS);
+    if (session->trace == NULL) {
+        LOG_WARNING("can not allocate the trace of %s", SSH_TRACE_ENV);
+    }
+}
+
+/**
+ * @brief Dump the trace started by `ssh_trace_env_start`, the session is
+ * being freed.
+ *
+ * @param session
+ */
+void ssh_trace_env_dump(ssh_session session) {
+    const char *prefix = getenv(SSH_TRACE_ENV);
+    char path[4096];
+
+    if (session->trace == NULL || prefix == NULL || *prefix == '\0') return;
+
+    snprintf(path, sizeof(path), "%s.%d.%u", prefix, (int)getpid(),
+             __atomic_fetch_add(&trace_env_count, 1, __ATOMIC_RELAXED));
+    if (ssh_trace_write(session->trace, path, session->server) != SSH_OK) {
+        LOG_WARNING("%s", ssh_get_error());
+    }
+}
+
+int ssh_trace_start(ssh_session session, unsigned int events) {
+    ssh_trace trace;
+
+    if (session == NULL || events == 0) return SSH_ERROR;
+
+    trace = ssh_trace_new(events);
+    if (trace == NULL) {
+        ssh_set_error(SSH_FATAL, "can not allocate %u trace events", events);
+        return SSH_ERROR;
+    }
+
+    ssh_trace_free(session->trace);
+    session->trace = trace;
+    return SSH_OK;
+}
+
+int ssh_trace_dump(ssh_session session, const char *path) {
+    int rc;
+
+    if (session == NULL || path == NULL) return SSH_ERROR;
+
+    if (session->trace == NULL) {
+        ssh_set_error(SSH_REQUEST_DENIED, "session is not traced");
+        rc = SSH_ERROR;
+    } else {
+        rc = ssh_trace_write(session->trace, path, session->server);
+    }
+    return rc;
+}
+
+void ssh_trace_stop(ssh_session session) {
+    if (session == NULL) return;
+
+    ssh_trace_free(session->trace);
+    session->trace = NULL;
+}
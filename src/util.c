@@ -13,19 +13,23 @@
 
 #include <ctype.h>
 #include <pwd.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef LINUX
 #include <sys/types.h>
 #endif
 #include "libsftp/logger.h"
 
+/* getpwuid() returns static storage, these use getpwuid_r() to be called
+ * from any thread */
+#define PASSWD_BUF_SIZE 4096
+
 char *ssh_get_local_username(void) {
-    struct passwd *pw;
-    uid_t uid;
-    int c;
+    struct passwd pwd;
+    struct passwd *pw = NULL;
+    char buf[PASSWD_BUF_SIZE];
 
-    uid = geteuid();
-    pw = getpwuid(uid);
+    getpwuid_r(geteuid(), &pwd, buf, sizeof(buf), &pw);
     if (pw) {
         return strdup(pw->pw_name);
     } else {
@@ -34,12 +38,11 @@ char *ssh_get_local_username(void) {
 }
 
 char *ssh_get_home_dir(void) {
-    struct passwd *pw;
-    uid_t uid;
-    int c;
+    struct passwd pwd;
+    struct passwd *pw = NULL;
+    char buf[PASSWD_BUF_SIZE];
 
-    uid = geteuid();
-    pw = getpwuid(uid);
+    getpwuid_r(geteuid(), &pwd, buf, sizeof(buf), &pw);
     if (pw) {
         return strdup(pw->pw_dir);
     } else {
@@ -56,6 +59,18 @@ void explicit_bzero(void *s, size_t n) {
 #endif
 }
 
+/**
+ * @brief Monotonic clock in nanoseconds, for the statistics.
+ *
+ * @return uint64_t
+ */
+uint64_t ssh_time_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 /**
  * @brief Log the content of a buffer in hexadecimal format, similar to the
  * output of 'hexdump -C' command.
@@ -0,0 +1,330 @@
+/**
+ * @file tracedump.c
+ * @author Yuhan Zhou (zhouyuhan@pku.edu.cn)
+ * @brief Convert the binary traces written by ssh_trace_dump() or
+ * LIBSFTP_TRACE to Chrome trace JSON (chrome://tracing, Perfetto) or to
+ * perf script like text. Traces of the client and of the server taken on
+ * the same host share the clock and can be given together.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libsftp/libsftp.h"
+#include "libsftp/trace.h"
+
+struct trace_file {
+    const char *path;
+    struct ssh_trace_header header;
+    struct ssh_trace_event *events;
+};
+
+static const char *ssh_type_name(uint8_t type) {
+    switch (type) {
+        case SSH_MSG_DISCONNECT: return "DISCONNECT";
+        case SSH_MSG_IGNORE: return "IGNORE";
+        case SSH_MSG_UNIMPLEMENTED: return "UNIMPLEMENTED";
+        case SSH_MSG_DEBUG: return "DEBUG";
+        case SSH_MSG_SERVICE_REQUEST: return "SERVICE_REQUEST";
+        case SSH_MSG_SERVICE_ACCEPT: return "SERVICE_ACCEPT";
+        case SSH_MSG_KEXINIT: return "KEXINIT";
+        case SSH_MSG_NEWKEYS: return "NEWKEYS";
+        case SSH_MSG_KEXDH_INIT: return "KEXDH_INIT";
+        case SSH_MSG_KEXDH_REPLY: return "KEXDH_REPLY";
+        case SSH_MSG_USERAUTH_REQUEST: return "USERAUTH_REQUEST";
+        case SSH_MSG_USERAUTH_FAILURE: return "USERAUTH_FAILURE";
+        case SSH_MSG_USERAUTH_SUCCESS: return "USERAUTH_SUCCESS";
+        case SSH_MSG_USERAUTH_BANNER: return "USERAUTH_BANNER";
+        case SSH_MSG_GLOBAL_REQUEST: return "GLOBAL_REQUEST";
+        case SSH_MSG_REQUEST_SUCCESS: return "REQUEST_SUCCESS";
+        case SSH_MSG_REQUEST_FAILURE: return "REQUEST_FAILURE";
+        case SSH_MSG_CHANNEL_OPEN: return "CHANNEL_OPEN";
+        case SSH_MSG_CHANNEL_OPEN_CONFIRMATION: return "CHANNEL_OPEN_CONFIRMATION";
+        case SSH_MSG_CHANNEL_OPEN_FAILURE: return "CHANNEL_OPEN_FAILURE";
+        case SSH_MSG_CHANNEL_WINDOW_ADJUST: return "CHANNEL_WINDOW_ADJUST";
+        case SSH_MSG_CHANNEL_DATA: return "CHANNEL_DATA";
+        case SSH_MSG_CHANNEL_EXTENDED_DATA: return "CHANNEL_EXTENDED_DATA";
+        case SSH_MSG_CHANNEL_EOF: return "CHANNEL_EOF";
+        case SSH_MSG_CHANNEL_CLOSE: return "CHANNEL_CLOSE";
+        case SSH_MSG_CHANNEL_REQUEST: return "CHANNEL_REQUEST";
+        case SSH_MSG_CHANNEL_SUCCESS: return "CHANNEL_SUCCESS";
+        case SSH_MSG_CHANNEL_FAILURE: return "CHANNEL_FAILURE";
+        default: return NULL;
+    }
+}
+
+static const char *sftp_type_name(uint8_t type) {
+    switch (type) {
+        case SSH_FXP_INIT: return "INIT";
+        case SSH_FXP_VERSION: return "VERSION";
+        case SSH_FXP_OPEN: return "OPEN";
+        case SSH_FXP_CLOSE: return "CLOSE";
+        case SSH_FXP_READ: return "READ";
+        case SSH_FXP_WRITE: return "WRITE";
+        case SSH_FXP_LSTAT: return "LSTAT";
+        case SSH_FXP_FSTAT: return "FSTAT";
+        case SSH_FXP_SETSTAT: return "SETSTAT";
+        case SSH_FXP_FSETSTAT: return "FSETSTAT";
+        case SSH_FXP_OPENDIR: return "OPENDIR";
+        case SSH_FXP_READDIR: return "READDIR";
+        case SSH_FXP_REMOVE: return "REMOVE";
+        case SSH_FXP_MKDIR: return "MKDIR";
+        case SSH_FXP_RMDIR: return "RMDIR";
+        case SSH_FXP_REALPATH: return "REALPATH";
+        case SSH_FXP_STAT: return "STAT";
+        case SSH_FXP_RENAME: return "RENAME";
+        case SSH_FXP_STATUS: return "STATUS";
+        case SSH_FXP_HANDLE: return "HANDLE";
+        case SSH_FXP_DATA: return "DATA";
+        case SSH_FXP_NAME: return "NAME";
+        case SSH_FXP_ATTRS: return "ATTRS";
+        default: return NULL;
+    }
+}
+
+/* event name, category and Chrome thread of each kind */
+static const struct {
+    const char *name;
+    const char *cat;
+    int tid;
+} kinds[] = {
+    [SSH_TRACE_PACKET_SEND] = {"send", "packet", 1},
+    [SSH_TRACE_PACKET_RECV] = {"recv", "packet", 2},
+    [SSH_TRACE_WINDOW_STALL] = {"window_stall", "channel", 3},
+    [SSH_TRACE_WINDOW_ADJUST_OUT] = {"window_adjust_out", "channel", 3},
+    [SSH_TRACE_WINDOW_ADJUST_IN] = {"window_adjust_in", "channel", 3},
+    [SSH_TRACE_REKEY] = {"rekey", "kex", 4},
+    [SSH_TRACE_SFTP_REQUEST] = {"request", "sftp", 5},
+    [SSH_TRACE_SFTP_REPLY] = {"reply", "sftp", 5},
+};
+
+static const char *thread_names[] = {NULL,      "packet send", "packet recv",
+                                     "channel", "kex",         "sftp"};
+
+static int kind_known(uint16_t kind) {
+    return kind < sizeof(kinds) / sizeof(kinds[0]) && kinds[kind].name != NULL;
+}
+
+/**
+ * @brief The message type as text, "?" + number when unknown.
+ */
+static const char *type_name(const struct ssh_trace_event *e, char *buf,
+                             size_t len) {
+    const char *name = NULL;
+
+    if (e->kind == SSH_TRACE_PACKET_SEND || e->kind == SSH_TRACE_PACKET_RECV) {
+        name = ssh_type_name(e->type);
+    } else if (e->kind == SSH_TRACE_SFTP_REQUEST ||
+               e->kind == SSH_TRACE_SFTP_REPLY) {
+        name = sftp_type_name(e->type);
+    } else {
+        return NULL;
+    }
+    if (name != NULL) return name;
+
+    snprintf(buf, len, "?%u", e->type);
+    return buf;
+}
+
+static int load(struct trace_file *f) {
+    FILE *in;
+
+    in = fopen(f->path, "rb");
+    if (in == NULL) {
+        perror(f->path);
+        return -1;
+    }
+
+    if (fread(&f->header, sizeof(f->header), 1, in) != 1 ||
+        memcmp(f->header.magic, SSH_TRACE_MAGIC, sizeof(f->header.magic)) !=
+            0) {
+        fprintf(stderr, "%s: not a trace\n", f->path);
+        goto error;
+    }
+    if (f->header.version != SSH_TRACE_VERSION ||
+        f->header.event_size != sizeof(struct ssh_trace_event)) {
+        fprintf(stderr, "%s: trace version %u is not supported\n", f->path,
+                f->header.version);
+        goto error;
+    }
+
+    f->events = calloc(f->header.count ? f->header.count : 1,
+                       sizeof(struct ssh_trace_event));
+    if (f->events == NULL ||
+        fread(f->events, sizeof(struct ssh_trace_event), f->header.count,
+              in) != f->header.count) {
+        fprintf(stderr, "%s: truncated trace\n", f->path);
+        goto error;
+    }
+
+    fclose(in);
+    if (f->header.dropped > 0) {
+        fprintf(stderr, "%s: the ring wrapped, %llu older events are lost\n",
+                f->path, (unsigned long long)f->header.dropped);
+    }
+    return 0;
+
+error:
+    fclose(in);
+    return -1;
+}
+
+static void dump_chrome(FILE *out, struct trace_file *files, int n,
+                        uint64_t origin) {
+    const struct ssh_trace_event *e;
+    const char *type;
+    char buf[16];
+    int first = 1;
+    uint64_t i;
+    int pid, t;
+
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+    for (pid = 1; pid <= n; pid++) {
+        struct trace_file *f = &files[pid - 1];
+
+        fprintf(out,
+                "%s\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+                "\"args\": {\"name\": \"%s %s\"}}",
+                first ? "" : ",", pid,
+                f->header.server ? "server" : "client", f->path);
+        first = 0;
+        for (t = 1; t < (int)(sizeof(thread_names) / sizeof(thread_names[0]));
+             t++) {
+            fprintf(out,
+                    ",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+                    "\"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                    pid, t, thread_names[t]);
+        }
+
+        for (i = 0; i < f->header.count; i++) {
+            e = &f->events[i];
+            if (!kind_known(e->kind)) continue;
+            type = type_name(e, buf, sizeof(buf));
+
+            fprintf(out, ",\n{\"name\": \"%s%s%s\", \"cat\": \"%s\", ",
+                    kinds[e->kind].name, type ? " " : "", type ? type : "",
+                    kinds[e->kind].cat);
+            if (e->dur_ns > 0) {
+                fprintf(out, "\"ph\": \"X\", \"dur\": %.3f, ",
+                        e->dur_ns / 1e3);
+            } else {
+                fprintf(out, "\"ph\": \"i\", \"s\": \"t\", ");
+            }
+            fprintf(out,
+                    "\"ts\": %.3f, \"pid\": %d, \"tid\": %d, "
+                    "\"args\": {\"seq\": %u, \"size\": %u, \"arg\": %u}}",
+                    (e->ts_ns - origin) / 1e3, pid, kinds[e->kind].tid, e->seq,
+                    e->size, e->arg);
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+}
+
+static void dump_perf(FILE *out, struct trace_file *files, int n) {
+    const struct ssh_trace_event *e;
+    const char *type;
+    char buf[16];
+    uint64_t i;
+    int k;
+
+    for (k = 0; k < n; k++) {
+        for (i = 0; i < files[k].header.count; i++) {
+            e = &files[k].events[i];
+            if (!kind_known(e->kind)) continue;
+            type = type_name(e, buf, sizeof(buf));
+
+            fprintf(out,
+                    "%16s %5d [000] %llu.%09llu: libsftp:%s_%s: type=%s "
+                    "size=%u seq=%u arg=%u dur_ns=%u\n",
+                    files[k].header.server ? "server" : "client", k + 1,
+                    (unsigned long long)(e->ts_ns / 1000000000ULL),
+                    (unsigned long long)(e->ts_ns % 1000000000ULL),
+                    kinds[e->kind].cat, kinds[e->kind].name,
+                    type ? type : "-", e->size, e->seq, e->arg, e->dur_ns);
+        }
+    }
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [-f chrome|perf] [-o file] trace...\n"
+            "  -f  output format, default chrome\n"
+            "  -o  output file, default stdout\n",
+            argv0);
+}
+
+int main(int argc, char *argv[]) {
+    struct trace_file *files;
+    const char *format = "chrome";
+    const char *output = NULL;
+    uint64_t origin = UINT64_MAX;
+    FILE *out = stdout;
+    uint64_t k;
+    int n, i, opt;
+    int rc = 1;
+
+    while ((opt = getopt(argc, argv, "f:o:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                format = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc ||
+        (strcmp(format, "chrome") != 0 && strcmp(format, "perf") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    n = argc - optind;
+    files = calloc(n, sizeof(struct trace_file));
+    if (files == NULL) return 1;
+
+    for (i = 0; i < n; i++) {
+        files[i].path = argv[optind + i];
+        if (load(&files[i]) != 0) goto out;
+        /* a reply starts with its request, which may have been overwritten */
+        for (k = 0; k < files[i].header.count; k++) {
+            if (files[i].events[k].ts_ns < origin) {
+                origin = files[i].events[k].ts_ns;
+            }
+        }
+    }
+    if (origin == UINT64_MAX) origin = 0;
+
+    if (output != NULL) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            perror(output);
+            goto out;
+        }
+    }
+
+    if (strcmp(format, "chrome") == 0) {
+        dump_chrome(out, files, n, origin);
+    } else {
+        dump_perf(out, files, n);
+    }
+    rc = 0;
+
+    if (out != stdout) fclose(out);
+
+out:
+    for (i = 0; i < n; i++) free(files[i].events);
+    free(files);
+    return rc;
+}